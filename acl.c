@@ -0,0 +1,475 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: acl.c
+ * Description: source address allow and deny lists. The rules of every
+ * scope, a listener port and an optional path prefix, are compiled into
+ * a Patricia trie per address family, so a check is one longest prefix
+ * match of at most 32 or 128 bits.
+ *
+ * Created by: Daan Pape
+ * Created on: June 17, 2014
+ */
+
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "acl.h"
+
+/* Rule actions */
+enum acl_action {
+	ACL_NONE,
+	ACL_ALLOW,
+	ACL_DENY,
+};
+
+/**
+ * A trie node, an address prefix. Nodes that only join two branches
+ * have no action.
+ */
+struct acl_node {
+	struct acl_node *child[2];
+	uint8_t key[16];			/* The prefix, bits after len are zero */
+	uint8_t len;				/* The prefix length in bits */
+	uint8_t action;
+};
+
+/**
+ * The rules of one listener and path prefix
+ */
+struct acl_scope {
+	struct list_head list;
+	int port;					/* The listener port, 0 for all */
+	char *path;					/* The path prefix, NULL for connections */
+	int path_len;
+	struct acl_node *root[2];	/* IPv4 and IPv6 tries */
+};
+
+struct acl {
+	struct list_head scopes;
+	int rules;
+};
+
+/* The rule set in use */
+static struct acl *acl_cur;
+
+static struct acl_stats stats;
+
+/**
+ * Get a bit of an address prefix
+ * @key the prefix
+ * @i the bit, 0 is the most significant bit
+ */
+static inline int acl_bit(const uint8_t *key, int i)
+{
+	return (key[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+/**
+ * Count the leading bits two prefixes have in common
+ * @a the first prefix
+ * @b the second prefix
+ * @max the most bits to compare
+ */
+static int acl_common(const uint8_t *a, const uint8_t *b, int max)
+{
+	int n = 0;
+	uint8_t x;
+
+	while (n < max) {
+		x = a[n >> 3] ^ b[n >> 3];
+		if (x) {
+			while (!(x & 0x80)) {
+				x <<= 1;
+				n++;
+			}
+			break;
+		}
+		n += 8;
+	}
+
+	return min(n, max);
+}
+
+/**
+ * Create a trie node
+ */
+static struct acl_node *acl_node_new(const uint8_t *key, int len, int action)
+{
+	struct acl_node *n = calloc(1, sizeof(*n));
+
+	if (!n)
+		return NULL;
+
+	memcpy(n->key, key, (len + 7) / 8);
+	if (len & 7)
+		n->key[len / 8] &= 0xff << (8 - (len & 7));
+
+	n->len = len;
+	n->action = action;
+	return n;
+}
+
+/**
+ * Add a prefix to a trie, the action of a prefix given twice is replaced
+ * @root the trie
+ * @key the prefix, bits after len must be zero
+ * @len the prefix length in bits
+ * @action the rule action
+ */
+static bool acl_insert(struct acl_node **root, const uint8_t *key, int len, int action)
+{
+	struct acl_node **pp = root, *n, *join, *leaf;
+	int common;
+
+	while ((n = *pp)) {
+		common = acl_common(n->key, key, min(n->len, len));
+
+		/* The new prefix splits the edge to this node */
+		if (common < n->len) {
+			leaf = acl_node_new(key, len, action);
+			if (!leaf)
+				return false;
+
+			if (common == len) {
+				leaf->child[acl_bit(n->key, len)] = n;
+				*pp = leaf;
+				return true;
+			}
+
+			join = acl_node_new(key, common, ACL_NONE);
+			if (!join) {
+				free(leaf);
+				return false;
+			}
+
+			join->child[acl_bit(n->key, common)] = n;
+			join->child[acl_bit(key, common)] = leaf;
+			*pp = join;
+			return true;
+		}
+
+		if (n->len == len) {
+			n->action = action;
+			return true;
+		}
+
+		pp = &n->child[acl_bit(key, n->len)];
+	}
+
+	*pp = acl_node_new(key, len, action);
+	return *pp != NULL;
+}
+
+/**
+ * Find the action of the longest prefix that matches an address
+ * @n the trie
+ * @key the address
+ * @bits the address length in bits
+ * @return ACL_NONE when no prefix matches
+ */
+static int acl_lookup(const struct acl_node *n, const uint8_t *key, int bits)
+{
+	int action = ACL_NONE;
+
+	while (n && acl_common(n->key, key, n->len) == n->len) {
+		if (n->action)
+			action = n->action;
+
+		if (n->len == bits)
+			break;
+
+		n = n->child[acl_bit(key, n->len)];
+	}
+
+	return action;
+}
+
+/**
+ * Free a trie
+ */
+static void acl_node_free(struct acl_node *n)
+{
+	if (!n)
+		return;
+
+	acl_node_free(n->child[0]);
+	acl_node_free(n->child[1]);
+	free(n);
+}
+
+struct acl *acl_new(void)
+{
+	struct acl *acl = calloc(1, sizeof(*acl));
+
+	if (acl)
+		INIT_LIST_HEAD(&acl->scopes);
+
+	return acl;
+}
+
+/**
+ * Find or create the scope of a listener and path prefix
+ */
+static struct acl_scope *acl_scope_get(struct acl *acl, int port, const char *path, int path_len)
+{
+	struct acl_scope *s;
+
+	if (!path)
+		path_len = -1;
+
+	list_for_each_entry(s, &acl->scopes, list) {
+		if (s->port != port || s->path_len != path_len)
+			continue;
+
+		if (!path || !strncmp(s->path, path, path_len))
+			return s;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	if (path) {
+		s->path = strndup(path, path_len);
+		if (!s->path) {
+			free(s);
+			return NULL;
+		}
+	}
+
+	s->port = port;
+	s->path_len = path_len;
+	list_add_tail(&s->list, &acl->scopes);
+
+	return s;
+}
+
+bool acl_add(struct acl *acl, bool allow, const char *rule)
+{
+	char net[INET6_ADDRSTRLEN + 4], *slash, *end;
+	const char *path = NULL, *p = rule;
+	struct acl_scope *s;
+	uint8_t key[16];
+	int port = 0, path_len = 0, len, family, n;
+	long v;
+
+	/* The network */
+	n = strcspn(p, " \t");
+	if (!n || n >= sizeof(net))
+		return false;
+
+	memcpy(net, p, n);
+	net[n] = 0;
+	p += n;
+
+	/* The listener port and path prefix */
+	while (*(p += strspn(p, " \t"))) {
+		n = strcspn(p, " \t");
+
+		if (*p == ':') {
+			v = strtol(p + 1, &end, 10);
+			if (end != p + n || v < 1 || v > 65535)
+				return false;
+
+			port = v;
+		} else if (*p == '/') {
+			path = p;
+			path_len = n;
+		} else {
+			return false;
+		}
+
+		p += n;
+	}
+
+	s = acl_scope_get(acl, port, path, path_len);
+	if (!s)
+		return false;
+
+	/* Every address of both families */
+	if (!strcmp(net, "all")) {
+		memset(key, 0, sizeof(key));
+		acl->rules++;
+		return acl_insert(&s->root[0], key, 0, allow ? ACL_ALLOW : ACL_DENY) &&
+		       acl_insert(&s->root[1], key, 0, allow ? ACL_ALLOW : ACL_DENY);
+	}
+
+	slash = strchr(net, '/');
+	if (slash)
+		*slash++ = 0;
+
+	if (inet_pton(AF_INET, net, key) == 1)
+		family = 0;
+	else if (inet_pton(AF_INET6, net, key) == 1)
+		family = 1;
+	else
+		return false;
+
+	len = family ? 128 : 32;
+	if (slash) {
+		v = strtol(slash, &end, 10);
+		if (end == slash || *end || v < 0 || v > len)
+			return false;
+
+		len = v;
+	}
+
+	acl->rules++;
+	return acl_insert(&s->root[family], key, len, allow ? ACL_ALLOW : ACL_DENY);
+}
+
+void acl_free(struct acl *acl)
+{
+	struct acl_scope *s, *tmp;
+
+	if (!acl)
+		return;
+
+	list_for_each_entry_safe(s, tmp, &acl->scopes, list) {
+		acl_node_free(s->root[0]);
+		acl_node_free(s->root[1]);
+		free(s->path);
+		free(s);
+	}
+
+	free(acl);
+}
+
+void acl_use(struct acl *acl)
+{
+	acl_free(acl_cur);
+	acl_cur = acl;
+}
+
+/**
+ * Get the trie key of an address, IPv4 mapped IPv6 addresses are
+ * checked as IPv4
+ * @addr the address
+ * @key filled with the address bytes
+ * @return the family index
+ */
+static int acl_key(const struct uh_addr *addr, const uint8_t **key)
+{
+	if (addr->family == AF_INET) {
+		*key = (const uint8_t *) &addr->in;
+		return 0;
+	}
+
+	if (IN6_IS_ADDR_V4MAPPED(&addr->in6)) {
+		*key = (const uint8_t *) &addr->in6 + 12;
+		return 0;
+	}
+
+	*key = (const uint8_t *) &addr->in6;
+	return 1;
+}
+
+/**
+ * Check if an address is private, also for IPv4 mapped addresses
+ */
+static bool acl_rfc1918(const struct uh_addr *addr)
+{
+	struct uh_addr a = *addr;
+
+	if (a.family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&a.in6)) {
+		a.family = AF_INET;
+		memcpy(&a.in, (uint8_t *) &addr->in6 + 12, sizeof(a.in));
+	}
+
+	return uh_addr_rfc1918(&a);
+}
+
+/**
+ * Find the action for an address in a scope
+ */
+static int acl_scope_lookup(const struct acl_scope *s, const struct uh_addr *addr)
+{
+	const uint8_t *key;
+	int family = acl_key(addr, &key);
+
+	return acl_lookup(s->root[family], key, family ? 128 : 32);
+}
+
+bool acl_connection(const struct uh_addr *peer, const struct uh_addr *srv)
+{
+	struct acl_scope *s;
+	int action = ACL_NONE, any = ACL_NONE;
+
+	/* Public clients may not reach a private server address */
+	if (conf.rfc1918_filter && acl_rfc1918(srv) && !acl_rfc1918(peer)) {
+		stats.rfc1918++;
+		return false;
+	}
+
+	if (!acl_cur)
+		return true;
+
+	/* The rules of the listener come before the rules for all listeners */
+	list_for_each_entry(s, &acl_cur->scopes, list) {
+		if (s->path)
+			continue;
+
+		if (s->port == srv->port)
+			action = acl_scope_lookup(s, peer);
+		else if (!s->port)
+			any = acl_scope_lookup(s, peer);
+	}
+
+	if (!action)
+		action = any;
+
+	if (action == ACL_DENY) {
+		stats.denied_connections++;
+		return false;
+	}
+
+	return true;
+}
+
+bool acl_request(struct client *cl, const char *path)
+{
+	struct acl_scope *s, *best = NULL;
+	int action = ACL_NONE, a;
+
+	if (!acl_cur)
+		return true;
+
+	/* The longest path prefix with a matching rule wins, then the rules of the listener */
+	list_for_each_entry(s, &acl_cur->scopes, list) {
+		if (!s->path || (s->port && s->port != cl->srv_addr.port))
+			continue;
+
+		/* The prefix has to end at a path segment */
+		if (strncmp(path, s->path, s->path_len) ||
+		    (s->path[s->path_len - 1] != '/' &&
+		     path[s->path_len] && path[s->path_len] != '/'))
+			continue;
+
+		if (best && (s->path_len < best->path_len ||
+		    (s->path_len == best->path_len && !s->port)))
+			continue;
+
+		a = acl_scope_lookup(s, &cl->peer_addr);
+		if (a) {
+			best = s;
+			action = a;
+		}
+	}
+
+	if (action == ACL_DENY) {
+		stats.denied_requests++;
+		return false;
+	}
+
+	return true;
+}
+
+void acl_get_stats(struct acl_stats *s)
+{
+	*s = stats;
+	s->rules = acl_cur ? acl_cur->rules : 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: acl.h
+ * Description: source address allow and deny lists per listener and
+ * per path prefix.
+ *
+ * Created by: Daan Pape
+ * Created on: June 17, 2014
+ */
+
+#ifndef ACL_H_
+#define ACL_H_
+
+#include <stdbool.h>
+
+#include "uhttpd.h"
+
+/**
+ * A compiled set of access rules
+ */
+struct acl;
+
+/**
+ * Access control statistics
+ */
+struct acl_stats {
+	int rules;					/* Rules in use */
+	int denied_connections;		/* Connections closed after accept() */
+	int denied_requests;		/* Requests refused by a path rule */
+	int rfc1918;				/* Connections closed by the RFC1918 filter */
+};
+
+/**
+ * Create an empty rule set
+ * @return NULL when out of memory
+ */
+struct acl *acl_new(void);
+
+/**
+ * Add a rule to a rule set
+ * @acl the rule set
+ * @allow true for an allow rule, false for a deny rule
+ * @rule the network in CIDR notation or 'all', optionally followed by
+ * ':port' to limit it to one listener and '/path' to limit it to
+ * requests under a path
+ * @return false when the rule is invalid
+ */
+bool acl_add(struct acl *acl, bool allow, const char *rule);
+
+/**
+ * Free a rule set that is not in use
+ * @acl the rule set, may be NULL
+ */
+void acl_free(struct acl *acl);
+
+/**
+ * Use a rule set for new connections and requests, the previous one is
+ * freed
+ * @acl the rule set
+ */
+void acl_use(struct acl *acl);
+
+/**
+ * Check a connection right after accept()
+ * @peer the peer address
+ * @srv the local address of the connection
+ * @return false when the connection must be closed
+ */
+bool acl_connection(const struct uh_addr *peer, const struct uh_addr *srv);
+
+/**
+ * Check a request against the rules of the longest matching path prefix
+ * @cl the client that made the request
+ * @path the decoded and normalized request path
+ * @return false when the request must be refused
+ */
+bool acl_request(struct client *cl, const char *path);
+
+/**
+ * Get the access control statistics
+ * @s the statistics to fill in
+ */
+void acl_get_stats(struct acl_stats *s);
+
+#endif /* ACL_H_ */
@@ -0,0 +1,133 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: admit.c
+ * Description: admission control. Connections are always accepted and
+ * get a slot when their first request arrives. A share of the slots is
+ * reserved for API calls, idle keep-alive connections give up their slot
+ * first and requests that do not fit are refused right away.
+ *
+ * Created by: Daan Pape
+ * Created on: June 11, 2014
+ */
+
+#include "config.h"
+#include "uhttpd.h"
+#include "client.h"
+#include "admit.h"
+
+/* Connections holding a slot, the longest idle first */
+static LIST_HEAD(admitted);
+
+/* The number of slots in use per class */
+static int n_admitted[__ADMIT_MAX];
+
+/**
+ * Get the number of slots only API calls can use
+ */
+static int admit_reserved(void)
+{
+	return max(conf.max_connections * ADMIT_RESERVED_SHARE / 100, 1);
+}
+
+/**
+ * Check if there is a free slot for a class
+ * @c the class of the request
+ */
+static bool admit_has_room(enum admit_class c)
+{
+	if (!conf.max_connections)
+		return true;
+
+	if (n_admitted[ADMIT_NORMAL] + n_admitted[ADMIT_PRIORITY] >= conf.max_connections)
+		return false;
+
+	if (c == ADMIT_NORMAL &&
+	    n_admitted[ADMIT_NORMAL] >= conf.max_connections - admit_reserved())
+		return false;
+
+	return true;
+}
+
+/**
+ * Check if a connection is waiting for its next request
+ * @cl the client to check
+ */
+static bool admit_is_idle(struct client *cl)
+{
+	if (cl->state != CLIENT_STATE_INIT || !cl->requests)
+		return false;
+
+	return !cl->us->r.data_bytes && !cl->us->w.data_bytes;
+}
+
+/**
+ * Close the idle keep-alive connection that waited longest. Normal slots
+ * go first, only priority requests take idle priority slots.
+ * @c the class of the request that needs the slot
+ * @return false when there is no idle connection
+ */
+static bool admit_reclaim(enum admit_class c)
+{
+	struct client *cl;
+	int pass;
+
+	for (pass = ADMIT_NORMAL; pass <= c; pass++) {
+		list_for_each_entry(cl, &admitted, admit_list) {
+			if (cl->admit != pass || !admit_is_idle(cl))
+				continue;
+
+			admit_release(cl);
+			close_connection(cl);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool admit_connection(void)
+{
+	if (!conf.max_connections || n_clients < conf.max_connections + ADMIT_OVERFLOW)
+		return true;
+
+	return admit_reclaim(ADMIT_PRIORITY);
+}
+
+bool admit_request(struct client *cl, const char *url)
+{
+	enum admit_class c = ADMIT_NORMAL;
+
+	if (cl->admit != ADMIT_NONE)
+		return true;
+
+	if (url && uh_path_match(ADMIT_PRIORITY_PATH, url))
+		c = ADMIT_PRIORITY;
+
+	if (!admit_has_room(c) && (!admit_reclaim(c) || !admit_has_room(c)))
+		return false;
+
+	cl->admit = c;
+	n_admitted[c]++;
+	list_add_tail(&cl->admit_list, &admitted);
+
+	return true;
+}
+
+void admit_idle(struct client *cl)
+{
+	if (cl->admit != ADMIT_NONE)
+		list_move_tail(&cl->admit_list, &admitted);
+}
+
+void admit_release(struct client *cl)
+{
+	if (cl->admit == ADMIT_NONE)
+		return;
+
+	n_admitted[cl->admit]--;
+	list_del(&cl->admit_list);
+	cl->admit = ADMIT_NONE;
+}
@@ -0,0 +1,48 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: admit.h
+ * Description: admission control, decides which connections and
+ * requests are served when the server is loaded.
+ *
+ * Created by: Daan Pape
+ * Created on: June 11, 2014
+ */
+
+#ifndef ADMIT_H_
+#define ADMIT_H_
+
+#include "uhttpd.h"
+
+/**
+ * Check if a new connection can be accepted, idle keep-alive
+ * connections are closed to make room when needed.
+ * @return false when the connection should be refused
+ */
+bool admit_connection(void);
+
+/**
+ * Give a connection a slot for the request it made. Connections keep
+ * their slot for the requests that follow on the same connection.
+ * @cl the client that made the request
+ * @url the request URL, NULL when it is not known
+ * @return false when the request should be refused
+ */
+bool admit_request(struct client *cl, const char *url);
+
+/**
+ * Mark a connection as an idle keep-alive connection, idle connections
+ * are the first to lose their slot.
+ * @cl the client that finished a request
+ */
+void admit_idle(struct client *cl);
+
+/**
+ * Give the slot of a connection back
+ * @cl the client that is closed
+ */
+void admit_release(struct client *cl);
+
+#endif /* ADMIT_H_ */
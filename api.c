@@ -13,18 +13,43 @@
 #include "client.h"
 #include "config.h"
 #include "gethandlers.h"
+#include "window.h"
+#include "params.h"
+#include "script.h"
 
 /* Return code ok */
 const struct http_response r_ok = { 200, "OK" };
-const struct http_response r_bad_req = { 400, "Bad request" };
+const struct http_response r_bad_req = { 400, "Bad Request" };
+static const struct http_response r_timeout = { 504, "Gateway Timeout" };
+
+/* Its address marks a deferred result */
+char api_pending;
+
+/* The calls waiting for their result */
+static LIST_HEAD(pending_calls);
+
+/* The caller of the running handler */
+static api_done_cb call_done;
+static json_object *call_tag;
+static struct api_deferred *call_deferred;
 
 /**
  * The get handlers table
  */
-const struct f_entry get_handlers[3] = {
+const struct f_entry get_handlers[13] = {
 		{"freespace",  get_free_disk_space },
 		{"test", test },
-		{"testing", testing}
+		{"testing", testing},
+		{"budget", get_memory_budget, true},
+		{"memory", get_memory},
+		{"load", get_load},
+		{"uptime", get_uptime},
+		{"interfaces", get_interfaces},
+		{"scripts", get_scripts, true},
+		{"peers", get_peers, true},
+		{"access", get_access, true},
+		{"trace", get_trace, true},
+		{"deadlines", get_deadlines, true}
 };
 
 /**
@@ -51,37 +76,133 @@ const struct f_entry* handlers[] = {
 };
 
 
+/**
+ * Free a deferred call
+ * @d the call to free
+ */
+static void api_deferred_free(struct api_deferred *d)
+{
+	list_del(&d->list);
+	uloop_timeout_cancel(&d->timeout);
+	json_object_put(d->tag);
+	free(d);
+}
+
+/**
+ * Give up on a call that takes too long
+ */
+static void api_deferred_timeout(struct uloop_timeout *t)
+{
+	struct api_deferred *d = container_of(t, struct api_deferred, timeout);
+
+	if (d->cancel)
+		d->cancel(d);
+
+	api_complete(d, &r_timeout, NULL);
+}
+
+json_object* api_call(struct client *cl, api_handler handler, api_done_cb done, json_object *tag)
+{
+	json_object *result;
+
+	call_done = done;
+	call_tag = tag;
+	call_deferred = NULL;
+
+	result = handler(cl);
+
+	/* A handler returning API_PENDING without deferring has failed */
+	if (result == API_PENDING && !call_deferred)
+		result = NULL;
+	else if (result != API_PENDING && call_deferred)
+		api_deferred_free(call_deferred);
+
+	call_done = NULL;
+	call_tag = NULL;
+	call_deferred = NULL;
+
+	return result;
+}
+
+struct api_deferred* api_defer(struct client *cl, void (*cancel)(struct api_deferred *d), void *priv)
+{
+	struct api_deferred *d;
+
+	if (!call_done || call_deferred)
+		return NULL;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+
+	d->cl = cl;
+	d->cancel = cancel;
+	d->priv = priv;
+	d->done = call_done;
+	d->tag = call_tag ? json_object_get(call_tag) : NULL;
+	d->timeout.cb = api_deferred_timeout;
+	uloop_timeout_set(&d->timeout, API_DEFER_TIMEOUT * 1000);
+	list_add_tail(&d->list, &pending_calls);
+
+	call_deferred = d;
+	return d;
+}
+
+void api_complete(struct api_deferred *d, const struct http_response *status, json_object *result)
+{
+	/* The caller may cancel other calls, take this one off the list first */
+	list_del_init(&d->list);
+	uloop_timeout_cancel(&d->timeout);
+
+	d->done(d, status, result);
+
+	json_object_put(d->tag);
+	free(d);
+}
+
+void api_cancel(struct client *cl)
+{
+	struct api_deferred *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &pending_calls, list) {
+		if (d->cl != cl)
+			continue;
+
+		if (d->cancel)
+			d->cancel(d);
+
+		api_deferred_free(d);
+	}
+}
+
 /**
  * Handle response write in chunks
  * cl the client containing the response
  */
 static void handle_chunk_write(struct client *cl)
 {
-	int len;
+	int len = strlen(cl->response + cl->readidx);
 	int r;
-	len = strlen(cl->response);
-
-	while (cl->us->w.data_bytes < 256) {
-		r = (len - cl->readidx) > sizeof(uh_buf) ? sizeof(uh_buf) : (len - cl->readidx);
-		cl->readidx = r;
-		strncpy(uh_buf, cl->response, r);
 
+	while ((r = window_room(cl)) > 0) {
+		r = min(r, len);
 		if (!r) {
 			free(cl->response);
 			request_done(cl);
 			return;
 		}
 
-		uh_chunk_write(cl, uh_buf, r);
+		uh_chunk_write(cl, cl->response + cl->readidx, r);
+		cl->readidx += r;
+		len -= r;
 	}
 }
 
 static void write_response(struct client *cl, int code, const char *summary)
 {
 	/* Write response */
-	write_http_header(cl, code, summary);
-	ustream_printf(cl->us, "Content-Type: application/json\r\n");
-	ustream_printf(cl->us, "Content-Length: %i\r\n\r\n", strlen(cl->response));
+	write_http_header(cl, code, summary, strlen(cl->response));
+	ustream_printf(cl->us, "Content-Type: application/json\r\n\r\n");
 
 	/* Stop if this is a header only request */
 	if (cl->request.method == UH_HTTP_MSG_HEAD) {
@@ -101,96 +222,482 @@ static void write_response(struct client *cl, int code, const char *summary)
 }
 
 /**
- * Handle api requests
+ * Write the response of an API call
+ * @cl the client who made the call
+ * @status the response status
+ * @response the response object, NULL when the call failed
+ */
+static void api_respond(struct client *cl, const struct http_response *status, json_object *response)
+{
+	const char *body;
+
+	/* Get the string representation of the JSON object */
+	if (response)
+		body = json_object_to_json_string(response);
+	else if (status->code == r_timeout.code)
+		body = "Request timed out.";
+	else
+		body = "Request not supported by server.";
+
+	/* Copy the response to the response buffer */
+	cl->response = strdup(body);
+
+	/* Free the JSON object */
+	if (response)
+		json_object_put(response);
+
+	/* Write the response */
+	write_response(cl, status->code, status->message);
+}
+
+/**
+ * Write the result of a deferred API call
+ */
+static void api_request_done(struct api_deferred *d, const struct http_response *status,
+			     json_object *result)
+{
+	d->cl->dispatch.free = NULL;
+	api_respond(d->cl, status, result);
+}
+
+/**
+ * Cancel the deferred call of a request when the connection closes
+ * @cl the client that made the call
+ */
+static void api_request_free(struct client *cl)
+{
+	api_cancel(cl);
+}
+
+/**
+ * Get the key of a call of a batch request in the response, the id of
+ * the call or its name when there is none
+ * @call the call name or call object
+ * @return the key, an empty string for malformed calls
+ */
+static const char* api_batch_key(json_object *call)
+{
+	json_object *val;
+	const char *key = NULL;
+
+	if (json_object_is_type(call, json_type_string))
+		key = json_object_get_string(call);
+	else if (json_object_is_type(call, json_type_object) &&
+		 (json_object_object_get_ex(call, "id", &val) ||
+		  json_object_object_get_ex(call, "call", &val)))
+		key = json_object_get_string(val);
+
+	return key ? key : "";
+}
+
+/**
+ * Parse the call list of a batch request. GET requests name the calls in
+ * the query string, /api/batch?calls=freespace,test. POST requests send a
+ * JSON array, or an object with a "calls" array, of call names or objects
+ * like {"call": "freespace", "method": "GET", "id": "disk"}.
+ * Every call needs its own key in the response, calls repeated without
+ * an id are refused.
+ * @cl the client who sent the request
+ * @return the array of calls or NULL when the request is malformed
+ */
+static json_object* api_batch_parse(struct client *cl)
+{
+	json_object *calls, *val;
+	char *list, *name, *save;
+	int i, j, n;
+
+	if (cl->request.method == UH_HTTP_MSG_POST) {
+		if (!cl->ispostdata)
+			return NULL;
+
+		calls = json_tokener_parse(cl->postdata);
+		if (calls && json_object_is_type(calls, json_type_object)) {
+			val = NULL;
+			if (json_object_object_get_ex(calls, "calls", &val))
+				json_object_get(val);
+			json_object_put(calls);
+			calls = val;
+		}
+	} else {
+		name = (char *) param_get(cl, "calls");
+		if (!name || !(list = strdup(name)))
+			return NULL;
+
+		calls = json_object_new_array();
+		for (name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save))
+			json_object_array_add(calls, json_object_new_string(name));
+		free(list);
+	}
+
+	if (calls && (!json_object_is_type(calls, json_type_array) ||
+		      json_object_array_length(calls) > API_BATCH_MAX_CALLS)) {
+		json_object_put(calls);
+		return NULL;
+	}
+
+	/* Duplicate keys would make all but one result disappear */
+	n = calls ? json_object_array_length(calls) : 0;
+	for (i = 1; i < n; i++) {
+		name = (char *) api_batch_key(json_object_array_get_idx(calls, i));
+		for (j = 0; j < i; j++) {
+			if (!strcmp(name, api_batch_key(json_object_array_get_idx(calls, j)))) {
+				json_object_put(calls);
+				return NULL;
+			}
+		}
+	}
+
+	return calls;
+}
+
+/**
+ * Write the result of a call of a batch request
+ * @cl the client who sent the request
+ * @key the key of the call in the response
+ * @status the call status
+ * @result the call result, NULL when there is none
+ * @first true when this is the first call of the batch
+ */
+static void api_batch_entry(struct client *cl, json_object *key, int status,
+			    json_object *result, bool first)
+{
+	json_object *entry = json_object_new_object();
+
+	json_object_object_add(entry, "status", json_object_new_int(status));
+	if (result)
+		json_object_object_add(entry, "result", result);
+
+	uh_chunk_printf(cl, "%s%s:%s", first ? "" : ",",
+			json_object_to_json_string(key), json_object_to_json_string(entry));
+
+	json_object_put(entry);
+}
+
+static void api_batch_write_cb(struct client *cl);
+
+/**
+ * Write the result of a deferred call and continue with the batch
+ */
+static void api_batch_done(struct api_deferred *d, const struct http_response *status,
+			   json_object *result)
+{
+	struct client *cl = d->cl;
+
+	/* The pending call is the last one started */
+	api_batch_entry(cl, d->tag, status->code, result, cl->dispatch.batch.idx == 1);
+	cl->dispatch.batch.pending = false;
+	api_batch_write_cb(cl);
+}
+
+/**
+ * Run a single call of a batch request and write its result
+ * @cl the client who sent the request
+ * @call the call name or call object
+ * @first true when this is the first call of the batch
+ */
+static void api_batch_run(struct client *cl, json_object *call, bool first)
+{
+	enum http_method saved = cl->request.method;
+	json_object *key, *val, *result = NULL;
+	const char *name = NULL;
+	int method = UH_HTTP_MSG_GET;
+	api_handler handler = NULL;
+	int status = 400;
+
+	if (json_object_is_type(call, json_type_string)) {
+		name = json_object_get_string(call);
+	} else if (json_object_is_type(call, json_type_object) &&
+		   json_object_object_get_ex(call, "call", &val)) {
+		name = json_object_get_string(val);
+		if (json_object_object_get_ex(call, "method", &val))
+			method = api_find_method(json_object_get_string(val));
+	}
+
+	if (!name)
+		name = "";
+	else if (method >= 0)
+		handler = api_find_handler(method, name);
+
+	if (name[0] && !handler)
+		status = method < 0 ? 405 : 404;
+
+	key = json_object_new_string(api_batch_key(call));
+
+	if (handler) {
+		cl->request.method = method;
+		cl->http_status = r_bad_req;
+		result = api_call(cl, handler, api_batch_done, key);
+		if (result)
+			status = cl->http_status.code;
+		cl->request.method = saved;
+	}
+
+	/* The result is written when the call completes */
+	if (result == API_PENDING)
+		cl->dispatch.batch.pending = true;
+	else
+		api_batch_entry(cl, key, status, result, first);
+
+	json_object_put(key);
+}
+
+/**
+ * Write the results of a batch request, calls are run as the client
+ * accepts their output.
+ * @cl the client containing the batch
+ */
+static void api_batch_write_cb(struct client *cl)
+{
+	json_object *calls = cl->dispatch.batch.calls;
+
+	while (!cl->dispatch.batch.pending && window_room(cl) > 0) {
+		if (cl->dispatch.batch.idx == json_object_array_length(calls)) {
+			uh_chunk_write(cl, "}", 1);
+			request_done(cl);
+			return;
+		}
+
+		api_batch_run(cl, json_object_array_get_idx(calls, cl->dispatch.batch.idx),
+			      !cl->dispatch.batch.idx);
+		cl->dispatch.batch.idx++;
+	}
+}
+
+/**
+ * Free the call list of a batch request
+ * @cl the client containing the batch
+ */
+static void api_batch_free(struct client *cl)
+{
+	api_cancel(cl);
+	json_object_put(cl->dispatch.batch.calls);
+}
+
+/**
+ * Handle a batch request, the response is a JSON object holding the
+ * status and result of every call keyed by call.
+ * @cl the client who sent the request
+ */
+static void api_batch_request(struct client *cl)
+{
+	json_object *calls = api_batch_parse(cl);
+
+	if (!calls) {
+		send_client_error(cl, 400, "Bad Request", "Invalid batch request.");
+		return;
+	}
+
+	write_http_header(cl, 200, "OK", HTTP_LENGTH_STREAM);
+	ustream_printf(cl->us, "Content-Type: application/json\r\n\r\n");
+
+	/* Stop if this is a header only request */
+	if (cl->request.method == UH_HTTP_MSG_HEAD) {
+		json_object_put(calls);
+		request_done(cl);
+		return;
+	}
+
+	cl->dispatch.batch.calls = calls;
+	cl->dispatch.batch.idx = 0;
+	cl->dispatch.batch.pending = false;
+	cl->dispatch.write_cb = api_batch_write_cb;
+	cl->dispatch.free = api_batch_free;
+
+	uh_chunk_write(cl, "{", 1);
+	api_batch_write_cb(cl);
+}
+
+/**
+ * Run an api request once its body is complete
  * @cl the client who sent the request
  * @url the request URL
- * @pi info concerning the path
  */
-void api_handle_request(struct client *cl, char *url)
+static void api_run_request(struct client *cl, char *url)
 {
 	json_object *response = NULL; 		/* The response */
-	char *request;						/* The request method */
-
-	/* Filter the request out of the url */
-	char *firstslash = strchr(url + API_STR_LEN, '/');
-	if(firstslash){
-		/* Get the length of the request when there is a slash after the data */
-		size_t len = firstslash - url - API_STR_LEN;
-		request = (char*) malloc(len*sizeof(char));
-		memcpy(request, url + API_STR_LEN, len*sizeof(char));
-		request[len] = 0;
-	} else {
-		/* Request is the same as url without API prefix */
-		request = url + API_STR_LEN;
+	char request[API_CALL_MAX_LEN];		/* The call name */
+	const char *call = url + API_STR_LEN;
+	const char *query = strchr(call, '?');
+	api_handler handler = NULL;
+	int len;
+
+	/* Handlers find their parameters through the query string */
+	param_set_query(cl, query ? query + 1 : NULL);
+
+	/* The call name ends at the first slash or the query string */
+	len = strcspn(call, "/?");
+
+	/* Batch requests stream their own response */
+	if (len == strlen(API_BATCH_CALL) && !strncmp(call, API_BATCH_CALL, len)) {
+		api_batch_request(cl);
+		return;
 	}
 
 	/* Search the correct handler */
-	json_object* (*handler)(struct client *) = NULL;
-	switch(cl->request.method) {
-		case UH_HTTP_MSG_GET:
-			handler = api_get_function(request, get_handlers, sizeof(get_handlers)/sizeof(struct f_entry));
-			break;
-		case UH_HTTP_MSG_POST:
-			handler = api_get_function(request, post_handlers, sizeof(post_handlers)/sizeof(struct f_entry));
-			break;
-		case UH_HTTP_MSG_PUT:
-			handler = api_get_function(request, put_handlers, sizeof(put_handlers)/sizeof(struct f_entry));
-			break;
-		default:
-			handler = NULL;
-			break;
+	if (len < sizeof(request)) {
+		memcpy(request, call, len);
+		request[len] = 0;
+		handler = api_find_handler(cl->request.method, request);
 	}
 
+	/* Calls without a handler may be scripts */
+	if (!handler && script_request(cl, url, call, len))
+		return;
+
 	/* If a handler is found execute it */
 	if(handler){
-		response = handler(cl);
+		response = api_call(cl, handler, api_request_done, NULL);
 	}
 
-	/* Write response when there is one */
-	if(response){
-		/* Get the string representation of the JSON object */
-		const char* stringResponse = json_object_to_json_string(response);
-
-		/* Copy the response to the response buffer */
-		cl->response = (char*) malloc((strlen(stringResponse)+1)*sizeof(char));
-		strcpy(cl->response, stringResponse);
+	/* Wait for the handler, the connection may close meanwhile */
+	if(response == API_PENDING){
+		uloop_timeout_cancel(&cl->timeout);
+		cl->dispatch.free = api_request_free;
+		return;
+	}
 
-		/* Free the JSON object */
-		json_object_put(response);
-	}else{
-		/* Handle bad request */
+	/* Failed calls are bad requests */
+	if(!response){
 		cl->http_status = r_bad_req;
-		const char* stringResponse = "Request not supported by server.";
+	}
+
+	api_respond(cl, &cl->http_status, response);
+}
+
+/**
+ * Collect body data of an api request
+ * @cl the client who sent the request
+ * @data the body data
+ * @len the length of the data
+ * @return the number of bytes used, all of them
+ */
+static int api_body_send(struct client *cl, const char *data, int len)
+{
+	char *body;
+
+	/* The rest of a body over the limit is read and dropped */
+	if (cl->postdata_len < 0)
+		return len;
+
+	body = NULL;
+	if (cl->postdata_len + len <= API_MAX_BODY)
+		body = realloc(cl->postdata, cl->postdata_len + len + 1);
 
-		/* Copy the response to the response buffer */
-		cl->response = (char*) malloc((strlen(stringResponse)+1)*sizeof(char));
-		strcpy(cl->response, stringResponse);
+	if (!body) {
+		free(cl->postdata);
+		cl->postdata = NULL;
+		cl->postdata_len = -1;
+		return len;
 	}
 
-	/* Free request resource if new space was allocated */
-	if(firstslash) {
-		free(request);
+	memcpy(body + cl->postdata_len, data, len);
+	cl->postdata = body;
+	cl->postdata_len += len;
+	body[cl->postdata_len] = 0;
+
+	return len;
+}
+
+/**
+ * Run an api request after its body was received
+ * @cl the client who sent the request
+ */
+static void api_body_done(struct client *cl)
+{
+	char *url = blobmsg_data(blob_data(cl->hdr.head));
+
+	cl->dispatch.data_send = NULL;
+	cl->dispatch.data_done = NULL;
+
+	if (cl->postdata_len < 0) {
+		cl->postdata_len = 0;
+		send_client_error(cl, 413, "Request Entity Too Large", NULL);
+		return;
 	}
 
-	/* Write the response */
-	write_response(cl, cl->http_status.code, cl->http_status.message);
+	cl->ispostdata = cl->postdata != NULL;
+	api_run_request(cl, url);
+}
+
+/**
+ * Handle api requests, a request body is received before the call runs
+ * @cl the client who sent the request
+ * @url the request URL
+ */
+void api_handle_request(struct client *cl, char *url)
+{
+	struct http_request *r = &cl->request;
+
+	/* HTTP/2 streams run with their body complete */
+	if (cl->h2_stream || (!r->content_length && !r->transfer_chunked)) {
+		api_run_request(cl, url);
+		return;
+	}
+
+	/* The rest of a body that is too large would be read as the next request */
+	if (r->content_length > API_MAX_BODY) {
+		r->connection_close = true;
+		send_client_error(cl, 413, "Request Entity Too Large", NULL);
+		return;
+	}
+
+	cl->dispatch.data_send = api_body_send;
+	cl->dispatch.data_done = api_body_done;
 }
 
 /**
- * Get a function pointer from the name
+ * Get a function pointer from the name, statistics calls are only found
+ * when they are enabled
  * @name the function name
  * @table the function lookup table, must be in lexical order
  * @table_size the size of the table
  */
-void* api_get_function(char* name, const struct f_entry* table, size_t table_size)
+void* api_get_function(const char* name, const struct f_entry* table, size_t table_size)
 {
 	//TODO: optimize to binary search
 	for(int i = 0; i < table_size; ++i) {
 		if(strcmp(name, table[i].name) == 0){
-			return table[i].function;
+			return table[i].stats && !conf.stats_api ? NULL : table[i].function;
 		}
 	}
 
 	/* Return NULL when no request could be found */
 	return NULL;
 }
+
+/**
+ * Map a method name to the http method of an API call
+ * @name the method name, NULL for GET
+ * @return -1 when API calls do not support the method
+ */
+int api_find_method(const char *name)
+{
+	if (!name || !strcmp(name, "GET"))
+		return UH_HTTP_MSG_GET;
+	if (!strcmp(name, "POST"))
+		return UH_HTTP_MSG_POST;
+	if (!strcmp(name, "PUT"))
+		return UH_HTTP_MSG_PUT;
+
+	return -1;
+}
+
+/**
+ * Find the handler for an API call
+ * @method the http method of the call
+ * @name the call name
+ * @return NULL when the call does not exist
+ */
+api_handler api_find_handler(enum http_method method, const char *name)
+{
+	switch(method) {
+		case UH_HTTP_MSG_GET:
+			return api_get_function(name, get_handlers, sizeof(get_handlers)/sizeof(struct f_entry));
+		case UH_HTTP_MSG_POST:
+			return api_get_function(name, post_handlers, sizeof(post_handlers)/sizeof(struct f_entry));
+		case UH_HTTP_MSG_PUT:
+			return api_get_function(name, put_handlers, sizeof(put_handlers)/sizeof(struct f_entry));
+		default:
+			return NULL;
+	}
+}
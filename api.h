@@ -2,6 +2,7 @@
 #define API_H
 
 #include <sys/types.h>
+#include <json/json.h>
 
 #include "uhttpd.h"
 #include "config.h"
@@ -12,6 +13,46 @@
 struct f_entry {
 	const char name[API_CALL_MAX_LEN];
 	void* function;
+	bool stats;				/* Only served when stats_api is set */
+};
+
+/**
+ * An API call handler, returns the response object or NULL
+ * when the request could not be handled. Handlers that wait for
+ * device I/O or other processes return API_PENDING after calling
+ * api_defer() and complete the call later with api_complete().
+ */
+typedef json_object* (*api_handler)(struct client *cl);
+
+/* Returned by a handler that completes its call later */
+extern char api_pending;
+#define API_PENDING		((json_object *) &api_pending)
+
+struct api_deferred;
+
+/**
+ * Called with the result of a deferred call
+ * @d the deferred call
+ * @status the response status
+ * @result the response object, NULL when the call failed
+ */
+typedef void (*api_done_cb)(struct api_deferred *d, const struct http_response *status,
+			    json_object *result);
+
+/**
+ * An API call that completes later, from a uloop callback. The client
+ * may go away before that, the cancel callback is then called and the
+ * handler must forget the call.
+ */
+struct api_deferred {
+	struct list_head list;
+	struct client *cl;				/* The client waiting for the result */
+	struct uloop_timeout timeout;	/* Gives up after API_DEFER_TIMEOUT */
+	void (*cancel)(struct api_deferred *d);	/* Handler cleanup, may be NULL */
+	void *priv;						/* Handler data */
+
+	api_done_cb done;				/* Delivers the result to the caller */
+	json_object *tag;				/* Caller data */
 };
 
 /**
@@ -22,11 +63,62 @@ struct f_entry {
 void api_handle_request(struct client *cl, char *url);
 
 /**
- * Get a function pointer from the name
+ * Run an API handler
+ * @cl the client who made the call
+ * @handler the handler to run
+ * @done called with the result when the handler defers it
+ * @tag caller data for done, a reference is kept while the call is pending
+ * @return the result, API_PENDING when it is delivered to done later
+ */
+json_object* api_call(struct client *cl, api_handler handler, api_done_cb done, json_object *tag);
+
+/**
+ * Defer the result of the running handler, the handler returns
+ * API_PENDING after this call
+ * @cl the client passed to the handler
+ * @cancel called when the result is no longer wanted, may be NULL
+ * @priv handler data
+ * @return NULL when the handler is not called through api_call()
+ */
+struct api_deferred* api_defer(struct client *cl, void (*cancel)(struct api_deferred *d), void *priv);
+
+/**
+ * Complete a deferred call, d is freed. Only call this after the
+ * handler returned, from a uloop callback.
+ * @d the deferred call
+ * @status the response status
+ * @result the response object, ownership passes to the caller, NULL on failure
+ */
+void api_complete(struct api_deferred *d, const struct http_response *status, json_object *result);
+
+/**
+ * Cancel the deferred calls of a client
+ * @cl the client that went away
+ */
+void api_cancel(struct client *cl);
+
+/**
+ * Get a function pointer from the name, statistics calls are only found
+ * when they are enabled
  * @name the function name
  * @table the function lookup table, must be in lexical order
  * @table_size the size of the table
  */
-void* api_get_function(char* name, const struct f_entry* table, size_t table_size);
+void* api_get_function(const char* name, const struct f_entry* table, size_t table_size);
+
+/**
+ * Map a method name to the http method of an API call
+ * @name the method name, NULL for GET
+ * @return -1 when API calls do not support the method
+ */
+int api_find_method(const char *name);
+
+/**
+ * Find the handler for an API call
+ * @method the http method of the call
+ * @name the call name
+ * @return NULL when the call does not exist
+ */
+api_handler api_find_handler(enum http_method method, const char *name);
 
 #endif
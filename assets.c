@@ -0,0 +1,30 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: assets.c
+ * Description: lookup in the embedded web interface. The first hash
+ * picks a bucket, the displacement of that bucket moves the second hash
+ * to the slot of the asset, so every lookup probes a single slot.
+ *
+ * Created by: Daan Pape
+ * Created on: June 12, 2014
+ */
+
+#include <string.h>
+
+#include "assets.h"
+
+const struct asset *asset_find(const char *path, int len)
+{
+	uint32_t h = asset_hash(asset_seed[0], path, len);
+	uint32_t g = asset_hash(asset_seed[1], path, len);
+	const struct asset *a;
+
+	a = &asset_table[(g + asset_disp[h % asset_buckets]) & (asset_slots - 1)];
+	if (!a->path || a->path_len != len || memcmp(a->path, path, len))
+		return NULL;
+
+	return a;
+}
@@ -0,0 +1,68 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: assets.h
+ * Description: the web interface embedded in the server at build time.
+ * The tables are generated by tools/mkassets.c and indexed by a
+ * perfect hash of the request path.
+ *
+ * Created by: Daan Pape
+ * Created on: June 12, 2014
+ */
+
+#ifndef ASSETS_H_
+#define ASSETS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * A file of the embedded web interface
+ */
+struct asset {
+	const char *path;			/* The request path, NULL for an empty slot */
+	int path_len;
+	const char *mime;			/* The content type */
+	const char *etag;			/* Strong entity tag of the body */
+	const char *gz_etag;		/* Strong entity tag of the gzip body */
+	time_t mtime;				/* Modification time of the source file */
+	const char *data;			/* The body */
+	int len;
+	const char *gz;				/* The gzip body, NULL when it is not smaller */
+	int gz_len;
+};
+
+/* Generated tables */
+extern const struct asset asset_table[];	/* The slots, asset_slots entries */
+extern const uint32_t asset_slots;			/* The number of slots, a power of two */
+extern const uint32_t asset_buckets;		/* The number of displacement buckets */
+extern const uint32_t asset_disp[];			/* Slot displacement per bucket */
+extern const uint32_t asset_seed[2];		/* Seeds of the bucket and slot hashes */
+
+/**
+ * FNV-1a hash used to place the assets, shared with the generator
+ * @h the seed
+ * @s the data to hash
+ * @len the length of the data
+ */
+static inline uint32_t asset_hash(uint32_t h, const char *s, int len)
+{
+	while (len-- > 0) {
+		h ^= (uint8_t) *s++;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+/**
+ * Find an embedded asset
+ * @path the decoded request path
+ * @len the length of the path
+ * @return NULL when the path is not in the bundle
+ */
+const struct asset *asset_find(const char *path, int len);
+
+#endif /* ASSETS_H_ */
@@ -23,14 +23,196 @@
 #ifdef HAVE_SHADOW
 #include <shadow.h>
 #endif
+#include <ctype.h>
 #include "uhttpd.h"
+#include "config.h"
 #include "client.h"
 
-static LIST_HEAD(auth_realms);
+/* Maximum number of realm paths that can be a prefix of one url */
+#define AUTH_MAX_MATCHES	16
+
+/**
+ * Node in the realm prefix trie, realm paths are matched case
+ * insensitive so the trie holds lower case characters.
+ */
+struct auth_node {
+	struct auth_node *child;		/* The first child node */
+	struct auth_node *next;			/* The next sibling node */
+	struct list_head realms;		/* Realms whose path ends here */
+	char c;
+};
+
+/**
+ * A credential that was verified against a realm.
+ */
+struct auth_cache_entry {
+	uint64_t hash;					/* Keyed hash of the raw credentials */
+	const struct auth_realm *realm;	/* The realm they were verified for */
+	time_t expires;					/* Monotonic expiry time */
+};
+
+static struct auth_node auth_root = {
+	.realms = LIST_HEAD_INIT(auth_root.realms),
+};
+
+static struct auth_cache_entry *auth_cache;
+static unsigned int auth_cache_mask;
+static uint8_t auth_cache_key[16];
+static bool auth_cache_ready;
+
+/**
+ * Forget all verified credentials.
+ */
+static void auth_cache_flush(void)
+{
+	if (auth_cache)
+		memset(auth_cache, 0, (auth_cache_mask + 1) * sizeof(*auth_cache));
+}
+
+/**
+ * Get the keyed hash of raw credentials.
+ * @cred the base64 encoded credentials
+ */
+static uint64_t auth_cache_hash(const char *cred)
+{
+	if (!auth_cache_ready)
+		auth_cache_ready = uh_random_bytes(auth_cache_key, sizeof(auth_cache_key));
+
+	return uh_siphash(auth_cache_key, cred, strlen(cred));
+}
+
+/**
+ * Look up the realm verified for the given credentials.
+ * @hash the keyed hash of the credentials
+ * @return NULL when the credentials are not known
+ */
+static const struct auth_realm *auth_cache_get(uint64_t hash)
+{
+	struct auth_cache_entry *e;
+
+	if (!auth_cache || !auth_cache_ready)
+		return NULL;
+
+	e = &auth_cache[hash & auth_cache_mask];
+	if (!e->realm || e->hash != hash)
+		return NULL;
+
+	if (e->expires <= uh_monotonic()) {
+		e->realm = NULL;
+		return NULL;
+	}
+
+	return e->realm;
+}
+
+/**
+ * Remember credentials that were verified for a realm.
+ */
+static void auth_cache_put(uint64_t hash, const struct auth_realm *realm)
+{
+	struct auth_cache_entry *e;
+
+	if (!auth_cache || !auth_cache_ready)
+		return;
+
+	e = &auth_cache[hash & auth_cache_mask];
+	e->hash = hash;
+	e->realm = realm;
+	e->expires = uh_monotonic() + AUTH_CACHE_TTL;
+}
+
+/**
+ * Get the trie node for a realm path, creating it when needed.
+ * @path the realm path
+ */
+static struct auth_node *auth_node_get(const char *path)
+{
+	struct auth_node *node = &auth_root;
+	struct auth_node *child;
+	char c;
+
+	for (; *path; path++) {
+		c = tolower(*path);
+
+		for (child = node->child; child; child = child->next)
+			if (child->c == c)
+				break;
+
+		if (!child) {
+			child = calloc(1, sizeof(*child));
+			if (!child)
+				return NULL;
+
+			child->c = c;
+			INIT_LIST_HEAD(&child->realms);
+			child->next = node->child;
+			node->child = child;
+		}
+
+		node = child;
+	}
+
+	return node;
+}
+
+/**
+ * Collect all trie nodes with realms whose path is a prefix of name.
+ * @name the requested path
+ * @nodes the nodes found, the longest prefix last
+ * @return the number of nodes found
+ */
+static int auth_node_match(const char *name, struct auth_node **nodes)
+{
+	struct auth_node *node = &auth_root;
+	int n = 0;
+	char c;
+
+	while (node) {
+		if (!list_empty(&node->realms)) {
+			/* Keep the most specific matches */
+			if (n == AUTH_MAX_MATCHES) {
+				memmove(nodes, nodes + 1, (n - 1) * sizeof(*nodes));
+				n--;
+			}
+			nodes[n++] = node;
+		}
+
+		if (!*name)
+			break;
+
+		c = tolower(*name++);
+		for (node = node->child; node; node = node->next)
+			if (node->c == c)
+				break;
+	}
+
+	return n;
+}
+
+/**
+ * Find the realm for a user, the most specific realm path wins.
+ * @nodes the matching trie nodes, the longest prefix last
+ * @n the number of nodes
+ * @user the user name, NULL to get the most specific realm
+ */
+static struct auth_realm *auth_realm_find(struct auth_node **nodes, int n, const char *user)
+{
+	struct auth_realm *realm;
+
+	while (n-- > 0) {
+		list_for_each_entry(realm, &nodes[n]->realms, list) {
+			if (!user || !strcmp(user, realm->user))
+				return realm;
+		}
+	}
+
+	return NULL;
+}
 
 void uh_auth_add(const char *path, const char *user, const char *pass)
 {
 	struct auth_realm *new = NULL;
+	struct auth_node *node;
 	struct passwd *pwd;
 	const char *new_pass = NULL;
 	char *dest_path, *dest_user, *dest_pass;
@@ -68,68 +250,102 @@ void uh_auth_add(const char *path, const char *user, const char *pass)
 	if (!new)
 		return;
 
+	node = auth_node_get(path);
+	if (!node) {
+		free(new);
+		return;
+	}
+
 	new->path = strcpy(dest_path, path);
 	new->user = strcpy(dest_user, user);
 	new->pass = strcpy(dest_pass, new_pass);
-	list_add(&new->list, &auth_realms);
+	list_add(&new->list, &node->realms);
+
+	/* Previously verified credentials may match another realm now */
+	auth_cache_flush();
+}
+
+void uh_auth_cache_resize(void)
+{
+	unsigned int size = 1;
+
+	if (conf.auth_cache_size <= 0) {
+		free(auth_cache);
+		auth_cache = NULL;
+		return;
+	}
+
+	/* Entries are indexed by masking the hash */
+	while (size < conf.auth_cache_size)
+		size <<= 1;
+
+	if (auth_cache && size == auth_cache_mask + 1)
+		return;
+
+	free(auth_cache);
+	auth_cache = calloc(size, sizeof(*auth_cache));
+	auth_cache_mask = size - 1;
 }
 
 bool uh_auth_check(struct client *cl, struct path_info *pi)
 {
+	static const char body[] = "Authorization Required\n";
 	struct http_request *req = &cl->request;
+	struct auth_node *nodes[AUTH_MAX_MATCHES];
+	const struct auth_realm *cached;
 	struct auth_realm *realm;
-	bool user_match = false;
+	const char *cred = NULL;
+	char buf[256];
 	char *user = NULL;
 	char *pass = NULL;
-	int plen;
+	const char *hash;
+	uint64_t key = 0;
+	int n;
 
-	if (pi->auth && !strncasecmp(pi->auth, "Basic ", 6)) {
-		const char *auth = pi->auth + 6;
+	req->realm = NULL;
+	n = auth_node_match(pi->name, nodes);
+	if (!n)
+		return true;
+
+	if (pi->auth && !strncasecmp(pi->auth, "Basic ", 6))
+		cred = pi->auth + 6;
 
-		uh_b64decode(uh_buf, sizeof(uh_buf), auth, strlen(auth));
-		pass = strchr(uh_buf, ':');
+	/* Credentials verified before are accepted without decoding them */
+	if (cred) {
+		key = auth_cache_hash(cred);
+		cached = auth_cache_get(key);
+		if (cached && auth_realm_find(nodes, n, cached->user) == cached) {
+			req->realm = cached;
+			return true;
+		}
+
+		uh_b64decode(buf, sizeof(buf), cred, strlen(cred));
+		pass = strchr(buf, ':');
 		if (pass) {
-			user = uh_buf;
+			user = buf;
 			*pass++ = 0;
 		}
 	}
 
-	req->realm = NULL;
-	plen = strlen(pi->name);
-	list_for_each_entry(realm, &auth_realms, list) {
-		int rlen = strlen(realm->path);
-
-		if (plen < rlen)
-			continue;
-
-		if (strncasecmp(pi->name, realm->path, rlen) != 0)
-			continue;
-
+	realm = user ? auth_realm_find(nodes, n, user) : NULL;
+	if (realm) {
 		req->realm = realm;
-		if (!user)
-			break;
-
-		if (strcmp(user, realm->user) != 0)
-			continue;
 
-		user_match = true;
-		break;
+		if (!strcmp(pass, realm->pass) ||
+		    ((hash = crypt(pass, realm->pass)) && !strcmp(hash, realm->pass))) {
+			auth_cache_put(key, realm);
+			return true;
+		}
+	} else {
+		req->realm = auth_realm_find(nodes, n, NULL);
 	}
 
-	if (!req->realm)
-		return true;
-
-	if (user_match &&
-	    (!strcmp(pass, realm->pass) ||
-	     !strcmp(crypt(pass, realm->pass), realm->pass)))
-		return true;
-
-	write_http_header(cl, 401, "Authorization Required");
+	write_http_header(cl, 401, "Authorization Required", sizeof(body) - 1);
 	ustream_printf(cl->us,
 				  "WWW-Authenticate: Basic realm=\"%s\"\r\n"
 				  "Content-Type: text/plain\r\n\r\n",
 				  conf.realm);
-	uh_chunk_printf(cl, "Authorization Required\n");
+	uh_chunk_write(cl, body, sizeof(body) - 1);
 	request_done(cl);
 
 	return false;
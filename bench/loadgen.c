@@ -0,0 +1,967 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: loadgen.c
+ * Description: loopback load generator and latency benchmark. Starts
+ * woodbox-server on a loopback port with a generated document root and
+ * drives it with an event driven HTTP client.
+ *
+ * Created by: Daan Pape
+ * Created on: June 2, 2014
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <libubox/uloop.h>
+
+#define BENCH_RECV_BUFF		16384		/* Size of the per connection receive buffer */
+#define BENCH_SLOW_READ		4096		/* Bytes a slow reader consumes per tick */
+#define BENCH_SLOW_TICK		50			/* Milliseconds between slow reader ticks */
+#define BENCH_SLOW_READERS	8			/* Number of slow readers in the slow scenario */
+#define BENCH_POST_SIZE		1024		/* Size of the POST body in bytes */
+
+/**
+ * A generated document root file.
+ */
+struct bench_file {
+	const char *name;
+	int size;
+};
+
+static const struct bench_file bench_files[] = {
+	{ "small.html", 512 },
+	{ "medium.js", 16 * 1024 },
+	{ "large.css", 256 * 1024 },
+	{ "huge.png", 4 * 1024 * 1024 },
+};
+
+/**
+ * The kind of request a connection issues.
+ */
+enum bench_req {
+	REQ_SMALL,
+	REQ_MIXED,
+	REQ_HUGE,
+	REQ_POST,
+};
+
+/**
+ * A benchmark scenario.
+ */
+struct scenario {
+	const char *name;
+	enum bench_req req;			/* The requests issued by measured connections */
+	bool keepalive;				/* Reuse connections between requests */
+	int slow_readers;			/* Number of additional slow readers */
+};
+
+static const struct scenario scenarios[] = {
+	{ "keepalive",	REQ_SMALL,	true,	0 },
+	{ "churn",		REQ_SMALL,	false,	0 },
+	{ "mixed",		REQ_MIXED,	true,	0 },
+	{ "slowread",	REQ_SMALL,	true,	BENCH_SLOW_READERS },
+	{ "post",		REQ_POST,	true,	0 },
+	{ "download",	REQ_HUGE,	true,	0 },
+};
+
+/**
+ * Response parser states.
+ */
+enum parse_state {
+	PARSE_HEADER,
+	PARSE_BODY,
+	PARSE_CHUNK_SIZE,
+	PARSE_CHUNK_DATA,
+	PARSE_CHUNK_CRLF,
+	PARSE_TRAILER,
+	PARSE_DONE,
+};
+
+/**
+ * A benchmark client connection.
+ */
+struct conn {
+	struct uloop_fd fd;				/* Event loop information */
+	struct uloop_timeout slow;		/* Read timer for slow readers */
+	bool slow_reader;				/* True if this is a slow reader */
+	bool connected;					/* True when a request was sent */
+	int responses;					/* Responses received in this scenario */
+
+	char out[BENCH_POST_SIZE + 512];	/* The request being sent */
+	int out_len, out_ofs;
+
+	char in[BENCH_RECV_BUFF];		/* Received but unparsed data */
+	int in_len;
+
+	enum parse_state state;
+	long long remaining;			/* Remaining body or chunk bytes */
+	bool server_close;				/* Server announced Connection: close */
+	bool head_only;					/* Response has no body */
+	uint64_t start;					/* Request start time in microseconds */
+};
+
+/**
+ * Latency sample collection.
+ */
+struct samples {
+	uint32_t *lat;
+	int count;
+	int size;
+};
+
+static const struct scenario *cur;	/* The running scenario */
+static struct samples samples;		/* Measured latencies */
+static int n_errors;				/* Failed requests */
+static int n_requests;				/* Total requests issued */
+static uint32_t rnd = 2463534242u;	/* xorshift state for the mixed scenario */
+
+static struct sockaddr_in srv_addr;	/* Address of the server under test */
+static pid_t srv_pid;				/* The pid of the server under test */
+static char docroot[] = "/tmp/woodbox-bench.XXXXXX";
+static char conffile[PATH_MAX];		/* Runtime configuration of the server */
+
+static int opt_conns = 64;			/* Measured concurrent connections */
+static int opt_duration = 5;		/* Seconds per scenario */
+static const char *opt_only;		/* Run only this scenario */
+
+static void conn_start(struct conn *c);
+
+/**
+ * Get the monotonic time in microseconds.
+ */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Add a latency sample.
+ * @us the latency in microseconds
+ */
+static void samples_add(uint64_t us)
+{
+	if (samples.count == samples.size) {
+		samples.size = samples.size ? samples.size * 2 : 65536;
+		samples.lat = realloc(samples.lat, samples.size * sizeof(*samples.lat));
+	}
+
+	samples.lat[samples.count++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Get a percentile from the sorted samples.
+ * @p the percentile between 0 and 1
+ */
+static uint32_t samples_pct(double p)
+{
+	int idx;
+
+	if (!samples.count)
+		return 0;
+
+	idx = (int) (p * samples.count);
+	if (idx >= samples.count)
+		idx = samples.count - 1;
+
+	return samples.lat[idx];
+}
+
+/**
+ * Build the next request for a connection.
+ * @c the connection to build the request for
+ */
+static void conn_build_request(struct conn *c)
+{
+	const char *conn_hdr = cur->keepalive ? "Keep-Alive" : "close";
+	const char *path = "/small.html";
+	enum bench_req req = c->slow_reader ? REQ_HUGE : cur->req;
+
+	c->head_only = false;
+
+	if (req == REQ_MIXED) {
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+
+		switch (rnd % 10) {
+		case 0: case 1: case 2:
+			path = "/api/test";
+			break;
+		case 3:
+			path = "/api/load";
+			break;
+		case 4: case 5:
+			path = "/medium.js";
+			break;
+		case 6:
+			path = "/large.css";
+			break;
+		default:
+			path = "/small.html";
+			break;
+		}
+	} else if (req == REQ_HUGE) {
+		path = "/huge.png";
+	}
+
+	if (req == REQ_POST) {
+		c->out_len = snprintf(c->out, sizeof(c->out),
+			"POST /api/test HTTP/1.1\r\n"
+			"Host: 127.0.0.1\r\n"
+			"Connection: %s\r\n"
+			"Content-Type: application/x-www-form-urlencoded\r\n"
+			"Content-Length: %d\r\n\r\n",
+			conn_hdr, BENCH_POST_SIZE);
+		memset(c->out + c->out_len, 'a', BENCH_POST_SIZE);
+		c->out_len += BENCH_POST_SIZE;
+	} else {
+		c->out_len = snprintf(c->out, sizeof(c->out),
+			"GET %s HTTP/1.1\r\n"
+			"Host: 127.0.0.1\r\n"
+			"Connection: %s\r\n\r\n",
+			path, conn_hdr);
+	}
+
+	c->out_ofs = 0;
+	c->state = PARSE_HEADER;
+	c->server_close = false;
+	c->in_len = 0;
+}
+
+/**
+ * Close the connection of a client.
+ * @c the client connection
+ */
+static void conn_close(struct conn *c)
+{
+	uloop_timeout_cancel(&c->slow);
+	if (c->fd.fd >= 0) {
+		uloop_fd_delete(&c->fd);
+		close(c->fd.fd);
+	}
+	c->fd.fd = -1;
+	c->connected = false;
+}
+
+/**
+ * Register the connection for the right poll events.
+ * @c the client connection
+ */
+static void conn_poll(struct conn *c)
+{
+	unsigned int flags = 0;
+
+	if (c->out_ofs < c->out_len)
+		flags |= ULOOP_WRITE;
+	else if (!c->slow_reader)
+		flags |= ULOOP_READ;
+
+	if (flags)
+		uloop_fd_add(&c->fd, flags);
+	else
+		uloop_fd_delete(&c->fd);
+
+	if (c->slow_reader && !(flags & ULOOP_WRITE))
+		uloop_timeout_set(&c->slow, BENCH_SLOW_TICK);
+}
+
+/**
+ * Record a failed request and start over with a new connection.
+ * @c the client connection
+ */
+static void conn_error(struct conn *c)
+{
+	n_errors++;
+	conn_close(c);
+	conn_start(c);
+}
+
+/**
+ * Called when a full response has been received.
+ * @c the client connection
+ */
+static void conn_response_done(struct conn *c)
+{
+	c->responses++;
+	if (!c->slow_reader)
+		samples_add(now_us() - c->start);
+
+	if (c->server_close || !cur->keepalive || c->in_len) {
+		conn_close(c);
+		conn_start(c);
+		return;
+	}
+
+	n_requests++;
+	conn_build_request(c);
+	c->start = now_us();
+	conn_poll(c);
+}
+
+/**
+ * Parse the response headers.
+ * @c the client connection
+ * @return the number of bytes consumed, 0 if the header is incomplete
+ */
+static int parse_header(struct conn *c)
+{
+	char *end, *line;
+	int status = 0;
+	bool chunked = false;
+	long long length = -1;
+
+	end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+	if (!end)
+		return 0;
+
+	*end = 0;
+	sscanf(c->in, "HTTP/%*d.%*d %d", &status);
+
+	for (line = strstr(c->in, "\r\n"); line; line = strstr(line, "\r\n")) {
+		line += 2;
+		if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line, "chunked"))
+			chunked = true;
+		else if (!strncasecmp(line, "Content-Length:", 15))
+			length = strtoll(line + 15, NULL, 10);
+		else if (!strncasecmp(line, "Connection:", 11) && strcasestr(line, "close"))
+			c->server_close = true;
+	}
+
+	/* Refusals such as 429 and 503 are failures too */
+	if (status < 200 || status >= 400)
+		n_errors++;
+
+	if (c->head_only || status == 204 || status == 304)
+		c->state = PARSE_DONE;
+	else if (chunked)
+		c->state = PARSE_CHUNK_SIZE;
+	else if (length >= 0) {
+		c->remaining = length;
+		c->state = length ? PARSE_BODY : PARSE_DONE;
+	} else {
+		/* Body is delimited by connection close */
+		c->remaining = -1;
+		c->server_close = true;
+		c->state = PARSE_BODY;
+	}
+
+	return end + 4 - c->in;
+}
+
+/**
+ * Parse a piece of the response.
+ * @c the client connection
+ * @return false if the response is malformed
+ */
+static bool conn_parse(struct conn *c)
+{
+	int used = 0;
+
+	while (used < c->in_len && c->state != PARSE_DONE) {
+		char *buf = c->in + used;
+		int len = c->in_len - used;
+		char *nl;
+		int n;
+
+		switch (c->state) {
+		case PARSE_HEADER:
+			memmove(c->in, buf, len);
+			c->in_len = len;
+			used = 0;
+			n = parse_header(c);
+			if (!n) {
+				if (c->in_len == sizeof(c->in))
+					return false;
+				return true;
+			}
+			used = n;
+			break;
+
+		case PARSE_BODY:
+			if (c->remaining < 0) {
+				used += len;
+				break;
+			}
+			n = len < c->remaining ? len : c->remaining;
+			c->remaining -= n;
+			used += n;
+			if (!c->remaining)
+				c->state = PARSE_DONE;
+			break;
+
+		case PARSE_CHUNK_SIZE:
+		case PARSE_CHUNK_CRLF:
+		case PARSE_TRAILER:
+			nl = memmem(buf, len, "\r\n", 2);
+			if (!nl) {
+				memmove(c->in, buf, len);
+				c->in_len = len;
+				return len < 64;
+			}
+
+			if (c->state == PARSE_CHUNK_SIZE) {
+				c->remaining = strtoll(buf, NULL, 16);
+				c->state = c->remaining ? PARSE_CHUNK_DATA : PARSE_TRAILER;
+			} else if (c->state == PARSE_CHUNK_CRLF) {
+				c->state = PARSE_CHUNK_SIZE;
+			} else if (nl == buf) {
+				c->state = PARSE_DONE;
+			}
+			used += nl + 2 - buf;
+			break;
+
+		case PARSE_CHUNK_DATA:
+			n = len < c->remaining ? len : c->remaining;
+			c->remaining -= n;
+			used += n;
+			if (!c->remaining)
+				c->state = PARSE_CHUNK_CRLF;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	memmove(c->in, c->in + used, c->in_len - used);
+	c->in_len -= used;
+
+	if (c->state == PARSE_DONE)
+		conn_response_done(c);
+
+	return true;
+}
+
+/**
+ * Read available response data.
+ * @c the client connection
+ * @max the maximum number of bytes to read
+ */
+static void conn_read(struct conn *c, int max)
+{
+	int room, r;
+
+	do {
+		room = sizeof(c->in) - c->in_len;
+		if (room > max)
+			room = max;
+
+		r = read(c->fd.fd, c->in + c->in_len, room);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				conn_error(c);
+			return;
+		}
+
+		if (!r) {
+			/* Connection delimited body ends here */
+			if (c->state == PARSE_BODY && c->remaining < 0) {
+				c->state = PARSE_DONE;
+				c->server_close = true;
+				conn_response_done(c);
+			} else {
+				conn_error(c);
+			}
+			return;
+		}
+
+		max -= r;
+		c->in_len += r;
+		if (!conn_parse(c)) {
+			conn_error(c);
+			return;
+		}
+	} while (c->connected && max > 0 && c->fd.fd >= 0 && c->state != PARSE_HEADER);
+}
+
+/**
+ * Handle socket events for a connection.
+ */
+static void conn_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct conn *c = container_of(fd, struct conn, fd);
+	int w;
+
+	if (events & ULOOP_WRITE) {
+		while (c->out_ofs < c->out_len) {
+			w = write(c->fd.fd, c->out + c->out_ofs, c->out_len - c->out_ofs);
+			if (w < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN)
+					conn_error(c);
+				return;
+			}
+			c->out_ofs += w;
+		}
+		c->connected = true;
+		conn_poll(c);
+		return;
+	}
+
+	if (events & ULOOP_READ)
+		conn_read(c, sizeof(c->in));
+}
+
+/**
+ * Slow reader timer, consumes a small amount of the response.
+ */
+static void conn_slow_cb(struct uloop_timeout *t)
+{
+	struct conn *c = container_of(t, struct conn, slow);
+
+	conn_read(c, BENCH_SLOW_READ);
+	if (c->fd.fd >= 0 && c->slow_reader && !c->slow.pending)
+		uloop_timeout_set(&c->slow, BENCH_SLOW_TICK);
+}
+
+/**
+ * Open a new connection and queue the first request.
+ * @c the client connection
+ */
+static void conn_start(struct conn *c)
+{
+	int fd, rcvbuf = BENCH_SLOW_READ;
+
+	if (uloop_cancelled)
+		return;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		n_errors++;
+		return;
+	}
+
+	if (c->slow_reader)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (connect(fd, (struct sockaddr *) &srv_addr, sizeof(srv_addr)) < 0 &&
+	    errno != EINPROGRESS) {
+		close(fd);
+		n_errors++;
+		return;
+	}
+
+	n_requests++;
+	c->fd.fd = fd;
+	c->fd.cb = conn_fd_cb;
+	c->slow.cb = conn_slow_cb;
+	conn_build_request(c);
+	c->start = now_us();
+	conn_poll(c);
+}
+
+/**
+ * Stop the event loop when the scenario duration passed.
+ */
+static void scenario_end_cb(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+/**
+ * Read the cpu time used by the server in clock ticks.
+ */
+static unsigned long long server_cpu_ticks(void)
+{
+	unsigned long long utime = 0, stime = 0;
+	char path[64], buf[1024];
+	char *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", srv_pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	if (fgets(buf, sizeof(buf), f)) {
+		/* Skip the command name which may contain spaces */
+		p = strrchr(buf, ')');
+		if (p)
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			       &utime, &stime);
+	}
+	fclose(f);
+
+	return utime + stime;
+}
+
+/**
+ * Read the peak resident set size of the server in kB.
+ */
+static long server_peak_rss(void)
+{
+	char path[64], line[256];
+	long kb = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", srv_pid);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+
+	return kb;
+}
+
+/**
+ * Reset the peak resident set size of the server.
+ */
+static void server_reset_peak_rss(void)
+{
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/clear_refs", srv_pid);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return;
+
+	if (write(fd, "5", 1) < 0)
+		perror("clear_refs");
+	close(fd);
+}
+
+/**
+ * Run one scenario and print a report line.
+ * @sc the scenario to run
+ * @return false when a measured connection never received a response
+ */
+static bool run_scenario(const struct scenario *sc)
+{
+	struct uloop_timeout end = { .cb = scenario_end_cb };
+	int total = opt_conns + sc->slow_readers;
+	unsigned long long cpu;
+	struct conn *conns;
+	uint64_t start, elapsed;
+	double cpu_us;
+	int i, stalled = 0;
+
+	cur = sc;
+	samples.count = 0;
+	n_errors = 0;
+	n_requests = 0;
+
+	conns = calloc(total, sizeof(*conns));
+	if (!conns)
+		return false;
+
+	server_reset_peak_rss();
+	cpu = server_cpu_ticks();
+	start = now_us();
+
+	uloop_cancelled = false;
+	for (i = 0; i < total; i++) {
+		conns[i].fd.fd = -1;
+		conns[i].slow_reader = i >= opt_conns;
+		conn_start(&conns[i]);
+	}
+
+	uloop_timeout_set(&end, opt_duration * 1000);
+	uloop_run();
+
+	elapsed = now_us() - start;
+	cpu = server_cpu_ticks() - cpu;
+	for (i = 0; i < total; i++) {
+		if (!conns[i].slow_reader && !conns[i].responses)
+			stalled++;
+		conn_close(&conns[i]);
+	}
+	free(conns);
+
+	qsort(samples.lat, samples.count, sizeof(*samples.lat), u32_cmp);
+	cpu_us = samples.count ?
+		(double) cpu * 1000000.0 / sysconf(_SC_CLK_TCK) / samples.count : 0;
+
+	printf("%-10s %6d %9d %10.0f %8u %8u %8u %9ld %9.1f %7d\n",
+	       sc->name, opt_conns, samples.count,
+	       samples.count * 1000000.0 / elapsed,
+	       samples_pct(0.50), samples_pct(0.99), samples_pct(0.999),
+	       server_peak_rss(), cpu_us, n_errors);
+	fflush(stdout);
+
+	if (stalled) {
+		fprintf(stderr, "%d connections stalled during scenario %s\n", stalled, sc->name);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Create the document root with the benchmark files and the runtime
+ * configuration of the server.
+ * @return false if the document root could not be created
+ */
+static bool create_docroot(void)
+{
+	char path[PATH_MAX];
+	char block[4096];
+	int i, fd, left;
+	FILE *f;
+
+	if (!mkdtemp(docroot)) {
+		perror("mkdtemp()");
+		return false;
+	}
+
+	memset(block, 'x', sizeof(block));
+	for (i = 0; i < sizeof(bench_files) / sizeof(bench_files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", docroot, bench_files[i].name);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror("open()");
+			return false;
+		}
+
+		for (left = bench_files[i].size; left > 0; left -= sizeof(block))
+			if (write(fd, block, left < sizeof(block) ? left : sizeof(block)) < 0) {
+				perror("write()");
+				close(fd);
+				return false;
+			}
+		close(fd);
+	}
+
+	/*
+	 * Every connection comes from the loopback address, so the limits
+	 * per source address would refuse most of the load
+	 */
+	snprintf(conffile, sizeof(conffile), "%s.conf", docroot);
+	f = fopen(conffile, "w");
+	if (!f) {
+		perror("fopen()");
+		return false;
+	}
+
+	fprintf(f, "peer_max_connections 0\npeer_request_rate 0\n");
+	if (fclose(f)) {
+		perror("fclose()");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Remove the generated document root.
+ */
+static void remove_docroot(void)
+{
+	char path[PATH_MAX];
+	int i;
+
+	for (i = 0; i < sizeof(bench_files) / sizeof(bench_files[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", docroot, bench_files[i].name);
+		unlink(path);
+	}
+	rmdir(docroot);
+
+	if (conffile[0])
+		unlink(conffile);
+}
+
+/**
+ * Find a free loopback port for the server.
+ * @return the port in host order, 0 on failure
+ */
+static int find_free_port(void)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t len = sizeof(addr);
+	int fd, port = 0;
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+
+	if (!bind(fd, (struct sockaddr *) &addr, sizeof(addr)) &&
+	    !getsockname(fd, (struct sockaddr *) &addr, &len))
+		port = ntohs(addr.sin_port);
+	close(fd);
+
+	return port;
+}
+
+/**
+ * Start the server under test and wait until it accepts connections.
+ * @server the path to the woodbox-server binary
+ * @return false if the server did not come up
+ */
+static bool start_server(const char *server)
+{
+	char listen[32], conns[16];
+	int i, fd, port;
+
+	port = find_free_port();
+	if (!port)
+		return false;
+
+	snprintf(listen, sizeof(listen), "127.0.0.1:%d", port);
+	snprintf(conns, sizeof(conns), "%d", opt_conns + BENCH_SLOW_READERS + 16);
+
+	srv_pid = fork();
+	if (srv_pid < 0) {
+		perror("fork()");
+		return false;
+	}
+
+	if (!srv_pid) {
+		execl(server, server, "-p", listen, "-h", docroot, "-n", conns, "-c", conffile, NULL);
+		perror("execl()");
+		_exit(127);
+	}
+
+	srv_addr.sin_family = AF_INET;
+	srv_addr.sin_port = htons(port);
+	srv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	/* Wait up to five seconds for the listener */
+	for (i = 0; i < 500; i++) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd >= 0 && !connect(fd, (struct sockaddr *) &srv_addr, sizeof(srv_addr))) {
+			close(fd);
+			return true;
+		}
+		if (fd >= 0)
+			close(fd);
+
+		if (waitpid(srv_pid, NULL, WNOHANG) == srv_pid) {
+			srv_pid = 0;
+			return false;
+		}
+		usleep(10000);
+	}
+
+	return false;
+}
+
+/**
+ * Stop the server under test.
+ */
+static void stop_server(void)
+{
+	if (srv_pid <= 0)
+		return;
+
+	kill(srv_pid, SIGTERM);
+	waitpid(srv_pid, NULL, 0);
+}
+
+static int usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options] <path to woodbox-server>\n"
+		"Options:\n"
+		"	-c count    Number of measured concurrent connections (default %d)\n"
+		"	-d seconds  Duration of every scenario (default %d)\n"
+		"	-s name     Only run the given scenario\n"
+		"\n", name, opt_conns, opt_duration);
+
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	int ch, i, ret = EXIT_SUCCESS;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	while ((ch = getopt(argc, argv, "c:d:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			opt_conns = atoi(optarg);
+			break;
+		case 'd':
+			opt_duration = atoi(optarg);
+			break;
+		case 's':
+			opt_only = optarg;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc || opt_conns <= 0 || opt_duration <= 0)
+		return usage(argv[0]);
+
+	if (!create_docroot())
+		return EXIT_FAILURE;
+
+	if (!start_server(argv[optind])) {
+		fprintf(stderr, "Could not start %s\n", argv[optind]);
+		stop_server();
+		remove_docroot();
+		return EXIT_FAILURE;
+	}
+
+	uloop_init();
+
+	printf("%-10s %6s %9s %10s %8s %8s %8s %9s %9s %7s\n",
+	       "scenario", "conns", "requests", "req/s", "p50(us)",
+	       "p99(us)", "p999(us)", "rss(kB)", "cpu/req", "errors");
+
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		if (opt_only && strcmp(opt_only, scenarios[i].name))
+			continue;
+
+		if (!run_scenario(&scenarios[i]))
+			ret = EXIT_FAILURE;
+
+		/* Bail out when the server died during the scenario */
+		if (waitpid(srv_pid, NULL, WNOHANG) == srv_pid) {
+			fprintf(stderr, "Server exited during scenario %s\n", scenarios[i].name);
+			srv_pid = 0;
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	uloop_done();
+	stop_server();
+	remove_docroot();
+	free(samples.lat);
+
+	return ret;
+}
@@ -0,0 +1,250 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: budget.c
+ * Description: accounts the memory buffered for connections against a
+ * server wide budget. Output stops for connections over their high-water
+ * mark, reads pause when the budget is used up and the most expensive
+ * idle connections are shed when the memory does not drain.
+ *
+ * Created by: Daan Pape
+ * Created on: June 10, 2014
+ */
+
+#include "config.h"
+#include "uhttpd.h"
+#include "client.h"
+#include "websocket.h"
+#include "http2.h"
+#include "budget.h"
+
+/* The list of accounted connections */
+static LIST_HEAD(connections);
+
+/* Bytes buffered over all connections */
+static int mem_total;
+
+/* The highest number of bytes buffered at once */
+static int mem_peak;
+
+/* The number of connections closed to free memory */
+static int mem_shed;
+
+/* True while reads are paused */
+static bool mem_paused;
+
+static void budget_shed_cb(struct uloop_timeout *t);
+static void budget_resume_cb(struct uloop_timeout *t);
+
+/* Sheds connections while the budget is used up */
+static struct uloop_timeout shed_timer = {
+	.cb = budget_shed_cb
+};
+
+/* Resumes paused readers and writers */
+static struct uloop_timeout resume_timer = {
+	.cb = budget_resume_cb
+};
+
+/**
+ * Get the connection a client is accounted to
+ * @cl the client
+ */
+static struct client *budget_owner(struct client *cl)
+{
+	if (cl->h2_stream)
+		return h2_connection(cl);
+
+	return cl;
+}
+
+/**
+ * Count the bytes buffered for a connection
+ * @cl the connection
+ */
+static int budget_usage(struct client *cl)
+{
+	int used = cl->us->w.data_bytes + cl->us->r.data_bytes;
+
+	/* TLS connections buffer the encrypted stream as well */
+	if (cl->us != &cl->sfd.stream)
+		used += cl->sfd.stream.w.data_bytes + cl->sfd.stream.r.data_bytes;
+
+	if (cl->postdata)
+		used += max(cl->postdata_len, 0);
+
+	return used + ws_buffered(cl) + h2_buffered(cl);
+}
+
+/**
+ * Get a share of the configured budget
+ * @pct the share in percent
+ */
+static int budget_share(int pct)
+{
+	return conf.mem_budget / 100 * pct;
+}
+
+/**
+ * Pause or resume reading when the total crosses the budget
+ */
+static void budget_check(void)
+{
+	if (mem_total > mem_peak)
+		mem_peak = mem_total;
+
+	if (!mem_paused && mem_total >= conf.mem_budget) {
+		fprintf(stderr, "Memory budget used up (%d bytes), pausing reads\n", mem_total);
+		mem_paused = true;
+		uloop_timeout_set(&shed_timer, MEM_SHED_INTERVAL);
+	} else if (mem_paused && mem_total < budget_share(MEM_LOW_WATER_PCT)) {
+		mem_paused = false;
+		uloop_timeout_cancel(&shed_timer);
+		uloop_timeout_set(&resume_timer, 0);
+	}
+}
+
+/**
+ * Close a connection without waiting for its output to drain
+ * @cl the connection to close
+ */
+static void budget_close(struct client *cl)
+{
+	fprintf(stderr, "Shedding client %d holding %d bytes\n", cl->id, cl->mem_used);
+
+	mem_shed++;
+	cl->us->write_error = true;
+	close_connection(cl);
+}
+
+/**
+ * Called while the budget is used up, closes connections until enough
+ * memory is freed. Idle connections go first, the most expensive of
+ * them before the others. Busy connections are only closed above the
+ * hard limit.
+ */
+static void budget_shed_cb(struct uloop_timeout *t)
+{
+	time_t now = uh_monotonic();
+	int left = mem_total;
+	struct client *cl, *victim;
+	bool idle, victim_idle;
+
+	while (left >= conf.mem_budget) {
+		victim = NULL;
+		victim_idle = false;
+
+		list_for_each_entry(cl, &connections, budget) {
+			if (!cl->mem_used || cl->us->write_error)
+				continue;
+
+			idle = now - cl->mem_active >= MEM_IDLE_TIME;
+			if (!victim || (idle && !victim_idle) ||
+			    (idle == victim_idle && cl->mem_used > victim->mem_used)) {
+				victim = cl;
+				victim_idle = idle;
+			}
+		}
+
+		if (!victim || (!victim_idle && left < budget_share(MEM_HARD_LIMIT_PCT)))
+			break;
+
+		left -= victim->mem_used;
+		budget_close(victim);
+	}
+
+	uloop_timeout_set(t, MEM_SHED_INTERVAL);
+}
+
+/**
+ * Give paused readers and writers the chance to continue
+ */
+static void budget_resume_cb(struct uloop_timeout *t)
+{
+	struct client *cl, *tmp;
+
+	list_for_each_entry_safe(cl, tmp, &connections, budget) {
+		if (mem_paused)
+			break;
+
+		if (cl->mem_wait && cl->mem_used < MEM_CONN_LOW_WATER) {
+			cl->mem_wait = false;
+			if (cl->dispatch.write_cb)
+				cl->dispatch.write_cb(cl);
+		}
+
+		/* Handle the data that was left in the stream */
+		if (cl->us->r.data_bytes && cl->us->notify_read)
+			cl->us->notify_read(cl->us, 0);
+	}
+}
+
+void budget_add(struct client *cl)
+{
+	cl->mem_used = 0;
+	cl->mem_wait = false;
+	cl->mem_active = uh_monotonic();
+	list_add_tail(&cl->budget, &connections);
+}
+
+void budget_release(struct client *cl)
+{
+	mem_total -= cl->mem_used;
+	cl->mem_used = 0;
+	list_del(&cl->budget);
+	budget_check();
+}
+
+void budget_account(struct client *cl)
+{
+	int used;
+
+	cl = budget_owner(cl);
+	used = budget_usage(cl);
+	mem_total += used - cl->mem_used;
+	cl->mem_used = used;
+	budget_check();
+
+	/* A writer waiting for this connection to drain can continue */
+	if (cl->mem_wait && !mem_paused && used < MEM_CONN_LOW_WATER)
+		uloop_timeout_set(&resume_timer, 0);
+}
+
+void budget_progress(struct client *cl)
+{
+	budget_owner(cl)->mem_active = uh_monotonic();
+	budget_account(cl);
+}
+
+bool budget_write_blocked(struct client *cl)
+{
+	struct client *owner = budget_owner(cl);
+
+	budget_account(cl);
+	if (!mem_paused && owner->mem_used < MEM_CONN_HIGH_WATER)
+		return false;
+
+	cl->mem_wait = true;
+	owner->mem_wait = true;
+	return true;
+}
+
+bool budget_read_paused(void)
+{
+	return mem_paused;
+}
+
+void budget_get_stats(struct budget_stats *s)
+{
+	struct client *cl;
+
+	s->used = mem_total;
+	s->peak = mem_peak;
+	s->shed = mem_shed;
+	s->paused = mem_paused;
+	s->connections = 0;
+	list_for_each_entry(cl, &connections, budget)
+		s->connections++;
+}
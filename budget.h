@@ -0,0 +1,74 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: budget.h
+ * Description: accounts the memory buffered for connections against a
+ * server wide budget.
+ *
+ * Created by: Daan Pape
+ * Created on: June 10, 2014
+ */
+
+#ifndef BUDGET_H_
+#define BUDGET_H_
+
+#include "uhttpd.h"
+
+/**
+ * Memory accounting statistics
+ */
+struct budget_stats {
+	int used;			/* Bytes buffered over all connections */
+	int peak;			/* The highest number of bytes buffered at once */
+	int shed;			/* Connections closed to free memory */
+	int connections;	/* Accounted connections */
+	bool paused;		/* Reads are paused */
+};
+
+/**
+ * Start accounting the buffers of a new connection
+ * @cl the accepted client
+ */
+void budget_add(struct client *cl);
+
+/**
+ * Stop accounting a connection, called when it is closed
+ * @cl the client to release
+ */
+void budget_release(struct client *cl);
+
+/**
+ * Recount the bytes buffered for a connection after its buffers changed.
+ * HTTP/2 streams are accounted to their connection.
+ * @cl the client to recount
+ */
+void budget_account(struct client *cl);
+
+/**
+ * Recount a connection that read or sent data, it is not idle
+ * @cl the client that made progress
+ */
+void budget_progress(struct client *cl);
+
+/**
+ * Check if a response body writer should stop producing output. The
+ * writer is called again through its dispatch write callback once the
+ * memory is available.
+ * @cl the client the output is for
+ */
+bool budget_write_blocked(struct client *cl);
+
+/**
+ * Check if reading from clients is paused because the budget is used up
+ */
+bool budget_read_paused(void);
+
+/**
+ * Get the memory accounting statistics
+ * @s the statistics to fill in
+ */
+void budget_get_stats(struct budget_stats *s);
+
+#endif /* BUDGET_H_ */
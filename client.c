@@ -12,12 +12,23 @@
 
 #include <libubox/blobmsg.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "config.h"
 #include "listen.h"
 #include "uhttpd.h"
 #include "tls.h"
 #include "client.h"
+#include "websocket.h"
+#include "http2.h"
+#include "budget.h"
+#include "admit.h"
+#include "upgrade.h"
+#include "api.h"
+#include "window.h"
+#include "params.h"
+#include "peer.h"
+#include "acl.h"
 
 /* The list of connected clients */
 static LIST_HEAD(clients);
@@ -28,6 +39,9 @@ int n_clients = 0;
 /* Status flag for currently selected client */
 static bool client_done = false;
 
+/* Connections closed by a deadline */
+static struct client_deadline_stats deadline_stats;
+
 /* The server configuration */
 struct config conf = {};
 
@@ -46,59 +60,320 @@ const char * const http_methods[] = {
 	[UH_HTTP_MSG_PUT] = "PUT",
 };
 
+/**
+ * A status the server sends often, its response heads are prebuilt for
+ * every http version and for closed and kept alive connections. Error
+ * statuses also get their complete error page.
+ */
+struct status_template {
+	int code;
+	const char *summary;
+	const char *message;		/* Text after the error page heading, NULL for none */
+	char *data[UH_HTTP_VER_1_1 + 1][2];
+	int head_len[UH_HTTP_VER_1_1 + 1][2];	/* The status line and connection headers */
+	int len[UH_HTTP_VER_1_1 + 1][2];		/* The whole error response */
+	int body_len;				/* The error page, left out for HEAD */
+};
+
+static struct status_template status_templates[] = {
+	{ 200, "OK" },
+	{ 204, "No Content" },
+	{ 302, "Found" },
+	{ 304, "Not Modified" },
+	{ 400, "Bad Request" },
+	{ 401, "Authorization Required" },
+	{ 403, "Forbidden", "Access to this resource is denied." },
+	{ 404, "Not Found", "The requested URL was not found on this server." },
+	{ 412, "Precondition Failed" },
+	{ 413, "Request Entity Too Large" },
+	{ 429, "Too Many Requests", "Slow down." },
+	{ 500, "Internal Server Error" },
+	{ 502, "Bad Gateway" },
+	{ 503, "Service Unavailable" },
+	{ 504, "Gateway Timeout" },
+};
+
+/* The keep alive time the templates were built with */
+static int status_templates_keepalive = -1;
+
+/**
+ * Build the response heads and error pages of the status templates. The
+ * Keep-Alive header carries the keep alive time, so they are rebuilt
+ * when it changes.
+ */
+static void status_templates_build(void)
+{
+	struct status_template *t;
+	char buf[512];
+	int v, keep, len, body;
+
+	for (t = status_templates; t < status_templates + ARRAY_SIZE(status_templates); t++) {
+		t->body_len = 0;
+		for (v = 0; v <= UH_HTTP_VER_1_1; v++) {
+			for (keep = 0; keep < 2; keep++) {
+				free(t->data[v][keep]);
+				t->data[v][keep] = NULL;
+
+				if (keep)
+					len = snprintf(buf, sizeof(buf), "%s %03i %s\r\nConnection: Keep-Alive\r\n"
+						       "Keep-Alive: timeout=%d\r\n", http_versions[v], t->code,
+						       t->summary, conf.http_keepalive);
+				else
+					len = snprintf(buf, sizeof(buf), "%s %03i %s\r\nConnection: close\r\n",
+						       http_versions[v], t->code, t->summary);
+
+				t->head_len[v][keep] = len;
+
+				/* The error page with its exact length */
+				if (t->code >= 400) {
+					body = snprintf(NULL, 0, "<h1>%s</h1>%s", t->summary,
+							t->message ? t->message : "");
+					t->body_len = body;
+					len += snprintf(buf + len, sizeof(buf) - len,
+							"Content-Length: %d\r\nContent-Type: text/html\r\n\r\n"
+							"<h1>%s</h1>%s", body, t->summary,
+							t->message ? t->message : "");
+				}
+
+				if (len >= sizeof(buf))
+					continue;
+
+				t->data[v][keep] = malloc(len);
+				if (t->data[v][keep])
+					memcpy(t->data[v][keep], buf, len);
+				t->len[v][keep] = len;
+			}
+		}
+	}
+
+	status_templates_keepalive = conf.http_keepalive;
+}
+
+/**
+ * Find the template of a status
+ * @code the status code
+ * @summary the code description, NULL to match any
+ * @return NULL when the status has no template
+ */
+static struct status_template *status_template_find(int code, const char *summary)
+{
+	struct status_template *t;
+
+	if (status_templates_keepalive != conf.http_keepalive)
+		status_templates_build();
+
+	for (t = status_templates; t < status_templates + ARRAY_SIZE(status_templates); t++)
+		if (t->code == code)
+			return !summary || !strcmp(t->summary, summary) ? t : NULL;
+
+	return NULL;
+}
+
+/**
+ * Write a Content-Length header line
+ * @buf the buffer, at least 32 bytes
+ * @length the body length
+ * @return the line length
+ */
+static int write_content_length(char *buf, int length)
+{
+	static const char name[] = "Content-Length: ";
+	char digits[12];
+	int len = sizeof(name) - 1, n = 0;
+
+	memcpy(buf, name, len);
+	do {
+		digits[n++] = '0' + length % 10;
+	} while ((length /= 10));
+
+	while (n)
+		buf[len++] = digits[--n];
+
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+	return len;
+}
+
 /**
  * Write a http header to a client
  * @client the client to write the header to
  * @code the http status code t o write
  * @summary the http status code info, for example if code = 200, summary = "Ok"
+ * @length the length of the body, HTTP_LENGTH_STREAM when it is not known up front
  */
-void write_http_header(struct client *cl, int code, const char *summary)
+void write_http_header(struct client *cl, int code, const char *summary, int length)
 {
+	static const char chunked[] = "Transfer-Encoding: chunked\r\n";
 	struct http_request *r = &cl->request;
-	const char *enc = "Transfer-Encoding: chunked\r\n";
-	const char *conn;
-
-	/* If no chunked transfer is used, remove the encoding line */
-	if (!uh_use_chunked(cl))
-		enc = "";
+	struct status_template *t;
+	char enc[32];
+	int enc_len = 0;
+	int keep;
+
+	/*
+	 * A known length is sent as is, a streamed body is chunked when the
+	 * client understands it and otherwise ends with the connection.
+	 * Informational, 204 and 304 responses never carry a body.
+	 */
+	r->respond_chunked = false;
+	if (code < 200 || code == 204 || code == 304) {
+		/* No framing */
+	} else if (length >= 0) {
+		enc_len = write_content_length(enc, length);
+	} else if (r->method == UH_HTTP_MSG_HEAD) {
+		/* No body follows */
+	} else if (r->version == UH_HTTP_VER_1_1) {
+		r->respond_chunked = true;
+		enc_len = sizeof(chunked) - 1;
+		memcpy(enc, chunked, enc_len);
+	} else {
+		r->connection_close = true;
+	}
 
 	/* Check if connection should be closed or kept open after request */
-	if (r->connection_close)
-		conn = "Connection: close";
-	else
-		conn = "Connection: Keep-Alive";
+	keep = !r->connection_close;
 
-	/* Send the header to the client */
-	ustream_printf(cl->us, "%s %03i %s\r\n%s\r\n%s",
-		http_versions[cl->request.version],
-		code, summary, conn, enc);
+	/* Send the header to the client, common statuses are prebuilt */
+	trace_response(cl, code);
+	t = status_template_find(code, summary);
+	if (t && t->data[r->version][keep]) {
+		ustream_write(cl->us, t->data[r->version][keep], t->head_len[r->version][keep], true);
+	} else {
+		ustream_printf(cl->us, "%s %03i %s\r\n%s\r\n",
+			http_versions[r->version], code, summary,
+			keep ? "Connection: Keep-Alive" : "Connection: close");
+
+		/* If this is a Keep-Alive connection, send the keep alive time */
+		if (keep)
+			ustream_printf(cl->us, "Keep-Alive: timeout=%d\r\n", conf.http_keepalive);
+	}
 
-	/* If this is a Keep-Alive connection, send the keep alive time */
-	if (!r->connection_close)
-		ustream_printf(cl->us, "Keep-Alive: timeout=%d\r\n", KEEP_ALIVE_TIME);
+	if (enc_len)
+		ustream_write(cl->us, enc, enc_len, true);
+}
+
+/**
+ * Send a prebuilt error response in one write and end the request
+ * @cl the client
+ * @t the template of the status
+ * @return false when the status has no prebuilt error response
+ */
+static bool send_client_prebuilt(struct client *cl, struct status_template *t)
+{
+	struct http_request *r = &cl->request;
+	int keep = !r->connection_close;
+	int len;
+
+	if (!t || t->code < 400 || !t->data[r->version][keep])
+		return false;
+
+	/* A HEAD response gets the headers of the error page only */
+	len = t->len[r->version][keep];
+	if (r->method == UH_HTTP_MSG_HEAD)
+		len -= t->body_len;
+
+	r->respond_chunked = false;
+	trace_response(cl, t->code);
+	if (cl->state != CLIENT_STATE_CLEANUP) {
+		uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+		ustream_write(cl->us, t->data[r->version][keep], len, true);
+		budget_account(cl);
+	}
+
+	request_done(cl);
+	return true;
 }
 
 /**
  * Close this client connection
  * @client the client to close the connection from
  */
-static void close_connection(struct client *cl)
+void close_connection(struct client *cl)
 {
 	cl->state = CLIENT_STATE_CLOSE;
 	cl->us->eof = true;
 	ustream_state_change(cl->us);
 }
 
+/**
+ * Wait for the client socket to become writable. Used by body writers
+ * that bypass the stream buffers, the dispatch write callback is called
+ * as soon as the socket accepts data again.
+ * @cl the client to wait for
+ */
+void client_poll_write(struct client *cl)
+{
+	struct ustream *s = &cl->sfd.stream;
+	unsigned int flags = ULOOP_WRITE;
+
+	cl->progress.blocked = true;
+	cl->write_wait = true;
+
+	if (!s->eof && !ustream_read_blocked(s))
+		flags |= ULOOP_READ;
+
+	uloop_fd_add(&cl->sfd.fd, flags);
+}
+
+/**
+ * Handle socket events. The ustream handler stops polling for writes as
+ * soon as its own buffer is empty and only calls the write handler when
+ * it wrote something, so a body writer that waits for the socket is
+ * called here and its poll is restored afterwards.
+ * @fd the client socket
+ * @events the events that occurred
+ */
+static void client_fd_cb(struct uloop_fd *fd, unsigned int events)
+{
+	struct client *cl = container_of(fd, struct client, sfd.fd);
+	bool writable = cl->write_wait && (events & ULOOP_WRITE);
+
+	if (writable)
+		cl->write_wait = false;
+
+	cl->fd_cb(fd, events);
+
+	if (cl->tls && (events & ULOOP_WRITE))
+		uh_tls_client_flushed(cl);
+
+	if (writable && !cl->write_wait && cl->dispatch.write_cb &&
+	    cl->state != CLIENT_STATE_CLOSE && cl->state != CLIENT_STATE_CLEANUP)
+		cl->dispatch.write_cb(cl);
+
+	if (cl->write_wait)
+		client_poll_write(cl);
+}
+
+void client_sent(struct client *cl, int bytes)
+{
+	cl->progress.tx += bytes;
+	cl->progress.blocked = false;
+}
+
+void client_get_deadline_stats(struct client_deadline_stats *s)
+{
+	*s = deadline_stats;
+}
+
 /**
  * Free the dispatch method resources
  * @client the client to free the resources from
  */
-static void dispatch_done(struct client *cl)
+void dispatch_done(struct client *cl)
 {
 	if (cl->dispatch.free)
 		cl->dispatch.free(cl);
 	if (cl->dispatch.req_free)
 		cl->dispatch.req_free(cl);
+
+	window_release(cl);
+	param_free(cl);
+
+	/* The request body belongs to the request */
+	free(cl->postdata);
+	cl->postdata = NULL;
+	cl->postdata_len = 0;
+	cl->ispostdata = false;
 }
 
 /**
@@ -111,10 +386,82 @@ static void timeout_event_handler(struct uloop_timeout *timeout)
 	/* Get the client that caused the timeout event */
 	struct client *cl = container_of(timeout, struct client, timeout);
 
+	/* An idle kept alive connection is not a missed deadline */
+	if (cl->state == CLIENT_STATE_INIT && (cl->first_byte || !cl->requests))
+		deadline_stats.request_line++;
+	else if (cl->state == CLIENT_STATE_HEADER)
+		deadline_stats.headers++;
+
 	/* Close the connection */
 	close_connection(cl);
 }
 
+/**
+ * Check the transfer rates of a request once per CLIENT_RATE_WINDOW. A
+ * body must keep arriving at body_min_rate unless the server holds it
+ * back, and a response the client leaves queued must drain at
+ * response_min_rate.
+ * @timeout: the progress timer of the client
+ */
+static void progress_event_handler(struct uloop_timeout *timeout)
+{
+	struct client *cl = container_of(timeout, struct client, progress.timer);
+	struct http_request *r = &cl->request;
+	int queued, need;
+
+	if (cl->state == CLIENT_STATE_CLOSE || cl->state == CLIENT_STATE_CLEANUP)
+		return;
+
+	if (cl->state == CLIENT_STATE_DATA && conf.body_min_rate &&
+	    !cl->dispatch.data_blocked && !ustream_read_blocked(cl->us) &&
+	    !budget_read_paused()) {
+		need = conf.body_min_rate * CLIENT_RATE_WINDOW;
+		if (!r->transfer_chunked)
+			need = min(need, r->content_length);
+
+		if (cl->progress.rx < need) {
+			deadline_stats.body++;
+			close_connection(cl);
+			return;
+		}
+	}
+
+	if (conf.response_min_rate && cl->progress.pending &&
+	    cl->progress.tx < min(cl->progress.pending, conf.response_min_rate * CLIENT_RATE_WINDOW)) {
+		deadline_stats.response++;
+		close_connection(cl);
+		return;
+	}
+
+	/* The data the client has to take during the next window */
+	queued = cl->us->w.data_bytes;
+	if (cl->us != &cl->sfd.stream)
+		queued += cl->sfd.stream.w.data_bytes;
+	if (!queued && cl->progress.blocked)
+		queued = conf.response_min_rate * CLIENT_RATE_WINDOW;
+
+	cl->progress.pending = queued;
+	cl->progress.rx = 0;
+	cl->progress.tx = 0;
+
+	/* Watch until the request is done and its response has drained */
+	if (cl->state == CLIENT_STATE_DATA || cl->state == CLIENT_STATE_DONE || queued)
+		uloop_timeout_set(timeout, CLIENT_RATE_WINDOW * 1000);
+}
+
+/**
+ * Start checking the transfer rates of a request
+ * @cl the client
+ */
+static void progress_start(struct client *cl)
+{
+	cl->progress.timer.cb = progress_event_handler;
+	cl->progress.rx = 0;
+	cl->progress.tx = 0;
+	cl->progress.pending = 0;
+	uloop_timeout_set(&cl->progress.timer, CLIENT_RATE_WINDOW * 1000);
+}
+
 /**
  * This handler should be installed on the event loop timeout event
  * when a keepalive connections is used. It wil keep the connection
@@ -126,8 +473,8 @@ static void polling_event_handler(struct uloop_timeout *timeout)
 	/* Get the client that caused the timeout event */
 	struct client *cl = container_of(timeout, struct client, timeout);
 
-	/* Set timeout when the client had made request, network timeout otherwise */
-	int msec = cl->requests > 0 ? KEEP_ALIVE_TIME : NETWORK_TIMEOUT;
+	/* A kept alive connection may idle, a new one must send its request line */
+	int msec = cl->requests > 0 ? conf.http_keepalive : conf.request_line_timeout;
 
 	/* Install closing event handler on the connection */
 	cl->timeout.cb = timeout_event_handler;
@@ -152,20 +499,27 @@ static void poll_connection(struct client *cl)
  */
 void request_done(struct client *cl)
 {
+	trace_done(cl);
+
 	/* Send EOF to client and free dispatch resources */
 	uh_chunk_eof(cl);
 	dispatch_done(cl);
 
 	/* Set the dispatch pointers to zero */
 	memset(&cl->dispatch, 0, sizeof(cl->dispatch));
+	cl->write_wait = false;
+
+	/* The next request has its own deadlines */
+	cl->first_byte = 0;
 
 	/* If this is no Keep-Alive connection close it */
-	if (!KEEP_ALIVE_TIME || cl->request.connection_close){
+	if (!conf.http_keepalive || cl->request.connection_close){
 		close_connection(cl);
 	} else {
 		/* Else wait for new requests and poll the connection to keep it alive */
 		cl->state = CLIENT_STATE_INIT;
 		cl->requests++;
+		admit_idle(cl);
 		poll_connection(cl);
 	}
 }
@@ -179,10 +533,25 @@ void request_done(struct client *cl)
  */
 void __printf(4, 5) send_client_error(struct client *cl, int code, const char *summary, const char *fmt, ...)
 {
+	struct status_template *t;
 	va_list arg;
+	int len;
+
+	/* An error without details has its response prebuilt */
+	t = fmt ? NULL : status_template_find(code, summary);
+	if (t && !t->message && send_client_prebuilt(cl, t))
+		return;
+
+	/* The body is short, measure it so it can be sent with its length */
+	len = snprintf(NULL, 0, "<h1>%s</h1>", summary);
+	if (fmt) {
+		va_start(arg, fmt);
+		len += vsnprintf(NULL, 0, fmt, arg);
+		va_end(arg);
+	}
 
 	/* Write the header with the error code */
-	write_http_header(cl, code, summary);
+	write_http_header(cl, code, summary, len);
 
 	/* Set the content type to html */
 	ustream_printf(cl->us, "Content-Type: text/html\r\n\r\n");
@@ -201,6 +570,14 @@ void __printf(4, 5) send_client_error(struct client *cl, int code, const char *s
 	request_done(cl);
 }
 
+void send_client_status(struct client *cl, int code)
+{
+	struct status_template *t = status_template_find(code, NULL);
+
+	if (!send_client_prebuilt(cl, t))
+		send_client_error(cl, code, t ? t->summary : "Error", NULL);
+}
+
 /**
  * Handle header errors.
  * @cl the client that send wrong headers
@@ -213,6 +590,23 @@ static void header_error(struct client *cl, int code, const char *summary)
 	close_connection(cl);
 }
 
+/**
+ * Refuse a request because the server is too busy, the client is told
+ * when it can try again.
+ * @cl the client that made the request
+ */
+static void client_refuse(struct client *cl)
+{
+	static const char body[] = "<h1>Service Unavailable</h1>";
+
+	cl->request.connection_close = true;
+	write_http_header(cl, 503, "Service Unavailable", sizeof(body) - 1);
+	ustream_printf(cl->us, "Retry-After: %d\r\nContent-Type: text/html\r\n\r\n",
+		       ADMIT_RETRY_AFTER);
+	uh_chunk_write(cl, body, sizeof(body) - 1);
+	request_done(cl);
+}
+
 /**
  * This helper method is used to find the index of the http_methods
  * and http_version enums from the header string.
@@ -271,9 +665,16 @@ static int parse_client_request(struct client *cl, char *data)
 	req->version = h_version;
 
 	/* Close connection when needed */
-	if (req->version < UH_HTTP_VER_1_1 || req->method == UH_HTTP_MSG_POST)
+	if (req->version < UH_HTTP_VER_1_1 || req->method == UH_HTTP_MSG_POST ||
+	    !conf.http_keepalive || upgrade_draining())
 		req->connection_close = true;
 
+	/* Refuse the request right away when there is no capacity left for it */
+	if (!admit_request(cl, path)) {
+		client_refuse(cl);
+		return CLIENT_STATE_CLOSE;
+	}
+
 	/* Set the state as header parsed */
 	return CLIENT_STATE_HEADER;
 }
@@ -288,6 +689,25 @@ static bool client_init_handler(struct client *cl, char *buf, int len)
 {
 	char *newline;
 
+	/* HTTP/2 with prior knowledge starts with the connection preface */
+	if (h2_is_preface(buf, len)) {
+		if (!admit_request(cl, NULL)) {
+			close_connection(cl);
+			return true;
+		}
+
+		return h2_accept(cl, buf, len);
+	}
+
+	trace_mark(cl, TRACE_FIRST_BYTE);
+
+	/* A kept alive connection gets the request line deadline from its first byte */
+	if (!cl->first_byte) {
+		cl->first_byte = uh_monotonic_ms();
+		if (cl->requests)
+			uloop_timeout_set(&cl->timeout, conf.request_line_timeout * 1000);
+	}
+
 	/* Get the first newline in the the header, if there is no newlien
 	 * the header is faulty */
 	newline = strstr(buf, "\r\n");
@@ -309,8 +729,15 @@ static bool client_init_handler(struct client *cl, char *buf, int len)
 	ustream_consume(cl->us, newline + 2 - buf);
 
 	/* Return an error when the header is malformed */
-	if (cl->state == CLIENT_STATE_DONE)
+	if (cl->state == CLIENT_STATE_DONE) {
 		header_error(cl, 400, "Bad Request");
+		return true;
+	}
+
+	/* All headers are due some time after the first byte */
+	if (cl->state == CLIENT_STATE_HEADER)
+		uloop_timeout_set(&cl->timeout, max(cl->first_byte + conf.header_timeout * 1000 -
+						    uh_monotonic_ms(), (int64_t) 1));
 
 	return true;
 }
@@ -324,6 +751,9 @@ static void client_header_complete(struct client *cl)
 {
 	struct http_request *r = &cl->request;
 
+	trace_mark(cl, TRACE_HEADERS);
+	progress_start(cl);
+
 	/* If a contiuation is expected return status 100 */
 	if (r->expect_cont)
 		ustream_printf(cl->us, "HTTP/1.1 100 Continue\r\n\r\n");
@@ -344,6 +774,12 @@ static void client_header_complete(struct client *cl)
 		break;
 	}
 
+	/* Switch protocols instead of handling the request */
+	if (r->upgrade == UH_UPGRADE_WEBSOCKET && ws_upgrade(cl))
+		return;
+	if (r->upgrade == UH_UPGRADE_H2C && h2_upgrade(cl))
+		return;
+
 	uh_handle_request(cl);
 }
 
@@ -400,6 +836,11 @@ static void client_parse_header(struct client *cl, char *data)
 	} else if (!strcmp(data, "connection")) {
 		if (!strcasecmp(val, "close"))
 			r->connection_close = true;
+	} else if (!strcmp(data, "upgrade")) {
+		if (!strcasecmp(val, "websocket"))
+			r->upgrade = UH_UPGRADE_WEBSOCKET;
+		else if (!strcasecmp(val, "h2c"))
+			r->upgrade = UH_UPGRADE_H2C;
 	} else if (!strcmp(data, "user-agent")) {
 		char *str;
 
@@ -482,6 +923,7 @@ void client_post_data(struct client *cl)
 			}
 
 			r->content_length -= cur_len;
+			cl->progress.rx += cur_len;
 			ustream_consume(cl->us, cur_len);
 			continue;
 		}
@@ -523,10 +965,10 @@ void client_post_data(struct client *cl)
 	/* Read the parameter into the buffer */
 	buf = ustream_get_read_buf(cl->us, &len);
 	if (!r->content_length && !r->transfer_chunked && cl->state != CLIENT_STATE_DONE) {
+		/* The handler may finish the request right away */
+		cl->state = CLIENT_STATE_DONE;
 		if (cl->dispatch.data_done)
 			cl->dispatch.data_done(cl);
-
-		cl->state = CLIENT_STATE_DONE;
 	}
 }
 
@@ -559,17 +1001,6 @@ static bool client_header_handler(struct client *cl, char *buf, int len)
 		return false;
 	}
 
-	/* Nullterminate the string buffer on newline when
-	 * newline is not followed by another newline. Otherwise
-	 * buffer contains post data
-	 */
-	if(!strstr(newline + 2, "\r\n")){
-		// Save the found post data
-		cl->ispostdata = true;
-		cl->postdata = (char*) realloc(cl->postdata, (strlen(newline+2)+1)*sizeof(char));
-		strcpy(cl->postdata, newline + 2);
-	}
-
 	*newline = 0;
 
 	/* Parse the header */
@@ -592,6 +1023,8 @@ static read_cb_t read_cbs[] = {
 	[CLIENT_STATE_INIT] 	= client_init_handler,
 	[CLIENT_STATE_HEADER] 	= client_header_handler,
 	[CLIENT_STATE_DATA] 	= client_data_handler,
+	[CLIENT_STATE_WEBSOCKET] = ws_read_handler,
+	[CLIENT_STATE_HTTP2]	= h2_read_handler,
 };
 
 /**
@@ -605,6 +1038,12 @@ void read_from_client(struct client *cl)
 	char *str;
 	int len;
 
+	/* Leave the data in the stream while the memory budget is used up */
+	if (budget_read_paused()) {
+		budget_account(cl);
+		return;
+	}
+
 	client_done = false;
 	do {
 		/* Read sata if there is any */
@@ -623,6 +1062,9 @@ void read_from_client(struct client *cl)
 			break;
 		}
 	} while (!client_done);
+
+	if (!client_done)
+		budget_progress(cl);
 }
 
 /**
@@ -634,16 +1076,26 @@ static void client_close(struct client *cl)
 	/* Cleanup when necessary */
 	if (cl->refcount) {
 		cl->state = CLIENT_STATE_CLEANUP;
+		if (cl->dispatch.cancel)
+			cl->dispatch.cancel(cl);
 		return;
 	}
 
+	/* Keep the trace of a request the connection ended */
+	trace_done(cl);
+
 	/* Free all resources */
-	if(cl->ispostdata)
-		free(cl->postdata);
+	api_cancel(cl);
+	ws_free(cl);
+	h2_free(cl);
 	client_done = true;
 	n_clients--;
 	dispatch_done(cl);
+	budget_release(cl);
+	admit_release(cl);
+	peer_disconnect(&cl->peer_addr);
 	uloop_timeout_cancel(&cl->timeout);
+	uloop_timeout_cancel(&cl->progress.timer);
 	if (cl->tls)
 		uh_tls_client_detach(cl);
 	ustream_free(&cl->sfd.stream);
@@ -651,11 +1103,6 @@ static void client_close(struct client *cl)
 	list_del(&cl->list);
 	blob_buf_free(&cl->hdr);
 	free(cl);
-
-
-
-	/* Unblock other listeners so pending clients can be handled */
-	unblock_listeners();
 }
 
 /**
@@ -701,8 +1148,11 @@ static void client_ustream_write_handler(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, sfd.stream);
 
+	client_sent(cl, bytes);
 	if (cl->dispatch.write_cb)
 		cl->dispatch.write_cb(cl);
+
+	budget_progress(cl);
 }
 
 /**
@@ -737,35 +1187,87 @@ static void set_addr(struct uh_addr *addr, void *src)
 }
 
 /**
- * Accept a new client
- * @fd the socket to accept the client on
+ * Answer a connection that can not be accepted with 503 and close it,
+ * the request is not read. A TLS client expects a handshake and would
+ * take a plain text answer for a protocol error, so it is just closed.
+ * @sfd the socket of the connection
+ * @tls true if the connection came in on a TLS listener
+ */
+static void refuse_socket(int sfd, bool tls)
+{
+	char resp[128];
+	int len;
+
+	if (tls) {
+		close(sfd);
+		return;
+	}
+
+	len = snprintf(resp, sizeof(resp),
+		"HTTP/1.0 503 Service Unavailable\r\nRetry-After: %d\r\n"
+		"Connection: close\r\nContent-Length: 0\r\n\r\n", ADMIT_RETRY_AFTER);
+
+	/* A full socket buffer is common under overload, not worth a message */
+	if (send(sfd, resp, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+	    errno != EAGAIN && errno != EWOULDBLOCK)
+		perror("send()");
+
+	shutdown(sfd, SHUT_WR);
+	close(sfd);
+}
+
+/**
+ * Serve an accepted connection
+ * @sfd the connection
+ * @addr the peer address
  * @tls true if this client has https
  */
-bool accept_client(int fd, bool tls)
+static void client_add(int sfd, struct sockaddr_in6 *addr, bool tls)
 {
 	static struct client *next_client;
+	static int client_id = 0;
 	struct client *cl;
 	unsigned int sl;
-	int sfd;
-	static int client_id = 0;
-	struct sockaddr_in6 addr;
 
 	/* If the list has no space enlarge it with one */
 	if (!next_client)
 		next_client = calloc(1, sizeof(*next_client));
 
 	cl = next_client;
+	if (!cl) {
+		close(sfd);
+		return;
+	}
 
 	/* Set all the correct addresses */
-	sl = sizeof(addr);
-	sfd = accept(fd, (struct sockaddr *) &addr, &sl);
-	if (sfd < 0)
-		return false;
+	set_addr(&cl->peer_addr, addr);
+	sl = sizeof(*addr);
+	getsockname(sfd, (struct sockaddr *) addr, &sl);
+	set_addr(&cl->srv_addr, addr);
+
+	/* Drop denied sources before anything is spent on them */
+	if (!acl_connection(&cl->peer_addr, &cl->srv_addr)) {
+		close(sfd);
+		return;
+	}
+
+	/* Refuse the connection when even the overflow slots are used */
+	if (!admit_connection()) {
+		refuse_socket(sfd, tls);
+		return;
+	}
 
-	set_addr(&cl->peer_addr, &addr);
-	sl = sizeof(addr);
-	getsockname(sfd, (struct sockaddr *) &addr, &sl);
-	set_addr(&cl->srv_addr, &addr);
+	/* One address may not take all connections */
+	if (!peer_connect(&cl->peer_addr)) {
+		refuse_socket(sfd, tls);
+		return;
+	}
+
+	/* Size the read buffers, ustream keeps values that are already set */
+	cl->sfd.stream.r.buffer_len = conf.read_buffer_size;
+#ifdef HAVE_TLS
+	cl->ssl.stream.r.buffer_len = conf.read_buffer_size;
+#endif
 
 	/* Attach all handlers */
 	cl->us = &cl->sfd.stream;
@@ -780,20 +1282,78 @@ bool accept_client(int fd, bool tls)
 	/* Initialise stream for string data */
 	cl->us->string_data = true;
 	ustream_fd_init(&cl->sfd, sfd);
+	cl->fd_cb = cl->sfd.fd.cb;
+	cl->sfd.fd.cb = client_fd_cb;
 
 	/* Add the client to the list and poll connection */
 	poll_connection(cl);
 	list_add_tail(&cl->list, &clients);
+	budget_add(cl);
 
 	/* Do some administration */
 	next_client = NULL;
 	n_clients++;
 	cl->id = client_id++;
 	cl->tls = tls;
+	trace_start(cl);
+}
+
+/**
+ * Accept a new client
+ * @fd the socket to accept the client on
+ * @tls true if this client has https
+ */
+bool accept_client(int fd, bool tls)
+{
+	struct sockaddr_in6 addr;
+	unsigned int sl = sizeof(addr);
+	int sfd;
+
+	sfd = accept(fd, (struct sockaddr *) &addr, &sl);
+	if (sfd < 0)
+		return false;
+
+	/* Scripts and upgraded servers must not inherit the connection */
+	fd_cloexec(sfd);
+	client_add(sfd, &addr, tls);
 
 	return true;
 }
 
+/**
+ * Serve a connection the io_uring backend accepted
+ * @sfd the connection
+ * @tls true if this client has https
+ */
+void client_accepted(int sfd, bool tls)
+{
+	struct sockaddr_in6 addr;
+	unsigned int sl = sizeof(addr);
+
+	if (getpeername(sfd, (struct sockaddr *) &addr, &sl)) {
+		close(sfd);
+		return;
+	}
+
+	client_add(sfd, &addr, tls);
+}
+
+/**
+ * Close the connections that wait for a new request
+ */
+void close_idle_clients(void)
+{
+	struct client *cl, *tmp;
+
+	list_for_each_entry_safe(cl, tmp, &clients, list) {
+		if (cl->state == CLIENT_STATE_HTTP2)
+			h2_drain(cl);
+		else if (cl->state == CLIENT_STATE_INIT && cl->requests &&
+			 !cl->us->r.data_bytes && !cl->us->w.data_bytes)
+			close_connection(cl);
+	}
+}
+
 /**
  * Close all clients
  */
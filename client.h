@@ -13,13 +13,60 @@
 #ifndef CLIENT_H_
 #define CLIENT_H_
 
+/* The body length of a response that is streamed */
+#define HTTP_LENGTH_STREAM	-1
+
 /**
  * Write a http header to a client
  * @cl the client to write the header to
  * @code the http status code t o write
  * @summary the http status code info, for example if code = 200, summary = "Ok"
+ * @length the length of the body, HTTP_LENGTH_STREAM when it is not known up front
+ */
+void write_http_header(struct client *cl, int code, const char *summary, int length);
+
+/**
+ * Close this client connection
+ * @cl the client to close the connection from
  */
-void write_http_header(struct client *cl, int code, const char *summary);
+void close_connection(struct client *cl);
+
+/**
+ * Wait for the client socket to become writable. Used by body writers
+ * that bypass the stream buffers.
+ * @cl the client to wait for
+ */
+void client_poll_write(struct client *cl);
+
+/**
+ * Count the response bytes a client took, for the response rate
+ * deadline. The stream write handlers count their own.
+ * @cl the client
+ * @bytes the number of bytes sent
+ */
+void client_sent(struct client *cl, int bytes);
+
+/**
+ * Connections closed by a request deadline
+ */
+struct client_deadline_stats {
+	int request_line;		/* No request line in time */
+	int headers;			/* No end of the headers in time */
+	int body;				/* The request body arrived too slowly */
+	int response;			/* The response was taken too slowly */
+};
+
+/**
+ * Get the number of connections closed by each request deadline
+ * @s the statistics to fill in
+ */
+void client_get_deadline_stats(struct client_deadline_stats *s);
+
+/**
+ * Free the dispatch method resources
+ * @cl the client to free the resources from
+ */
+void dispatch_done(struct client *cl);
 
 /**
  * Signal a request is done and set the connection to wait
@@ -37,6 +84,14 @@ void request_done(struct client *cl);
  */
 void __printf(4, 5) send_client_error(struct client *cl, int code, const char *summary, const char *fmt, ...);
 
+/**
+ * Send the prebuilt error page of a status, the response is written in
+ * one piece. Used for the errors scanners trigger most.
+ * @cl the client to send the error page to
+ * @code the error code, 403, 404 or 429 for a page with an explanation
+ */
+void send_client_status(struct client *cl, int code);
+
 /**
  * Parse client POST data.
  * @cl the client who sent de data
@@ -63,6 +118,19 @@ void client_notify_state(struct client *cl);
  */
 bool accept_client(int fd, bool tls);
 
+/**
+ * Serve a connection the io_uring backend accepted, it is opened
+ * with close-on-exec.
+ * @sfd the connection
+ * @tls true if this client has https
+ */
+void client_accepted(int sfd, bool tls);
+
+/**
+ * Close the connections that wait for a new request
+ */
+void close_idle_clients(void);
+
 /**
  * Close all clients
  */
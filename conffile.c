@@ -0,0 +1,293 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: conffile.c
+ * Description: the runtime configuration file. Every line holds an
+ * option name and a value, '#' starts a comment. The file is read again
+ * on SIGHUP, the new values are used for new connections and timers
+ * while existing connections are kept. 'allow' and 'deny' lines can be
+ * given more than once, they are compiled into a new rule set.
+ *
+ * Created by: Daan Pape
+ * Created on: June 13, 2014
+ */
+
+#include <stddef.h>
+#include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "listen.h"
+#include "tls.h"
+#include "acl.h"
+#include "conffile.h"
+
+/* Option flags */
+#define CONF_STRING		(1 << 0)	/* The value is a string */
+#define CONF_STARTUP	(1 << 1)	/* Only used when the server starts */
+
+/**
+ * A configuration file option
+ */
+struct conf_option {
+	const char *name;			/* The name in the configuration file */
+	size_t offset;				/* The offset in struct config */
+	int flags;
+	int min, max;				/* The valid range of numbers */
+};
+
+/**
+ * An option set on the command line
+ */
+struct conf_override {
+	const struct conf_option *opt;
+	char *value;
+};
+
+#define CONF_INT(field, min, max) \
+	{ #field, offsetof(struct config, field), 0, min, max }
+
+#define CONF_STARTUP_INT(field, min, max) \
+	{ #field, offsetof(struct config, field), CONF_STARTUP, min, max }
+
+#define CONF_STR(field, flags) \
+	{ #field, offsetof(struct config, field), CONF_STRING | (flags), 0, 0 }
+
+static const struct conf_option options[] = {
+	CONF_STR(listen, CONF_STARTUP),
+	CONF_INT(listen_backlog, 1, 65535),
+	CONF_INT(max_connections, 0, 65535),
+	CONF_INT(network_timeout, 1, 3600),
+	CONF_INT(http_keepalive, 0, 3600),
+	CONF_INT(request_line_timeout, 1, 3600),
+	CONF_INT(header_timeout, 1, 3600),
+	CONF_INT(body_min_rate, 0, 1048576),
+	CONF_INT(response_min_rate, 0, 1048576),
+	CONF_INT(tcp_keepalive, 0, 3600),
+	CONF_INT(read_buffer_size, 1024, 1048576),
+	CONF_INT(max_script_requests, 1, 1024),
+	CONF_INT(script_timeout, 1, 3600),
+	CONF_STARTUP_INT(script_workers, 0, 64),
+	CONF_STARTUP_INT(io_uring, 0, 1),
+	CONF_INT(peer_max_connections, 0, 65535),
+	CONF_INT(peer_request_rate, 0, 100000),
+	CONF_INT(peer_request_burst, 1, 100000),
+	CONF_INT(rfc1918_filter, 0, 1),
+	CONF_INT(stats_api, 0, 1),
+	CONF_INT(dirlist_cache_entries, 0, 1024),
+	CONF_INT(dirlist_cache_max, 0, 16777216),
+	CONF_INT(auth_cache_size, 0, 65536),
+	CONF_INT(tls_session_cache_size, 1, 1048576),
+	CONF_INT(mem_budget, 65536, 1073741824),
+	CONF_INT(drain_timeout, 0, 86400),
+};
+
+/* The options set on the command line */
+static struct conf_override *overrides;
+static int n_overrides;
+
+/* The configuration file, NULL before it is loaded */
+static char *conf_path;
+
+/**
+ * Find an option by name
+ * @name the option name
+ */
+static const struct conf_option *conf_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(options); i++)
+		if (!strcmp(options[i].name, name))
+			return &options[i];
+
+	return NULL;
+}
+
+/**
+ * Store an option value in a configuration
+ * @c the configuration to change
+ * @opt the option
+ * @value the value as text
+ * @return false when the value is invalid
+ */
+static bool conf_set(struct config *c, const struct conf_option *opt, const char *value)
+{
+	void *field = (char *) c + opt->offset;
+	char *end;
+	long n;
+
+	if (opt->flags & CONF_STRING) {
+		char *s = strdup(value);
+
+		if (!s)
+			return false;
+
+		*(const char **) field = s;
+		return true;
+	}
+
+	errno = 0;
+	n = strtol(value, &end, 10);
+	if (errno || end == value || *end || n < opt->min || n > opt->max)
+		return false;
+
+	*(int *) field = n;
+	return true;
+}
+
+/**
+ * Parse the configuration file into a configuration
+ * @c the configuration to change
+ * @acl the rule set the access rules are added to
+ * @path the configuration file
+ * @startup false to skip options only used when the server starts
+ * @return false when the file contains errors
+ */
+static bool conf_parse(struct config *c, struct acl *acl, const char *path, bool startup)
+{
+	const struct conf_option *opt;
+	char line[256], *name, *value, *end;
+	bool ok = true;
+	int lineno = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return errno == ENOENT;
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		/* Strip comments and surrounding white space */
+		if ((end = strchr(line, '#')))
+			*end = 0;
+
+		name = line + strspn(line, " \t\r\n");
+		end = name + strlen(name);
+		while (end > name && isspace((unsigned char) end[-1]))
+			*--end = 0;
+
+		if (!*name)
+			continue;
+
+		value = name + strcspn(name, " \t");
+		if (*value) {
+			*value++ = 0;
+			value += strspn(value, " \t");
+		}
+
+		/* Access rules */
+		if (!strcmp(name, "allow") || !strcmp(name, "deny")) {
+			if (!acl_add(acl, *name == 'a', value)) {
+				fprintf(stderr, "[ERROR] %s:%d: invalid rule '%s'\n", path, lineno, value);
+				ok = false;
+			}
+			continue;
+		}
+
+		opt = conf_find(name);
+		if (!opt) {
+			fprintf(stderr, "[WARNING] %s:%d: unknown option '%s'\n", path, lineno, name);
+			continue;
+		}
+
+		if (!startup && (opt->flags & CONF_STARTUP))
+			continue;
+
+		if (!conf_set(c, opt, value)) {
+			fprintf(stderr, "[ERROR] %s:%d: invalid value '%s' for %s\n",
+				path, lineno, value, name);
+			ok = false;
+		}
+	}
+
+	fclose(f);
+	return ok;
+}
+
+/**
+ * Use the new configuration in the parts of the server that keep
+ * their own copy of a value
+ */
+static void conf_apply(void)
+{
+	uh_auth_cache_resize();
+	reconfigure_listeners();
+	uh_tls_reconfigure();
+}
+
+bool conf_override(const char *name, const char *value)
+{
+	const struct conf_option *opt = conf_find(name);
+	struct conf_override *o;
+
+	if (!opt || !conf_set(&conf, opt, value))
+		return false;
+
+	o = realloc(overrides, (n_overrides + 1) * sizeof(*overrides));
+	if (!o)
+		return false;
+
+	overrides = o;
+	overrides[n_overrides].opt = opt;
+	overrides[n_overrides].value = strdup(value);
+	n_overrides++;
+
+	return true;
+}
+
+bool conf_load(const char *path)
+{
+	struct config c = conf;
+	bool startup = !conf_path;
+	struct acl *acl;
+	int i;
+
+	if (startup)
+		conf_path = strdup(path);
+
+	acl = acl_new();
+	if (!acl)
+		return false;
+
+	if (!conf_parse(&c, acl, path, startup)) {
+		acl_free(acl);
+		return false;
+	}
+
+	/* The command line wins over the file */
+	for (i = 0; i < n_overrides; i++)
+		if (startup || !(overrides[i].opt->flags & CONF_STARTUP))
+			conf_set(&c, overrides[i].opt, overrides[i].value);
+
+	conf = c;
+	acl_use(acl);
+	conf_apply();
+
+	return true;
+}
+
+/**
+ * Reload the configuration file, runs from the event loop
+ */
+static void conf_reload(void)
+{
+	if (!conf_path)
+		return;
+
+	if (conf_load(conf_path))
+		fprintf(stderr, "Reloaded configuration from %s\n", conf_path);
+	else
+		fprintf(stderr, "[ERROR] Keeping the previous configuration, %s has errors\n", conf_path);
+}
+
+void conf_watch(void)
+{
+	if (!uh_signal_add(SIGHUP, conf_reload))
+		fprintf(stderr, "[ERROR] Could not watch for SIGHUP\n");
+}
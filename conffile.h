@@ -0,0 +1,41 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: conffile.h
+ * Description: the runtime configuration file, reloaded on SIGHUP.
+ *
+ * Created by: Daan Pape
+ * Created on: June 13, 2014
+ */
+
+#ifndef CONFFILE_H_
+#define CONFFILE_H_
+
+#include <stdbool.h>
+
+/**
+ * Set an option for the lifetime of the server, the value is applied
+ * again after every reload. Used for command line options.
+ * @name the option name as used in the configuration file
+ * @value the option value
+ * @return false when the option or value is invalid
+ */
+bool conf_override(const char *name, const char *value);
+
+/**
+ * Load the configuration file. A missing file is not an error, the
+ * defaults are used in that case.
+ * @path the configuration file
+ * @return false when the file contains errors
+ */
+bool conf_load(const char *path);
+
+/**
+ * Reload the configuration file when SIGHUP is received, call after
+ * uloop_init().
+ */
+void conf_watch(void);
+
+#endif /* CONFFILE_H_ */
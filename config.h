@@ -23,6 +23,94 @@
 #define API_PATH				"/api"			/* The API uri */
 #define API_STR_LEN				5				/* The number of characters used for api in the url */
 #define API_CALL_MAX_LEN		12				/* The maximum length of an API call */
+#define API_BATCH_CALL			"batch"			/* The API call running several calls at once */
+#define API_BATCH_MAX_CALLS		32				/* Maximum number of calls in a batch */
+#define API_DEFER_TIMEOUT		20				/* Seconds a deferred API call may take */
+#define API_MAX_PARAMS			64				/* Query string and form parameters indexed per request */
+#define API_MAX_BODY			65536			/* Largest request body an API call collects */
 #define LISTEN_PORT				"8080"			/* Port to listen to for incoming requests */
+#define LISTEN_BACKLOG			64				/* Connections waiting to be accepted */
+#define MAX_CONNECTIONS			100				/* Maximum number of concurrent connections */
+#define READ_BUFFER_SIZE		4096			/* Read buffer of a connection, holds the longest header line */
+#define MAX_SCRIPT_REQUESTS		3				/* Scripts running at the same time */
+#define SCRIPT_TIMEOUT			60				/* Seconds a script may run */
+#define SCRIPT_WORKERS			2				/* Worker processes running the scripts under the API docroot */
+#define SCRIPT_QUEUE_MAX		16				/* Script requests waiting for a worker before 503 is returned */
+#define SCRIPT_MAX_MSG			(1024 * 1024)	/* Largest environment or body passed to a script */
+#define SCRIPT_MAX_ENV			64				/* Most environment variables of a script */
+#define SCRIPT_KILL_GRACE		5				/* Seconds after script_timeout before a worker is killed */
+#define SCRIPT_RESPAWN_DELAY	1000			/* Milliseconds before a failed worker is started again */
+#define DRAIN_TIMEOUT			60				/* Seconds an upgraded server waits for its clients to finish */
+#define CONFIG_FILE				"/etc/woodbox-server.conf"	/* The runtime configuration file */
+
+#define IO_WINDOW_MIN			16384			/* Initial body bytes queued for a connection */
+#define IO_WINDOW_MAX			131072			/* Most body bytes queued for a connection, below MEM_CONN_HIGH_WATER */
+#define IO_WINDOW_LOW_DIV		4				/* Output is refilled below 1/4 of the window */
+
+#define DIRLIST_BATCH_ENTRIES	32				/* Directory entries rendered per write */
+#define DIRLIST_BATCH_SIZE		8192			/* Maximum size of a rendered batch of entries */
+#define DIRLIST_CACHE_ENTRIES	8				/* Number of rendered directory listings to cache */
+#define DIRLIST_CACHE_MAX		65536			/* Largest directory listing to cache in bytes */
+#define DIRLIST_CACHE_TTL		10				/* Seconds a cached listing may show stale file sizes */
+
+#define AUTH_CACHE_SIZE			16				/* Number of verified credentials to remember, rounded up to a power of two */
+#define AUTH_CACHE_TTL			300				/* Seconds verified credentials are remembered */
+
+#define TLS_SESSION_CACHE_SIZE	128				/* Maximum number of cached TLS sessions */
+#define TLS_SESSION_TIMEOUT		3600			/* Lifetime of a cached TLS session in seconds */
+#define TLS_TICKET_ROTATE_TIME	3600			/* Seconds before the session ticket key is rotated */
+
+#define HPACK_TABLE_SIZE		4096			/* Size of the HTTP/2 header compression tables */
+#define HPACK_MAX_STRING		4096			/* Longest HTTP/2 header name or value */
+
+#define H2_MAX_STREAMS			16				/* Concurrent HTTP/2 streams per connection */
+#define H2_FRAME_SIZE			16384			/* Largest HTTP/2 frame accepted, at least 16384 */
+#define H2_MAX_HEADER_BLOCK		16384			/* Largest HTTP/2 header block */
+#define H2_MAX_BODY				65536			/* Largest HTTP/2 request body */
+#define H2_HIGH_WATER			32768			/* Pending output bytes that pause HTTP/2 streams */
+
+#define ADMIT_PRIORITY_PATH		API_PATH		/* Requests under this path may use the reserved slots */
+#define ADMIT_RESERVED_SHARE	20				/* Percentage of the connection slots reserved for API calls */
+#define ADMIT_OVERFLOW			16				/* Connections accepted above the limit to refuse them with 503 */
+#define IO_URING				1				/* Use io_uring when the kernel supports it */
+#define URING_ENTRIES			256				/* Submission queue entries */
+#define TRACE_RING				64				/* Requests kept by the flight recorder */
+#define TRACE_ROUTES			32				/* Routes with a slowest request kept */
+#define TRACE_ROUTE_LEN			48				/* Bytes of the URL path kept */
+#define REQUEST_LINE_TIMEOUT	10				/* Seconds for the request line of a new connection */
+#define HEADER_TIMEOUT			20				/* Seconds from the first byte to the end of the headers */
+#define BODY_MIN_RATE			256				/* Bytes per second a request body must arrive at, 0 for no limit */
+#define RESPONSE_MIN_RATE		256				/* Bytes per second a client must take a response at, 0 for no limit */
+#define CLIENT_RATE_WINDOW		5				/* Seconds the transfer rates are measured over */
+#define RFC1918_FILTER			0				/* Refuse public clients on private server addresses */
+#define STATS_API				0				/* Serve the API calls that expose client addresses and server state */
+#define PEER_MAX_CONNECTIONS	0				/* Connections per source address, 0 for no limit */
+#define PEER_REQUEST_RATE		0				/* Requests per second per source address, 0 for no limit */
+#define PEER_REQUEST_BURST		40				/* Requests a source address can make at once */
+#define PEER_TABLE_SIZE			512				/* Source addresses tracked, must be a power of two */
+#define PEER_EXPIRE_INTERVAL	10000			/* Milliseconds between removing unused addresses */
+#define ADMIT_RETRY_AFTER		5				/* Seconds refused clients are asked to wait */
+
+#define MEM_BUDGET				(8 * 1024 * 1024)	/* Buffered bytes over all connections before reads pause */
+#define MEM_LOW_WATER_PCT		75				/* Percentage of the budget below which reads resume */
+#define MEM_HARD_LIMIT_PCT		150				/* Percentage of the budget above which busy connections are shed too */
+#define MEM_CONN_HIGH_WATER		262144			/* Buffered bytes that stop output of a connection */
+#define MEM_CONN_LOW_WATER		65536			/* Buffered bytes that resume output of a connection */
+#define MEM_IDLE_TIME			5				/* Seconds without progress before a connection is idle */
+#define MEM_SHED_INTERVAL		1000			/* Milliseconds between shedding rounds */
+
+#define STATS_DISK_PATH			"/overlay"		/* The file system reported by the freespace call */
+#define STATS_DISK_INTERVAL		5000			/* Milliseconds between file system samples */
+#define STATS_SYSTEM_INTERVAL	1000			/* Milliseconds between memory, load and uptime samples */
+#define STATS_NET_INTERVAL		2000			/* Milliseconds between interface counter samples */
+#define STATS_MAX_INTERFACES	16				/* Network interfaces reported */
+
+#define WEBSOCKET_PATH			"/ws"			/* The WebSocket uri */
+#define WS_TIMEOUT				300				/* Seconds before an idle WebSocket is closed */
+#define WS_MAX_MESSAGE			65536			/* Largest accepted WebSocket message in bytes */
+#define WS_MAX_SUBSCRIPTIONS	8				/* Topics a single WebSocket can subscribe to */
+#define WS_HIGH_WATER			65536			/* Pending output bytes that pause a WebSocket */
+#define WS_LOW_WATER			16384			/* Pending output bytes that resume a WebSocket */
+#define WS_DEFLATE_MIN			256				/* Smallest message worth compressing */
 
 #endif
@@ -23,6 +23,7 @@
 
 #include <sys/types.h>
 #include <sys/dir.h>
+#include <sys/sendfile.h>
 #include <time.h>
 #include <strings.h>
 #include <dirent.h>
@@ -33,17 +34,14 @@
 #include "mimetypes.h"
 #include "client.h"
 #include "config.h"
+#include "tls.h"
 #include "api.h"
-
-static LIST_HEAD(pending_requests);
-
-struct deferred_request {
-	struct list_head list;
-	struct dispatch_handler *d;
-	struct client *cl;
-	struct path_info pi;
-	bool called, path;
-};
+#include "window.h"
+#include "peer.h"
+#include "acl.h"
+#ifdef HAVE_ASSETS
+#include "assets.h"
+#endif
 
 enum file_hdr {
 	HDR_AUTHORIZATION,
@@ -52,20 +50,21 @@ enum file_hdr {
 	HDR_IF_MATCH,
 	HDR_IF_NONE_MATCH,
 	HDR_IF_RANGE,
+	HDR_ACCEPT_ENCODING,
 	__HDR_MAX
 };
 
 /**
- * Try to normalize the a path to a canonical path
+ * Normalize a path without looking at the filesystem, repeated slashes
+ * and . and .. segments are removed
+ * @path the path
+ * @path_resolved the output buffer, at least PATH_MAX bytes
  */
-static char * canonpath(const char *path, char *path_resolved)
+static char * normpath(const char *path, char *path_resolved)
 {
 	const char *path_cpy = path;
 	char *path_res = path_resolved;
 
-	if (conf.no_symlinks)
-		return realpath(path, path_resolved);
-
 	/* normalize */
 	while ((*path_cpy != '\0') && (path_cpy < (path + PATH_MAX - 2))) {
 		if (*path_cpy != '/')
@@ -110,6 +109,17 @@ next:
 	return path_resolved;
 }
 
+/**
+ * Try to normalize the a path to a canonical path
+ */
+static char * canonpath(const char *path, char *path_resolved)
+{
+	if (conf.no_symlinks)
+		return realpath(path, path_resolved);
+
+	return normpath(path, path_resolved);
+}
+
 /**
  * Given a url this functions tries to find the physical path on the server.
  * @cl the client that made the request
@@ -122,7 +132,7 @@ static struct path_info *path_lookup(struct client *cl, const char *url)
 	static char path_info[PATH_MAX];
 	static struct path_info p;
 
-	int docroot_len = strlen(DOCUMENT_ROOT);
+	int docroot_len = strlen(conf.docroot);
 	char *pathptr = NULL;
 	bool slash;
 
@@ -139,7 +149,7 @@ static struct path_info *path_lookup(struct client *cl, const char *url)
 	path_info[0] = 0;
 
 	/* Start the canonical path with the document root */
-	strcpy(uh_buf, DOCUMENT_ROOT);
+	strcpy(uh_buf, conf.docroot);
 
 	/* Separate query string from url */
 	if ((pathptr = strchr(url, '?')) != NULL) {
@@ -189,7 +199,7 @@ static struct path_info *path_lookup(struct client *cl, const char *url)
 	}
 
 	/* Check whether found path is within docroot */
-	if (strncmp(path_phys, DOCUMENT_ROOT, docroot_len) != 0 ||
+	if (strncmp(path_phys, conf.docroot, docroot_len) != 0 ||
 	    (path_phys[docroot_len] != 0 &&
 	     path_phys[docroot_len] != '/')){
 		return NULL;
@@ -197,7 +207,7 @@ static struct path_info *path_lookup(struct client *cl, const char *url)
 
 	/* Check if the found file is a regular file */
 	if (p.stat.st_mode & S_IFREG) {
-		p.root = DOCUMENT_ROOT;
+		p.root = conf.docroot;
 		p.phys = path_phys;
 		p.name = &path_phys[docroot_len];
 		p.info = path_info[0] ? path_info : NULL;
@@ -226,8 +236,7 @@ static struct path_info *path_lookup(struct client *cl, const char *url)
 	   is missing in the request url, redirect the client to the same
 	   url with trailing slash appended */
 	if (!slash) {
-		write_http_header(cl, 302, "Found");
-		ustream_printf(cl->us, "Content-Length: 0\r\n");
+		write_http_header(cl, 302, "Found", 0);
 		ustream_printf(cl->us, "Location: %s%s%s\r\n\r\n",
 				&path_phys[docroot_len],
 				p.query ? "?" : "",
@@ -250,7 +259,7 @@ static struct path_info *path_lookup(struct client *cl, const char *url)
 		}
 	}
 
-	p.root = DOCUMENT_ROOT;
+	p.root = conf.docroot;
 	p.phys = path_phys;
 	p.name = &path_phys[docroot_len];
 
@@ -323,41 +332,40 @@ static char *uh_file_header(struct client *cl, int idx)
 	return (char *) blobmsg_data(cl->dispatch.file.hdr[idx]);
 }
 
-static void uh_file_response_ok_hdrs(struct client *cl, struct stat *s)
+static void uh_file_response_ok_hdrs(struct client *cl, const char *tag, time_t mtime)
 {
 	char buf[128];
 
-	if (s) {
-		ustream_printf(cl->us, "ETag: %s\r\n", make_file_etag(s, buf, sizeof(buf)));
+	if (tag) {
+		ustream_printf(cl->us, "ETag: %s\r\n", tag);
 		ustream_printf(cl->us, "Last-Modified: %s\r\n",
-			       uh_file_unix2date(s->st_mtime, buf, sizeof(buf)));
+			       uh_file_unix2date(mtime, buf, sizeof(buf)));
 	}
 	ustream_printf(cl->us, "Date: %s\r\n",
 		       uh_file_unix2date(time(NULL), buf, sizeof(buf)));
 }
 
-static void uh_file_response_200(struct client *cl, struct stat *s)
+static void uh_file_response_200(struct client *cl, const char *tag, time_t mtime,
+				 int length)
 {
-	write_http_header(cl, 200, "OK");
-	return uh_file_response_ok_hdrs(cl, s);
+	write_http_header(cl, 200, "OK", length);
+	return uh_file_response_ok_hdrs(cl, tag, mtime);
 }
 
-static void uh_file_response_304(struct client *cl, struct stat *s)
+static void uh_file_response_304(struct client *cl, const char *tag, time_t mtime)
 {
-	write_http_header(cl, 304, "Not Modified");
+	write_http_header(cl, 304, "Not Modified", 0);
 
-	return uh_file_response_ok_hdrs(cl, s);
+	return uh_file_response_ok_hdrs(cl, tag, mtime);
 }
 
 static void uh_file_response_412(struct client *cl)
 {
-	write_http_header(cl, 412, "Precondition Failed");
+	write_http_header(cl, 412, "Precondition Failed", 0);
 }
 
-static bool uh_file_if_match(struct client *cl, struct stat *s)
+static bool uh_file_if_match(struct client *cl, const char *tag)
 {
-	char buf[128];
-	const char *tag = make_file_etag(s, buf, sizeof(buf));
 	char *hdr = uh_file_header(cl, HDR_IF_MATCH);
 	char *p;
 	int i;
@@ -380,25 +388,23 @@ static bool uh_file_if_match(struct client *cl, struct stat *s)
 	return false;
 }
 
-static int uh_file_if_modified_since(struct client *cl, struct stat *s)
+static int uh_file_if_modified_since(struct client *cl, const char *tag, time_t mtime)
 {
 	char *hdr = uh_file_header(cl, HDR_IF_MODIFIED_SINCE);
 
 	if (!hdr)
 		return true;
 
-	if (uh_file_date2unix(hdr) >= s->st_mtime) {
-		uh_file_response_304(cl, s);
+	if (uh_file_date2unix(hdr) >= mtime) {
+		uh_file_response_304(cl, tag, mtime);
 		return false;
 	}
 
 	return true;
 }
 
-static int uh_file_if_none_match(struct client *cl, struct stat *s)
+static int uh_file_if_none_match(struct client *cl, const char *tag, time_t mtime)
 {
-	char buf[128];
-	const char *tag = make_file_etag(s, buf, sizeof(buf));
 	char *hdr = uh_file_header(cl, HDR_IF_NONE_MATCH);
 	char *p;
 	int i;
@@ -414,7 +420,7 @@ static int uh_file_if_none_match(struct client *cl, struct stat *s)
 		} else if (!strcmp(p, "*") || !strcmp(p, tag)) {
 			if ((cl->request.method == UH_HTTP_MSG_GET) ||
 				(cl->request.method == UH_HTTP_MSG_HEAD))
-				uh_file_response_304(cl, s);
+				uh_file_response_304(cl, tag, mtime);
 			else
 				uh_file_response_412(cl);
 
@@ -425,7 +431,7 @@ static int uh_file_if_none_match(struct client *cl, struct stat *s)
 	return true;
 }
 
-static int uh_file_if_range(struct client *cl, struct stat *s)
+static int uh_file_if_range(struct client *cl)
 {
 	char *hdr = uh_file_header(cl, HDR_IF_RANGE);
 
@@ -437,11 +443,11 @@ static int uh_file_if_range(struct client *cl, struct stat *s)
 	return true;
 }
 
-static int uh_file_if_unmodified_since(struct client *cl, struct stat *s)
+static int uh_file_if_unmodified_since(struct client *cl, time_t mtime)
 {
 	char *hdr = uh_file_header(cl, HDR_IF_UNMODIFIED_SINCE);
 
-	if (hdr && uh_file_date2unix(hdr) <= s->st_mtime) {
+	if (hdr && uh_file_date2unix(hdr) <= mtime) {
 		uh_file_response_412(cl);
 		return false;
 	}
@@ -449,110 +455,618 @@ static int uh_file_if_unmodified_since(struct client *cl, struct stat *s)
 	return true;
 }
 
-static int dirent_cmp(const struct dirent **a, const struct dirent **b)
+/**
+ * Check the conditional request headers, a response is sent when the
+ * body should not be sent.
+ * @cl the client that made the request
+ * @tag the entity tag of the body
+ * @mtime the modification time of the body
+ * @return false when the request is done
+ */
+static bool uh_file_preconditions(struct client *cl, const char *tag, time_t mtime)
 {
-	bool dir_a = !!((*a)->d_type & DT_DIR);
-	bool dir_b = !!((*b)->d_type & DT_DIR);
+	if (!uh_file_if_modified_since(cl, tag, mtime) ||
+		!uh_file_if_match(cl, tag) ||
+		!uh_file_if_range(cl) ||
+		!uh_file_if_unmodified_since(cl, mtime) ||
+		!uh_file_if_none_match(cl, tag, mtime)) {
+		ustream_printf(cl->us, "\r\n");
+		request_done(cl);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * The rendered entries of a directory listing, kept for as long as the
+ * directory does not change. The heading is not part of it as it names
+ * the request path.
+ */
+struct dirlist_cache {
+	struct list_head list;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	time_t expires;
+	bool json;
+	int len;
+	char body[];
+};
 
-	/* directories first */
-	if (dir_a != dir_b)
-		return dir_b - dir_a;
+static LIST_HEAD(dirlist_cache);
+static int n_dirlist_cache;
 
-	return alphasort(a, b);
+/**
+ * Check if the query string requests a JSON listing.
+ * @query the query string, may be NULL
+ */
+static bool dirlist_want_json(const char *query)
+{
+	const char *p = query;
+
+	while (p && *p) {
+		if (!strncmp(p, "format=json", 11) && (p[11] == '&' || !p[11]))
+			return true;
+
+		p = strchr(p, '&');
+		if (p)
+			p++;
+	}
+
+	return false;
 }
 
-static void list_entries(struct client *cl, struct dirent **files, int count,
-			 const char *path, char *local_path)
+/**
+ * Find a cached listing of a directory.
+ * @st the status of the open directory
+ * @json true for the JSON listing
+ */
+static struct dirlist_cache *dirlist_cache_get(struct stat *st, bool json)
+{
+	struct dirlist_cache *c;
+
+	list_for_each_entry(c, &dirlist_cache, list) {
+		if (c->dev != st->st_dev || c->ino != st->st_ino || c->json != json)
+			continue;
+
+		if (c->mtime.tv_sec != st->st_mtim.tv_sec ||
+		    c->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+		    c->expires <= uh_monotonic()) {
+			list_del(&c->list);
+			n_dirlist_cache--;
+			free(c);
+			return NULL;
+		}
+
+		/* Keep the most recently used listing in front */
+		list_del(&c->list);
+		list_add(&c->list, &dirlist_cache);
+
+		return c;
+	}
+
+	return NULL;
+}
+
+/**
+ * Remember a rendered listing, the least recently used one is dropped
+ * when the cache is full.
+ */
+static void dirlist_cache_put(struct stat *st, bool json, const char *body, int len)
+{
+	struct dirlist_cache *c;
+
+	/* Modifications within the same second do not change the mtime */
+	if (st->st_mtime >= time(NULL) - 1)
+		return;
+
+	/* The configured size may have shrunk since the last listing */
+	while (n_dirlist_cache && n_dirlist_cache >= conf.dirlist_cache_entries) {
+		c = list_last_entry(&dirlist_cache, struct dirlist_cache, list);
+		list_del(&c->list);
+		n_dirlist_cache--;
+		free(c);
+	}
+
+	if (!conf.dirlist_cache_entries)
+		return;
+
+	c = malloc(sizeof(*c) + len);
+	if (!c)
+		return;
+
+	c->dev = st->st_dev;
+	c->ino = st->st_ino;
+	c->mtime = st->st_mtim;
+	c->expires = uh_monotonic() + DIRLIST_CACHE_TTL;
+	c->json = json;
+	c->len = len;
+	memcpy(c->body, body, len);
+
+	list_add(&c->list, &dirlist_cache);
+	n_dirlist_cache++;
+}
+
+/**
+ * Escape a string for use in HTML or JSON output.
+ * @buf the output buffer
+ * @len the size of the output buffer
+ * @str the string to escape
+ * @json true to escape for JSON, false for HTML
+ */
+static const char *dirlist_escape(char *buf, int len, const char *str, bool json)
+{
+	char *p = buf, *end = buf + len - 8;
+
+	for (; *str && p < end; str++) {
+		unsigned char c = *str;
+
+		if (json) {
+			if (c == '"' || c == '\\')
+				p += sprintf(p, "\\%c", c);
+			else if (c < 0x20)
+				p += sprintf(p, "\\u%04x", c);
+			else
+				*p++ = c;
+		} else {
+			if (c == '<')
+				p += sprintf(p, "&lt;");
+			else if (c == '>')
+				p += sprintf(p, "&gt;");
+			else if (c == '&')
+				p += sprintf(p, "&amp;");
+			else if (c == '\'' || c == '"')
+				p += sprintf(p, "&#%d;", c);
+			else
+				*p++ = c;
+		}
+	}
+	*p = 0;
+
+	return buf;
+}
+
+/**
+ * Render a single directory entry.
+ * @cl the client requesting the listing
+ * @name the entry name
+ * @line the output buffer
+ * @len the size of the output buffer
+ * @return the length of the rendered entry, 0 if the entry is skipped
+ */
+static int dirlist_render_entry(struct client *cl, const char *name, char *line, int len)
 {
-	const char *suffix = "/";
 	const char *type = "directory";
+	const char *suffix = "/";
 	unsigned int mode = S_IXOTH;
+	char esc[3 * NAME_MAX + 1];
+	char url[3 * NAME_MAX + 1];
+	char date[64];
 	struct stat s;
-	char *file;
-	char buf[128];
-	int i;
+	int n;
 
-	file = local_path + strlen(local_path);
-	for (i = 0; i < count; i++) {
-		const char *name = files[i]->d_name;
-		bool dir = !!(files[i]->d_type & DT_DIR);
+	if (name[0] == '.' && name[1] == 0)
+		return 0;
 
-		if (name[0] == '.' && name[1] == 0)
-			continue;
+	if (fstatat(dirfd(cl->dispatch.dirlist.dir), name, &s, 0))
+		return 0;
 
-		sprintf(file, "%s", name);
-		if (stat(local_path, &s))
-			continue;
+	if (!S_ISDIR(s.st_mode)) {
+		suffix = "";
+		mode = S_IROTH;
+		type = file_mime_lookup(name);
+	}
+
+	if (!(s.st_mode & mode))
+		return 0;
+
+	dirlist_escape(esc, sizeof(esc), name, cl->dispatch.dirlist.json);
+
+	if (cl->dispatch.dirlist.json) {
+		n = snprintf(line, len,
+			"%s{\"name\":\"%s\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%ld}",
+			cl->dispatch.dirlist.first ? "" : ",",
+			esc, type, (long long) s.st_size, (long) s.st_mtime);
+	} else {
+		n = uh_urlencode(url, sizeof(url) - 1, name, strlen(name));
+		if (n < 0)
+			return 0;
+		url[n] = 0;
+
+		n = snprintf(line, len,
+			"<li><strong><a href='%s%s'>%s</a>%s"
+			"</strong><br /><small>modified: %s"
+			"<br />%s - %.02f kbyte<br />"
+			"<br /></small></li>",
+			url, suffix, esc, suffix,
+			uh_file_unix2date(s.st_mtime, date, sizeof(date)),
+			type, s.st_size / 1024.0);
+	}
+
+	if (n >= len)
+		return 0;
+
+	cl->dispatch.dirlist.first = false;
+	return n;
+}
+
+/**
+ * Append rendered output to the listing kept for the cache, caching
+ * is given up when the listing grows too large.
+ */
+static void dirlist_keep(struct client *cl, const char *data, int len)
+{
+	char *cache = cl->dispatch.dirlist.cache;
+	int cur = cl->dispatch.dirlist.cache_len;
+
+	if (!cache)
+		return;
+
+	if (cur + len > cl->dispatch.dirlist.cache_size) {
+		free(cache);
+		cl->dispatch.dirlist.cache = NULL;
+		return;
+	}
+
+	memcpy(cache + cur, data, len);
+	cl->dispatch.dirlist.cache_len += len;
+}
+
+/**
+ * Write a piece of the listing to the client and keep it for the cache.
+ */
+static void dirlist_write(struct client *cl, const char *data, int len)
+{
+	dirlist_keep(cl, data, len);
+	uh_chunk_write(cl, data, len);
+}
 
-		if (!dir) {
-			suffix = "";
-			mode = S_IROTH;
-			type = file_mime_lookup(local_path);
+static void dirlist_close(struct client *cl)
+{
+	if (cl->dispatch.dirlist.dir)
+		closedir(cl->dispatch.dirlist.dir);
+	cl->dispatch.dirlist.dir = NULL;
+}
+
+static void dirlist_free(struct client *cl)
+{
+	dirlist_close(cl);
+	free(cl->dispatch.dirlist.cache);
+	cl->dispatch.dirlist.cache = NULL;
+}
+
+/**
+ * Stream the directory listing in bounded batches, so a large directory
+ * does not block the event loop.
+ * @cl the client requesting the listing
+ */
+static void dirlist_write_cb(struct client *cl)
+{
+	static const char html_end[] = "</ol><hr /></body></html>";
+	static const char json_end[] = "]}";
+	char batch[DIRLIST_BATCH_SIZE];
+	char line[WORKING_BUFF_SIZE];
+	struct dirent *e;
+	struct stat st;
+	int len, n, i;
+
+	while (window_room(cl) > 0) {
+		len = 0;
+		e = NULL;
+
+		for (i = 0; i < DIRLIST_BATCH_ENTRIES; i++) {
+			e = readdir(cl->dispatch.dirlist.dir);
+			if (!e)
+				break;
+
+			n = dirlist_render_entry(cl, e->d_name, line, sizeof(line));
+			if (!n)
+				continue;
+
+			if (len + n > sizeof(batch)) {
+				dirlist_write(cl, batch, len);
+				len = 0;
+			}
+
+			memcpy(batch + len, line, n);
+			len += n;
 		}
 
-		if (!(s.st_mode & mode))
+		if (len)
+			dirlist_write(cl, batch, len);
+
+		if (e)
 			continue;
 
-		uh_chunk_printf(cl,
-				"<li><strong><a href='%s%s%s'>%s</a>%s"
-				"</strong><br /><small>modified: %s"
-				"<br />%s - %.02f kbyte<br />"
-				"<br /></small></li>",
-				path, name, suffix,
-				name, suffix,
-				uh_file_unix2date(s.st_mtime, buf, sizeof(buf)),
-				type, s.st_size / 1024.0);
+		/* End of the directory */
+		if (cl->dispatch.dirlist.json)
+			dirlist_write(cl, json_end, sizeof(json_end) - 1);
+		else
+			dirlist_write(cl, html_end, sizeof(html_end) - 1);
+
+		/* Only cache when the directory did not change while listing */
+		if (cl->dispatch.dirlist.cache &&
+		    !fstat(dirfd(cl->dispatch.dirlist.dir), &st) &&
+		    st.st_mtim.tv_sec == cl->dispatch.dirlist.st.st_mtim.tv_sec &&
+		    st.st_mtim.tv_nsec == cl->dispatch.dirlist.st.st_mtim.tv_nsec)
+			dirlist_cache_put(&st, cl->dispatch.dirlist.json,
+					  cl->dispatch.dirlist.cache,
+					  cl->dispatch.dirlist.cache_len);
 
-		*file = 0;
-		free(files[i]);
+		request_done(cl);
+		return;
 	}
 }
 
+/**
+ * Send a directory listing. The listing is served from the cache when
+ * the directory did not change, otherwise it is streamed in directory
+ * order. Use ?format=json for a JSON listing.
+ * @cl the client requesting the listing
+ * @pi the path info of the directory
+ */
 static void uh_file_dirlist(struct client *cl, struct path_info *pi)
 {
-	struct dirent **files = NULL;
-	int count = 0;
+	bool json = dirlist_want_json(pi->query);
+	struct dirlist_cache *c;
+	char esc[PATH_MAX * 2];
+	char head[sizeof(esc) * 2 + 128];
+	struct stat st;
+	DIR *dir;
+	int fd, head_len;
+
+	fd = open(pi->phys, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) || !(dir = fdopendir(fd))) {
+		if (fd >= 0)
+			close(fd);
+
+		send_client_status(cl, 403);
+		return;
+	}
 
-	uh_file_response_200(cl, NULL);
-	ustream_printf(cl->us, "Content-Type: text/html\r\n\r\n");
+	/*
+	 * The heading names the request path, which differs between aliases
+	 * of the same directory, so it is rendered per request and only the
+	 * entries are cached.
+	 */
+	dirlist_escape(esc, sizeof(esc), pi->name, json);
+	if (json)
+		snprintf(head, sizeof(head), "{\"path\":\"%s\",\"entries\":[", esc);
+	else
+		snprintf(head, sizeof(head),
+			"<html><head><title>Index of %s</title></head>"
+			"<body><h1>Index of %s</h1><hr /><ol>", esc, esc);
+	head_len = strlen(head);
+
+	/* A cached listing is sent with its length */
+	c = dirlist_cache_get(&st, json);
+
+	uh_file_response_200(cl, NULL, 0, c ? head_len + c->len : HTTP_LENGTH_STREAM);
+	ustream_printf(cl->us, "Content-Type: %s\r\n\r\n",
+		       json ? "application/json" : "text/html");
 
-	uh_chunk_printf(cl,
-		"<html><head><title>Index of %s</title></head>"
-		"<body><h1>Index of %s</h1><hr /><ol>",
-		pi->name, pi->name);
+	/* Stop if this is a header only request */
+	if (cl->request.method == UH_HTTP_MSG_HEAD) {
+		closedir(dir);
+		request_done(cl);
+		return;
+	}
 
-	count = scandir(pi->phys, &files, NULL, dirent_cmp);
-	if (count > 0) {
-		strcpy(uh_buf, pi->phys);
-		list_entries(cl, files, count, pi->name, uh_buf);
+	uh_chunk_write(cl, head, head_len);
+
+	if (c) {
+		closedir(dir);
+		uh_chunk_write(cl, c->body, c->len);
+		request_done(cl);
+		return;
 	}
-	free(files);
 
-	uh_chunk_printf(cl, "</ol><hr /></body></html>");
-	request_done(cl);
+	cl->dispatch.dirlist.dir = dir;
+	cl->dispatch.dirlist.json = json;
+	cl->dispatch.dirlist.first = true;
+	cl->dispatch.dirlist.st = st;
+	cl->dispatch.dirlist.cache = NULL;
+	if (conf.dirlist_cache_entries && conf.dirlist_cache_max)
+		cl->dispatch.dirlist.cache = malloc(conf.dirlist_cache_max);
+	cl->dispatch.dirlist.cache_len = 0;
+	cl->dispatch.dirlist.cache_size = conf.dirlist_cache_max;
+	cl->dispatch.write_cb = dirlist_write_cb;
+	cl->dispatch.free = dirlist_free;
+	cl->dispatch.close_fds = dirlist_close;
+
+	dirlist_write_cb(cl);
 }
 
 static void file_write_cb(struct client *cl)
 {
 	int fd = cl->dispatch.file.fd;
-	int r;
+	int room, len, r;
+	char *buf;
 
-	while (cl->us->w.data_bytes < 256) {
-		r = read(fd, uh_buf, sizeof(uh_buf));
+	while ((room = window_room(cl)) > 0) {
+		buf = window_buf(cl, &len);
+		if (!buf) {
+			close_connection(cl);
+			return;
+		}
+
+		r = read(fd, buf, min(room, len));
 		if (r < 0) {
 			if (errno == EINTR)
 				continue;
 		}
 
-		if (!r) {
+		if (r <= 0) {
 			request_done(cl);
 			return;
 		}
 
-		uh_chunk_write(cl, uh_buf, r);
+		uh_chunk_write(cl, buf, r);
 	}
 }
 
+/**
+ * Send the file body straight from the page cache to the socket. The
+ * kernel encrypts the data itself when kernel TLS is active.
+ * @cl the client to send the file to
+ */
+static void file_sendfile_cb(struct client *cl)
+{
+	ssize_t r;
+
+	/* Headers and earlier data go out first */
+	if (cl->us->w.data_bytes || cl->sfd.stream.w.data_bytes)
+		return;
+
+	while (cl->dispatch.file.left > 0) {
+		r = sendfile(cl->sfd.fd.fd, cl->dispatch.file.fd, &cl->dispatch.file.off,
+			     min(cl->dispatch.file.left, INT_MAX));
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN) {
+				client_poll_write(cl);
+				return;
+			}
+		}
+
+		/* The body can not be completed, the connection is unusable */
+		if (r <= 0) {
+			close_connection(cl);
+			return;
+		}
+
+		cl->dispatch.file.left -= r;
+		client_sent(cl, r);
+		uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+	}
+
+	request_done(cl);
+}
+
+static void file_uring_cb(struct client *cl);
+
+/**
+ * Continue after both operations of an io_uring window completed
+ * @cl the client the window was sent to
+ */
+static void file_uring_put(struct client *cl)
+{
+	int res = cl->dispatch.file.sent;
+
+	cl->refcount--;
+	if (--cl->dispatch.file.busy)
+		return;
+
+	/* The connection was closed while the window was in flight */
+	if (cl->state == CLIENT_STATE_CLEANUP) {
+		client_notify_state(cl);
+		return;
+	}
+
+	if (res == -EAGAIN) {
+		client_poll_write(cl);
+		return;
+	}
+
+	/* A failed read cancels the send, the connection is unusable */
+	if (res <= 0) {
+		close_connection(cl);
+		return;
+	}
+
+	cl->dispatch.file.off += res;
+	cl->dispatch.file.left -= res;
+	client_sent(cl, res);
+	uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
+
+	/* Every window that went out completely may grow the next one */
+	cl->win.filling = false;
+	file_uring_cb(cl);
+}
+
+static void file_uring_read_cb(struct uring_op *op, int res, bool more)
+{
+	file_uring_put(container_of(op, struct client, dispatch.file.read));
+}
+
+static void file_uring_send_cb(struct uring_op *op, int res, bool more)
+{
+	struct client *cl = container_of(op, struct client, dispatch.file.send);
+
+	cl->dispatch.file.sent = res;
+	file_uring_put(cl);
+}
+
+static void file_uring_cancel(struct client *cl)
+{
+	if (cl->dispatch.file.busy) {
+		uring_cancel(&cl->dispatch.file.read);
+		uring_cancel(&cl->dispatch.file.send);
+	}
+}
+
+/**
+ * Send the file body with a linked io_uring read and send per window,
+ * the event loop only sees the completion.
+ * @cl the client to send the file to
+ */
+static void file_uring_cb(struct client *cl)
+{
+	int room, len;
+	char *buf;
+
+	/* Headers and earlier data go out first, one window is in flight at a time */
+	if (cl->us->w.data_bytes || cl->sfd.stream.w.data_bytes || cl->dispatch.file.busy)
+		return;
+
+	if (!cl->dispatch.file.left) {
+		request_done(cl);
+		return;
+	}
+
+	room = window_room(cl);
+	if (room <= 0)
+		return;
+
+	buf = window_buf(cl, &len);
+	if (!buf) {
+		close_connection(cl);
+		return;
+	}
+
+	len = min(min(room, len), cl->dispatch.file.left);
+	cl->dispatch.file.read.cb = file_uring_read_cb;
+	cl->dispatch.file.send.cb = file_uring_send_cb;
+
+	/* The ring is full, send the rest without it */
+	if (!uring_read_send(&cl->dispatch.file.read, &cl->dispatch.file.send,
+			     cl->dispatch.file.fd, cl->dispatch.file.off,
+			     cl->sfd.fd.fd, buf, len)) {
+		cl->dispatch.write_cb = file_sendfile_cb;
+		file_sendfile_cb(cl);
+		return;
+	}
+
+	cl->dispatch.file.busy = 2;
+	cl->refcount += 2;
+}
+
+/**
+ * Check if the body of the response can bypass the stream buffers.
+ * @cl the client to check
+ */
+static bool file_can_sendfile(struct client *cl)
+{
+	/* HTTP/2 streams have no socket of their own */
+	if (uh_use_chunked(cl) || cl->h2_stream)
+		return false;
+
+	return !cl->tls || uh_tls_client_ktls(cl);
+}
+
 static void uh_file_free(struct client *cl)
 {
 	close(cl->dispatch.file.fd);
@@ -560,28 +1074,21 @@ static void uh_file_free(struct client *cl)
 
 static void uh_file_data(struct client *cl, struct path_info *pi, int fd)
 {
+	char tag[128];
+
 	/* test preconditions */
-	if (!uh_file_if_modified_since(cl, &pi->stat) ||
-		!uh_file_if_match(cl, &pi->stat) ||
-		!uh_file_if_range(cl, &pi->stat) ||
-		!uh_file_if_unmodified_since(cl, &pi->stat) ||
-		!uh_file_if_none_match(cl, &pi->stat)) {
-		ustream_printf(cl->us, "Content-Length: 0\r\n");
-		ustream_printf(cl->us, "\r\n");
-		request_done(cl);
+	make_file_etag(&pi->stat, tag, sizeof(tag));
+	if (!uh_file_preconditions(cl, tag, pi->stat.st_mtime)) {
 		close(fd);
 		return;
 	}
 
 	/* write status */
-	uh_file_response_200(cl, &pi->stat);
+	uh_file_response_200(cl, tag, pi->stat.st_mtime, pi->stat.st_size);
 
-	ustream_printf(cl->us, "Content-Type: %s\r\n",
+	ustream_printf(cl->us, "Content-Type: %s\r\n\r\n",
 			file_mime_lookup(pi->name));
 
-	ustream_printf(cl->us, "Content-Length: %i\r\n\r\n",
-			   pi->stat.st_size);
-
 
 	/* Stop if this is a header only request */
 	if (cl->request.method == UH_HTTP_MSG_HEAD) {
@@ -591,9 +1098,23 @@ static void uh_file_data(struct client *cl, struct path_info *pi, int fd)
 	}
 
 	cl->dispatch.file.fd = fd;
-	cl->dispatch.write_cb = file_write_cb;
 	cl->dispatch.free = uh_file_free;
 	cl->dispatch.close_fds = uh_file_free;
+
+	/* Use the zero-copy path when the body is sent without framing */
+	if (file_can_sendfile(cl)) {
+		cl->dispatch.file.left = pi->stat.st_size;
+		cl->dispatch.write_cb = file_sendfile_cb;
+		if (uring_active()) {
+			cl->dispatch.write_cb = file_uring_cb;
+			cl->dispatch.cancel = file_uring_cancel;
+		}
+
+		cl->dispatch.write_cb(cl);
+		return;
+	}
+
+	cl->dispatch.write_cb = file_write_cb;
 	file_write_cb(cl);
 }
 
@@ -605,7 +1126,7 @@ static void uh_file_request(struct client *cl, const char *url, struct path_info
 		goto error;
 
 	if (pi->stat.st_mode & S_IFREG) {
-		fd = open(pi->phys, O_RDONLY);
+		fd = open(pi->phys, O_RDONLY | O_CLOEXEC);
 		if (fd < 0)
 			goto error;
 
@@ -624,8 +1145,104 @@ static void uh_file_request(struct client *cl, const char *url, struct path_info
 	}
 
 error:
-	send_client_error(cl, 403, "Forbidden", "You don't have permission to access %s on this server.", url);
+	send_client_status(cl, 403);
+}
+
+#ifdef HAVE_ASSETS
+static void file_asset_write_cb(struct client *cl)
+{
+	int len;
+
+	while ((len = window_room(cl)) > 0) {
+		len = min(cl->dispatch.file.left, len);
+		if (!len) {
+			request_done(cl);
+			return;
+		}
+
+		uh_chunk_write(cl, cl->dispatch.file.data, len);
+		cl->dispatch.file.data += len;
+		cl->dispatch.file.left -= len;
+	}
+}
+
+/**
+ * Serve a request from the web interface embedded at build time, no
+ * filesystem access is needed.
+ * @cl the client that made the request
+ * @url the request URL
+ * @tb the parsed request headers
+ * @return false when the interface has no file for the URL
+ */
+static bool file_asset_request(struct client *cl, const char *url, struct blob_attr **tb)
+{
+	struct path_info pi = {};
+	const struct asset *a;
+	const char *query, *tag;
+	char path[PATH_MAX];
+	bool gzip;
+	int len;
+
+	/* The interface is built from the default document root */
+	if (strcmp(conf.docroot, DOCUMENT_ROOT))
+		return false;
+
+	query = strchr(url, '?');
+	len = uh_urldecode(path, sizeof(path) - sizeof(INDEX_FILE), url,
+			   query ? query - url : strlen(url));
+	if (len <= 0)
+		return false;
+
+	/* Directories are served by their index file */
+	if (path[len - 1] == '/') {
+		strcpy(&path[len], INDEX_FILE);
+		len += strlen(INDEX_FILE);
+	}
+	path[len] = 0;
+
+	a = asset_find(path, len);
+	if (!a)
+		return false;
+
+	pi.name = a->path;
+	if (tb[HDR_AUTHORIZATION])
+		pi.auth = blobmsg_data(tb[HDR_AUTHORIZATION]);
+
+	if (!uh_auth_check(cl, &pi))
+		return true;
+
+	gzip = a->gz && tb[HDR_ACCEPT_ENCODING] &&
+	       strstr(blobmsg_data(tb[HDR_ACCEPT_ENCODING]), "gzip");
+	tag = gzip ? a->gz_etag : a->etag;
+
+	cl->dispatch.file.hdr = tb;
+	if (!uh_file_preconditions(cl, tag, a->mtime)) {
+		cl->dispatch.file.hdr = NULL;
+		return true;
+	}
+	cl->dispatch.file.hdr = NULL;
+
+	uh_file_response_200(cl, tag, a->mtime, gzip ? a->gz_len : a->len);
+	ustream_printf(cl->us, "Content-Type: %s\r\n", a->mime);
+	if (a->gz)
+		ustream_printf(cl->us, "Vary: Accept-Encoding\r\n");
+	if (gzip)
+		ustream_printf(cl->us, "Content-Encoding: gzip\r\n");
+	ustream_printf(cl->us, "\r\n");
+
+	if (cl->request.method == UH_HTTP_MSG_HEAD) {
+		request_done(cl);
+		return true;
+	}
+
+	cl->dispatch.file.data = gzip ? a->gz : a->data;
+	cl->dispatch.file.left = gzip ? a->gz_len : a->len;
+	cl->dispatch.write_cb = file_asset_write_cb;
+	file_asset_write_cb(cl);
+
+	return true;
 }
+#endif
 
 static bool handle_file_request(struct client *cl, char *url)
 {
@@ -636,10 +1253,19 @@ static bool handle_file_request(struct client *cl, char *url)
 		[HDR_IF_MATCH] = { "if-match", BLOBMSG_TYPE_STRING },
 		[HDR_IF_NONE_MATCH] = { "if-none-match", BLOBMSG_TYPE_STRING },
 		[HDR_IF_RANGE] = { "if-range", BLOBMSG_TYPE_STRING },
+		[HDR_ACCEPT_ENCODING] = { "accept-encoding", BLOBMSG_TYPE_STRING },
 	};
 	struct blob_attr *tb[__HDR_MAX];
 	struct path_info *pi;
 
+	blobmsg_parse(hdr_policy, __HDR_MAX, tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+
+#ifdef HAVE_ASSETS
+	/* The embedded web interface goes before the filesystem */
+	if (file_asset_request(cl, url, tb))
+		return true;
+#endif
+
 	pi = path_lookup(cl, url);
 	if (!pi)
 		return false;
@@ -647,7 +1273,6 @@ static bool handle_file_request(struct client *cl, char *url)
 	if (pi->redirected)
 		return true;
 
-	blobmsg_parse(hdr_policy, __HDR_MAX, tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
 	if (tb[HDR_AUTHORIZATION])
 		pi->auth = blobmsg_data(tb[HDR_AUTHORIZATION]);
 
@@ -660,21 +1285,66 @@ static bool handle_file_request(struct client *cl, char *url)
 	return true;
 }
 
-void uh_handle_request(struct client *cl)
+/**
+ * Check the limits of a request and pass it to its handler
+ * @cl the client that made the request
+ * @url the request URL
+ */
+static void file_route_request(struct client *cl, char *url)
 {
 	struct http_request *req = &cl->request;
-	char *url = blobmsg_data(blob_data(cl->hdr.head));
+
+	char decoded[PATH_MAX], path[PATH_MAX];
+	const char *query;
+	int len;
 
 	req->redirect_status = 200;
 
+	/*
+	 * The rules of the path prefix, matched on the path the request
+	 * resolves to so encoded or non canonical URLs cannot avoid them
+	 */
+	query = strchr(url, '?');
+	len = uh_urldecode(decoded, sizeof(decoded) - 1, url, query ? query - url : strlen(url));
+	if (len < 0) {
+		send_client_status(cl, 400);
+		return;
+	}
+	decoded[len] = 0;
+
+	if (!acl_request(cl, normpath(decoded, path))) {
+		send_client_status(cl, 403);
+		return;
+	}
+
+	/* Every request takes a token from the bucket of its address */
+	if (!peer_request(cl)) {
+		req->connection_close = true;
+		send_client_status(cl, 429);
+		return;
+	}
+
 	/* Check if this is an api or file request */
 	if(uh_path_match(API_PATH, url)){
 		api_handle_request(cl, url);
+		return;
 	}else{
 		if (handle_file_request(cl, url))
 			return;
 	}
 
 	req->redirect_status = 404;
-	send_client_error(cl, 404, "Not Found", "The requested URL %s was not found on this server.", url);
+	send_client_status(cl, 404);
+}
+
+void uh_handle_request(struct client *cl)
+{
+	char *url = blobmsg_data(blob_data(cl->hdr.head));
+
+	trace_handler(cl, url);
+	file_route_request(cl, url);
+
+	/* A finished request already started the trace of the next one */
+	if (cl->trace.at[TRACE_HANDLER])
+		trace_mark(cl, TRACE_HANDLER_END);
 }
@@ -11,13 +11,97 @@
  * Created on: May 14, 2014
  */
 
-#include <mntent.h>
-#include <sys/vfs.h>
+#include <arpa/inet.h>
 #include <json/json.h>
 
 #include "uhttpd.h"
+#include "config.h"
+#include "budget.h"
+#include "sampler.h"
+#include "script.h"
+#include "peer.h"
+#include "acl.h"
+#include "trace.h"
+#include "client.h"
+#include "api.h"
 #include "gethandlers.h"
 
+/**
+ * A call waiting for the first snapshot of its source
+ */
+struct sample_wait {
+	struct list_head list;
+	struct api_deferred *d;
+	api_handler handler;			/* Runs again after every sample */
+	bool (*tried)(void);			/* The source had its first sample */
+};
+
+static LIST_HEAD(sample_waiters);
+
+/**
+ * Forget a waiting call, its client went away or it timed out
+ */
+static void sample_wait_cancel(struct api_deferred *d)
+{
+	struct sample_wait *w = d->priv;
+
+	list_del(&w->list);
+	free(w);
+}
+
+/**
+ * Wait for a source that has no snapshot because its first sample was
+ * not taken yet. The call completes after that sample. A source that
+ * failed its first sample is taken to be missing, and calls fail at once
+ * rather than waiting for the timeout.
+ * @cl the client who made the request
+ * @handler the handler to run again
+ * @tried tells if the source had its first sample
+ * @return API_PENDING, NULL when the call fails
+ */
+static json_object* sample_defer(struct client *cl, api_handler handler, bool (*tried)(void))
+{
+	struct sample_wait *w;
+
+	if (tried())
+		return NULL;
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return NULL;
+
+	w->d = api_defer(cl, sample_wait_cancel, w);
+	if (!w->d) {
+		free(w);
+		return NULL;
+	}
+
+	w->handler = handler;
+	w->tried = tried;
+	list_add_tail(&w->list, &sample_waiters);
+	return API_PENDING;
+}
+
+void get_sampled(void)
+{
+	struct sample_wait *w, *tmp;
+	struct api_deferred *d;
+	json_object *result;
+
+	list_for_each_entry_safe(w, tmp, &sample_waiters, list) {
+		d = w->d;
+		result = w->handler(d->cl);
+		if (!result && !w->tried())
+			continue;
+
+		list_del(&w->list);
+		free(w);
+
+		/* Failed calls are bad requests */
+		api_complete(d, result ? &d->cl->http_status : &r_bad_req, result);
+	}
+}
+
 /**
  * Get free disk space if a mounted filesystem
  * could be found.
@@ -25,14 +109,16 @@
  */
 json_object* get_free_disk_space(struct client *cl)
 {
-	/* The mount point we want to check */
-	struct statfs s;
-	statfs("/overlay", &s);
+	/* The mount point is sampled in the background */
+	const struct sample_disk *s = sampler_disk();
+
+	if (!s)
+		return sample_defer(cl, get_free_disk_space, sampler_disk_tried);
 
 	/* Put data in JSON object */
 	json_object *jobj = json_object_new_object();
-	json_object *freespace = json_object_new_int((int)((s.f_bavail * s.f_frsize)/1048576));
-	json_object *totalspace = json_object_new_int((int)((s.f_blocks * s.f_frsize)/1048576));
+	json_object *freespace = json_object_new_int((int)(s->free / 1048576));
+	json_object *totalspace = json_object_new_int((int)(s->total / 1048576));
 
 	json_object_object_add(jobj, "free", freespace);
 	json_object_object_add(jobj, "total", totalspace);
@@ -42,6 +128,280 @@ json_object* get_free_disk_space(struct client *cl)
 	return jobj;
 }
 
+/**
+ * Get the memory usage of the system in kilobytes.
+ * @cl the client who made the request
+ */
+json_object* get_memory(struct client *cl)
+{
+	const struct sample_system *s = sampler_system();
+	json_object *jobj;
+
+	if (!s)
+		return sample_defer(cl, get_memory, sampler_system_tried);
+
+	jobj = json_object_new_object();
+	json_object_object_add(jobj, "total", json_object_new_int(s->mem_total / 1024));
+	json_object_object_add(jobj, "free", json_object_new_int(s->mem_free / 1024));
+	json_object_object_add(jobj, "shared", json_object_new_int(s->mem_shared / 1024));
+	json_object_object_add(jobj, "buffered", json_object_new_int(s->mem_buffered / 1024));
+	json_object_object_add(jobj, "swap_total", json_object_new_int(s->swap_total / 1024));
+	json_object_object_add(jobj, "swap_free", json_object_new_int(s->swap_free / 1024));
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Get the 1, 5 and 15 minute load averages and the number
+ * of processes.
+ * @cl the client who made the request
+ */
+json_object* get_load(struct client *cl)
+{
+	const struct sample_system *s = sampler_system();
+	json_object *jobj, *load;
+	int i;
+
+	if (!s)
+		return sample_defer(cl, get_load, sampler_system_tried);
+
+	load = json_object_new_array();
+	for (i = 0; i < 3; i++)
+		json_object_array_add(load, json_object_new_double(s->load[i]));
+
+	jobj = json_object_new_object();
+	json_object_object_add(jobj, "load", load);
+	json_object_object_add(jobj, "procs", json_object_new_int(s->procs));
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Get the system uptime in seconds.
+ * @cl the client who made the request
+ */
+json_object* get_uptime(struct client *cl)
+{
+	const struct sample_system *s = sampler_system();
+	json_object *jobj;
+
+	if (!s)
+		return sample_defer(cl, get_uptime, sampler_system_tried);
+
+	jobj = json_object_new_object();
+	json_object_object_add(jobj, "uptime", json_object_new_int(s->uptime));
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Get the traffic counters of the network interfaces.
+ * @cl the client who made the request
+ */
+json_object* get_interfaces(struct client *cl)
+{
+	const struct sample_net *s = sampler_net();
+	json_object *jobj, *iface;
+	int i;
+
+	if (!s)
+		return sample_defer(cl, get_interfaces, sampler_net_tried);
+
+	jobj = json_object_new_object();
+	for (i = 0; i < s->n_ifaces; i++) {
+		iface = json_object_new_object();
+		json_object_object_add(iface, "rx_bytes", json_object_new_int64(s->ifaces[i].rx_bytes));
+		json_object_object_add(iface, "rx_packets", json_object_new_int64(s->ifaces[i].rx_packets));
+		json_object_object_add(iface, "rx_errors", json_object_new_int64(s->ifaces[i].rx_errors));
+		json_object_object_add(iface, "rx_dropped", json_object_new_int64(s->ifaces[i].rx_dropped));
+		json_object_object_add(iface, "tx_bytes", json_object_new_int64(s->ifaces[i].tx_bytes));
+		json_object_object_add(iface, "tx_packets", json_object_new_int64(s->ifaces[i].tx_packets));
+		json_object_object_add(iface, "tx_errors", json_object_new_int64(s->ifaces[i].tx_errors));
+		json_object_object_add(iface, "tx_dropped", json_object_new_int64(s->ifaces[i].tx_dropped));
+		json_object_object_add(jobj, s->ifaces[i].name, iface);
+	}
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Get the memory used by connection buffers and the
+ * budget it is accounted against.
+ * @cl the client who made the request
+ */
+json_object* get_memory_budget(struct client *cl)
+{
+	struct budget_stats s;
+	json_object *jobj = json_object_new_object();
+
+	budget_get_stats(&s);
+	json_object_object_add(jobj, "used", json_object_new_int(s.used));
+	json_object_object_add(jobj, "peak", json_object_new_int(s.peak));
+	json_object_object_add(jobj, "budget", json_object_new_int(conf.mem_budget));
+	json_object_object_add(jobj, "connections", json_object_new_int(s.connections));
+	json_object_object_add(jobj, "paused", json_object_new_boolean(s.paused));
+	json_object_object_add(jobj, "shed", json_object_new_int(s.shed));
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Get the state of the script workers.
+ * @cl the client who made the request
+ */
+json_object* get_scripts(struct client *cl)
+{
+	struct script_stats s;
+	json_object *jobj = json_object_new_object();
+
+	script_get_stats(&s);
+	json_object_object_add(jobj, "workers", json_object_new_int(s.workers));
+	json_object_object_add(jobj, "busy", json_object_new_int(s.busy));
+	json_object_object_add(jobj, "queued", json_object_new_int(s.queued));
+	json_object_object_add(jobj, "max_requests", json_object_new_int(conf.max_script_requests));
+	json_object_object_add(jobj, "requests", json_object_new_int(s.requests));
+	json_object_object_add(jobj, "timeouts", json_object_new_int(s.timeouts));
+	json_object_object_add(jobj, "rejected", json_object_new_int(s.rejected));
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Add a tracked source address to a list
+ */
+static void add_peer(const struct uh_addr *addr, int conns, int tokens, void *priv)
+{
+	json_object *jpeer = json_object_new_object();
+	char buf[INET6_ADDRSTRLEN];
+
+	inet_ntop(addr->family, &addr->in6, buf, sizeof(buf));
+	json_object_object_add(jpeer, "address", json_object_new_string(buf));
+	json_object_object_add(jpeer, "connections", json_object_new_int(conns));
+	json_object_object_add(jpeer, "tokens", json_object_new_int(tokens));
+	json_object_array_add(priv, jpeer);
+}
+
+/**
+ * Get the connections and request tokens of the tracked source addresses.
+ */
+json_object* get_peers(struct client *cl)
+{
+	struct peer_stats s;
+	json_object *jobj = json_object_new_object();
+	json_object *jpeers = json_object_new_array();
+
+	peer_get_stats(&s);
+	json_object_object_add(jobj, "max_connections", json_object_new_int(conf.peer_max_connections));
+	json_object_object_add(jobj, "request_rate", json_object_new_int(conf.peer_request_rate));
+	json_object_object_add(jobj, "request_burst", json_object_new_int(conf.peer_request_burst));
+	json_object_object_add(jobj, "tracked", json_object_new_int(s.tracked));
+	json_object_object_add(jobj, "refused", json_object_new_int(s.refused));
+	json_object_object_add(jobj, "limited", json_object_new_int(s.limited));
+	json_object_object_add(jobj, "untracked", json_object_new_int(s.untracked));
+
+	peer_for_each(add_peer, jpeers);
+	json_object_object_add(jobj, "peers", jpeers);
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Get the access rule counters.
+ */
+json_object* get_access(struct client *cl)
+{
+	struct acl_stats s;
+	json_object *jobj = json_object_new_object();
+
+	acl_get_stats(&s);
+	json_object_object_add(jobj, "rules", json_object_new_int(s.rules));
+	json_object_object_add(jobj, "rfc1918_filter", json_object_new_boolean(conf.rfc1918_filter));
+	json_object_object_add(jobj, "denied_connections", json_object_new_int(s.denied_connections));
+	json_object_object_add(jobj, "denied_requests", json_object_new_int(s.denied_requests));
+	json_object_object_add(jobj, "rfc1918", json_object_new_int(s.rfc1918));
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Add a recorded request to a list
+ */
+static void add_trace(const struct trace *t, void *priv)
+{
+	json_object *jtrace = json_object_new_object();
+	json_object *jphases = json_object_new_object();
+	int i;
+
+	json_object_object_add(jtrace, "time", json_object_new_int64(t->done));
+	json_object_object_add(jtrace, "method", json_object_new_string(http_methods[t->method]));
+	json_object_object_add(jtrace, "route", json_object_new_string(t->route));
+	json_object_object_add(jtrace, "status", json_object_new_int(t->status));
+	json_object_object_add(jtrace, "reused", json_object_new_boolean(t->reused));
+	json_object_object_add(jtrace, "total", json_object_new_int64(trace_total(t)));
+
+	/* Microseconds after the connection was accepted or became idle */
+	for (i = 0; i < TRACE_PHASES; i++)
+		if (t->at[i])
+			json_object_object_add(jphases, trace_phase_name(i), json_object_new_int64(t->at[i]));
+
+	json_object_object_add(jtrace, "phases", jphases);
+	json_object_array_add(priv, jtrace);
+}
+
+/**
+ * Get the flight recorder, the last requests and the slowest per route.
+ */
+json_object* get_trace(struct client *cl)
+{
+	json_object *jobj = json_object_new_object();
+	json_object *jrecent = json_object_new_array();
+	json_object *jslowest = json_object_new_array();
+
+	trace_for_each(false, add_trace, jrecent);
+	trace_for_each(true, add_trace, jslowest);
+	json_object_object_add(jobj, "recent", jrecent);
+	json_object_object_add(jobj, "slowest", jslowest);
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
+/**
+ * Get the number of connections closed by each request deadline.
+ */
+json_object* get_deadlines(struct client *cl)
+{
+	struct client_deadline_stats s;
+	json_object *jobj = json_object_new_object();
+
+	client_get_deadline_stats(&s);
+	json_object_object_add(jobj, "request_line", json_object_new_int(s.request_line));
+	json_object_object_add(jobj, "headers", json_object_new_int(s.headers));
+	json_object_object_add(jobj, "body", json_object_new_int(s.body));
+	json_object_object_add(jobj, "response", json_object_new_int(s.response));
+
+	/* Return status ok */
+	cl->http_status = r_ok;
+	return jobj;
+}
+
 /**
  * Test object
  */
@@ -17,6 +17,12 @@
 
 #include "uhttpd.h"
 
+/**
+ * Complete the calls that wait for a statistics snapshot, called by the
+ * sampler after every sample attempt.
+ */
+void get_sampled(void);
+
 /**
  * Get free disk space if a mounted filesystem
  * could be found.
@@ -24,6 +30,68 @@
  */
 json_object* get_free_disk_space(struct client *cl);
 
+/**
+ * Get the memory usage of the system in kilobytes.
+ * @cl the client who made the request
+ */
+json_object* get_memory(struct client *cl);
+
+/**
+ * Get the 1, 5 and 15 minute load averages and the number
+ * of processes.
+ * @cl the client who made the request
+ */
+json_object* get_load(struct client *cl);
+
+/**
+ * Get the system uptime in seconds.
+ * @cl the client who made the request
+ */
+json_object* get_uptime(struct client *cl);
+
+/**
+ * Get the traffic counters of the network interfaces.
+ * @cl the client who made the request
+ */
+json_object* get_interfaces(struct client *cl);
+
+/**
+ * Get the memory used by connection buffers and the
+ * budget it is accounted against.
+ * @cl the client who made the request
+ */
+json_object* get_memory_budget(struct client *cl);
+
+/**
+ * Get the state of the script workers.
+ * @cl the client who made the request
+ */
+json_object* get_scripts(struct client *cl);
+
+/**
+ * Get the connections and request tokens of the tracked source addresses.
+ * @cl the client who made the request
+ */
+json_object* get_peers(struct client *cl);
+
+/**
+ * Get the access rule counters.
+ * @cl the client who made the request
+ */
+json_object* get_access(struct client *cl);
+
+/**
+ * Get the flight recorder, the last requests and the slowest per route.
+ * @cl the client who made the request
+ */
+json_object* get_trace(struct client *cl);
+
+/**
+ * Get the number of connections closed by each request deadline.
+ * @cl the client who made the request
+ */
+json_object* get_deadlines(struct client *cl);
+
 /**
  * Test object
  */
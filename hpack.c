@@ -0,0 +1,658 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: hpack.c
+ * Description: HTTP/2 header compression (RFC 7541).
+ *
+ * Created by: Daan Pape
+ * Created on: June 9, 2014
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+/* Number of entries in the static table */
+#define HPACK_STATIC_ENTRIES	61
+
+/* The Huffman code of the end of string symbol */
+#define HPACK_HUFF_EOS			256
+
+static const uint32_t hpack_huff_codes[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+	0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+	0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+	0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+	0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+	0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+	0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+	0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+	0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+	0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+	0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+	0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+	0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+	0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+	0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+	0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+	0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+	0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+	0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+	0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+	0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+	0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+	0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+	0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+	0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+	0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+	0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+	0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+	0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+	0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+	0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+	0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+
+static const uint8_t hpack_huff_lens[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+static const char * const hpack_static[][2] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+/* Decoding tree built from the Huffman codes */
+static struct {
+	int16_t next[2];
+	int16_t sym;
+} hpack_huff_tree[2 * 257];
+static int hpack_huff_nodes;
+
+/**
+ * Build the Huffman decoding tree
+ */
+static void hpack_huff_init(void)
+{
+	int i, bit, node;
+
+	hpack_huff_nodes = 1;
+	hpack_huff_tree[0].sym = -1;
+
+	for (i = 0; i < 257; i++) {
+		node = 0;
+		for (bit = hpack_huff_lens[i] - 1; bit >= 0; bit--) {
+			int b = (hpack_huff_codes[i] >> bit) & 1;
+
+			if (!hpack_huff_tree[node].next[b]) {
+				hpack_huff_tree[hpack_huff_nodes].sym = -1;
+				hpack_huff_tree[node].next[b] = hpack_huff_nodes++;
+			}
+			node = hpack_huff_tree[node].next[b];
+		}
+		hpack_huff_tree[node].sym = i;
+	}
+}
+
+/**
+ * Decode a Huffman encoded string
+ * @src the encoded string
+ * @len the length of the encoded string
+ * @out the output buffer
+ * @size the size of the output buffer
+ * @return the decoded length or -1 when the string is invalid
+ */
+static int hpack_huff_decode(const uint8_t *src, int len, char *out, int size)
+{
+	int node = 0, depth = 0, olen = 0;
+	bool ones = true;
+	int i, bit;
+
+	if (!hpack_huff_nodes)
+		hpack_huff_init();
+
+	for (i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			int b = (src[i] >> bit) & 1;
+
+			node = hpack_huff_tree[node].next[b];
+			if (!node)
+				return -1;
+
+			depth++;
+			ones = ones && b;
+
+			if (hpack_huff_tree[node].sym < 0)
+				continue;
+
+			if (hpack_huff_tree[node].sym == HPACK_HUFF_EOS || olen == size)
+				return -1;
+
+			out[olen++] = hpack_huff_tree[node].sym;
+			node = 0;
+			depth = 0;
+			ones = true;
+		}
+	}
+
+	/* Padding is the most significant bits of the EOS code */
+	if (depth > 7 || !ones)
+		return -1;
+
+	return olen;
+}
+
+/**
+ * Get the length of a string after Huffman encoding
+ * @str the string to encode
+ * @len the length of the string
+ */
+static int hpack_huff_len(const char *str, int len)
+{
+	int bits = 0;
+
+	while (len--)
+		bits += hpack_huff_lens[(uint8_t) *str++];
+
+	return (bits + 7) / 8;
+}
+
+/**
+ * Huffman encode a string
+ * @out the output buffer, large enough for the encoded string
+ * @str the string to encode
+ * @len the length of the string
+ */
+static void hpack_huff_encode(uint8_t *out, const char *str, int len)
+{
+	uint64_t acc = 0;
+	int bits = 0;
+
+	while (len--) {
+		uint8_t c = *str++;
+
+		acc = (acc << hpack_huff_lens[c]) | hpack_huff_codes[c];
+		bits += hpack_huff_lens[c];
+
+		while (bits >= 8) {
+			bits -= 8;
+			*out++ = acc >> bits;
+		}
+	}
+
+	if (bits)
+		*out = (acc << (8 - bits)) | (0xff >> bits);
+}
+
+/**
+ * Get the size of a table entry as defined by RFC 7541
+ * @entry the entry
+ */
+static int hpack_entry_size(const char *entry)
+{
+	int nlen = strlen(entry);
+
+	return nlen + strlen(entry + nlen + 1) + 32;
+}
+
+/**
+ * Remove the oldest entry from a table
+ * @t the table
+ */
+static void hpack_table_evict(struct hpack_table *t)
+{
+	int idx = (t->head - t->count + 1 + HPACK_TABLE_ENTRIES) % HPACK_TABLE_ENTRIES;
+
+	t->size -= hpack_entry_size(t->entries[idx]);
+	free(t->entries[idx]);
+	t->entries[idx] = NULL;
+	t->count--;
+}
+
+/**
+ * Set the maximum size of a table, evicting entries that no longer fit
+ * @t the table
+ * @max_size the new maximum size
+ */
+static void hpack_table_resize(struct hpack_table *t, int max_size)
+{
+	t->max_size = max_size;
+	while (t->count && t->size > t->max_size)
+		hpack_table_evict(t);
+}
+
+/**
+ * Add an entry to a table
+ * @t the table
+ * @name the header name
+ * @value the header value
+ */
+static void hpack_table_add(struct hpack_table *t, const char *name, const char *value)
+{
+	int nlen = strlen(name), vlen = strlen(value);
+	int size = nlen + vlen + 32;
+	char *entry;
+
+	while (t->count && t->size + size > t->max_size)
+		hpack_table_evict(t);
+
+	/* Entries larger than the table just empty it */
+	if (size > t->max_size)
+		return;
+
+	entry = malloc(nlen + vlen + 2);
+	if (!entry)
+		return;
+
+	memcpy(entry, name, nlen + 1);
+	memcpy(entry + nlen + 1, value, vlen + 1);
+
+	t->head = (t->head + 1) % HPACK_TABLE_ENTRIES;
+	t->entries[t->head] = entry;
+	t->count++;
+	t->size += size;
+}
+
+/**
+ * Look up a header field by index
+ * @t the table
+ * @index the index in the combined static and dynamic table
+ * @name set to the header name
+ * @value set to the header value
+ * @return false when the index does not exist
+ */
+static bool hpack_table_get(struct hpack_table *t, uint32_t index, const char **name, const char **value)
+{
+	char *entry;
+
+	if (!index)
+		return false;
+
+	if (index <= HPACK_STATIC_ENTRIES) {
+		*name = hpack_static[index - 1][0];
+		*value = hpack_static[index - 1][1];
+		return true;
+	}
+
+	index -= HPACK_STATIC_ENTRIES;
+	if (index > t->count)
+		return false;
+
+	entry = t->entries[(t->head - index + 1 + HPACK_TABLE_ENTRIES) % HPACK_TABLE_ENTRIES];
+	*name = entry;
+	*value = entry + strlen(entry) + 1;
+	return true;
+}
+
+/**
+ * Find a header field in a table
+ * @t the table
+ * @name the header name
+ * @value the header value
+ * @name_index set to the index of an entry with the same name, or 0
+ * @return the index of an exact match or 0
+ */
+static int hpack_table_find(struct hpack_table *t, const char *name, const char *value, int *name_index)
+{
+	const char *n, *v;
+	int i;
+
+	*name_index = 0;
+
+	for (i = 1; i <= HPACK_STATIC_ENTRIES + t->count; i++) {
+		hpack_table_get(t, i, &n, &v);
+		if (strcmp(n, name))
+			continue;
+
+		if (!strcmp(v, value))
+			return i;
+
+		if (!*name_index)
+			*name_index = i;
+	}
+
+	return 0;
+}
+
+void hpack_table_init(struct hpack_table *t, int max_size)
+{
+	memset(t, 0, sizeof(*t));
+	t->max_size = max_size;
+	t->limit = max_size;
+}
+
+void hpack_table_free(struct hpack_table *t)
+{
+	while (t->count)
+		hpack_table_evict(t);
+}
+
+void hpack_table_limit(struct hpack_table *t, int limit)
+{
+	int max_size = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+
+	t->limit = limit;
+	if (max_size == t->max_size)
+		return;
+
+	hpack_table_resize(t, max_size);
+	t->resize = true;
+}
+
+/**
+ * Decode a prefixed integer
+ * @p the read position, advanced past the integer
+ * @end the end of the data
+ * @prefix the number of bits in the prefix
+ * @val set to the integer
+ * @return false when the integer is truncated or too large
+ */
+static bool hpack_decode_int(const uint8_t **p, const uint8_t *end, int prefix, uint32_t *val)
+{
+	uint32_t max = (1 << prefix) - 1;
+	uint32_t v = **p & max;
+	int shift = 0;
+	uint8_t b;
+
+	(*p)++;
+	if (v < max) {
+		*val = v;
+		return true;
+	}
+
+	do {
+		if (*p == end || shift > 21)
+			return false;
+
+		b = *(*p)++;
+		v += (uint32_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	*val = v;
+	return true;
+}
+
+/**
+ * Decode a string literal
+ * @p the read position, advanced past the string
+ * @end the end of the data
+ * @out the output buffer, the string is NUL terminated
+ * @size the size of the output buffer
+ * @return false when the string is invalid or too long
+ */
+static bool hpack_decode_string(const uint8_t **p, const uint8_t *end, char *out, int size)
+{
+	bool huffman;
+	uint32_t len;
+	int olen;
+
+	if (*p == end)
+		return false;
+
+	huffman = **p & 0x80;
+	if (!hpack_decode_int(p, end, 7, &len) || len > end - *p)
+		return false;
+
+	if (huffman) {
+		olen = hpack_huff_decode(*p, len, out, size - 1);
+		if (olen < 0)
+			return false;
+	} else {
+		if (len >= size)
+			return false;
+		memcpy(out, *p, len);
+		olen = len;
+	}
+
+	out[olen] = 0;
+	*p += len;
+	return true;
+}
+
+bool hpack_decode(struct hpack_table *t, const uint8_t *data, int len, hpack_header_cb cb, void *priv)
+{
+	static char name[HPACK_MAX_STRING], value[HPACK_MAX_STRING];
+	const uint8_t *p = data, *end = data + len;
+	const char *n, *v;
+	uint32_t index;
+	bool add;
+
+	while (p < end) {
+		/* Indexed header field */
+		if (*p & 0x80) {
+			if (!hpack_decode_int(&p, end, 7, &index) ||
+			    !hpack_table_get(t, index, &n, &v))
+				return false;
+
+			cb(priv, n, v);
+			continue;
+		}
+
+		/* Dynamic table size update */
+		if ((*p & 0xe0) == 0x20) {
+			if (!hpack_decode_int(&p, end, 5, &index) || index > t->limit)
+				return false;
+
+			hpack_table_resize(t, index);
+			continue;
+		}
+
+		/* Literal header field, with or without indexing */
+		add = *p & 0x40;
+		if (!hpack_decode_int(&p, end, add ? 6 : 4, &index))
+			return false;
+
+		if (index) {
+			if (!hpack_table_get(t, index, &n, &v) || strlen(n) >= sizeof(name))
+				return false;
+			strcpy(name, n);
+		} else if (!hpack_decode_string(&p, end, name, sizeof(name))) {
+			return false;
+		}
+
+		if (!hpack_decode_string(&p, end, value, sizeof(value)))
+			return false;
+
+		if (add)
+			hpack_table_add(t, name, value);
+
+		cb(priv, name, value);
+	}
+
+	return true;
+}
+
+/**
+ * Encode a prefixed integer
+ * @buf the output buffer
+ * @size the size of the output buffer
+ * @prefix the number of bits in the prefix
+ * @flags the representation bits above the prefix
+ * @val the integer
+ * @return the number of bytes written or -1 when the buffer is too small
+ */
+static int hpack_encode_int(uint8_t *buf, int size, int prefix, uint8_t flags, uint32_t val)
+{
+	uint32_t max = (1 << prefix) - 1;
+	int len = 1;
+
+	if (size < 1)
+		return -1;
+
+	if (val < max) {
+		buf[0] = flags | val;
+		return 1;
+	}
+
+	buf[0] = flags | max;
+	val -= max;
+	while (val >= 0x80) {
+		if (len == size)
+			return -1;
+		buf[len++] = 0x80 | (val & 0x7f);
+		val >>= 7;
+	}
+
+	if (len == size)
+		return -1;
+	buf[len++] = val;
+
+	return len;
+}
+
+/**
+ * Encode a string literal, Huffman encoded when that is shorter
+ * @buf the output buffer
+ * @size the size of the output buffer
+ * @str the string
+ * @return the number of bytes written or -1 when the buffer is too small
+ */
+static int hpack_encode_string(uint8_t *buf, int size, const char *str)
+{
+	int len = strlen(str);
+	int hlen = hpack_huff_len(str, len);
+	bool huffman = hlen < len;
+	int n;
+
+	n = hpack_encode_int(buf, size, 7, huffman ? 0x80 : 0, huffman ? hlen : len);
+	if (n < 0 || size - n < (huffman ? hlen : len))
+		return -1;
+
+	if (huffman)
+		hpack_huff_encode(buf + n, str, len);
+	else
+		memcpy(buf + n, str, len);
+
+	return n + (huffman ? hlen : len);
+}
+
+int hpack_encode_begin(struct hpack_table *t, uint8_t *buf, int size)
+{
+	if (!t->resize)
+		return 0;
+
+	t->resize = false;
+	return hpack_encode_int(buf, size, 5, 0x20, t->max_size);
+}
+
+int hpack_encode(struct hpack_table *t, uint8_t *buf, int size,
+		 const char *name, const char *value, bool index)
+{
+	int name_index, match, len, n;
+
+	match = hpack_table_find(t, name, value, &name_index);
+	if (match)
+		return hpack_encode_int(buf, size, 7, 0x80, match);
+
+	index = index && strlen(name) + strlen(value) + 32 <= t->max_size;
+	len = hpack_encode_int(buf, size, index ? 6 : 4, index ? 0x40 : 0, name_index);
+	if (len < 0)
+		return -1;
+
+	if (!name_index) {
+		n = hpack_encode_string(buf + len, size - len, name);
+		if (n < 0)
+			return -1;
+		len += n;
+	}
+
+	n = hpack_encode_string(buf + len, size - len, value);
+	if (n < 0)
+		return -1;
+	len += n;
+
+	if (index)
+		hpack_table_add(t, name, value);
+
+	return len;
+}
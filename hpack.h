@@ -0,0 +1,100 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: hpack.h
+ * Description: HTTP/2 header compression (RFC 7541).
+ *
+ * Created by: Daan Pape
+ * Created on: June 9, 2014
+ */
+
+#ifndef HPACK_H_
+#define HPACK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/* Every table entry takes at least 32 bytes of the table size */
+#define HPACK_TABLE_ENTRIES		(HPACK_TABLE_SIZE / 32)
+
+/**
+ * A dynamic header table, entries are stored as "name\0value"
+ */
+struct hpack_table {
+	char *entries[HPACK_TABLE_ENTRIES];	/* Ring of entries, newest at head */
+	int head;
+	int count;
+	int size;							/* The current size as defined by RFC 7541 */
+	int max_size;						/* The maximum size in use */
+	int limit;							/* The maximum size allowed by the peer */
+	bool resize;						/* A size update must be sent */
+};
+
+/**
+ * Called for every decoded header field
+ * @priv the private pointer given to hpack_decode
+ * @name the header name, NUL terminated
+ * @value the header value, NUL terminated
+ */
+typedef void (*hpack_header_cb)(void *priv, const char *name, const char *value);
+
+/**
+ * Initialise a dynamic header table
+ * @t the table to initialise
+ * @max_size the maximum table size
+ */
+void hpack_table_init(struct hpack_table *t, int max_size);
+
+/**
+ * Free all entries of a dynamic header table
+ * @t the table to free
+ */
+void hpack_table_free(struct hpack_table *t);
+
+/**
+ * Change the maximum size of an encoder table, the change is announced
+ * at the start of the next header block.
+ * @t the encoder table
+ * @limit the maximum size the peer allows
+ */
+void hpack_table_limit(struct hpack_table *t, int limit);
+
+/**
+ * Decode a header block
+ * @t the decoder table
+ * @data the header block
+ * @len the length of the header block
+ * @cb the function called for every header field
+ * @priv private pointer passed to the callback
+ * @return false when the block is malformed, the connection can not be
+ * used anymore in that case
+ */
+bool hpack_decode(struct hpack_table *t, const uint8_t *data, int len, hpack_header_cb cb, void *priv);
+
+/**
+ * Start encoding a header block
+ * @t the encoder table
+ * @buf the output buffer
+ * @size the size of the output buffer
+ * @return the number of bytes written or -1 when the buffer is too small
+ */
+int hpack_encode_begin(struct hpack_table *t, uint8_t *buf, int size);
+
+/**
+ * Encode a header field
+ * @t the encoder table
+ * @buf the output buffer
+ * @size the size of the output buffer
+ * @name the lower case header name
+ * @value the header value
+ * @index false for values that are unlikely to be repeated
+ * @return the number of bytes written or -1 when the buffer is too small
+ */
+int hpack_encode(struct hpack_table *t, uint8_t *buf, int size,
+		 const char *name, const char *value, bool index);
+
+#endif /* HPACK_H_ */
@@ -0,0 +1,1496 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: http2.c
+ * Description: HTTP/2 framing layer (RFC 7540). Every stream runs its
+ * request on a virtual client whose stream converts the HTTP/1.1
+ * response written by the normal handlers into HEADERS and DATA frames.
+ *
+ * Created by: Daan Pape
+ * Created on: June 9, 2014
+ */
+
+#include <libubox/blobmsg.h>
+#include <ctype.h>
+
+#include "uhttpd.h"
+#include "config.h"
+#include "client.h"
+#include "hpack.h"
+#include "http2.h"
+#include "budget.h"
+
+#define H2_PREFACE			"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN		24
+#define H2_FRAME_HEADER		9
+#define H2_DEFAULT_WINDOW	65535
+#define H2_DEFAULT_FRAME	16384
+#define H2_MAX_WINDOW		0x7fffffff
+#define H2_MAX_HEAD_LINES	32
+
+enum h2_frame_type {
+	H2_DATA				= 0x0,
+	H2_HEADERS			= 0x1,
+	H2_PRIORITY			= 0x2,
+	H2_RST_STREAM		= 0x3,
+	H2_SETTINGS			= 0x4,
+	H2_PUSH_PROMISE		= 0x5,
+	H2_PING				= 0x6,
+	H2_GOAWAY			= 0x7,
+	H2_WINDOW_UPDATE	= 0x8,
+	H2_CONTINUATION		= 0x9,
+};
+
+enum h2_frame_flags {
+	H2_FLAG_END_STREAM	= 0x01,
+	H2_FLAG_ACK			= 0x01,
+	H2_FLAG_END_HEADERS	= 0x04,
+	H2_FLAG_PADDED		= 0x08,
+	H2_FLAG_PRIORITY	= 0x20,
+};
+
+enum h2_setting {
+	H2_SET_HEADER_TABLE_SIZE		= 0x1,
+	H2_SET_ENABLE_PUSH				= 0x2,
+	H2_SET_MAX_CONCURRENT_STREAMS	= 0x3,
+	H2_SET_INITIAL_WINDOW_SIZE		= 0x4,
+	H2_SET_MAX_FRAME_SIZE			= 0x5,
+	H2_SET_MAX_HEADER_LIST_SIZE		= 0x6,
+};
+
+enum h2_error {
+	H2_NO_ERROR				= 0x0,
+	H2_PROTOCOL_ERROR		= 0x1,
+	H2_INTERNAL_ERROR		= 0x2,
+	H2_FLOW_CONTROL_ERROR	= 0x3,
+	H2_STREAM_CLOSED		= 0x5,
+	H2_FRAME_SIZE_ERROR		= 0x6,
+	H2_REFUSED_STREAM		= 0x7,
+	H2_COMPRESSION_ERROR	= 0x9,
+	H2_ENHANCE_YOUR_CALM	= 0xb,
+};
+
+/* Progress of the HTTP/1.1 response written to a stream */
+enum h2_response {
+	H2_RESP_HEAD,
+	H2_RESP_BODY,
+	H2_RESP_DONE,
+};
+
+/* Progress of a chunked response body */
+enum h2_chunk {
+	H2_CHUNK_SIZE,
+	H2_CHUNK_EXT,
+	H2_CHUNK_DATA,
+	H2_CHUNK_CRLF,
+};
+
+/**
+ * HTTP/2 state of a connection
+ */
+struct h2_conn {
+	struct client *cl;				/* The connection */
+	struct list_head streams;		/* The open streams */
+	int n_streams;
+	uint32_t last_stream;			/* Highest stream id opened by the client */
+
+	int32_t send_window;			/* Connection flow control window */
+	int32_t initial_window;			/* Initial stream window set by the client */
+	uint32_t max_frame;				/* Largest frame the client accepts */
+
+	struct hpack_table dec;			/* Request header decoder */
+	struct hpack_table enc;			/* Response header encoder */
+
+	bool preface;					/* The preface has not been received yet */
+	bool settings;					/* The first SETTINGS frame was received */
+	bool goaway;					/* No new frames are processed */
+
+	uint8_t *rbuf;					/* Received frames not processed yet */
+	int rlen;
+
+	uint8_t *hblock;				/* Header block waiting for CONTINUATION frames */
+	int hlen;
+	uint32_t hstream;
+	uint8_t hflags;
+};
+
+/**
+ * A single HTTP/2 stream
+ */
+struct h2_stream {
+	struct list_head list;
+	struct h2_conn *conn;
+	uint32_t id;
+	int32_t send_window;			/* Stream flow control window */
+
+	struct client cl;				/* Virtual client running the request */
+	struct ustream us;				/* Receives the response of the virtual client */
+
+	/* Request */
+	char *path;
+	char *authority;
+	int method;
+	bool regular;					/* A regular header field was decoded */
+	bool url_added;
+	bool malformed;
+	char *body;
+	int body_len;
+	bool too_large;
+	bool end_recv;
+
+	/* Response */
+	enum h2_response resp;
+	char *head;
+	int head_len;
+	bool chunked;
+	enum h2_chunk chunk;
+	int chunk_left;
+	int64_t left;					/* Body bytes left, -1 when unknown */
+	bool end_sent;
+};
+
+/* Methods a request can use */
+static const int h2_methods[] = {
+	UH_HTTP_MSG_GET,
+	UH_HTTP_MSG_POST,
+	UH_HTTP_MSG_HEAD,
+	UH_HTTP_MSG_PUT,
+};
+
+static uint32_t h2_get32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void h2_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+/**
+ * Write a frame to the connection
+ * @conn the connection
+ * @type the frame type
+ * @flags the frame flags
+ * @id the stream id
+ * @data the payload
+ * @len the payload length
+ */
+static void h2_frame(struct h2_conn *conn, int type, int flags, uint32_t id, const void *data, int len)
+{
+	uint8_t hdr[H2_FRAME_HEADER];
+
+	hdr[0] = len >> 16;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+	hdr[3] = type;
+	hdr[4] = flags;
+	h2_put32(hdr + 5, id & 0x7fffffff);
+
+	ustream_write(conn->cl->us, (char *) hdr, sizeof(hdr), !!len);
+	if (len)
+		ustream_write(conn->cl->us, data, len, false);
+
+	budget_account(conn->cl);
+}
+
+/**
+ * Close the connection because of a connection error
+ * @conn the connection
+ * @error the error code
+ */
+static void h2_goaway(struct h2_conn *conn, int error)
+{
+	uint8_t payload[8];
+
+	if (conn->goaway)
+		return;
+
+	h2_put32(payload, conn->last_stream);
+	h2_put32(payload + 4, error);
+	h2_frame(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+
+	conn->goaway = true;
+	close_connection(conn->cl);
+}
+
+/**
+ * Reset a stream
+ * @conn the connection
+ * @id the stream id
+ * @error the error code
+ */
+static void h2_rst(struct h2_conn *conn, uint32_t id, int error)
+{
+	uint8_t payload[4];
+
+	h2_put32(payload, error);
+	h2_frame(conn, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Open up a receive window
+ * @conn the connection
+ * @id the stream id, 0 for the connection window
+ * @inc the window increment
+ */
+static void h2_window_update(struct h2_conn *conn, uint32_t id, uint32_t inc)
+{
+	uint8_t payload[4];
+
+	h2_put32(payload, inc);
+	h2_frame(conn, H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Send the server settings
+ * @conn the connection
+ */
+static void h2_settings_send(struct h2_conn *conn)
+{
+	static const struct {
+		uint16_t id;
+		uint32_t val;
+	} settings[] = {
+		{ H2_SET_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS },
+		{ H2_SET_MAX_FRAME_SIZE, H2_FRAME_SIZE },
+		{ H2_SET_HEADER_TABLE_SIZE, HPACK_TABLE_SIZE },
+		{ H2_SET_MAX_HEADER_LIST_SIZE, H2_MAX_HEADER_BLOCK },
+	};
+	uint8_t payload[6 * ARRAY_SIZE(settings)];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(settings); i++) {
+		payload[6 * i] = settings[i].id >> 8;
+		payload[6 * i + 1] = settings[i].id;
+		h2_put32(payload + 6 * i + 2, settings[i].val);
+	}
+
+	h2_frame(conn, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+/**
+ * Find an open stream
+ * @conn the connection
+ * @id the stream id
+ */
+static struct h2_stream *h2_stream_find(struct h2_conn *conn, uint32_t id)
+{
+	struct h2_stream *st;
+
+	list_for_each_entry(st, &conn->streams, list)
+		if (st->id == id)
+			return st;
+
+	return NULL;
+}
+
+/**
+ * Free a stream and the virtual client running its request
+ * @st the stream to free
+ */
+static void h2_stream_free(struct h2_stream *st)
+{
+	struct h2_conn *conn = st->conn;
+	struct client *cl = &st->cl;
+
+	list_del(&st->list);
+	conn->n_streams--;
+
+	dispatch_done(cl);
+	uloop_timeout_cancel(&cl->timeout);
+	ustream_free(&st->us);
+	blob_buf_free(&cl->hdr);
+
+	free(st->path);
+	free(st->authority);
+	free(st->body);
+	free(st->head);
+	free(st);
+	budget_account(conn->cl);
+
+	/* The client said goodbye, close when all its streams are done */
+	if (conn->goaway && list_empty(&conn->streams))
+		close_connection(conn->cl);
+}
+
+/**
+ * Get the number of body bytes a stream may send right now
+ * @st the stream
+ */
+static int h2_stream_window(struct h2_stream *st)
+{
+	struct h2_conn *conn = st->conn;
+	int32_t win = min(st->send_window, conn->send_window);
+
+	/* Leave the remaining output in the stream buffers */
+	if (conn->cl->us->w.data_bytes >= H2_HIGH_WATER)
+		return 0;
+
+	return win > 0 ? win : 0;
+}
+
+/**
+ * Send response body data, the caller checks the flow control windows
+ * @st the stream
+ * @data the body data
+ * @len the length of the data
+ * @end true to end the stream after the data
+ */
+static void h2_send_data(struct h2_stream *st, const char *data, int len, bool end)
+{
+	struct h2_conn *conn = st->conn;
+	int n;
+
+	do {
+		n = min(len, conn->max_frame);
+		h2_frame(conn, H2_DATA, (end && n == len) ? H2_FLAG_END_STREAM : 0, st->id, data, n);
+
+		st->send_window -= n;
+		conn->send_window -= n;
+		data += n;
+		len -= n;
+	} while (len > 0);
+
+	if (end) {
+		st->end_sent = true;
+		st->resp = H2_RESP_DONE;
+	}
+}
+
+/**
+ * Send an encoded header block, split over CONTINUATION frames when
+ * it does not fit in a single frame
+ * @st the stream
+ * @block the header block
+ * @len the length of the block
+ * @end true when the response has no body
+ */
+static void h2_send_headers(struct h2_stream *st, const uint8_t *block, int len, bool end)
+{
+	struct h2_conn *conn = st->conn;
+	int type = H2_HEADERS;
+	int flags = end ? H2_FLAG_END_STREAM : 0;
+	int n;
+
+	do {
+		n = min(len, conn->max_frame);
+		if (n == len)
+			flags |= H2_FLAG_END_HEADERS;
+
+		h2_frame(conn, type, flags, st->id, block, n);
+
+		type = H2_CONTINUATION;
+		flags = 0;
+		block += n;
+		len -= n;
+	} while (len > 0);
+
+	if (end) {
+		st->end_sent = true;
+		st->resp = H2_RESP_DONE;
+	}
+}
+
+/**
+ * Convert the HTTP/1.1 response head written by the virtual client into
+ * a HEADERS frame
+ * @st the stream
+ */
+static void h2_response_head(struct h2_stream *st)
+{
+	static uint8_t block[H2_MAX_HEADER_BLOCK];
+	struct hpack_table *enc = &st->conn->enc;
+	char *names[H2_MAX_HEAD_LINES], *values[H2_MAX_HEAD_LINES];
+	char *line, *next, *val, *c;
+	char status[4];
+	int n_lines = 0;
+	int len, n, i;
+	bool end;
+
+	/* Status line */
+	next = strstr(st->head, "\r\n");
+	*next = 0;
+	line = strchr(st->head, ' ');
+	n = line ? atoi(line + 1) : 0;
+	if (n < 100 || n > 999)
+		n = 500;
+	snprintf(status, sizeof(status), "%03d", n);
+
+	end = st->cl.request.method == UH_HTTP_MSG_HEAD || n == 204 || n == 304;
+
+	/* Header lines */
+	for (line = next + 2; *line && n_lines < H2_MAX_HEAD_LINES; line = next + 2) {
+		next = strstr(line, "\r\n");
+		*next = 0;
+
+		val = strchr(line, ':');
+		if (!val)
+			continue;
+
+		*val++ = 0;
+		while (*val == ' ')
+			val++;
+
+		for (c = line; *c; c++)
+			*c = tolower(*c);
+
+		/* Connection specific fields do not exist in HTTP/2 */
+		if (!strcmp(line, "transfer-encoding")) {
+			st->chunked = !strcasecmp(val, "chunked");
+			continue;
+		}
+
+		if (!strcmp(line, "connection") || !strcmp(line, "keep-alive") ||
+		    !strcmp(line, "upgrade") || !strcmp(line, "proxy-connection"))
+			continue;
+
+		names[n_lines] = line;
+		values[n_lines++] = val;
+	}
+
+	st->left = -1;
+
+	len = hpack_encode_begin(enc, block, sizeof(block));
+	n = hpack_encode(enc, block + len, sizeof(block) - len, ":status", status, true);
+
+	for (i = 0; n >= 0 && i < n_lines; i++) {
+		len += n;
+
+		if (!strcmp(names[i], "content-length")) {
+			if (st->chunked) {
+				n = 0;
+				continue;
+			}
+			st->left = strtoll(values[i], NULL, 10);
+		}
+
+		/* Values that change with every response are not worth indexing */
+		n = hpack_encode(enc, block + len, sizeof(block) - len, names[i], values[i],
+				 strcmp(names[i], "date") && strcmp(names[i], "content-length") &&
+				 strcmp(names[i], "etag") && strcmp(names[i], "last-modified"));
+	}
+
+	/*
+	 * The fields encoded so far are in the encoder table already, the
+	 * peer would never see them and the compression state of the
+	 * connection is lost
+	 */
+	if (len < 0 || n < 0) {
+		h2_goaway(st->conn, H2_COMPRESSION_ERROR);
+		st->end_sent = true;
+		st->resp = H2_RESP_DONE;
+		return;
+	}
+
+	h2_send_headers(st, block, len + n, end || !st->left);
+	if (st->resp != H2_RESP_DONE)
+		st->resp = H2_RESP_BODY;
+
+	free(st->head);
+	st->head = NULL;
+}
+
+/**
+ * Send body data of an identity encoded response
+ * @st the stream
+ * @buf the data
+ * @len the length of the data
+ * @return the number of bytes consumed
+ */
+static int h2_response_body(struct h2_stream *st, const char *buf, int len)
+{
+	int n = min(len, h2_stream_window(st));
+
+	if (st->left >= 0 && n > st->left)
+		n = st->left;
+
+	if (!n)
+		return 0;
+
+	if (st->left >= 0)
+		st->left -= n;
+
+	h2_send_data(st, buf, n, !st->left);
+	return n;
+}
+
+/**
+ * Send body data of a chunked response, the chunk framing is removed
+ * @st the stream
+ * @buf the data
+ * @len the length of the data
+ * @return the number of bytes consumed
+ */
+static int h2_response_chunked(struct h2_stream *st, const char *buf, int len)
+{
+	int done = 0, n;
+	char c;
+
+	while (done < len && st->resp == H2_RESP_BODY) {
+		switch (st->chunk) {
+		case H2_CHUNK_SIZE:
+		case H2_CHUNK_EXT:
+			c = buf[done++];
+			if (c == '\n') {
+				if (!st->chunk_left) {
+					/* The last chunk ends the stream */
+					h2_send_data(st, NULL, 0, true);
+					break;
+				}
+				st->chunk = H2_CHUNK_DATA;
+			} else if (st->chunk == H2_CHUNK_SIZE && isxdigit(c)) {
+				st->chunk_left = st->chunk_left * 16 +
+					(isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+			} else {
+				st->chunk = H2_CHUNK_EXT;
+			}
+			break;
+
+		case H2_CHUNK_DATA:
+			n = min(min(len - done, st->chunk_left), h2_stream_window(st));
+			if (!n)
+				return done;
+
+			h2_send_data(st, buf + done, n, false);
+			st->chunk_left -= n;
+			done += n;
+
+			if (!st->chunk_left)
+				st->chunk = H2_CHUNK_CRLF;
+			break;
+
+		case H2_CHUNK_CRLF:
+			if (buf[done++] == '\n')
+				st->chunk = H2_CHUNK_SIZE;
+			break;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * Write handler of the virtual client stream, converts the response into
+ * frames. Returns less than len when flow control or the connection
+ * buffer stops the stream, ustream keeps the rest buffered which in turn
+ * makes the request handler wait.
+ */
+static int h2_stream_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct h2_stream *st = container_of(s, struct h2_stream, us);
+	int done = 0, n;
+
+	while (done < len) {
+		switch (st->resp) {
+		case H2_RESP_HEAD:
+			if (!st->head)
+				st->head = malloc(WORKING_BUFF_SIZE);
+
+			if (!st->head || st->head_len == WORKING_BUFF_SIZE - 1) {
+				h2_rst(st->conn, st->id, H2_INTERNAL_ERROR);
+				st->end_sent = true;
+				st->resp = H2_RESP_DONE;
+				break;
+			}
+
+			st->head[st->head_len++] = buf[done++];
+			if (st->head_len >= 4 && !memcmp(st->head + st->head_len - 4, "\r\n\r\n", 4)) {
+				st->head[st->head_len] = 0;
+				h2_response_head(st);
+			}
+			break;
+
+		case H2_RESP_BODY:
+			if (st->chunked)
+				n = h2_response_chunked(st, buf + done, len - done);
+			else
+				n = h2_response_body(st, buf + done, len - done);
+
+			if (!n)
+				return done;
+			done += n;
+			break;
+
+		case H2_RESP_DONE:
+			return len;
+		}
+	}
+
+	return len;
+}
+
+/**
+ * Let the request handler of a stream write more data
+ */
+static void h2_stream_notify_write(struct ustream *s, int bytes)
+{
+	struct h2_stream *st = container_of(s, struct h2_stream, us);
+
+	if (st->cl.dispatch.write_cb)
+		st->cl.dispatch.write_cb(&st->cl);
+}
+
+/**
+ * Called when the request handler closed the virtual client, ends the
+ * stream once all buffered output is sent.
+ */
+static void h2_stream_notify_state(struct ustream *s)
+{
+	struct h2_stream *st = container_of(s, struct h2_stream, us);
+	static const uint8_t error[] = { 0x8e };	/* :status 500 */
+
+	if (!s->eof && !s->write_error)
+		return;
+
+	if (s->w.data_bytes && !s->write_error)
+		return;
+
+	if (st->resp == H2_RESP_HEAD)
+		h2_send_headers(st, error, sizeof(error), true);
+	else if (!st->end_sent)
+		h2_send_data(st, NULL, 0, true);
+
+	/* The response is complete, the rest of the request is not needed */
+	if (!st->end_recv)
+		h2_rst(st->conn, st->id, H2_NO_ERROR);
+
+	h2_stream_free(st);
+}
+
+/**
+ * Give streams waiting for flow control or the connection buffer a
+ * chance to send
+ * @conn the connection
+ */
+static void h2_resume(struct h2_conn *conn)
+{
+	struct h2_stream *st, *tmp;
+
+	list_for_each_entry_safe(st, tmp, &conn->streams, list) {
+		if (conn->cl->us->w.data_bytes >= H2_HIGH_WATER)
+			break;
+
+		if (st->us.w.data_bytes) {
+			ustream_write_pending(&st->us);
+		} else if (st->cl.mem_wait) {
+			/* The handler stopped because memory was short */
+			st->cl.mem_wait = false;
+			if (st->cl.dispatch.write_cb)
+				st->cl.dispatch.write_cb(&st->cl);
+		}
+	}
+
+	/* Rotate the streams so no single stream can starve the others */
+	if (!list_empty(&conn->streams))
+		list_move_tail(conn->streams.next, &conn->streams);
+}
+
+/**
+ * Create a stream for a new request
+ * @conn the connection
+ * @id the stream id
+ */
+static struct h2_stream *h2_stream_new(struct h2_conn *conn, uint32_t id)
+{
+	struct client *parent = conn->cl;
+	struct h2_stream *st;
+	struct client *cl;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+
+	st->conn = conn;
+	st->id = id;
+	st->send_window = conn->initial_window;
+	st->method = UH_HTTP_MSG_GET;
+
+	st->us.write = h2_stream_write;
+	st->us.notify_write = h2_stream_notify_write;
+	st->us.notify_state = h2_stream_notify_state;
+	ustream_init_defaults(&st->us);
+
+	cl = &st->cl;
+	cl->us = &st->us;
+	cl->h2_stream = st;
+	cl->id = parent->id;
+	cl->tls = parent->tls;
+	cl->peer_addr = parent->peer_addr;
+	cl->srv_addr = parent->srv_addr;
+	cl->state = CLIENT_STATE_HEADER;
+	cl->request.version = UH_HTTP_VER_1_1;
+	cl->request.connection_close = true;
+	blob_buf_init(&cl->hdr, 0);
+
+	/* The stream starts with its first header block */
+	trace_start(cl);
+	trace_mark(cl, TRACE_FIRST_BYTE);
+
+	list_add_tail(&st->list, &conn->streams);
+	conn->n_streams++;
+
+	return st;
+}
+
+/**
+ * Add the request URL to the virtual client headers, it has to be the
+ * first header attribute.
+ * @st the stream
+ */
+static void h2_stream_url(struct h2_stream *st)
+{
+	if (st->url_added)
+		return;
+
+	blobmsg_add_string(&st->cl.hdr, "URL", st->path ? st->path : "");
+	if (st->authority)
+		blobmsg_add_string(&st->cl.hdr, "host", st->authority);
+
+	st->url_added = true;
+}
+
+/**
+ * Header decoding callback, stores the header fields of a request
+ */
+static void h2_header_cb(void *priv, const char *name, const char *value)
+{
+	struct h2_stream *st = priv;
+	int i;
+
+	if (name[0] == ':') {
+		/* Pseudo header fields come before all regular ones */
+		if (st->regular) {
+			st->malformed = true;
+		} else if (!strcmp(name, ":method")) {
+			st->method = -1;
+			for (i = 0; i < ARRAY_SIZE(h2_methods); i++)
+				if (!strcmp(http_methods[h2_methods[i]], value))
+					st->method = h2_methods[i];
+		} else if (!strcmp(name, ":path")) {
+			free(st->path);
+			st->path = strdup(value);
+		} else if (!strcmp(name, ":authority")) {
+			free(st->authority);
+			st->authority = strdup(value);
+		} else if (strcmp(name, ":scheme")) {
+			st->malformed = true;
+		}
+		return;
+	}
+
+	st->regular = true;
+	h2_stream_url(st);
+
+	if (!strcmp(name, "connection") || !strcmp(name, "keep-alive") ||
+	    !strcmp(name, "upgrade") || !strcmp(name, "transfer-encoding") ||
+	    !strcmp(name, "proxy-connection"))
+		return;
+
+	if (!strcmp(name, "content-length"))
+		st->cl.request.content_length = atoi(value);
+
+	blobmsg_add_string(&st->cl.hdr, name, value);
+}
+
+/**
+ * Header decoding callback for header blocks nobody is interested in,
+ * they are decoded to keep the decoder table in sync.
+ */
+static void h2_header_ignore_cb(void *priv, const char *name, const char *value)
+{
+}
+
+/**
+ * Run the request of a stream once it is received completely
+ * @st the stream
+ */
+static void h2_stream_run(struct h2_stream *st)
+{
+	struct client *cl = &st->cl;
+
+	h2_stream_url(st);
+	cl->state = CLIENT_STATE_DATA;
+
+	if (st->body) {
+		st->body[st->body_len] = 0;
+		cl->postdata = st->body;
+		cl->postdata_len = st->body_len;
+		cl->ispostdata = true;
+		st->body = NULL;
+	}
+
+	if (st->malformed || !st->path || st->method < 0) {
+		send_client_error(cl, 400, "Bad Request", NULL);
+		return;
+	}
+
+	if (st->too_large) {
+		send_client_error(cl, 413, "Request Entity Too Large", NULL);
+		return;
+	}
+
+	cl->request.method = st->method;
+	trace_mark(cl, TRACE_HEADERS);
+	uh_handle_request(cl);
+}
+
+/**
+ * Handle a complete header block
+ * @conn the connection
+ */
+static void h2_headers_done(struct h2_conn *conn)
+{
+	uint32_t id = conn->hstream;
+	struct h2_stream *st = h2_stream_find(conn, id);
+	bool end = conn->hflags & H2_FLAG_END_STREAM;
+	bool ok;
+
+	conn->hstream = 0;
+
+	/* Trailers, ignored but they end the request */
+	if (st) {
+		ok = hpack_decode(&conn->dec, conn->hblock, conn->hlen, h2_header_ignore_cb, NULL);
+		if (!ok) {
+			h2_goaway(conn, H2_COMPRESSION_ERROR);
+		} else if (!end || st->end_recv) {
+			h2_goaway(conn, H2_PROTOCOL_ERROR);
+		} else {
+			st->end_recv = true;
+			h2_stream_run(st);
+		}
+		return;
+	}
+
+	if (!(id & 1) || id <= conn->last_stream) {
+		h2_goaway(conn, id <= conn->last_stream ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	conn->last_stream = id;
+	st = conn->n_streams < H2_MAX_STREAMS ? h2_stream_new(conn, id) : NULL;
+
+	if (!st) {
+		ok = hpack_decode(&conn->dec, conn->hblock, conn->hlen, h2_header_ignore_cb, NULL);
+		if (ok)
+			h2_rst(conn, id, H2_REFUSED_STREAM);
+	} else {
+		ok = hpack_decode(&conn->dec, conn->hblock, conn->hlen, h2_header_cb, st);
+	}
+
+	if (!ok) {
+		h2_goaway(conn, H2_COMPRESSION_ERROR);
+		return;
+	}
+
+	if (st && end) {
+		st->end_recv = true;
+		h2_stream_run(st);
+	}
+}
+
+/**
+ * Remove the padding of a frame
+ * @data the payload, advanced past the pad length
+ * @len the payload length, reduced by the padding
+ * @return false when the padding is invalid
+ */
+static bool h2_unpad(const uint8_t **data, int *len)
+{
+	int pad;
+
+	if (*len < 1)
+		return false;
+
+	pad = **data;
+	(*data)++;
+	(*len)--;
+
+	if (pad > *len)
+		return false;
+
+	*len -= pad;
+	return true;
+}
+
+/**
+ * Handle a HEADERS frame
+ */
+static void h2_recv_headers(struct h2_conn *conn, int flags, uint32_t id, const uint8_t *data, int len)
+{
+	if (!id || ((flags & H2_FLAG_PADDED) && !h2_unpad(&data, &len))) {
+		h2_goaway(conn, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	/* Priorities are not used */
+	if (flags & H2_FLAG_PRIORITY) {
+		if (len < 5) {
+			h2_goaway(conn, H2_PROTOCOL_ERROR);
+			return;
+		}
+		data += 5;
+		len -= 5;
+	}
+
+	if (len > H2_MAX_HEADER_BLOCK) {
+		h2_goaway(conn, H2_ENHANCE_YOUR_CALM);
+		return;
+	}
+
+	memcpy(conn->hblock, data, len);
+	conn->hlen = len;
+	conn->hstream = id;
+	conn->hflags = flags;
+
+	if (flags & H2_FLAG_END_HEADERS)
+		h2_headers_done(conn);
+}
+
+/**
+ * Handle a CONTINUATION frame
+ */
+static void h2_recv_continuation(struct h2_conn *conn, int flags, const uint8_t *data, int len)
+{
+	if (conn->hlen + len > H2_MAX_HEADER_BLOCK) {
+		h2_goaway(conn, H2_ENHANCE_YOUR_CALM);
+		return;
+	}
+
+	memcpy(conn->hblock + conn->hlen, data, len);
+	conn->hlen += len;
+
+	if (flags & H2_FLAG_END_HEADERS)
+		h2_headers_done(conn);
+}
+
+/**
+ * Handle a DATA frame
+ */
+static void h2_recv_data(struct h2_conn *conn, int flags, uint32_t id, const uint8_t *data, int len)
+{
+	int size = len;
+	struct h2_stream *st;
+	char *body;
+
+	if (!id || ((flags & H2_FLAG_PADDED) && !h2_unpad(&data, &len))) {
+		h2_goaway(conn, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	/* Bodies are bounded by H2_MAX_BODY, so windows are replenished at once */
+	if (size)
+		h2_window_update(conn, 0, size);
+
+	st = h2_stream_find(conn, id);
+	if (!st || st->end_recv) {
+		if (id > conn->last_stream)
+			h2_goaway(conn, H2_PROTOCOL_ERROR);
+		else
+			h2_rst(conn, id, H2_STREAM_CLOSED);
+		return;
+	}
+
+	if (size && !(flags & H2_FLAG_END_STREAM))
+		h2_window_update(conn, id, size);
+
+	if (st->body_len + len > H2_MAX_BODY) {
+		st->too_large = true;
+	} else if (len) {
+		body = realloc(st->body, st->body_len + len + 1);
+		if (body) {
+			memcpy(body + st->body_len, data, len);
+			st->body = body;
+			st->body_len += len;
+		} else {
+			st->too_large = true;
+		}
+	}
+
+	if (flags & H2_FLAG_END_STREAM) {
+		st->end_recv = true;
+		h2_stream_run(st);
+	}
+}
+
+/**
+ * Apply settings sent by the client
+ * @conn the connection
+ * @data the settings
+ * @len the length of the settings
+ * @return an error code
+ */
+static int h2_apply_settings(struct h2_conn *conn, const uint8_t *data, int len)
+{
+	struct h2_stream *st;
+	int64_t window;
+	uint32_t val;
+	int id;
+
+	if (len % 6)
+		return H2_FRAME_SIZE_ERROR;
+
+	for (; len; data += 6, len -= 6) {
+		id = (data[0] << 8) | data[1];
+		val = h2_get32(data + 2);
+
+		switch (id) {
+		case H2_SET_HEADER_TABLE_SIZE:
+			hpack_table_limit(&conn->enc, val);
+			break;
+		case H2_SET_ENABLE_PUSH:
+			if (val > 1)
+				return H2_PROTOCOL_ERROR;
+			break;
+		case H2_SET_INITIAL_WINDOW_SIZE:
+			if (val > H2_MAX_WINDOW)
+				return H2_FLOW_CONTROL_ERROR;
+
+			/* A window raised by WINDOW_UPDATE may not pass 2^31-1 (RFC 7540 6.9.2) */
+			list_for_each_entry(st, &conn->streams, list) {
+				window = (int64_t) st->send_window + val - conn->initial_window;
+				if (window > H2_MAX_WINDOW)
+					return H2_FLOW_CONTROL_ERROR;
+				st->send_window = window;
+			}
+			conn->initial_window = val;
+			break;
+		case H2_SET_MAX_FRAME_SIZE:
+			if (val < H2_DEFAULT_FRAME || val > 0xffffff)
+				return H2_PROTOCOL_ERROR;
+			conn->max_frame = val;
+			break;
+		}
+	}
+
+	return H2_NO_ERROR;
+}
+
+/**
+ * Handle a SETTINGS frame
+ */
+static void h2_recv_settings(struct h2_conn *conn, int flags, uint32_t id, const uint8_t *data, int len)
+{
+	int error;
+
+	if (id) {
+		h2_goaway(conn, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	if (flags & H2_FLAG_ACK) {
+		if (len)
+			h2_goaway(conn, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+
+	error = h2_apply_settings(conn, data, len);
+	if (error) {
+		h2_goaway(conn, error);
+		return;
+	}
+
+	conn->settings = true;
+	h2_frame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+	h2_resume(conn);
+}
+
+/**
+ * Handle a WINDOW_UPDATE frame
+ */
+static void h2_recv_window_update(struct h2_conn *conn, uint32_t id, const uint8_t *data, int len)
+{
+	struct h2_stream *st;
+	uint32_t inc;
+
+	if (len != 4) {
+		h2_goaway(conn, H2_FRAME_SIZE_ERROR);
+		return;
+	}
+
+	inc = h2_get32(data) & 0x7fffffff;
+
+	if (!id) {
+		if (!inc || (int64_t) conn->send_window + inc > H2_MAX_WINDOW) {
+			h2_goaway(conn, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+			return;
+		}
+		conn->send_window += inc;
+	} else {
+		st = h2_stream_find(conn, id);
+		if (!st)
+			return;
+
+		if (!inc || (int64_t) st->send_window + inc > H2_MAX_WINDOW) {
+			h2_rst(conn, id, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+			h2_stream_free(st);
+			return;
+		}
+		st->send_window += inc;
+	}
+
+	h2_resume(conn);
+}
+
+/**
+ * Handle a single frame
+ * @conn the connection
+ * @type the frame type
+ * @flags the frame flags
+ * @id the stream id
+ * @data the payload
+ * @len the payload length
+ */
+static void h2_recv_frame(struct h2_conn *conn, int type, int flags, uint32_t id, const uint8_t *data, int len)
+{
+	struct h2_stream *st;
+
+	/* The client preface ends with a SETTINGS frame */
+	if (!conn->settings && type != H2_SETTINGS) {
+		h2_goaway(conn, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	/* Header blocks may not be interrupted */
+	if (conn->hstream && (type != H2_CONTINUATION || id != conn->hstream)) {
+		h2_goaway(conn, H2_PROTOCOL_ERROR);
+		return;
+	}
+
+	switch (type) {
+	case H2_DATA:
+		h2_recv_data(conn, flags, id, data, len);
+		break;
+
+	case H2_HEADERS:
+		h2_recv_headers(conn, flags, id, data, len);
+		break;
+
+	case H2_CONTINUATION:
+		if (!conn->hstream)
+			h2_goaway(conn, H2_PROTOCOL_ERROR);
+		else
+			h2_recv_continuation(conn, flags, data, len);
+		break;
+
+	case H2_RST_STREAM:
+		if (!id || len != 4) {
+			h2_goaway(conn, len != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+			break;
+		}
+
+		st = h2_stream_find(conn, id);
+		if (st)
+			h2_stream_free(st);
+		break;
+
+	case H2_SETTINGS:
+		h2_recv_settings(conn, flags, id, data, len);
+		break;
+
+	case H2_PING:
+		if (id || len != 8)
+			h2_goaway(conn, id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+		else if (!(flags & H2_FLAG_ACK))
+			h2_frame(conn, H2_PING, H2_FLAG_ACK, 0, data, len);
+		break;
+
+	case H2_GOAWAY:
+		conn->goaway = true;
+		if (list_empty(&conn->streams))
+			close_connection(conn->cl);
+		break;
+
+	case H2_WINDOW_UPDATE:
+		h2_recv_window_update(conn, id, data, len);
+		break;
+
+	case H2_PUSH_PROMISE:
+		h2_goaway(conn, H2_PROTOCOL_ERROR);
+		break;
+
+	default:
+		/* Priorities are not used, unknown frames are ignored */
+		break;
+	}
+}
+
+/**
+ * Handle all complete frames received so far
+ * @conn the connection
+ */
+static void h2_process(struct h2_conn *conn)
+{
+	uint8_t *p = conn->rbuf;
+	uint32_t len;
+
+	while (!conn->goaway && conn->rlen - (p - conn->rbuf) >= H2_FRAME_HEADER) {
+		len = (p[0] << 16) | (p[1] << 8) | p[2];
+		if (len > H2_FRAME_SIZE) {
+			h2_goaway(conn, H2_FRAME_SIZE_ERROR);
+			return;
+		}
+
+		if (conn->rlen - (p - conn->rbuf) < H2_FRAME_HEADER + len)
+			break;
+
+		h2_recv_frame(conn, p[3], p[4], h2_get32(p + 5) & 0x7fffffff, p + H2_FRAME_HEADER, len);
+		p += H2_FRAME_HEADER + len;
+	}
+
+	conn->rlen -= p - conn->rbuf;
+	memmove(conn->rbuf, p, conn->rlen);
+}
+
+/**
+ * Write handler of the connection, resumes streams when the connection
+ * buffer drained
+ */
+static void h2_write_cb(struct client *cl)
+{
+	if (cl->h2)
+		h2_resume(cl->h2);
+}
+
+/**
+ * Get the seconds an HTTP/2 connection may stay idle, the network
+ * timeout when keep-alive is disabled
+ */
+static int h2_idle_time(void)
+{
+	return conf.http_keepalive ? conf.http_keepalive : conf.network_timeout;
+}
+
+/**
+ * Close idle HTTP/2 connections
+ */
+static void h2_timeout_cb(struct uloop_timeout *timeout)
+{
+	struct client *cl = container_of(timeout, struct client, timeout);
+
+	if (cl->h2->n_streams) {
+		uloop_timeout_set(&cl->timeout, h2_idle_time() * 1000);
+		return;
+	}
+
+	h2_goaway(cl->h2, H2_NO_ERROR);
+}
+
+/**
+ * Switch a connection to HTTP/2
+ * @cl the connection
+ */
+static struct h2_conn *h2_conn_new(struct client *cl)
+{
+	struct h2_conn *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+
+	conn->rbuf = malloc(H2_FRAME_HEADER + H2_FRAME_SIZE);
+	conn->hblock = malloc(H2_MAX_HEADER_BLOCK);
+	if (!conn->rbuf || !conn->hblock) {
+		free(conn->rbuf);
+		free(conn->hblock);
+		free(conn);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&conn->streams);
+	conn->cl = cl;
+	conn->send_window = H2_DEFAULT_WINDOW;
+	conn->initial_window = H2_DEFAULT_WINDOW;
+	conn->max_frame = H2_DEFAULT_FRAME;
+	hpack_table_init(&conn->dec, HPACK_TABLE_SIZE);
+	hpack_table_init(&conn->enc, min(HPACK_TABLE_SIZE, 4096));
+
+	cl->h2 = conn;
+	cl->state = CLIENT_STATE_HTTP2;
+	cl->dispatch.write_cb = h2_write_cb;
+	cl->timeout.cb = h2_timeout_cb;
+	uloop_timeout_set(&cl->timeout, h2_idle_time() * 1000);
+
+	h2_settings_send(conn);
+
+	return conn;
+}
+
+bool h2_is_preface(const char *buf, int len)
+{
+	return len >= 3 && !memcmp(buf, H2_PREFACE, min(len, H2_PREFACE_LEN));
+}
+
+bool h2_accept(struct client *cl, char *buf, int len)
+{
+	if (len < H2_PREFACE_LEN)
+		return false;
+
+	ustream_consume(cl->us, H2_PREFACE_LEN);
+	if (!h2_conn_new(cl))
+		close_connection(cl);
+
+	return true;
+}
+
+bool h2_upgrade(struct client *cl)
+{
+	static const struct blobmsg_policy policy = { "http2-settings", BLOBMSG_TYPE_STRING };
+	struct http_request *r = &cl->request;
+	struct blob_attr *tb, *cur;
+	char *url = blobmsg_data(blob_data(cl->hdr.head));
+	char settings[128], *c;
+	struct h2_stream *st;
+	struct h2_conn *conn;
+	int len, rem;
+
+	blobmsg_parse(&policy, 1, &tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+
+	/* Requests with a body are answered over HTTP/1.1 */
+	if (!tb || r->content_length || r->transfer_chunked ||
+	    strlen(blobmsg_data(tb)) >= sizeof(settings))
+		return false;
+
+	/* The settings are base64url encoded */
+	strcpy(settings, blobmsg_data(tb));
+	for (c = settings; *c; c++) {
+		if (*c == '-')
+			*c = '+';
+		else if (*c == '_')
+			*c = '/';
+	}
+
+	len = uh_b64decode(settings, sizeof(settings), settings, strlen(settings)) - 1;
+	if (len < 0)
+		return false;
+
+	ustream_printf(cl->us,
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Connection: Upgrade\r\n"
+		"Upgrade: h2c\r\n\r\n");
+
+	conn = h2_conn_new(cl);
+	if (!conn) {
+		close_connection(cl);
+		return true;
+	}
+
+	/* The 101 response acknowledges the settings */
+	conn->preface = true;
+	if (h2_apply_settings(conn, (uint8_t *) settings, len)) {
+		h2_goaway(conn, H2_PROTOCOL_ERROR);
+		return true;
+	}
+
+	/* The upgraded request becomes stream 1 */
+	st = h2_stream_new(conn, 1);
+	if (!st) {
+		h2_goaway(conn, H2_INTERNAL_ERROR);
+		return true;
+	}
+
+	conn->last_stream = 1;
+	st->path = strdup(url);
+	st->method = r->method;
+	st->url_added = true;
+	st->end_recv = true;
+
+	blobmsg_for_each_attr(cur, cl->hdr.head, rem) {
+		const char *name = blobmsg_name(cur);
+
+		if (strcmp(name, "connection") && strcmp(name, "upgrade") &&
+		    strcmp(name, "http2-settings"))
+			blobmsg_add_string(&st->cl.hdr, name, blobmsg_data(cur));
+	}
+
+	h2_stream_run(st);
+	return true;
+}
+
+bool h2_read_handler(struct client *cl, char *buf, int len)
+{
+	struct h2_conn *conn = cl->h2;
+	int n;
+
+	if (conn->goaway) {
+		ustream_consume(cl->us, len);
+		return true;
+	}
+
+	/* After an upgrade the client still sends the preface */
+	if (conn->preface) {
+		if (!h2_is_preface(buf, len)) {
+			h2_goaway(conn, H2_PROTOCOL_ERROR);
+			return true;
+		}
+
+		if (len < H2_PREFACE_LEN)
+			return false;
+
+		ustream_consume(cl->us, H2_PREFACE_LEN);
+		conn->preface = false;
+		return true;
+	}
+
+	n = min(len, H2_FRAME_HEADER + H2_FRAME_SIZE - conn->rlen);
+	memcpy(conn->rbuf + conn->rlen, buf, n);
+	conn->rlen += n;
+	ustream_consume(cl->us, n);
+
+	uloop_timeout_set(&cl->timeout, h2_idle_time() * 1000);
+	h2_process(conn);
+
+	return true;
+}
+
+void h2_free(struct client *cl)
+{
+	struct h2_conn *conn = cl->h2;
+	struct h2_stream *st, *tmp;
+
+	if (!conn)
+		return;
+
+	conn->goaway = false;
+	list_for_each_entry_safe(st, tmp, &conn->streams, list)
+		h2_stream_free(st);
+
+	hpack_table_free(&conn->dec);
+	hpack_table_free(&conn->enc);
+	free(conn->rbuf);
+	free(conn->hblock);
+	free(conn);
+	cl->h2 = NULL;
+}
+
+struct client *h2_connection(struct client *cl)
+{
+	return cl->h2_stream->conn->cl;
+}
+
+void h2_drain(struct client *cl)
+{
+	if (cl->h2 && !cl->h2->n_streams)
+		h2_goaway(cl->h2, H2_NO_ERROR);
+}
+
+int h2_buffered(struct client *cl)
+{
+	struct h2_conn *conn = cl->h2;
+	struct h2_stream *st;
+	int used;
+
+	if (!conn)
+		return 0;
+
+	used = conn->rlen + conn->hlen;
+	list_for_each_entry(st, &conn->streams, list)
+		used += st->us.w.data_bytes + st->body_len + st->head_len;
+
+	return used;
+}
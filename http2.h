@@ -0,0 +1,78 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: http2.h
+ * Description: HTTP/2 framing layer (RFC 7540), requests are multiplexed
+ * onto the normal request dispatching.
+ *
+ * Created by: Daan Pape
+ * Created on: June 9, 2014
+ */
+
+#ifndef HTTP2_H_
+#define HTTP2_H_
+
+#include "uhttpd.h"
+
+/**
+ * Check if the data received on a new connection is, or could become,
+ * the HTTP/2 connection preface.
+ * @buf the received data
+ * @len the length of the received data
+ */
+bool h2_is_preface(const char *buf, int len);
+
+/**
+ * Switch a connection to HTTP/2 after the client sent the preface
+ * (prior knowledge or ALPN on TLS).
+ * @cl the client that sent the preface
+ * @buf the buffer containing the preface
+ * @len the length of the buffer
+ * @return false when more data is needed
+ */
+bool h2_accept(struct client *cl, char *buf, int len);
+
+/**
+ * Try to upgrade the connection to HTTP/2 (h2c). Called when the request
+ * headers are complete and the client asked for an upgrade.
+ * @cl the client that made the request
+ * @return false when the request should be handled as a normal request
+ */
+bool h2_upgrade(struct client *cl);
+
+/**
+ * Read handler for HTTP/2 connections
+ * @cl the client who sent the data
+ * @buf the buffer containing the data
+ * @len the length of the data
+ */
+bool h2_read_handler(struct client *cl, char *buf, int len);
+
+/**
+ * Free the HTTP/2 state of a client and all its streams
+ * @cl the client to free the state from
+ */
+void h2_free(struct client *cl);
+
+/**
+ * Get the connection an HTTP/2 stream is multiplexed on
+ * @cl the virtual client of the stream
+ */
+struct client *h2_connection(struct client *cl);
+
+/**
+ * Close an HTTP/2 connection when none of its streams is open
+ * @cl the connection
+ */
+void h2_drain(struct client *cl);
+
+/**
+ * Get the number of bytes buffered by the HTTP/2 state of a connection
+ * and its streams
+ * @cl the connection
+ */
+int h2_buffered(struct client *cl);
+
+#endif /* HTTP2_H_ */
@@ -30,15 +30,14 @@ struct listener {
 	int n_clients;				/* The number of clients */
 	struct sockaddr_in6 addr;	/* The IPv6 socket address */
 	bool tls;					/* Flag for SSL support */
-	bool blocked;				/* True if this listener is blocked */
+	struct uring_op accept;		/* The io_uring accept */
+	bool uring;					/* Accepted by io_uring instead of uloop */
+	bool released;				/* Freed when the io_uring accept completes */
 };
 
 /* The list of listeners */
 static LIST_HEAD(listeners);
 
-/* The number of blocked clients */
-static int n_blocked;
-
 /**
  * Close all listening sockets
  */
@@ -52,45 +51,81 @@ void close_listeners(void)
 }
 
 /**
- * If there is room for new connections unblock them
- * until the queue is full again.
+ * Stop accepting connections and close all listening sockets, the
+ * connections that are already accepted are kept
  */
-static void uh_poll_listeners(struct uloop_timeout *timeout)
+void release_listeners(void)
 {
-	struct listener *l;
+	struct listener *l, *tmp;
 
-	/* Check if there is room for new connections */
-	if ((!n_blocked && conf.max_connections) || n_clients >= conf.max_connections) {
-		return;
-	}
+	list_for_each_entry_safe(l, tmp, &listeners, list) {
+		close(l->fd.fd);
+		list_del(&l->list);
 
-	/* For each blocked listener, attach READ events*/
-	list_for_each_entry(l, &listeners, list) {
-		if (l->blocked){
+		/* The pending accept still points to the listener */
+		if (l->uring) {
+			l->released = true;
+			uring_cancel(&l->accept);
+			continue;
+		}
+
+		uloop_fd_delete(&l->fd);
+		free(l);
+	}
+}
 
-			/* Check if it can be unblocked */
-			l->fd.cb(&l->fd, ULOOP_READ);
-			if (n_clients >= conf.max_connections)
-				break;
+/**
+ * Get the listening sockets
+ * @fds filled with the sockets
+ * @tls filled with the TLS flags of the sockets
+ * @n the size of the arrays
+ * @return the number of listening sockets
+ */
+int get_listener_sockets(int *fds, bool *tls, int n)
+{
+	struct listener *l;
+	int i = 0;
 
-			/* Unblock listener */
-			--n_blocked;
-			l->blocked = false;
-			uloop_fd_add(&l->fd, ULOOP_READ);
+	list_for_each_entry(l, &listeners, list) {
+		if (i < n) {
+			fds[i] = l->fd.fd;
+			tls[i] = l->tls;
 		}
+		i++;
 	}
+
+	return i;
 }
 
 /**
- * Unblock all blocked listeners in the listener list.
+ * Use an already bound listening socket, for example one
+ * inherited from the process that started this one
+ * @sock the listening socket
+ * @tls true if this socket sould listen for TLS connections
  */
-void unblock_listeners(void)
+bool adopt_listener_socket(int sock, bool tls)
 {
-	static struct uloop_timeout poll_timer = {
-		.cb = uh_poll_listeners
-	};
+	struct listener *l;
+	int type = 0, listening = 0;
+	socklen_t len = sizeof(type);
+
+	if (getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &len) || type != SOCK_STREAM)
+		return false;
+
+	len = sizeof(listening);
+	if (getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) || !listening)
+		return false;
 
-	uloop_timeout_set(&poll_timer, 1);
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return false;
+
+	fd_cloexec(sock);
+	l->fd.fd = sock;
+	l->tls = tls;
+	list_add_tail(&l->list, &listeners);
+
+	return true;
 }
 
 /**
@@ -101,17 +136,67 @@ static void new_client_event(struct uloop_fd *fd, unsigned int events)
 	/* Get the listener that raised the event */
 	struct listener *l = container_of(fd, struct listener, fd);
 
-	/* Accept all clients */
+	/* Accept all clients, admission control decides which are served */
 	while (1) {
 		if (!accept_client(fd->fd, l->tls))
 			break;
 	}
+}
 
-	/* Block a client when there are to many connections */
-	if (conf.max_connections && n_clients >= conf.max_connections) {
-		uloop_fd_delete(&l->fd);
-		n_blocked++;
-		l->blocked = true;
+/**
+ * Handle the connections io_uring accepted for a listener
+ */
+static void listener_accept_cb(struct uring_op *op, int res, bool more)
+{
+	struct listener *l = container_of(op, struct listener, accept);
+
+	if (res >= 0) {
+		if (l->released)
+			close(res);
+		else
+			client_accepted(res, l->tls);
+	}
+
+	if (more)
+		return;
+
+	if (l->released) {
+		free(l);
+		return;
+	}
+
+	/* Single shot accepts and failures arm again, uloop takes over when the ring is full */
+	if (!uring_accept(op, l->fd.fd)) {
+		l->uring = false;
+		l->fd.cb = new_client_event;
+		uloop_fd_add(&l->fd, ULOOP_READ);
+	}
+}
+
+/**
+ * Apply the TCP keep-alive settings to a listener, accepted
+ * connections inherit them
+ * @l the listener to configure
+ */
+static void listener_keepalive(struct listener *l)
+{
+	int sock = l->fd.fd;
+	int yes = 1, no = 0;
+
+	/* Set up TCP Keep Alive for Linux */
+	if (conf.tcp_keepalive > 0) {
+		int tcp_ka_idl, tcp_ka_int, tcp_ka_cnt;
+
+		tcp_ka_idl = 1;
+		tcp_ka_cnt = 3;
+		tcp_ka_int = conf.tcp_keepalive;
+
+		setsockopt(sock, SOL_TCP, TCP_KEEPIDLE,  &tcp_ka_idl, sizeof(tcp_ka_idl));
+		setsockopt(sock, SOL_TCP, TCP_KEEPINTVL, &tcp_ka_int, sizeof(tcp_ka_int));
+		setsockopt(sock, SOL_TCP, TCP_KEEPCNT,   &tcp_ka_cnt, sizeof(tcp_ka_cnt));
+		setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+	} else {
+		setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &no, sizeof(no));
 	}
 }
 
@@ -122,24 +207,16 @@ static void new_client_event(struct uloop_fd *fd, unsigned int events)
 void setup_listeners(void)
 {
 	struct listener *l;
-	int yes = 1;
 
 	/* For all listeners in the list */
 	list_for_each_entry(l, &listeners, list) {
-		int sock = l->fd.fd;
-
-		/* Set up TCP Keep Alive for Linux */
-		if (conf.tcp_keepalive > 0) {
-			int tcp_ka_idl, tcp_ka_int, tcp_ka_cnt;
+		listener_keepalive(l);
 
-			tcp_ka_idl = 1;
-			tcp_ka_cnt = 3;
-			tcp_ka_int = conf.tcp_keepalive;
-
-			setsockopt(sock, SOL_TCP, TCP_KEEPIDLE,  &tcp_ka_idl, sizeof(tcp_ka_idl));
-			setsockopt(sock, SOL_TCP, TCP_KEEPINTVL, &tcp_ka_int, sizeof(tcp_ka_int));
-			setsockopt(sock, SOL_TCP, TCP_KEEPCNT,   &tcp_ka_cnt, sizeof(tcp_ka_cnt));
-			setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+		/* Let io_uring accept when it is in use */
+		l->accept.cb = listener_accept_cb;
+		if (uring_active() && uring_accept(&l->accept, l->fd.fd)) {
+			l->uring = true;
+			continue;
 		}
 
 		/* Register this listener with the uloop event loop and register READ events */
@@ -148,6 +225,22 @@ void setup_listeners(void)
 	}
 }
 
+/**
+ * Apply the backlog and TCP keep-alive settings of the
+ * configuration to the bound listeners.
+ */
+void reconfigure_listeners(void)
+{
+	struct listener *l;
+
+	list_for_each_entry(l, &listeners, list) {
+		/* Listening again on a listening socket only changes the backlog */
+		if (listen(l->fd.fd, conf.listen_backlog) < 0)
+			perror("listen()");
+
+		listener_keepalive(l);
+	}
+}
 
 /**
  * Bind a socket to listen from request on a given host on a given host.
@@ -208,7 +301,7 @@ bool bind_listener_sockets(const char *host, const char *port, bool tls)
 		}
 
 		/* Make a server socket  */
-		if (listen(sock, UH_LIMIT_CLIENTS) < 0) {
+		if (listen(sock, conf.listen_backlog) < 0) {
 			perror("listen()");
 			goto error;
 		}
@@ -30,13 +30,36 @@ bool bind_listener_sockets(const char *host, const char *port, bool tls);
 void setup_listeners(void);
 
 /**
- * Unblock all blocked listeners in the listener list.
+ * Apply the backlog and TCP keep-alive settings of the
+ * configuration to the bound listeners.
  */
-void unblock_listeners(void);
+void reconfigure_listeners(void);
 
 /**
  * Close all listening sockets
  */
 void close_listeners(void);
 
+/**
+ * Stop accepting connections and close all listening sockets, the
+ * connections that are already accepted are kept.
+ */
+void release_listeners(void);
+
+/**
+ * Get the listening sockets.
+ * @fds filled with the sockets.
+ * @tls filled with the TLS flags of the sockets.
+ * @n the size of the arrays.
+ * @return the number of listening sockets.
+ */
+int get_listener_sockets(int *fds, bool *tls, int n);
+
+/**
+ * Use an already bound listening socket.
+ * @sock the listening socket.
+ * @tls true if this socket sould listen for TLS connections.
+ */
+bool adopt_listener_socket(int sock, bool tls);
+
 #endif /* LISTEN_H_ */
@@ -30,11 +30,91 @@
 #include "config.h"
 #include "uhttpd.h"
 #include "api.h"
+#include "tls.h"
+#include "conffile.h"
+#include "upgrade.h"
+#include "sampler.h"
+#include "script.h"
+#include "uring.h"
+#include "trace.h"
+
+/* The command line options */
+#define OPTIONS		"p:s:C:K:h:n:c:"
+
 /**
  * The servers main working buffer.
  */
 char uh_buf[WORKING_BUFF_SIZE];
 
+/**
+ * Print the command line usage.
+ * @name the name of the executable.
+ */
+static int usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"	-p [addr:]port  Bind to specified address and port, multiple allowed,\n"
+		"	                IPv6 addresses are given as [addr]:port\n"
+#ifdef HAVE_TLS
+		"	-s [addr:]port  Like -p but provide HTTPS on this port\n"
+		"	-C file         ASN.1 server certificate file\n"
+		"	-K file         ASN.1 server private key file\n"
+#endif
+		"	-h directory    Specify the document root, default is '" DOCUMENT_ROOT "'\n"
+		"	-n count        Maximum allowed number of concurrent connections\n"
+		"	-c file         Runtime configuration file, default is '" CONFIG_FILE "'\n"
+		"\n", name);
+
+	return EXIT_FAILURE;
+}
+
+/**
+ * Bind a listener to an address given as [addr:]port, IPv6 addresses
+ * are given in brackets as [addr]:port.
+ * @addr the address string, will be modified.
+ * @tls true if this socket should listen for TLS connections.
+ * @return true if the socket could be bound.
+ */
+static bool add_listener_arg(char *addr, bool tls)
+{
+	char *port = strrchr(addr, ':');
+	char *host = NULL;
+
+	/* Split the host from the port when given */
+	if (addr[0] == '[') {
+		host = addr + 1;
+		port = strchr(host, ']');
+		if (!port || port[1] != ':') {
+			fprintf(stderr, "[ERROR] Expected [addr]:port but got %s\n", addr);
+			return false;
+		}
+
+		*port = 0;
+		port += 2;
+	} else if (port) {
+		/* An unbracketed IPv6 address cannot be told apart from its port */
+		if (strchr(addr, ':') != port) {
+			fprintf(stderr, "[ERROR] IPv6 addresses must be given as [addr]:port, got %s\n", addr);
+			return false;
+		}
+
+		host = addr;
+		*port++ = 0;
+	} else {
+		port = addr;
+	}
+
+	if (!bind_listener_sockets(host, port, tls)) {
+		fprintf(stderr, "[ERROR] Could not bind socket to %s:%s\n",
+			host ? host : "*", port);
+		return false;
+	}
+
+	return true;
+}
+
 /**
  * Main application entry point.
  * @argc the number of command line arguments.
@@ -45,6 +125,21 @@ int main(int argc, char **argv)
 	/* Current file descriptor for /dev/null */
 	int cur_fd;
 
+	/* True when a listener was given on the command line */
+	bool bound = false;
+
+	/* True when the listeners were handed over by an upgrade */
+	bool inherited;
+	int ch;
+
+	/* The runtime configuration file */
+	const char *conf_file = CONFIG_FILE;
+	char *addr;
+
+	/* TLS listener configuration */
+	const char *tls_key = NULL, *tls_crt = NULL;
+	int n_tls = 0;
+
 	/* Prevent SIGPIPE errors */
 	signal(SIGPIPE, SIG_IGN);
 
@@ -53,6 +148,83 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	/* Take over the listeners of the server being upgraded */
+	inherited = upgrade_inherit(argv);
+
+	/* Find the configuration file first, the other options override it */
+	opterr = 0;
+	while ((ch = getopt(argc, argv, OPTIONS)) != -1)
+		if (ch == 'c')
+			conf_file = optarg;
+
+	opterr = 1;
+	optind = 1;
+
+	if (!conf_load(conf_file)) {
+		fprintf(stderr, "[ERROR] Could not load the configuration file %s\n", conf_file);
+		return EXIT_FAILURE;
+	}
+
+	/* Parse the command line arguments */
+	while ((ch = getopt(argc, argv, OPTIONS)) != -1) {
+		switch(ch) {
+		case 's':
+			n_tls++;
+			/* fall through */
+		case 'p':
+			if (!inherited && !add_listener_arg(optarg, ch == 's'))
+				return EXIT_FAILURE;
+
+			bound = true;
+			break;
+
+		case 'C':
+			tls_crt = optarg;
+			break;
+
+		case 'K':
+			tls_key = optarg;
+			break;
+
+		case 'h':
+			conf.docroot = optarg;
+			break;
+
+		case 'n':
+			if (!conf_override("max_connections", optarg)) {
+				fprintf(stderr, "[ERROR] Invalid connection count %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'c':
+			break;
+
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	/* Load the certificate and key for TLS listeners */
+	if (n_tls) {
+		if (!tls_crt || !tls_key) {
+			fprintf(stderr, "[ERROR] Please specify a certificate and a key file to enable TLS support\n");
+			return EXIT_FAILURE;
+		}
+
+		if (uh_tls_init(tls_key, tls_crt))
+			return EXIT_FAILURE;
+	}
+
+	/* Bind a non TLS socket to the configured address */
+	if (!bound && !inherited) {
+		addr = strdup(conf.listen);
+		if (!addr || !add_listener_arg(addr, false))
+			return EXIT_FAILURE;
+
+		free(addr);
+	}
+
 	/* fork (if not disabled) */
 	if (FORK_ON_START) {
 		switch (fork()) {
@@ -82,9 +254,27 @@ int main(int argc, char **argv)
 	/* Initialize network event loop */
 	uloop_init();
 
+	/* Reload the configuration file on SIGHUP */
+	conf_watch();
+
+	/* Dump the flight recorder on SIGUSR1 */
+	trace_init();
+
+	/* Sample the system statistics in the background */
+	sampler_init();
+
+	/* Start the script workers before any client is connected */
+	script_init();
+
+	/* Accept and send through io_uring when the kernel supports it */
+	uring_init();
+
 	/* Set up all listener sockets */
 	setup_listeners();
 
+	/* Start serving in place of an upgraded server, upgrade on SIGUSR2 */
+	upgrade_watch();
+
 	/* Start the network event loop */
 	uloop_run();
 
@@ -92,26 +282,43 @@ int main(int argc, char **argv)
 }
 
 /**
- * Create the server configuration and bind to socket.
+ * Create the default server configuration.
  * @return: true if configuration was successful.
  */
 bool load_configuration(void)
 {
 	/* Set up configuration */
-	conf.max_connections = 100;
+	conf.docroot = DOCUMENT_ROOT;
+	conf.max_connections = MAX_CONNECTIONS;
 	conf.realm = "WoodBox Secured";
 	conf.cgi_docroot_path = "/www/api";
 	conf.cgi_path = "/sbin:/usr/sbin:/bin:/usr/bin";
 
-	/* Bind a non TLS socket to port */
-	if(!bind_listener_sockets(NULL, LISTEN_PORT, false)) {
-		fprintf(stderr, "[ERROR] Could not bind socket to 0.0.0.0:80\n");
-		return false;
-	}
+	/* Tunables, the configuration file may change these */
+	conf.listen = LISTEN_PORT;
+	conf.listen_backlog = LISTEN_BACKLOG;
+	conf.network_timeout = NETWORK_TIMEOUT;
+	conf.http_keepalive = KEEP_ALIVE_TIME;
+	conf.request_line_timeout = REQUEST_LINE_TIMEOUT;
+	conf.header_timeout = HEADER_TIMEOUT;
+	conf.body_min_rate = BODY_MIN_RATE;
+	conf.response_min_rate = RESPONSE_MIN_RATE;
+	conf.read_buffer_size = READ_BUFFER_SIZE;
+	conf.max_script_requests = MAX_SCRIPT_REQUESTS;
+	conf.script_timeout = SCRIPT_TIMEOUT;
+	conf.script_workers = SCRIPT_WORKERS;
+	conf.io_uring = IO_URING;
+	conf.rfc1918_filter = RFC1918_FILTER;
+	conf.stats_api = STATS_API;
+	conf.peer_max_connections = PEER_MAX_CONNECTIONS;
+	conf.peer_request_rate = PEER_REQUEST_RATE;
+	conf.peer_request_burst = PEER_REQUEST_BURST;
+	conf.dirlist_cache_entries = DIRLIST_CACHE_ENTRIES;
+	conf.dirlist_cache_max = DIRLIST_CACHE_MAX;
+	conf.auth_cache_size = AUTH_CACHE_SIZE;
+	conf.tls_session_cache_size = TLS_SESSION_CACHE_SIZE;
+	conf.mem_budget = MEM_BUDGET;
+	conf.drain_timeout = DRAIN_TIMEOUT;
 
 	return true;
 }
-
-
-
-
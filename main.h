@@ -16,7 +16,7 @@
 #include <stdbool.h>
 
 /**
- * Create the server configuration and bind to socket.
+ * Create the default server configuration.
  * @return: true if configuration was successful.
  */
 bool load_configuration(void);
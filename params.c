@@ -0,0 +1,298 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: params.c
+ * Description: indexed access to the query string and form parameters
+ * of a request. The first lookup copies the encoded parameters into a
+ * single arena, decodes them in place and hashes the names into an open
+ * addressed table. Later lookups do not allocate.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <libubox/blobmsg.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "params.h"
+
+/**
+ * A decoded parameter
+ */
+struct param {
+	const char *name;
+	const char *value;
+};
+
+/**
+ * The parameter index of a request, allocated as a single block
+ */
+struct param_index {
+	int n;						/* Number of parameters */
+	int mask;					/* Size of the hash table minus one */
+	struct param *params;
+	uint16_t *table;			/* Parameter number plus one, 0 when empty */
+	char *strings;				/* The decoded names and values */
+};
+
+/* Returned while a request has no parameters */
+static struct param_index empty_index;
+
+/**
+ * Hash a parameter name, FNV-1a
+ * @name the name
+ */
+static uint32_t param_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char) *name++) * 16777619u;
+
+	return h;
+}
+
+/**
+ * Count the parameters in an encoded string
+ * @s the encoded parameters, may be NULL
+ */
+static int param_count(const char *s)
+{
+	int n = 1;
+
+	if (!s || !*s)
+		return 0;
+
+	while ((s = strchr(s, '&'))) {
+		s++;
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * Decode a name or value in place, '+' stands for a space
+ * @s the encoded string
+ * @return false when the string has an invalid escape
+ */
+static bool param_decode(char *s)
+{
+	int len = strlen(s);
+	char *c;
+
+	for (c = s; *c; c++)
+		if (*c == '+')
+			*c = ' ';
+
+	return uh_urldecode(s, len + 1, s, len) >= 0;
+}
+
+/**
+ * Find a parameter in the index
+ * @idx the index
+ * @name the parameter name
+ * @insert set to the slot where the name would go when it is missing
+ */
+static struct param *param_find(struct param_index *idx, const char *name, uint16_t **insert)
+{
+	uint32_t i = param_hash(name) & idx->mask;
+	struct param *p;
+
+	if (!idx->n && !insert)
+		return NULL;
+
+	while (idx->table[i]) {
+		p = &idx->params[idx->table[i] - 1];
+		if (!strcmp(p->name, name))
+			return p;
+
+		i = (i + 1) & idx->mask;
+	}
+
+	if (insert)
+		*insert = &idx->table[i];
+
+	return NULL;
+}
+
+/**
+ * Add the parameters of an encoded string to the index
+ * @idx the index
+ * @s the copy of the encoded string in the arena
+ */
+static void param_add_all(struct param_index *idx, char *s)
+{
+	char *name, *value, *save;
+	uint16_t *slot;
+
+	for (name = strtok_r(s, "&", &save); name; name = strtok_r(NULL, "&", &save)) {
+		if (idx->n == API_MAX_PARAMS)
+			break;
+
+		value = strchr(name, '=');
+		if (value)
+			*value++ = 0;
+		else
+			value = name + strlen(name);
+
+		if (!*name || !param_decode(name) || !param_decode(value))
+			continue;
+
+		/* The first occurrence of a name wins */
+		if (param_find(idx, name, &slot))
+			continue;
+
+		idx->params[idx->n].name = name;
+		idx->params[idx->n].value = value;
+		*slot = ++idx->n;
+	}
+}
+
+/**
+ * Get the form encoded body of a request, API calls run once the whole
+ * body was collected
+ * @cl the client
+ * @return NULL when the request has none
+ */
+static const char *param_form_body(struct client *cl)
+{
+	static const struct blobmsg_policy policy = { "content-type", BLOBMSG_TYPE_STRING };
+	static const char form[] = "application/x-www-form-urlencoded";
+	struct blob_attr *tb;
+
+	if (!cl->ispostdata || cl->postdata_len <= 0 || !cl->hdr.head)
+		return NULL;
+
+	blobmsg_parse(&policy, 1, &tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+	if (!tb || strncasecmp(blobmsg_data(tb), form, sizeof(form) - 1))
+		return NULL;
+
+	return cl->postdata;
+}
+
+/**
+ * Get the parameter index of a request, it is built on first use
+ * @cl the client
+ */
+static struct param_index *param_index(struct client *cl)
+{
+	const char *query = cl->request.query;
+	const char *body = param_form_body(cl);
+	int n, size, qlen, blen;
+	struct param_index *idx;
+
+	if (cl->params)
+		return cl->params;
+
+	n = min(param_count(query) + param_count(body), API_MAX_PARAMS);
+	if (!n)
+		return &empty_index;
+
+	qlen = query ? strlen(query) + 1 : 0;
+	blen = body ? strlen(body) + 1 : 0;
+
+	/* The table is kept at most half full */
+	for (size = 2; size < n * 2; size <<= 1);
+
+	idx = calloc(1, sizeof(*idx) + n * sizeof(struct param) +
+		     size * sizeof(uint16_t) + qlen + blen);
+	if (!idx)
+		return &empty_index;
+
+	idx->mask = size - 1;
+	idx->params = (struct param *) (idx + 1);
+	idx->table = (uint16_t *) (idx->params + n);
+	idx->strings = (char *) (idx->table + size);
+
+	if (query) {
+		memcpy(idx->strings, query, qlen);
+		param_add_all(idx, idx->strings);
+	}
+
+	if (body) {
+		memcpy(idx->strings + qlen, body, blen);
+		param_add_all(idx, idx->strings + qlen);
+	}
+
+	cl->params = idx;
+	return idx;
+}
+
+void param_set_query(struct client *cl, const char *query)
+{
+	param_free(cl);
+	cl->request.query = query;
+}
+
+const char *param_get(struct client *cl, const char *name)
+{
+	struct param *p = param_find(param_index(cl), name, NULL);
+
+	return p ? p->value : NULL;
+}
+
+int param_get_int(struct client *cl, const char *name, int def)
+{
+	const char *val = param_get(cl, name);
+	char *end;
+	long n;
+
+	if (!val || !*val)
+		return def;
+
+	errno = 0;
+	n = strtol(val, &end, 10);
+	if (errno || *end || n < INT_MIN || n > INT_MAX)
+		return def;
+
+	return n;
+}
+
+bool param_get_bool(struct client *cl, const char *name, bool def)
+{
+	const char *val = param_get(cl, name);
+
+	if (!val)
+		return def;
+
+	if (!*val || !strcasecmp(val, "1") || !strcasecmp(val, "true") ||
+	    !strcasecmp(val, "yes") || !strcasecmp(val, "on"))
+		return true;
+
+	if (!strcasecmp(val, "0") || !strcasecmp(val, "false") ||
+	    !strcasecmp(val, "no") || !strcasecmp(val, "off"))
+		return false;
+
+	return def;
+}
+
+double param_get_float(struct client *cl, const char *name, double def)
+{
+	const char *val = param_get(cl, name);
+	char *end;
+	double d;
+
+	if (!val || !*val)
+		return def;
+
+	errno = 0;
+	d = strtod(val, &end);
+	if (errno || *end)
+		return def;
+
+	return d;
+}
+
+void param_free(struct client *cl)
+{
+	free(cl->params);
+	cl->params = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: params.h
+ * Description: indexed access to the query string and form parameters
+ * of a request.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#ifndef PARAMS_H_
+#define PARAMS_H_
+
+#include <stdbool.h>
+
+#include "uhttpd.h"
+
+/**
+ * Set the query string of the request a client is handling, the index
+ * is built on the first parameter lookup.
+ * @cl the client
+ * @query the query string without '?', NULL when there is none. It
+ * must stay valid until the request is done.
+ */
+void param_set_query(struct client *cl, const char *query);
+
+/**
+ * Get a decoded parameter from the query string or, for
+ * application/x-www-form-urlencoded requests, the body. The query
+ * string goes first when both have the same name.
+ * @cl the client
+ * @name the parameter name
+ * @return NULL when the parameter is not present, the value stays
+ * valid until the request is done
+ */
+const char *param_get(struct client *cl, const char *name);
+
+/**
+ * Get an integer parameter
+ * @cl the client
+ * @name the parameter name
+ * @def returned when the parameter is missing or not a number
+ */
+int param_get_int(struct client *cl, const char *name, int def);
+
+/**
+ * Get a boolean parameter, 1, true, yes and on are true, 0, false, no
+ * and off are false. A parameter without value is true.
+ * @cl the client
+ * @name the parameter name
+ * @def returned when the parameter is missing or not a boolean
+ */
+bool param_get_bool(struct client *cl, const char *name, bool def);
+
+/**
+ * Get a floating point parameter
+ * @cl the client
+ * @name the parameter name
+ * @def returned when the parameter is missing or not a number
+ */
+double param_get_float(struct client *cl, const char *name, double def);
+
+/**
+ * Free the parameter index of the request a client handled
+ * @cl the client
+ */
+void param_free(struct client *cl);
+
+#endif /* PARAMS_H_ */
@@ -0,0 +1,258 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: peer.c
+ * Description: per source address connection limits and request rate
+ * limiting. Every address with connections or a recent request has an
+ * entry in an open addressed hash table. An entry counts the open
+ * connections of the address and holds a token bucket that every
+ * request takes a token from. A timer removes entries without
+ * connections once their bucket is full again, such an entry is the
+ * same as a new one.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#include <limits.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "peer.h"
+
+/* Tokens are counted in thousandths of a request */
+#define PEER_TOKEN		1000
+
+/**
+ * A source address
+ */
+struct peer {
+	struct uh_addr addr;		/* The port is not used */
+	bool used;
+	int conns;					/* Open connections */
+	int tokens;					/* Requests that can be made, in thousandths */
+	int64_t refilled;			/* Monotonic time of the last refill in milliseconds */
+};
+
+static struct peer table[PEER_TABLE_SIZE];
+static int n_peers;
+
+static struct peer_stats stats;
+
+static void peer_expire_cb(struct uloop_timeout *t);
+
+/* Removes the entries that are no longer needed */
+static struct uloop_timeout expire_timer = {
+	.cb = peer_expire_cb
+};
+
+/**
+ * Hash the address of a peer, FNV-1a over the address bytes
+ * @addr the address
+ */
+static uint32_t peer_hash(const struct uh_addr *addr)
+{
+	const uint8_t *p = (const uint8_t *) &addr->in6;
+	int len = addr->family == AF_INET6 ? sizeof(addr->in6) : sizeof(addr->in);
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619u;
+
+	return h;
+}
+
+/**
+ * Compare the addresses of two peers
+ */
+static bool peer_addr_equal(const struct uh_addr *a, const struct uh_addr *b)
+{
+	if (a->family != b->family)
+		return false;
+
+	if (a->family == AF_INET6)
+		return !memcmp(&a->in6, &b->in6, sizeof(a->in6));
+
+	return a->in.s_addr == b->in.s_addr;
+}
+
+/**
+ * Find the entry of an address
+ * @addr the address
+ * @create add an entry when there is none
+ * @return NULL when the address has no entry
+ */
+static struct peer *peer_find(const struct uh_addr *addr, bool create)
+{
+	uint32_t i = peer_hash(addr) & (PEER_TABLE_SIZE - 1);
+	struct peer *p;
+
+	for (p = &table[i]; p->used; p = &table[i]) {
+		if (peer_addr_equal(&p->addr, addr))
+			return p;
+
+		i = (i + 1) & (PEER_TABLE_SIZE - 1);
+	}
+
+	/* Keep the probe sequences short */
+	if (!create || n_peers >= PEER_TABLE_SIZE * 3 / 4)
+		return NULL;
+
+	memset(p, 0, sizeof(*p));
+	p->used = true;
+	p->addr = *addr;
+	p->addr.port = 0;
+	p->tokens = conf.peer_request_burst * PEER_TOKEN;
+	p->refilled = uh_monotonic_ms();
+	n_peers++;
+
+	if (!expire_timer.pending)
+		uloop_timeout_set(&expire_timer, PEER_EXPIRE_INTERVAL);
+
+	return p;
+}
+
+/**
+ * Remove an entry, the entries after it that belong before it move up
+ * so lookups need no deleted markers
+ * @p the entry
+ */
+static void peer_remove(struct peer *p)
+{
+	uint32_t i = p - table, j = i, home;
+
+	for (;;) {
+		table[i].used = false;
+
+		for (;;) {
+			j = (j + 1) & (PEER_TABLE_SIZE - 1);
+			if (!table[j].used) {
+				n_peers--;
+				return;
+			}
+
+			/* An entry can fill the gap when its home is not between the gap and itself */
+			home = peer_hash(&table[j].addr) & (PEER_TABLE_SIZE - 1);
+			if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+				break;
+		}
+
+		table[i] = table[j];
+		i = j;
+	}
+}
+
+/**
+ * Add the tokens earned since the last refill
+ * @p the entry
+ * @now the monotonic time in milliseconds
+ */
+static void peer_refill(struct peer *p, int64_t now)
+{
+	int64_t tokens = p->tokens + (now - p->refilled) * conf.peer_request_rate;
+
+	/* Without a rate limit the bucket is always full */
+	if (!conf.peer_request_rate)
+		tokens = INT_MAX;
+
+	p->tokens = min(tokens, (int64_t) conf.peer_request_burst * PEER_TOKEN);
+	p->refilled = now;
+}
+
+/**
+ * Remove the entries without connections whose bucket is full
+ */
+static void peer_expire_cb(struct uloop_timeout *t)
+{
+	int64_t now = uh_monotonic_ms();
+	struct peer *p;
+	int i;
+
+	for (i = 0; i < PEER_TABLE_SIZE; i++) {
+		p = &table[i];
+		if (!p->used || p->conns)
+			continue;
+
+		peer_refill(p, now);
+		if (p->tokens < conf.peer_request_burst * PEER_TOKEN)
+			continue;
+
+		/* Another entry may move into this slot */
+		peer_remove(p);
+		i--;
+	}
+
+	if (n_peers)
+		uloop_timeout_set(t, PEER_EXPIRE_INTERVAL);
+}
+
+bool peer_connect(const struct uh_addr *addr)
+{
+	struct peer *p = peer_find(addr, true);
+
+	/* Without room to track the address it is not limited */
+	if (!p) {
+		stats.untracked++;
+		return true;
+	}
+
+	if (conf.peer_max_connections && p->conns >= conf.peer_max_connections) {
+		stats.refused++;
+		return false;
+	}
+
+	p->conns++;
+	return true;
+}
+
+void peer_disconnect(const struct uh_addr *addr)
+{
+	struct peer *p = peer_find(addr, false);
+
+	if (p && p->conns)
+		p->conns--;
+}
+
+bool peer_request(struct client *cl)
+{
+	struct peer *p;
+
+	if (!conf.peer_request_rate)
+		return true;
+
+	p = peer_find(&cl->peer_addr, true);
+	if (!p)
+		return true;
+
+	peer_refill(p, uh_monotonic_ms());
+	if (p->tokens < PEER_TOKEN) {
+		stats.limited++;
+		return false;
+	}
+
+	p->tokens -= PEER_TOKEN;
+	return true;
+}
+
+void peer_for_each(void (*cb)(const struct uh_addr *addr, int conns, int tokens, void *priv),
+		   void *priv)
+{
+	int64_t now = uh_monotonic_ms();
+	int i;
+
+	for (i = 0; i < PEER_TABLE_SIZE; i++) {
+		if (!table[i].used)
+			continue;
+
+		peer_refill(&table[i], now);
+		cb(&table[i].addr, table[i].conns, table[i].tokens / PEER_TOKEN, priv);
+	}
+}
+
+void peer_get_stats(struct peer_stats *s)
+{
+	*s = stats;
+	s->tracked = n_peers;
+}
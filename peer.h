@@ -0,0 +1,66 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: peer.h
+ * Description: per source address connection limits and request rate
+ * limiting.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#ifndef PEER_H_
+#define PEER_H_
+
+#include <stdbool.h>
+
+#include "uhttpd.h"
+
+/**
+ * Source address limiting statistics
+ */
+struct peer_stats {
+	int tracked;		/* Addresses in the table */
+	int refused;		/* Connections refused over the per address limit */
+	int limited;		/* Requests refused by the rate limit */
+	int untracked;		/* Connections accepted while the table was full */
+};
+
+/**
+ * Count a new connection of an address
+ * @addr the peer address
+ * @return false when the address holds too many connections
+ */
+bool peer_connect(const struct uh_addr *addr);
+
+/**
+ * Forget a connection counted by peer_connect()
+ * @addr the peer address
+ */
+void peer_disconnect(const struct uh_addr *addr);
+
+/**
+ * Take a request token from the bucket of the client address
+ * @cl the client that made the request
+ * @return false when the address sends requests too fast
+ */
+bool peer_request(struct client *cl);
+
+/**
+ * Call a function for every tracked address
+ * @cb the function, gets the address, its connections and the requests
+ * it can make right away
+ * @priv passed to the function
+ */
+void peer_for_each(void (*cb)(const struct uh_addr *addr, int conns, int tokens, void *priv),
+		   void *priv);
+
+/**
+ * Get the source address limiting statistics
+ * @s the statistics to fill in
+ */
+void peer_get_stats(struct peer_stats *s);
+
+#endif /* PEER_H_ */
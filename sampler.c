@@ -0,0 +1,226 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: sampler.c
+ * Description: samples system statistics in the background. Each
+ * source runs from its own uloop timer and publishes double-buffered
+ * snapshots, API handlers only read the published one.
+ *
+ * Created by: Daan Pape
+ * Created on: June 15, 2014
+ */
+
+#include <sys/vfs.h>
+#include <sys/sysinfo.h>
+#include <inttypes.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "sampler.h"
+#include "websocket.h"
+#include "gethandlers.h"
+
+/**
+ * Take a sample and publish it when it succeeds
+ */
+static void sampler_cb(struct uloop_timeout *t)
+{
+	struct sampler *s = container_of(t, struct sampler, timer);
+	int back = s->cur == 0 ? 1 : 0;
+	const char * const *call;
+	bool changed;
+
+	memset(s->snap[back], 0, s->size);
+	if (s->sample(s->snap[back])) {
+		changed = s->cur < 0 || memcmp(s->snap[back], s->snap[s->cur], s->size);
+		s->cur = back;
+		s->taken = uh_monotonic();
+
+		for (call = s->calls; changed && call && *call; call++)
+			ws_publish_call(*call);
+	}
+
+	/* Waiting calls complete, or fail when the source has no snapshot */
+	s->tried = true;
+	get_sampled();
+
+	uloop_timeout_set(t, s->interval);
+}
+
+bool sampler_add(struct sampler *s)
+{
+	s->snap[0] = calloc(2, s->size);
+	if (!s->snap[0])
+		return false;
+
+	s->snap[1] = (char *) s->snap[0] + s->size;
+	s->cur = -1;
+	s->timer.cb = sampler_cb;
+	sampler_cb(&s->timer);
+
+	if (s->cur < 0)
+		fprintf(stderr, "[WARNING] Could not sample %s\n", s->name);
+
+	return true;
+}
+
+const void *sampler_read(const struct sampler *s)
+{
+	if (s->cur < 0)
+		return NULL;
+
+	return s->snap[s->cur];
+}
+
+/**
+ * Sample the usage of the data file system
+ */
+static bool sample_disk(void *snap)
+{
+	struct sample_disk *d = snap;
+	struct statfs st;
+
+	if (statfs(STATS_DISK_PATH, &st))
+		return false;
+
+	d->total = (uint64_t) st.f_blocks * st.f_frsize;
+	d->free = (uint64_t) st.f_bavail * st.f_frsize;
+
+	return true;
+}
+
+/**
+ * Sample memory, load and uptime, one system call covers them all
+ */
+static bool sample_system(void *snap)
+{
+	struct sample_system *sys = snap;
+	struct sysinfo si;
+	int i;
+
+	if (sysinfo(&si))
+		return false;
+
+	sys->mem_total = (uint64_t) si.totalram * si.mem_unit;
+	sys->mem_free = (uint64_t) si.freeram * si.mem_unit;
+	sys->mem_shared = (uint64_t) si.sharedram * si.mem_unit;
+	sys->mem_buffered = (uint64_t) si.bufferram * si.mem_unit;
+	sys->swap_total = (uint64_t) si.totalswap * si.mem_unit;
+	sys->swap_free = (uint64_t) si.freeswap * si.mem_unit;
+
+	for (i = 0; i < 3; i++)
+		sys->load[i] = (double) si.loads[i] / (1 << SI_LOAD_SHIFT);
+
+	sys->uptime = si.uptime;
+	sys->procs = si.procs;
+
+	return true;
+}
+
+/**
+ * Sample the interface counters from /proc/net/dev
+ */
+static bool sample_net(void *snap)
+{
+	struct sample_net *net = snap;
+	char line[512], *name, *colon;
+	FILE *f;
+	int n;
+
+	f = fopen("/proc/net/dev", "r");
+	if (!f)
+		return false;
+
+	while (fgets(line, sizeof(line), f) && net->n_ifaces < STATS_MAX_INTERFACES) {
+		/* The two header lines have no colon */
+		colon = strchr(line, ':');
+		if (!colon)
+			continue;
+
+		*colon = 0;
+		name = line + strspn(line, " ");
+		n = net->n_ifaces;
+
+		if (sscanf(colon + 1,
+			   "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %*u %*u %*u %*u"
+			   " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+			   &net->ifaces[n].rx_bytes, &net->ifaces[n].rx_packets,
+			   &net->ifaces[n].rx_errors, &net->ifaces[n].rx_dropped,
+			   &net->ifaces[n].tx_bytes, &net->ifaces[n].tx_packets,
+			   &net->ifaces[n].tx_errors, &net->ifaces[n].tx_dropped) != 8)
+			continue;
+
+		snprintf(net->ifaces[n].name, sizeof(net->ifaces[n].name), "%s", name);
+		net->n_ifaces++;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static const char * const disk_calls[] = { "freespace", NULL };
+static const char * const system_calls[] = { "memory", "load", "uptime", NULL };
+static const char * const net_calls[] = { "interfaces", NULL };
+
+static struct sampler disk_sampler = {
+	.name = "disk",
+	.interval = STATS_DISK_INTERVAL,
+	.size = sizeof(struct sample_disk),
+	.sample = sample_disk,
+	.calls = disk_calls,
+};
+
+static struct sampler system_sampler = {
+	.name = "system",
+	.interval = STATS_SYSTEM_INTERVAL,
+	.size = sizeof(struct sample_system),
+	.sample = sample_system,
+	.calls = system_calls,
+};
+
+static struct sampler net_sampler = {
+	.name = "interfaces",
+	.interval = STATS_NET_INTERVAL,
+	.size = sizeof(struct sample_net),
+	.sample = sample_net,
+	.calls = net_calls,
+};
+
+void sampler_init(void)
+{
+	sampler_add(&disk_sampler);
+	sampler_add(&system_sampler);
+	sampler_add(&net_sampler);
+}
+
+const struct sample_disk *sampler_disk(void)
+{
+	return sampler_read(&disk_sampler);
+}
+
+const struct sample_system *sampler_system(void)
+{
+	return sampler_read(&system_sampler);
+}
+
+const struct sample_net *sampler_net(void)
+{
+	return sampler_read(&net_sampler);
+}
+
+bool sampler_disk_tried(void)
+{
+	return disk_sampler.tried;
+}
+
+bool sampler_system_tried(void)
+{
+	return system_sampler.tried;
+}
+
+bool sampler_net_tried(void)
+{
+	return net_sampler.tried;
+}
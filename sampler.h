@@ -0,0 +1,112 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: sampler.h
+ * Description: samples system statistics in the background so API
+ * handlers can read them without system calls.
+ *
+ * Created by: Daan Pape
+ * Created on: June 15, 2014
+ */
+
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <net/if.h>
+
+#include <libubox/uloop.h>
+
+#include "config.h"
+
+/**
+ * A metric source sampled on a timer. Every sample is taken into the
+ * back buffer, which becomes the published snapshot only when the
+ * sample succeeds, so readers always see a complete snapshot. When a
+ * snapshot differs from the previous one the API calls reading the
+ * source are pushed to their WebSocket subscribers.
+ */
+struct sampler {
+	const char *name;
+	int interval;					/* Milliseconds between samples */
+	int size;						/* The size of a snapshot */
+	bool (*sample)(void *snap);		/* Fill a snapshot, false on failure */
+	const char * const *calls;		/* API calls reading the source, NULL terminated */
+
+	/* Private */
+	struct uloop_timeout timer;
+	void *snap[2];
+	int cur;						/* The published snapshot, -1 before the first */
+	bool tried;						/* The first sample was attempted */
+	time_t taken;					/* Monotonic time of the published snapshot */
+};
+
+/**
+ * File system usage
+ */
+struct sample_disk {
+	uint64_t total;					/* Bytes */
+	uint64_t free;					/* Bytes available to users */
+};
+
+/**
+ * Memory, load and uptime
+ */
+struct sample_system {
+	uint64_t mem_total;				/* Bytes */
+	uint64_t mem_free;
+	uint64_t mem_shared;
+	uint64_t mem_buffered;
+	uint64_t swap_total;
+	uint64_t swap_free;
+	double load[3];					/* 1, 5 and 15 minute load averages */
+	long uptime;					/* Seconds */
+	int procs;						/* Number of processes */
+};
+
+/**
+ * Network interface counters
+ */
+struct sample_net {
+	int n_ifaces;
+	struct {
+		char name[IF_NAMESIZE];
+		uint64_t rx_bytes, rx_packets, rx_errors, rx_dropped;
+		uint64_t tx_bytes, tx_packets, tx_errors, tx_dropped;
+	} ifaces[STATS_MAX_INTERFACES];
+};
+
+/**
+ * Start sampling a metric source, the first sample is taken right away
+ * @s the source, must stay valid
+ * @return false when the snapshots could not be allocated
+ */
+bool sampler_add(struct sampler *s);
+
+/**
+ * Get the published snapshot of a source
+ * @s the source
+ * @return NULL when no sample succeeded yet
+ */
+const void *sampler_read(const struct sampler *s);
+
+/**
+ * Start the built-in system statistics sources, call after uloop_init()
+ */
+void sampler_init(void);
+
+/* Snapshots of the built-in sources, NULL when not available */
+const struct sample_disk *sampler_disk(void);
+const struct sample_system *sampler_system(void);
+const struct sample_net *sampler_net(void);
+
+/* True once the first sample of a built-in source was attempted */
+bool sampler_disk_tried(void);
+bool sampler_system_tried(void);
+bool sampler_net_tried(void);
+
+#endif /* SAMPLER_H_ */
@@ -0,0 +1,1035 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: script.c
+ * Description: runs the scripts under the API document root. A pool of
+ * worker processes is forked when the server starts, each connected to
+ * the server by a Unix socket. A request is sent to an idle worker as a
+ * single message holding the CGI environment and the request body, the
+ * worker runs the script and returns its output in length prefixed
+ * frames followed by the exit status. The server never forks while it
+ * serves and at most max_script_requests scripts run at once, other
+ * requests wait in a queue.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <limits.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <poll.h>
+#include <time.h>
+
+#include <libubox/blobmsg.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "client.h"
+#include "window.h"
+#include "script.h"
+
+/**
+ * A request sent to a worker, followed by the script path and the
+ * environment as NUL terminated strings and then the body
+ */
+struct script_msg {
+	uint32_t env_len;
+	uint32_t body_len;
+	uint32_t timeout;		/* Seconds the script may run */
+};
+
+/* Exit status reported for a script killed after its timeout */
+#define SCRIPT_STATUS_TIMEOUT	-1
+
+enum script_frame {
+	SCRIPT_FRAME_LEN,		/* Reading the length of a frame */
+	SCRIPT_FRAME_DATA,		/* Reading the data of a frame */
+	SCRIPT_FRAME_STATUS,	/* Reading the exit status after the last frame */
+};
+
+/**
+ * A worker process as seen by the server
+ */
+struct script_worker {
+	struct ustream_fd sfd;
+	struct uloop_process proc;
+	struct uloop_timeout timeout;	/* Kills a worker that does not answer */
+	struct uloop_timeout resume;	/* Continues reading from the event loop */
+
+	bool running;
+	bool busy;
+	struct client *cl;				/* NULL when the client went away */
+
+	/* Response parsing */
+	enum script_frame frame;
+	uint8_t num[4];					/* Length or status being read */
+	int num_len;
+	uint32_t left;					/* Bytes left in the data frame */
+	char *head;						/* The script headers until they are complete */
+	int head_len;
+	bool head_done;
+};
+
+static struct script_worker *workers;
+static int n_workers;
+
+/* Requests waiting for a worker */
+static LIST_HEAD(script_queue);
+
+static struct script_stats stats;
+
+static void script_spawn_cb(struct uloop_timeout *t);
+
+/* Starts the workers that are not running */
+static struct uloop_timeout spawn_timer = {
+	.cb = script_spawn_cb
+};
+
+static void script_next(void);
+
+/**
+ * Read until a buffer is full
+ * @fd the descriptor to read
+ * @buf the buffer
+ * @len the number of bytes to read
+ * @return false on end of file or an error
+ */
+static bool read_full(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+
+		buf = (char *) buf + r;
+		len -= r;
+	}
+
+	return true;
+}
+
+/**
+ * Write a complete buffer
+ * @fd the descriptor to write
+ * @buf the data
+ * @len the number of bytes to write
+ * @return false on an error
+ */
+static bool write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+
+		buf = (const char *) buf + r;
+		len -= r;
+	}
+
+	return true;
+}
+
+/**
+ * Send a frame of script output to the server, a zero length frame
+ * ends the output
+ * @fd the server socket
+ * @data the output
+ * @len the length of the output
+ */
+static void worker_frame(int fd, const void *data, uint32_t len)
+{
+	if (!write_full(fd, &len, sizeof(len)) || !write_full(fd, data, len))
+		_exit(EXIT_FAILURE);
+}
+
+/**
+ * Run a script and send its output to the server
+ * @fd the server socket
+ * @msg the request
+ * @env the script path followed by the environment
+ * @body the request body
+ * @return the exit status of the script
+ */
+static int worker_run(int fd, const struct script_msg *msg, char *env, const char *body)
+{
+	char *envp[SCRIPT_MAX_ENV + 1], *path = env, *dir, *c;
+	char buf[WORKING_BUFF_SIZE];
+	int in[2], out[2], n = 0, status;
+	uint32_t written = 0;
+	struct pollfd pfd[2];
+	int64_t deadline;
+	bool killed = false;
+	ssize_t r;
+	pid_t pid;
+
+	for (c = env + strlen(env) + 1; c < env + msg->env_len && n < SCRIPT_MAX_ENV;
+	     c += strlen(c) + 1)
+		envp[n++] = c;
+	envp[n] = NULL;
+
+	if (pipe(in))
+		return 127;
+
+	if (pipe(out)) {
+		close(in[0]);
+		close(in[1]);
+		return 127;
+	}
+
+	pid = fork();
+	if (!pid) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		close(fd);
+
+		/* Scripts run in their own directory */
+		dir = strdup(path);
+		if (dir && (c = strrchr(dir, '/'))) {
+			*c = 0;
+			if (chdir(*dir ? dir : "/"))
+				_exit(127);
+		}
+
+		execle(path, path, (char *) NULL, envp);
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+
+	if (pid < 0) {
+		close(in[1]);
+		close(out[0]);
+		return 127;
+	}
+
+	/* Scripts that do not read their body just get an empty input */
+	if (!msg->body_len) {
+		close(in[1]);
+		in[1] = -1;
+	}
+
+	deadline = uh_monotonic_ms() + (int64_t) msg->timeout * 1000;
+
+	while (out[0] >= 0) {
+		pfd[0].fd = out[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = in[1];
+		pfd[1].events = POLLOUT;
+
+		r = poll(pfd, in[1] >= 0 ? 2 : 1, max(deadline - uh_monotonic_ms(), 0));
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (!r) {
+			kill(pid, SIGKILL);
+			killed = true;
+			break;
+		}
+
+		if (in[1] >= 0 && pfd[1].revents) {
+			r = write(in[1], body + written, msg->body_len - written);
+			if (r > 0)
+				written += r;
+
+			if ((r < 0 && errno != EINTR && errno != EAGAIN) ||
+			    written == msg->body_len) {
+				close(in[1]);
+				in[1] = -1;
+			}
+		}
+
+		if (pfd[0].revents) {
+			r = read(out[0], buf, sizeof(buf));
+			if (r < 0 && errno == EINTR)
+				continue;
+
+			if (r <= 0) {
+				close(out[0]);
+				out[0] = -1;
+			} else {
+				worker_frame(fd, buf, r);
+			}
+		}
+	}
+
+	if (in[1] >= 0)
+		close(in[1]);
+	if (out[0] >= 0)
+		close(out[0]);
+
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+	if (killed)
+		return SCRIPT_STATUS_TIMEOUT;
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+ * Close every descriptor a new worker inherited from the server, it
+ * must not keep client connections or listening sockets open
+ * @keep the descriptor to keep
+ */
+static void worker_close_fds(int keep)
+{
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *e;
+	int fd;
+
+	if (!dir) {
+		for (fd = 3; fd < 1024; fd++)
+			if (fd != keep)
+				close(fd);
+		return;
+	}
+
+	while ((e = readdir(dir))) {
+		fd = atoi(e->d_name);
+		if (fd > 2 && fd != keep && fd != dirfd(dir))
+			close(fd);
+	}
+
+	closedir(dir);
+}
+
+/**
+ * The main loop of a worker process, runs the requests the server sends
+ * until the server closes the socket
+ * @fd the server socket
+ */
+static void __attribute__((noreturn)) worker_main(int fd)
+{
+	struct script_msg msg;
+	sigset_t set;
+	char *buf;
+	int32_t status;
+	int sig;
+
+	worker_close_fds(fd);
+
+	/* The signal handlers of the server have no business here */
+	for (sig = 1; sig < NSIG; sig++)
+		signal(sig, SIG_DFL);
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&set);
+	sigprocmask(SIG_SETMASK, &set, NULL);
+
+	/* The server kills the worker together with its script */
+	setpgid(0, 0);
+
+	while (read_full(fd, &msg, sizeof(msg))) {
+		if (!msg.env_len || msg.env_len > SCRIPT_MAX_MSG ||
+		    msg.body_len > SCRIPT_MAX_MSG)
+			break;
+
+		buf = malloc(msg.env_len + msg.body_len + 1);
+		if (!buf || !read_full(fd, buf, msg.env_len + msg.body_len))
+			break;
+
+		buf[msg.env_len - 1] = 0;
+		status = worker_run(fd, &msg, buf, buf + msg.env_len);
+		free(buf);
+
+		worker_frame(fd, NULL, 0);
+		if (!write_full(fd, &status, sizeof(status)))
+			break;
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+/**
+ * Take a worker out of service, its client gets an error
+ * @w the worker
+ */
+static void script_worker_stop(struct script_worker *w)
+{
+	struct client *cl = w->cl;
+
+	if (!w->running)
+		return;
+
+	w->running = false;
+	w->busy = false;
+	w->cl = NULL;
+	uloop_timeout_cancel(&w->timeout);
+	uloop_timeout_cancel(&w->resume);
+	uloop_process_delete(&w->proc);
+	ustream_free(&w->sfd.stream);
+	close(w->sfd.fd.fd);
+	free(w->head);
+	w->head = NULL;
+
+	/* The worker may be stuck, take its script along */
+	kill(-w->proc.pid, SIGKILL);
+	kill(w->proc.pid, SIGKILL);
+
+	if (cl) {
+		cl->dispatch.script.worker = NULL;
+		if (w->head_done)
+			close_connection(cl);
+		else
+			send_client_error(cl, 502, "Bad Gateway", "The script failed.");
+	}
+
+	uloop_timeout_set(&spawn_timer, SCRIPT_RESPAWN_DELAY);
+}
+
+/**
+ * Called when a worker process exits
+ */
+static void script_worker_exit(struct uloop_process *p, int ret)
+{
+	struct script_worker *w = container_of(p, struct script_worker, proc);
+
+	fprintf(stderr, "[WARNING] Script worker %d exited\n", (int) p->pid);
+	script_worker_stop(w);
+}
+
+/**
+ * Called when a worker does not finish its script in time
+ */
+static void script_worker_timeout(struct uloop_timeout *t)
+{
+	struct script_worker *w = container_of(t, struct script_worker, timeout);
+
+	fprintf(stderr, "[WARNING] Script worker %d does not respond, killing it\n",
+		(int) w->proc.pid);
+	stats.timeouts++;
+	script_worker_stop(w);
+}
+
+/**
+ * Parse the CGI headers of the script output and write the response
+ * header
+ * @w the worker running the script
+ * @return false when the headers are malformed
+ */
+static bool script_head(struct script_worker *w)
+{
+	struct client *cl = w->cl;
+	char *line, *next, *val, *end, *msg = "OK";
+	int code = 200, length = HTTP_LENGTH_STREAM;
+	bool location = false;
+
+	/* Headers end with an empty line, scripts often use bare newlines */
+	w->head[w->head_len] = 0;
+	end = strstr(w->head, "\r\n\r\n");
+	if (end) {
+		end += 4;
+	} else if ((end = strstr(w->head, "\n\n"))) {
+		end += 2;
+	} else {
+		return true;
+	}
+
+	w->head_done = true;
+
+	/* First pass, find the status */
+	for (line = w->head; line < end; line = next) {
+		next = strchr(line, '\n') + 1;
+		if (!strncasecmp(line, "Status:", 7)) {
+			code = strtol(line + 7, &val, 10);
+			while (*val == ' ')
+				val++;
+			msg = val;
+		} else if (!strncasecmp(line, "Location:", 9)) {
+			location = true;
+		} else if (!strncasecmp(line, "Content-Length:", 15)) {
+			length = atoi(line + 15);
+		}
+	}
+
+	if (code < 100 || code > 999)
+		return false;
+
+	if (location && code == 200) {
+		code = 302;
+		msg = "Found";
+	}
+
+	/* Terminate the status message and header lines */
+	for (line = w->head; line < end; line = next) {
+		next = strchr(line, '\n') + 1;
+		next[-1] = 0;
+		if (next - 2 >= line && next[-2] == '\r')
+			next[-2] = 0;
+	}
+
+	write_http_header(cl, code, msg, length);
+
+	for (line = w->head; line < end; line += strlen(line) + 1) {
+		while (line < end && !*line)
+			line++;
+
+		if (line >= end)
+			break;
+
+		val = strchr(line, ':');
+		if (!val || !strncasecmp(line, "Status:", 7) ||
+		    !strncasecmp(line, "Content-Length:", 15) ||
+		    !strncasecmp(line, "Connection:", 11) ||
+		    !strncasecmp(line, "Transfer-Encoding:", 18))
+			continue;
+
+		ustream_printf(cl->us, "%s\r\n", line);
+	}
+
+	ustream_printf(cl->us, "\r\n");
+
+	/* Output read past the headers is the start of the body */
+	if (w->head + w->head_len > end && cl->request.method != UH_HTTP_MSG_HEAD)
+		uh_chunk_write(cl, end, w->head + w->head_len - end);
+
+	free(w->head);
+	w->head = NULL;
+	w->head_len = 0;
+
+	return true;
+}
+
+/**
+ * Handle a frame of script output
+ * @w the worker running the script
+ * @data the output
+ * @len the length of the output
+ * @return false when the worker should stop reading for now
+ */
+static bool script_output(struct script_worker *w, const char *data, int *len)
+{
+	struct client *cl = w->cl;
+	int room;
+
+	/* The client went away, discard the output */
+	if (!cl)
+		return true;
+
+	if (!w->head_done) {
+		if (!w->head)
+			w->head = malloc(WORKING_BUFF_SIZE);
+
+		*len = min(*len, WORKING_BUFF_SIZE - 1 - w->head_len);
+		if (!w->head || !*len) {
+			w->head_done = true;
+			w->cl = NULL;
+			cl->dispatch.script.worker = NULL;
+			send_client_error(cl, 502, "Bad Gateway", "The script headers are too long.");
+			return true;
+		}
+
+		memcpy(w->head + w->head_len, data, *len);
+		w->head_len += *len;
+
+		if (!script_head(w)) {
+			w->cl = NULL;
+			cl->dispatch.script.worker = NULL;
+			send_client_error(cl, 502, "Bad Gateway", "The script sent a malformed header.");
+		}
+
+		return true;
+	}
+
+	if (cl->request.method == UH_HTTP_MSG_HEAD)
+		return true;
+
+	room = window_room(cl);
+	if (!room)
+		return false;
+
+	*len = min(*len, room);
+	uh_chunk_write(cl, data, *len);
+
+	return true;
+}
+
+/**
+ * Finish the request of a worker after the script exited
+ * @w the worker
+ * @status the exit status of the script
+ */
+static void script_finish(struct script_worker *w, int32_t status)
+{
+	struct client *cl = w->cl;
+
+	uloop_timeout_cancel(&w->timeout);
+	free(w->head);
+	w->head = NULL;
+	w->busy = false;
+	w->cl = NULL;
+
+	if (status == SCRIPT_STATUS_TIMEOUT)
+		stats.timeouts++;
+
+	if (cl) {
+		cl->dispatch.script.worker = NULL;
+		if (w->head_done)
+			request_done(cl);
+		else if (status == SCRIPT_STATUS_TIMEOUT)
+			send_client_error(cl, 504, "Gateway Timeout", "The script did not finish in time.");
+		else
+			send_client_error(cl, 502, "Bad Gateway", "The script sent no response.");
+	}
+
+	script_next();
+}
+
+/**
+ * Read the frames a worker sent
+ * @w the worker
+ */
+static void script_worker_read(struct script_worker *w)
+{
+	struct ustream *s = &w->sfd.stream;
+	int32_t status;
+	char *data;
+	int len, n;
+
+	while (w->busy && (data = ustream_get_read_buf(s, &len)) && len) {
+		switch (w->frame) {
+		case SCRIPT_FRAME_LEN:
+		case SCRIPT_FRAME_STATUS:
+			n = min(len, 4 - w->num_len);
+			memcpy(w->num + w->num_len, data, n);
+			w->num_len += n;
+			ustream_consume(s, n);
+
+			if (w->num_len < 4)
+				break;
+
+			w->num_len = 0;
+			if (w->frame == SCRIPT_FRAME_STATUS) {
+				memcpy(&status, w->num, sizeof(status));
+				w->frame = SCRIPT_FRAME_LEN;
+				script_finish(w, status);
+				break;
+			}
+
+			memcpy(&w->left, w->num, sizeof(w->left));
+			w->frame = w->left ? SCRIPT_FRAME_DATA : SCRIPT_FRAME_STATUS;
+			break;
+
+		case SCRIPT_FRAME_DATA:
+			n = min(len, w->left);
+			if (!script_output(w, data, &n)) {
+				/* The client buffers are full, continue from its write callback */
+				ustream_set_read_blocked(s, true);
+				return;
+			}
+
+			ustream_consume(s, n);
+			w->left -= n;
+			if (!w->left)
+				w->frame = SCRIPT_FRAME_LEN;
+			break;
+		}
+	}
+}
+
+static void script_worker_resume_cb(struct uloop_timeout *t)
+{
+	struct script_worker *w = container_of(t, struct script_worker, resume);
+
+	ustream_set_read_blocked(&w->sfd.stream, false);
+	script_worker_read(w);
+}
+
+static void script_worker_read_cb(struct ustream *s, int bytes)
+{
+	struct script_worker *w = container_of(s, struct script_worker, sfd.stream);
+
+	script_worker_read(w);
+}
+
+static void script_worker_state_cb(struct ustream *s)
+{
+	struct script_worker *w = container_of(s, struct script_worker, sfd.stream);
+
+	if (s->eof || s->write_error)
+		script_worker_stop(w);
+}
+
+/**
+ * Start a worker process
+ * @w the worker
+ * @return false when the process could not be started
+ */
+static bool script_worker_start(struct script_worker *w)
+{
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair()");
+		return false;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork()");
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
+
+	if (!pid)
+		worker_main(sv[1]);
+
+	close(sv[1]);
+
+	memset(w, 0, sizeof(*w));
+	w->sfd.stream.notify_read = script_worker_read_cb;
+	w->sfd.stream.notify_state = script_worker_state_cb;
+	ustream_fd_init(&w->sfd, sv[0]);
+
+	w->proc.pid = pid;
+	w->proc.cb = script_worker_exit;
+	uloop_process_add(&w->proc);
+
+	w->timeout.cb = script_worker_timeout;
+	w->resume.cb = script_worker_resume_cb;
+	w->running = true;
+
+	return true;
+}
+
+/**
+ * Start the workers that are not running
+ */
+static void script_spawn_cb(struct uloop_timeout *t)
+{
+	int i;
+
+	for (i = 0; i < n_workers; i++) {
+		if (workers[i].running)
+			continue;
+
+		if (!script_worker_start(&workers[i])) {
+			uloop_timeout_set(t, SCRIPT_RESPAWN_DELAY);
+			return;
+		}
+	}
+
+	script_next();
+}
+
+/**
+ * Continue a script response once the client buffers drained
+ * @cl the client
+ */
+static void script_write_cb(struct client *cl)
+{
+	struct script_worker *w = cl->dispatch.script.worker;
+
+	if (w)
+		uloop_timeout_set(&w->resume, 0);
+}
+
+/**
+ * Free the request of a client, a running script keeps going and its
+ * output is discarded
+ * @cl the client
+ */
+static void script_free(struct client *cl)
+{
+	struct script_worker *w = cl->dispatch.script.worker;
+
+	if (w) {
+		w->cl = NULL;
+		uloop_timeout_set(&w->resume, 0);
+	}
+
+	if (cl->dispatch.script.queued) {
+		list_del(&cl->dispatch.script.list);
+		cl->dispatch.script.queued = false;
+		stats.queued--;
+	}
+
+	free(cl->dispatch.script.msg);
+	cl->dispatch.script.msg = NULL;
+	cl->dispatch.script.worker = NULL;
+}
+
+/**
+ * Hand the waiting requests to idle workers
+ */
+static void script_next(void)
+{
+	struct script_worker *w;
+	struct client *cl;
+	int i, busy = 0;
+
+	for (i = 0; i < n_workers; i++)
+		busy += workers[i].busy;
+
+	for (i = 0; i < n_workers && busy < conf.max_script_requests; i++) {
+		w = &workers[i];
+		if (!w->running || w->busy)
+			continue;
+
+		if (list_empty(&script_queue))
+			return;
+
+		cl = list_first_entry(&script_queue, struct client, dispatch.script.list);
+		list_del(&cl->dispatch.script.list);
+		cl->dispatch.script.queued = false;
+		stats.queued--;
+
+		/* The script timeout covers the client from now on */
+		uloop_timeout_cancel(&cl->timeout);
+
+		w->busy = true;
+		w->cl = cl;
+		w->frame = SCRIPT_FRAME_LEN;
+		w->num_len = 0;
+		w->head_done = false;
+		w->head_len = 0;
+		cl->dispatch.script.worker = w;
+
+		ustream_write(&w->sfd.stream, cl->dispatch.script.msg,
+			      cl->dispatch.script.msg_len, false);
+		free(cl->dispatch.script.msg);
+		cl->dispatch.script.msg = NULL;
+
+		/* The worker enforces the timeout, this catches a stuck worker */
+		uloop_timeout_set(&w->timeout, (conf.script_timeout + SCRIPT_KILL_GRACE) * 1000);
+
+		stats.requests++;
+		busy++;
+	}
+}
+
+/**
+ * A growing buffer holding the request for a worker
+ */
+struct script_buf {
+	char *data;
+	int len, size;
+};
+
+/**
+ * Append to a request buffer
+ * @b the buffer
+ * @data the data
+ * @len the length of the data
+ */
+static void script_buf_add(struct script_buf *b, const void *data, int len)
+{
+	char *p;
+
+	if (!b->data && b->size)
+		return;
+
+	if (b->len + len > b->size) {
+		b->size = max(b->size * 2, b->len + len + WORKING_BUFF_SIZE);
+		p = realloc(b->data, b->size);
+		if (!p) {
+			free(b->data);
+			b->data = NULL;
+			return;
+		}
+
+		b->data = p;
+	}
+
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+/**
+ * Append an environment variable to a request buffer
+ * @b the buffer
+ * @name the name of the variable
+ * @fmt the value format
+ */
+static void __printf(3, 4) script_env(struct script_buf *b, const char *name, const char *fmt, ...)
+{
+	char val[PATH_MAX + 64];
+	va_list arg;
+
+	va_start(arg, fmt);
+	vsnprintf(val, sizeof(val), fmt, arg);
+	va_end(arg);
+
+	script_buf_add(b, name, strlen(name));
+	script_buf_add(b, "=", 1);
+	script_buf_add(b, val, strlen(val) + 1);
+}
+
+/**
+ * Format the address of a socket
+ * @addr the address
+ * @buf the buffer for the text
+ * @len the size of the buffer
+ */
+static const char *script_addr(const struct uh_addr *addr, char *buf, int len)
+{
+	if (!inet_ntop(addr->family, &addr->in6, buf, len))
+		snprintf(buf, len, "unknown");
+
+	return buf;
+}
+
+/**
+ * Build the request message for a worker, holding the CGI environment
+ * and the body
+ * @cl the client that made the request
+ * @url the request URL
+ * @path the script file
+ * @name the call name
+ * @return the message length, 0 when it could not be built
+ */
+static int script_build(struct client *cl, const char *url, const char *path, const char *name)
+{
+	struct script_buf b = {};
+	struct script_msg msg = {};
+	const char *info = url + API_STR_LEN + strlen(name);
+	const char *query = strchr(url, '?');
+	const char *body = cl->ispostdata && cl->postdata ? cl->postdata : "";
+	char addr[INET6_ADDRSTRLEN], var[128], *c;
+	struct blob_attr *cur;
+	int rem;
+
+	script_buf_add(&b, &msg, sizeof(msg));
+	script_buf_add(&b, path, strlen(path) + 1);
+
+	script_env(&b, "GATEWAY_INTERFACE", "CGI/1.1");
+	script_env(&b, "SERVER_SOFTWARE", "woodbox-server");
+	script_env(&b, "SERVER_PROTOCOL", "%s", http_versions[cl->request.version]);
+	script_env(&b, "REQUEST_METHOD", "%s", http_methods[cl->request.method]);
+	script_env(&b, "REQUEST_URI", "%s", url);
+	script_env(&b, "SCRIPT_NAME", "%s%s", API_PATH "/", name);
+	script_env(&b, "SCRIPT_FILENAME", "%s", path);
+	script_env(&b, "PATH_INFO", "%.*s", (int) strcspn(info, "?"), info);
+	script_env(&b, "QUERY_STRING", "%s", query ? query + 1 : "");
+	script_env(&b, "REMOTE_ADDR", "%s", script_addr(&cl->peer_addr, addr, sizeof(addr)));
+	script_env(&b, "REMOTE_PORT", "%d", cl->peer_addr.port);
+	script_env(&b, "SERVER_ADDR", "%s", script_addr(&cl->srv_addr, addr, sizeof(addr)));
+	script_env(&b, "SERVER_PORT", "%d", cl->srv_addr.port);
+	script_env(&b, "DOCUMENT_ROOT", "%s", conf.cgi_docroot_path);
+	script_env(&b, "PATH", "%s", conf.cgi_path);
+	script_env(&b, "CONTENT_LENGTH", "%d", (int) strlen(body));
+	if (cl->tls)
+		script_env(&b, "HTTPS", "on");
+
+	/* Request headers are passed as HTTP_ variables, the first entry is the URL */
+	blob_for_each_attr(cur, cl->hdr.head, rem) {
+		if (cur == blob_data(cl->hdr.head))
+			continue;
+
+		snprintf(var, sizeof(var), "HTTP_%s", blobmsg_name(cur));
+		for (c = var; *c; c++)
+			*c = *c == '-' ? '_' : toupper((unsigned char) *c);
+
+		if (!strcmp(var, "HTTP_CONTENT_TYPE"))
+			script_env(&b, "CONTENT_TYPE", "%s", (char *) blobmsg_data(cur));
+		else if (strcmp(var, "HTTP_CONTENT_LENGTH") && strcmp(var, "HTTP_AUTHORIZATION"))
+			script_env(&b, var, "%s", (char *) blobmsg_data(cur));
+	}
+
+	msg.env_len = b.len - sizeof(msg);
+	msg.body_len = strlen(body);
+	msg.timeout = conf.script_timeout;
+	script_buf_add(&b, body, msg.body_len);
+
+	if (!b.data || msg.env_len > SCRIPT_MAX_MSG || msg.body_len > SCRIPT_MAX_MSG) {
+		free(b.data);
+		return 0;
+	}
+
+	memcpy(b.data, &msg, sizeof(msg));
+	cl->dispatch.script.msg = b.data;
+
+	return b.len;
+}
+
+bool script_request(struct client *cl, const char *url, const char *name, int len)
+{
+	char path[PATH_MAX], call[NAME_MAX + 1];
+	struct stat st;
+
+	if (!n_workers || len > NAME_MAX || !len || name[0] == '.')
+		return false;
+
+	memcpy(call, name, len);
+	call[len] = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", conf.cgi_docroot_path, call);
+	if (stat(path, &st) || !S_ISREG(st.st_mode) || access(path, X_OK))
+		return false;
+
+	if (stats.queued >= SCRIPT_QUEUE_MAX) {
+		stats.rejected++;
+		send_client_error(cl, 503, "Service Unavailable", "Too many scripts are waiting.");
+		return true;
+	}
+
+	cl->dispatch.script.msg_len = script_build(cl, url, path, call);
+	if (!cl->dispatch.script.msg_len) {
+		send_client_error(cl, 413, "Request Entity Too Large", "The request is too large for a script.");
+		return true;
+	}
+
+	/* Waiting for a worker may take as long as running the script */
+	if (!cl->h2_stream)
+		uloop_timeout_set(&cl->timeout, conf.script_timeout * 1000);
+
+	cl->dispatch.script.worker = NULL;
+	cl->dispatch.script.queued = true;
+	cl->dispatch.write_cb = script_write_cb;
+	cl->dispatch.free = script_free;
+	list_add_tail(&cl->dispatch.script.list, &script_queue);
+	stats.queued++;
+
+	script_next();
+	return true;
+}
+
+void script_init(void)
+{
+	struct stat st;
+	int i;
+
+	if (!conf.script_workers || stat(conf.cgi_docroot_path, &st) || !S_ISDIR(st.st_mode))
+		return;
+
+	workers = calloc(conf.script_workers, sizeof(*workers));
+	if (!workers)
+		return;
+
+	n_workers = conf.script_workers;
+	for (i = 0; i < n_workers; i++)
+		if (!script_worker_start(&workers[i]))
+			uloop_timeout_set(&spawn_timer, SCRIPT_RESPAWN_DELAY);
+}
+
+void script_get_stats(struct script_stats *s)
+{
+	int i;
+
+	*s = stats;
+	s->workers = s->busy = 0;
+	for (i = 0; i < n_workers; i++) {
+		s->workers += workers[i].running;
+		s->busy += workers[i].busy;
+	}
+}
@@ -0,0 +1,55 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: script.h
+ * Description: runs the scripts under the API document root in a pool
+ * of worker processes started with the server.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#ifndef SCRIPT_H_
+#define SCRIPT_H_
+
+#include <stdbool.h>
+
+#include "uhttpd.h"
+
+/**
+ * Script execution statistics
+ */
+struct script_stats {
+	int workers;		/* Running worker processes */
+	int busy;			/* Workers running a script */
+	int queued;			/* Requests waiting for a worker */
+	int requests;		/* Scripts run */
+	int timeouts;		/* Scripts killed after script_timeout */
+	int rejected;		/* Requests refused because the queue was full */
+};
+
+/**
+ * Start the worker processes, call after uloop_init(). Nothing is
+ * started when the script directory does not exist.
+ */
+void script_init(void);
+
+/**
+ * Run the script an API call names when there is one
+ * @cl the client that made the request
+ * @url the request URL
+ * @name the call name, the script file under conf.cgi_docroot_path
+ * @len the length of the call name
+ * @return false when there is no such script
+ */
+bool script_request(struct client *cl, const char *url, const char *name, int len);
+
+/**
+ * Get the script execution statistics
+ * @s the statistics to fill in
+ */
+void script_get_stats(struct script_stats *s);
+
+#endif /* SCRIPT_H_ */
@@ -17,10 +17,17 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
 #include <dlfcn.h>
+#ifdef HAVE_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
 #include "uhttpd.h"
+#include "config.h"
 #include "tls.h"
 #include "client.h"
+#include "budget.h"
 
 #ifdef __APPLE__
 #define LIB_EXT "dylib"
@@ -28,10 +35,592 @@
 #define LIB_EXT "so"
 #endif
 
+/* OpenSSL control codes, the library itself is resolved at runtime */
+#define SSL_CTRL_SET_SESS_CACHE_SIZE		42
+#define SSL_CTRL_SET_SESS_CACHE_MODE		44
+#define SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB	72
+#define SSL_SESS_CACHE_SERVER				0x0002
+#define SSL_TLSEXT_ERR_OK					0
+#define SSL_TLSEXT_ERR_NOACK				3
+
+#define TICKET_NAME_LEN		16
+#define TICKET_KEY_LEN		32
+
+#ifdef HAVE_KTLS
+#ifndef SOL_TLS
+#define SOL_TLS		282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP		31
+#endif
+
+#define TLS1_2_VERSION_ID		0x0303
+#define SSL_OP_NO_RENEGOTIATION	(1UL << 30)
+#define TLS_RANDOM_LEN			32
+#define TLS_MASTER_LEN			48
+#endif
+
 static struct ustream_ssl_ops *ops;
 static void *dlh;
 static void *ctx;
 
+/**
+ * OpenSSL functions used for session resumption, these are looked up
+ * through the ustream-ssl library so nothing is needed when ustream-ssl
+ * uses another backend.
+ */
+static struct {
+	long (*ctx_ctrl)(void *ctx, int cmd, long larg, void *parg);
+	long (*ctx_callback_ctrl)(void *ctx, int cmd, void (*fp)(void));
+	long (*ctx_set_timeout)(void *ctx, long t);
+	int (*ctx_set_session_id_context)(void *ctx, const unsigned char *sid, unsigned int len);
+	void (*ctx_flush_sessions)(void *ctx, long tm);
+	int (*rand_bytes)(unsigned char *buf, int num);
+	const void *(*aes_256_cbc)(void);
+	const void *(*sha256)(void);
+	int (*encrypt_init)(void *ectx, const void *cipher, void *impl,
+			    const unsigned char *key, const unsigned char *iv);
+	int (*decrypt_init)(void *ectx, const void *cipher, void *impl,
+			    const unsigned char *key, const unsigned char *iv);
+	int (*hmac_init)(void *hctx, const void *key, int len, const void *md, void *impl);
+	void (*ctx_set_alpn_select_cb)(void *ctx,
+			int (*cb)(void *ssl, const unsigned char **out, unsigned char *outlen,
+				  const unsigned char *in, unsigned int inlen, void *arg),
+			void *arg);
+#ifdef HAVE_KTLS
+	int (*version)(const void *ssl);
+	const void *(*get_current_cipher)(const void *ssl);
+	unsigned long (*cipher_get_id)(const void *cipher);
+	size_t (*get_client_random)(const void *ssl, unsigned char *out, size_t len);
+	size_t (*get_server_random)(const void *ssl, unsigned char *out, size_t len);
+	void *(*get_session)(const void *ssl);
+	size_t (*session_get_master_key)(const void *sess, unsigned char *out, size_t len);
+	void (*set_quiet_shutdown)(void *ssl, int mode);
+	unsigned long (*set_options)(void *ssl, unsigned long op);
+	const void *(*sha384)(void);
+	unsigned char *(*hmac)(const void *md, const void *key, int key_len,
+			       const unsigned char *d, size_t n, unsigned char *out,
+			       unsigned int *out_len);
+	const void *(*bio_s_mem)(void);
+	void *(*bio_new)(const void *type);
+	int (*bio_free)(void *bio);
+	size_t (*bio_ctrl_pending)(void *bio);
+	void *(*get_wbio)(const void *ssl);
+	void (*set0_wbio)(void *ssl, void *bio);
+#endif
+} ossl;
+
+/**
+ * A session ticket key, valid for encryption during its rotation
+ * slot and for decryption during the slot after that.
+ */
+struct tls_ticket_key {
+	unsigned long slot;
+	unsigned char name[TICKET_NAME_LEN];
+	unsigned char hmac[TICKET_KEY_LEN];
+	unsigned char aes[TICKET_KEY_LEN];
+};
+
+/**
+ * The ticket keys live in shared memory so all worker processes
+ * forked from the server issue and accept the same tickets.
+ */
+struct tls_ticket_keys {
+	volatile int lock;
+	volatile unsigned long slot;
+	struct tls_ticket_key keys[2];
+};
+
+static struct tls_ticket_keys *tickets;
+
+#ifdef HAVE_KTLS
+/* True if the kernel can take over TLS encryption */
+static bool ktls;
+#endif
+
+/**
+ * Get the current ticket key rotation slot.
+ */
+static unsigned long tls_ticket_slot(void)
+{
+	return time(NULL) / TLS_TICKET_ROTATE_TIME;
+}
+
+/**
+ * Get the ticket key for the current slot, rotate when needed.
+ */
+static struct tls_ticket_key *tls_ticket_current(void)
+{
+	unsigned long slot = tls_ticket_slot();
+	struct tls_ticket_key *key = &tickets->keys[slot & 1];
+
+	if (tickets->slot == slot)
+		return key;
+
+	while (__sync_lock_test_and_set(&tickets->lock, 1))
+		;
+
+	/* Another worker might have rotated while we were waiting */
+	if (tickets->slot != slot) {
+		if (ossl.rand_bytes(key->name, sizeof(key->name)) == 1 &&
+		    ossl.rand_bytes(key->hmac, sizeof(key->hmac)) == 1 &&
+		    ossl.rand_bytes(key->aes, sizeof(key->aes)) == 1) {
+			key->slot = slot;
+			__sync_synchronize();
+			tickets->slot = slot;
+		} else {
+			key = NULL;
+		}
+	}
+
+	__sync_lock_release(&tickets->lock);
+
+	return key;
+}
+
+/**
+ * Find the ticket key with the given name that is still valid.
+ */
+static struct tls_ticket_key *tls_ticket_find(const unsigned char *name)
+{
+	unsigned long slot = tls_ticket_slot();
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(tickets->keys); i++) {
+		struct tls_ticket_key *key = &tickets->keys[i];
+
+		if (key->slot + 1 < slot)
+			continue;
+
+		if (!memcmp(key->name, name, sizeof(key->name)))
+			return key;
+	}
+
+	return NULL;
+}
+
+/**
+ * Session ticket key callback called by OpenSSL.
+ * @return 1 on success, 2 when the ticket should be renewed, 0 when
+ * no key is available and -1 on error.
+ */
+static int tls_ticket_cb(void *ssl, unsigned char *name, unsigned char *iv,
+			 void *ectx, void *hctx, int enc)
+{
+	struct tls_ticket_key *key;
+
+	if (enc) {
+		key = tls_ticket_current();
+		if (!key || ossl.rand_bytes(iv, 16) != 1)
+			return -1;
+
+		memcpy(name, key->name, sizeof(key->name));
+		ossl.encrypt_init(ectx, ossl.aes_256_cbc(), NULL, key->aes, iv);
+		ossl.hmac_init(hctx, key->hmac, sizeof(key->hmac), ossl.sha256(), NULL);
+
+		return 1;
+	}
+
+	/* Unknown or expired key, fall back to a full handshake */
+	key = tls_ticket_find(name);
+	if (!key)
+		return 0;
+
+	ossl.hmac_init(hctx, key->hmac, sizeof(key->hmac), ossl.sha256(), NULL);
+	ossl.decrypt_init(ectx, ossl.aes_256_cbc(), NULL, key->aes, iv);
+
+	/* Renew tickets issued with the previous key */
+	return key->slot == tls_ticket_slot() ? 1 : 2;
+}
+
+/**
+ * Periodically drop expired sessions from the session cache.
+ */
+static void tls_session_flush_cb(struct uloop_timeout *t)
+{
+	ossl.ctx_flush_sessions(ctx, time(NULL));
+	uloop_timeout_set(t, TLS_SESSION_TIMEOUT * 500);
+}
+
+/**
+ * Set up the server side session cache and session tickets. Only the
+ * OpenSSL backend of ustream-ssl exposes the needed functions, other
+ * backends keep their default behaviour.
+ */
+static void tls_session_init(void)
+{
+	static struct uloop_timeout flush = {
+		.cb = tls_session_flush_cb,
+	};
+	static const unsigned char sid_ctx[] = "woodbox-server";
+
+	ossl.ctx_ctrl = dlsym(dlh, "SSL_CTX_ctrl");
+	ossl.ctx_callback_ctrl = dlsym(dlh, "SSL_CTX_callback_ctrl");
+	ossl.ctx_set_timeout = dlsym(dlh, "SSL_CTX_set_timeout");
+	ossl.ctx_set_session_id_context = dlsym(dlh, "SSL_CTX_set_session_id_context");
+	ossl.ctx_flush_sessions = dlsym(dlh, "SSL_CTX_flush_sessions");
+	ossl.rand_bytes = dlsym(dlh, "RAND_bytes");
+	ossl.aes_256_cbc = dlsym(dlh, "EVP_aes_256_cbc");
+	ossl.sha256 = dlsym(dlh, "EVP_sha256");
+	ossl.encrypt_init = dlsym(dlh, "EVP_EncryptInit_ex");
+	ossl.decrypt_init = dlsym(dlh, "EVP_DecryptInit_ex");
+	ossl.hmac_init = dlsym(dlh, "HMAC_Init_ex");
+
+	if (!ossl.ctx_ctrl || !ossl.ctx_set_timeout ||
+	    !ossl.ctx_set_session_id_context || !ossl.ctx_flush_sessions) {
+		fprintf(stderr, "ustream-ssl backend does not support session caching\n");
+		return;
+	}
+
+	/* Bounded in-memory session cache with expiry */
+	ossl.ctx_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	ossl.ctx_ctrl(ctx, SSL_CTRL_SET_SESS_CACHE_MODE, SSL_SESS_CACHE_SERVER, NULL);
+	ossl.ctx_ctrl(ctx, SSL_CTRL_SET_SESS_CACHE_SIZE, conf.tls_session_cache_size, NULL);
+	ossl.ctx_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+	uloop_timeout_set(&flush, TLS_SESSION_TIMEOUT * 500);
+
+	if (!ossl.ctx_callback_ctrl || !ossl.rand_bytes || !ossl.aes_256_cbc ||
+	    !ossl.sha256 || !ossl.encrypt_init || !ossl.decrypt_init ||
+	    !ossl.hmac_init)
+		return;
+
+	/* Rotating session ticket keys shared with forked workers */
+	tickets = mmap(NULL, sizeof(*tickets), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tickets == MAP_FAILED) {
+		tickets = NULL;
+		return;
+	}
+
+	memset(tickets, 0, sizeof(*tickets));
+	tickets->slot = ~0UL;
+	ossl.ctx_callback_ctrl(ctx, SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB,
+			       (void (*)(void)) tls_ticket_cb);
+}
+
+/**
+ * Select the application protocol offered by the client, HTTP/2 is
+ * preferred. The client sends the HTTP/2 preface itself, so the
+ * connection switches over on its first bytes.
+ */
+static int tls_alpn_cb(void *ssl, const unsigned char **out, unsigned char *outlen,
+		       const unsigned char *in, unsigned int inlen, void *arg)
+{
+	const unsigned char *http1 = NULL;
+	unsigned int i;
+
+	for (i = 0; i < inlen && i + 1 + in[i] <= inlen; i += 1 + in[i]) {
+		if (in[i] == 2 && !memcmp(in + i + 1, "h2", 2)) {
+			*out = in + i + 1;
+			*outlen = 2;
+			return SSL_TLSEXT_ERR_OK;
+		}
+
+		if (in[i] == 8 && !memcmp(in + i + 1, "http/1.1", 8))
+			http1 = in + i;
+	}
+
+	if (!http1)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	*out = http1 + 1;
+	*outlen = *http1;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Announce HTTP/2 through ALPN when the backend supports it
+ */
+static void tls_alpn_init(void)
+{
+	ossl.ctx_set_alpn_select_cb = dlsym(dlh, "SSL_CTX_set_alpn_select_cb");
+	if (ossl.ctx_set_alpn_select_cb)
+		ossl.ctx_set_alpn_select_cb(ctx, tls_alpn_cb, NULL);
+}
+
+#ifdef HAVE_KTLS
+/**
+ * Resolve the OpenSSL functions needed to hand the TLS transmit
+ * state over to the kernel.
+ * @return true if kernel TLS can be used with this backend.
+ */
+static bool tls_ktls_init(void)
+{
+	ossl.version = dlsym(dlh, "SSL_version");
+	ossl.get_current_cipher = dlsym(dlh, "SSL_get_current_cipher");
+	ossl.cipher_get_id = dlsym(dlh, "SSL_CIPHER_get_id");
+	ossl.get_client_random = dlsym(dlh, "SSL_get_client_random");
+	ossl.get_server_random = dlsym(dlh, "SSL_get_server_random");
+	ossl.get_session = dlsym(dlh, "SSL_get_session");
+	ossl.session_get_master_key = dlsym(dlh, "SSL_SESSION_get_master_key");
+	ossl.set_quiet_shutdown = dlsym(dlh, "SSL_set_quiet_shutdown");
+	ossl.set_options = dlsym(dlh, "SSL_set_options");
+	ossl.sha384 = dlsym(dlh, "EVP_sha384");
+	ossl.hmac = dlsym(dlh, "HMAC");
+	ossl.bio_s_mem = dlsym(dlh, "BIO_s_mem");
+	ossl.bio_new = dlsym(dlh, "BIO_new");
+	ossl.bio_free = dlsym(dlh, "BIO_free");
+	ossl.bio_ctrl_pending = dlsym(dlh, "BIO_ctrl_pending");
+	ossl.get_wbio = dlsym(dlh, "SSL_get_wbio");
+	ossl.set0_wbio = dlsym(dlh, "SSL_set0_wbio");
+
+	return ossl.version && ossl.get_current_cipher && ossl.cipher_get_id &&
+	       ossl.get_client_random && ossl.get_server_random &&
+	       ossl.get_session && ossl.session_get_master_key &&
+	       ossl.set_quiet_shutdown && ossl.set_options && ossl.sha256 &&
+	       ossl.sha384 && ossl.hmac && ossl.bio_s_mem && ossl.bio_new &&
+	       ossl.bio_free && ossl.bio_ctrl_pending && ossl.get_wbio &&
+	       ossl.set0_wbio;
+}
+
+/**
+ * The TLS 1.2 pseudo random function (RFC 5246, section 5).
+ * @md the digest of the cipher suite
+ * @secret the master secret
+ * @seed the label followed by the seed
+ * @out the output buffer, filled completely
+ */
+static bool tls_prf(const void *md, const unsigned char *secret, int secret_len,
+		    const unsigned char *seed, int seed_len,
+		    unsigned char *out, int out_len)
+{
+	unsigned char a[64 + 128], block[64];
+	unsigned int a_len, block_len;
+	int n;
+
+	if (seed_len > 128)
+		return false;
+
+	/* A(1) = HMAC(secret, seed) */
+	if (!ossl.hmac(md, secret, secret_len, seed, seed_len, a, &a_len))
+		return false;
+
+	while (out_len > 0) {
+		/* HMAC(secret, A(i) + seed) */
+		memcpy(a + a_len, seed, seed_len);
+		if (!ossl.hmac(md, secret, secret_len, a, a_len + seed_len, block, &block_len))
+			return false;
+
+		n = min(out_len, block_len);
+		memcpy(out, block, n);
+		out += n;
+		out_len -= n;
+
+		/* A(i + 1) = HMAC(secret, A(i)) */
+		if (!ossl.hmac(md, secret, secret_len, a, a_len, a, &a_len))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Install the server transmit keys of an established TLS 1.2 AES-GCM
+ * session into the kernel. Only called before any application data is
+ * sent so the record sequence number is known.
+ * @cl the client whose handshake just completed
+ * @return true if the kernel now encrypts everything written to the socket.
+ */
+static bool tls_ktls_enable(struct client *cl)
+{
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+	} ci;
+	unsigned char seed[13 + 2 * TLS_RANDOM_LEN];
+	unsigned char master[TLS_MASTER_LEN];
+	unsigned char block[2 * 32 + 2 * 4];
+	unsigned char seq[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	void *ssl = cl->ssl.ssl;
+	const void *md;
+	int key_len, ci_len;
+	void *sess, *wbio;
+
+	if (ossl.version(ssl) != TLS1_2_VERSION_ID)
+		return false;
+
+	switch (ossl.cipher_get_id(ossl.get_current_cipher(ssl)) & 0xffff) {
+	case 0x009C:	/* RSA_WITH_AES_128_GCM_SHA256 */
+	case 0x009E:	/* DHE_RSA_WITH_AES_128_GCM_SHA256 */
+	case 0xC02B:	/* ECDHE_ECDSA_WITH_AES_128_GCM_SHA256 */
+	case 0xC02F:	/* ECDHE_RSA_WITH_AES_128_GCM_SHA256 */
+		key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		md = ossl.sha256();
+		break;
+	case 0x009D:	/* RSA_WITH_AES_256_GCM_SHA384 */
+	case 0x009F:	/* DHE_RSA_WITH_AES_256_GCM_SHA384 */
+	case 0xC02C:	/* ECDHE_ECDSA_WITH_AES_256_GCM_SHA384 */
+	case 0xC030:	/* ECDHE_RSA_WITH_AES_256_GCM_SHA384 */
+		key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		md = ossl.sha384();
+		break;
+	default:
+		return false;
+	}
+
+	sess = ossl.get_session(ssl);
+	if (!sess || ossl.session_get_master_key(sess, master, sizeof(master)) != sizeof(master))
+		return false;
+
+	/* key_block = PRF(master, "key expansion", server_random + client_random) */
+	memcpy(seed, "key expansion", 13);
+	if (ossl.get_server_random(ssl, seed + 13, TLS_RANDOM_LEN) != TLS_RANDOM_LEN ||
+	    ossl.get_client_random(ssl, seed + 13 + TLS_RANDOM_LEN, TLS_RANDOM_LEN) != TLS_RANDOM_LEN)
+		return false;
+
+	if (!tls_prf(md, master, sizeof(master), seed, sizeof(seed), block, 2 * key_len + 8)) {
+		memset(master, 0, sizeof(master));
+		return false;
+	}
+	memset(master, 0, sizeof(master));
+
+	/* The key block holds the client key, server key, client salt and server salt */
+	memset(&ci, 0, sizeof(ci));
+	if (key_len == TLS_CIPHER_AES_GCM_128_KEY_SIZE) {
+		ci.gcm128.info.version = TLS_1_2_VERSION;
+		ci.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(ci.gcm128.key, block + key_len, key_len);
+		memcpy(ci.gcm128.salt, block + 2 * key_len + 4, 4);
+		memcpy(ci.gcm128.iv, seq, sizeof(seq));
+		memcpy(ci.gcm128.rec_seq, seq, sizeof(seq));
+		ci_len = sizeof(ci.gcm128);
+	} else {
+		ci.gcm256.info.version = TLS_1_2_VERSION;
+		ci.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(ci.gcm256.key, block + key_len, key_len);
+		memcpy(ci.gcm256.salt, block + 2 * key_len + 4, 4);
+		memcpy(ci.gcm256.iv, seq, sizeof(seq));
+		memcpy(ci.gcm256.rec_seq, seq, sizeof(seq));
+		ci_len = sizeof(ci.gcm256);
+	}
+	memset(block, 0, sizeof(block));
+
+	wbio = ossl.bio_new(ossl.bio_s_mem());
+	if (!wbio) {
+		memset(&ci, 0, sizeof(ci));
+		return false;
+	}
+
+	if (setsockopt(cl->sfd.fd.fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) ||
+	    setsockopt(cl->sfd.fd.fd, SOL_TLS, TLS_TX, &ci, ci_len)) {
+		memset(&ci, 0, sizeof(ci));
+		ossl.bio_free(wbio);
+		return false;
+	}
+	memset(&ci, 0, sizeof(ci));
+
+	/*
+	 * Records OpenSSL still writes itself, alerts or a renegotiation,
+	 * are encrypted already and would be encrypted again by the kernel.
+	 * They go to a memory BIO instead and end the connection.
+	 */
+	ossl.set0_wbio(ssl, wbio);
+	ossl.set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+	ossl.set_quiet_shutdown(ssl, 1);
+
+	return true;
+}
+
+/* The ustream-ssl read handler of the socket stream */
+static void (*ssl_notify_read)(struct ustream *s, int bytes);
+
+/**
+ * Read handler of the socket stream once the kernel encrypts. OpenSSL
+ * still decrypts the records of the client and may answer one, which
+ * can not be sent, so the connection is closed.
+ */
+static void tls_ktls_notify_read(struct ustream *s, int bytes)
+{
+	struct client *cl = container_of(s, struct client, sfd.stream);
+
+	ssl_notify_read(s, bytes);
+
+	if (ossl.bio_ctrl_pending(ossl.get_wbio(cl->ssl.ssl)))
+		close_connection(cl);
+}
+
+/**
+ * Write handler for the TLS stream once the kernel encrypts, plain
+ * data goes straight to the socket stream.
+ */
+static int tls_ktls_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct client *cl = container_of(s, struct client, ssl.stream);
+
+	return ustream_write(&cl->sfd.stream, buf, len, more);
+}
+
+/* The ustream-ssl write handler, replaced while kernel TLS waits */
+static int (*ssl_write)(struct ustream *s, const char *buf, int len, bool more);
+
+/**
+ * Write handler for the TLS stream while the last handshake records are
+ * still queued. Once OpenSSL encrypted application data the kernel can
+ * no longer take over, so the connection stays in user space.
+ */
+static int tls_ktls_pending_write(struct ustream *s, const char *buf, int len, bool more)
+{
+	struct client *cl = container_of(s, struct client, ssl.stream);
+
+	cl->ktls_pending = false;
+	s->write = ssl_write;
+
+	return ssl_write(s, buf, len, more);
+}
+
+/**
+ * Let the kernel encrypt everything written to the socket from now on
+ * @cl the client whose handshake records are all on the socket
+ */
+static void tls_ktls_start(struct client *cl)
+{
+	if (!tls_ktls_enable(cl))
+		return;
+
+	cl->ktls = true;
+	cl->ssl.stream.write = tls_ktls_write;
+
+	ssl_notify_read = cl->sfd.stream.notify_read;
+	cl->sfd.stream.notify_read = tls_ktls_notify_read;
+}
+
+/**
+ * Called by ustream-ssl when the handshake is complete. Records still
+ * queued in the socket stream were encrypted by OpenSSL and would be
+ * encrypted again by the kernel, the switch waits until they are sent.
+ */
+static void tls_notify_connected(struct ustream_ssl *ssl)
+{
+	struct client *cl = container_of(ssl, struct client, ssl);
+
+	if (!ktls)
+		return;
+
+	if (cl->sfd.stream.w.data_bytes) {
+		ssl_write = cl->ssl.stream.write;
+		cl->ssl.stream.write = tls_ktls_pending_write;
+		cl->ktls_pending = true;
+		return;
+	}
+
+	tls_ktls_start(cl);
+}
+
+void uh_tls_client_flushed(struct client *cl)
+{
+	if (!cl->ktls_pending || cl->sfd.stream.w.data_bytes)
+		return;
+
+	cl->ktls_pending = false;
+	cl->ssl.stream.write = ssl_write;
+	tls_ktls_start(cl);
+}
+#else
+void uh_tls_client_flushed(struct client *cl)
+{
+}
+#endif
+
 int uh_tls_init(const char *key, const char *crt)
 {
 	static bool _init = false;
@@ -64,9 +653,23 @@ int uh_tls_init(const char *key, const char *crt)
 		return -EINVAL;
 	}
 
+	tls_session_init();
+	tls_alpn_init();
+
+#ifdef HAVE_KTLS
+	ktls = tls_ktls_init();
+#endif
+
 	return 0;
 }
 
+void uh_tls_reconfigure(void)
+{
+	/* Shrinking the cache drops the oldest sessions */
+	if (ctx && ossl.ctx_ctrl)
+		ossl.ctx_ctrl(ctx, SSL_CTRL_SET_SESS_CACHE_SIZE, conf.tls_session_cache_size, NULL);
+}
+
 static void tls_ustream_read_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, ssl.stream);
@@ -78,8 +681,11 @@ static void tls_ustream_write_cb(struct ustream *s, int bytes)
 {
 	struct client *cl = container_of(s, struct client, ssl.stream);
 
+	client_sent(cl, bytes);
 	if (cl->dispatch.write_cb)
 		cl->dispatch.write_cb(cl);
+
+	budget_progress(cl);
 }
 
 static void tls_notify_state(struct ustream *s)
@@ -96,6 +702,9 @@ void uh_tls_client_attach(struct client *cl)
 	cl->us->notify_read = tls_ustream_read_cb;
 	cl->us->notify_write = tls_ustream_write_cb;
 	cl->us->notify_state = tls_notify_state;
+#ifdef HAVE_KTLS
+	cl->ssl.notify_connected = tls_notify_connected;
+#endif
 }
 
 void uh_tls_client_detach(struct client *cl)
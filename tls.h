@@ -25,6 +25,19 @@
 int uh_tls_init(const char *key, const char *crt);
 void uh_tls_client_attach(struct client *cl);
 void uh_tls_client_detach(struct client *cl);
+void uh_tls_reconfigure(void);
+
+/**
+ * Called after the socket stream of a TLS client wrote queued data, a
+ * pending switch to kernel TLS happens once it is empty
+ * @cl the client
+ */
+void uh_tls_client_flushed(struct client *cl);
+
+static inline bool uh_tls_client_ktls(struct client *cl)
+{
+	return cl->ktls;
+}
 
 #else
 
@@ -41,6 +54,19 @@ static inline void uh_tls_client_detach(struct client *cl)
 {
 }
 
+static inline void uh_tls_reconfigure(void)
+{
+}
+
+static inline void uh_tls_client_flushed(struct client *cl)
+{
+}
+
+static inline bool uh_tls_client_ktls(struct client *cl)
+{
+	return false;
+}
+
 #endif
 
 #endif
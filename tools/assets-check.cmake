@@ -0,0 +1,72 @@
+# Generate a bundle with many displacement buckets, build the tables
+# mkassets makes of it and check that every file is found.
+#
+# Called by the assets-check target with MKASSETS, HOST_CC, SOURCE_DIR
+# and WORK_DIR set.
+
+SET(FILES 500)
+SET(WWW ${WORK_DIR}/assets-check-www)
+
+FILE(REMOVE_RECURSE ${WWW})
+SET(PATHS "")
+MATH(EXPR LAST "${FILES} - 1")
+FOREACH(i RANGE ${LAST})
+	FILE(WRITE ${WWW}/dir${i}/file${i}.html "<p>${i}</p>")
+	SET(PATHS "${PATHS}\t\"/dir${i}/file${i}.html\",\n")
+ENDFOREACH()
+
+EXECUTE_PROCESS(
+	COMMAND ${MKASSETS} ${WWW} ${WORK_DIR}/assets-check-data.c
+	RESULT_VARIABLE RESULT
+)
+IF(RESULT)
+	MESSAGE(FATAL_ERROR "mkassets failed for ${FILES} files")
+ENDIF()
+
+FILE(WRITE ${WORK_DIR}/assets-check-main.c
+"#include <stdio.h>
+#include <string.h>
+
+#include \"assets.h\"
+
+static const char *paths[] = {
+${PATHS}};
+
+int main(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		if (!asset_find(paths[i], strlen(paths[i]))) {
+			fprintf(stderr, \"%s not found\\n\", paths[i]);
+			return 1;
+		}
+	}
+
+	if (asset_find(\"/missing.html\", 13)) {
+		fprintf(stderr, \"/missing.html found\\n\");
+		return 1;
+	}
+
+	return 0;
+}
+")
+
+EXECUTE_PROCESS(
+	COMMAND ${HOST_CC} -Wall -Werror --std=gnu99 -I${SOURCE_DIR}
+		-o ${WORK_DIR}/assets-check
+		${WORK_DIR}/assets-check-main.c
+		${WORK_DIR}/assets-check-data.c
+		${SOURCE_DIR}/assets.c
+	RESULT_VARIABLE RESULT
+)
+IF(RESULT)
+	MESSAGE(FATAL_ERROR "The tables generated for ${FILES} files do not build")
+ENDIF()
+
+EXECUTE_PROCESS(COMMAND ${WORK_DIR}/assets-check RESULT_VARIABLE RESULT)
+IF(RESULT)
+	MESSAGE(FATAL_ERROR "The generated tables do not resolve every file")
+ENDIF()
+
+FILE(REMOVE_RECURSE ${WWW})
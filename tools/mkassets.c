@@ -0,0 +1,407 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: mkassets.c
+ * Description: build host tool turning a www directory into the C
+ * tables of the embedded web interface, see assets.h. Bodies are
+ * compressed with the gzip command when it makes them smaller.
+ *
+ * Usage: mkassets <www directory> <output.c>
+ *
+ * Created by: Daan Pape
+ * Created on: June 12, 2014
+ */
+
+#define _XOPEN_SOURCE 700
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#include "../assets.h"
+#include "../mimetypes.h"
+
+/* Attempts to find seeds giving a perfect hash */
+#define MAX_SEEDS	1000
+
+/**
+ * A file to embed
+ */
+struct file {
+	char *path;
+	int path_len;
+	time_t mtime;
+	char *data;
+	int len;
+	char *gz;
+	int gz_len;
+	uint32_t h, g;
+	int slot;
+};
+
+static struct file *files;
+static int n_files;
+static int root_len;
+
+/**
+ * Read a whole file
+ * @fd the file to read
+ * @len set to the length read
+ */
+static char *read_all(int fd, int *len)
+{
+	char *buf = NULL;
+	int size = 0, r;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 4096;
+			buf = realloc(buf, size);
+			if (!buf)
+				return NULL;
+		}
+
+		r = read(fd, buf + *len, size - *len);
+		if (r > 0)
+			*len += r;
+	} while (r > 0);
+
+	if (r < 0) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/**
+ * Compress a file with the gzip command
+ * @name the file to compress
+ * @len set to the compressed length
+ * @return NULL when gzip is not available
+ */
+static char *gzip_file(const char *name, int *len)
+{
+	int pipefd[2], status, fd;
+	char *out;
+	pid_t pid;
+
+	if (pipe(pipefd))
+		return NULL;
+
+	pid = fork();
+	if (pid < 0)
+		return NULL;
+
+	if (!pid) {
+		fd = open(name, O_RDONLY);
+		if (fd < 0)
+			_exit(1);
+
+		dup2(fd, 0);
+		dup2(pipefd[1], 1);
+		close(pipefd[0]);
+		execlp("gzip", "gzip", "-9", "-n", "-c", (char *) NULL);
+		_exit(127);
+	}
+
+	close(pipefd[1]);
+	out = read_all(pipefd[0], len);
+	close(pipefd[0]);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+/**
+ * Collect a file of the www directory
+ */
+static int add_file(const char *name, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct file *f;
+	int fd;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	files = realloc(files, (n_files + 1) * sizeof(*files));
+	if (!files)
+		return -1;
+
+	f = &files[n_files++];
+	memset(f, 0, sizeof(*f));
+	f->path = strdup(name + root_len);
+	f->path_len = strlen(f->path);
+	f->mtime = st->st_mtime;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		perror(name);
+		return -1;
+	}
+
+	f->data = read_all(fd, &f->len);
+	close(fd);
+	if (!f->data) {
+		perror(name);
+		return -1;
+	}
+
+	f->gz = gzip_file(name, &f->gz_len);
+	if (f->gz && f->gz_len >= f->len) {
+		free(f->gz);
+		f->gz = NULL;
+	}
+
+	return 0;
+}
+
+static int cmp_file(const void *a, const void *b)
+{
+	return strcmp(((const struct file *) a)->path, ((const struct file *) b)->path);
+}
+
+/**
+ * Lookup the mimetype of a file the way the server does
+ * @path the file path
+ */
+static const char *mime_lookup(const char *path)
+{
+	const struct mimetype *m;
+	const char *e = strrchr(path, '.');
+
+	if (e && !strchr(e, '/'))
+		for (m = uh_mime_types; m->extn; m++)
+			if (!strcasecmp(e + 1, m->extn))
+				return m->mime;
+
+	return "application/octet-stream";
+}
+
+/**
+ * Strong entity tag of a body, a 64-bit FNV-1a hash of the content
+ */
+static uint64_t body_hash(const char *data, int len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len-- > 0) {
+		h ^= (uint8_t) *data++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/**
+ * Try to place all files with the given seeds, buckets are placed from
+ * large to small so the hard ones get the most free slots.
+ */
+static bool place(uint32_t *seed, uint32_t *disp, int slots, int buckets)
+{
+	int *order, *count, i, j, k, n, d;
+	bool *used, ok = false;
+
+	order = calloc(buckets, sizeof(*order));
+	count = calloc(buckets, sizeof(*count));
+	used = calloc(slots, sizeof(*used));
+
+	for (i = 0; i < n_files; i++) {
+		files[i].h = asset_hash(seed[0], files[i].path, files[i].path_len);
+		files[i].g = asset_hash(seed[1], files[i].path, files[i].path_len);
+		count[files[i].h % buckets]++;
+	}
+
+	for (i = 0; i < buckets; i++)
+		order[i] = i;
+
+	for (i = 1; i < buckets; i++)
+		for (j = i; j > 0 && count[order[j]] > count[order[j - 1]]; j--) {
+			n = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = n;
+		}
+
+	for (i = 0; i < buckets; i++) {
+		int b = order[i];
+
+		disp[b] = 0;
+		if (!count[b])
+			continue;
+
+		for (d = 0; d < slots; d++) {
+			bool fits = true;
+
+			for (j = 0; j < n_files && fits; j++) {
+				if (files[j].h % buckets != b)
+					continue;
+
+				files[j].slot = (files[j].g + d) & (slots - 1);
+				if (used[files[j].slot])
+					fits = false;
+
+				/* Two files of the bucket on the same slot */
+				for (k = 0; k < j && fits; k++)
+					if (files[k].h % buckets == b && files[k].slot == files[j].slot)
+						fits = false;
+			}
+
+			if (fits)
+				break;
+		}
+
+		if (d == slots)
+			goto out;
+
+		disp[b] = d;
+		for (j = 0; j < n_files; j++)
+			if (files[j].h % buckets == b)
+				used[files[j].slot] = true;
+	}
+
+	ok = true;
+out:
+	free(order);
+	free(count);
+	free(used);
+	return ok;
+}
+
+/**
+ * Write data as a C string literal
+ */
+static void write_string(FILE *out, const char *data, int len)
+{
+	int i, col = 0;
+
+	fputc('"', out);
+	for (i = 0; i < len; i++) {
+		unsigned char c = data[i];
+
+		if (col >= 72) {
+			fputs("\"\n\t\"", out);
+			col = 0;
+		}
+
+		if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') {
+			fputc(c, out);
+			col++;
+		} else {
+			fprintf(out, "\\%03o", c);
+			col += 4;
+		}
+	}
+	fputc('"', out);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t seed[2], *disp;
+	int slots = 1, buckets, i, s;
+	FILE *out;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <www directory> <output.c>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	root_len = strlen(argv[1]);
+	while (root_len > 1 && argv[1][root_len - 1] == '/')
+		root_len--;
+
+	if (nftw(argv[1], add_file, 16, FTW_PHYS)) {
+		fprintf(stderr, "Could not read %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	/* Sort the files so the output does not depend on the directory order */
+	qsort(files, n_files, sizeof(*files), cmp_file);
+
+	while (slots < n_files + n_files / 4)
+		slots <<= 1;
+	buckets = n_files > 4 ? n_files / 4 : 1;
+	disp = calloc(buckets, sizeof(*disp));
+
+	for (s = 0; s < MAX_SEEDS; s++) {
+		seed[0] = 2166136261u ^ (s * 0x9e3779b9u);
+		seed[1] = 2166136261u ^ ((s + 1) * 0x85ebca6bu);
+		if (place(seed, disp, slots, buckets))
+			break;
+	}
+
+	if (s == MAX_SEEDS) {
+		fprintf(stderr, "Could not find a perfect hash for %d files\n", n_files);
+		return EXIT_FAILURE;
+	}
+
+	out = fopen(argv[2], "w");
+	if (!out) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "/* Generated by mkassets from %s, do not edit */\n\n", argv[1]);
+	fprintf(out, "#include <stddef.h>\n\n#include \"assets.h\"\n\n");
+
+	for (i = 0; i < n_files; i++) {
+		fprintf(out, "static const char asset_%d[] =\n\t", i);
+		write_string(out, files[i].data, files[i].len);
+		fprintf(out, ";\n\n");
+
+		if (files[i].gz) {
+			fprintf(out, "static const char asset_%d_gz[] =\n\t", i);
+			write_string(out, files[i].gz, files[i].gz_len);
+			fprintf(out, ";\n\n");
+		}
+	}
+
+	fprintf(out, "const uint32_t asset_seed[2] = { 0x%08xu, 0x%08xu };\n", seed[0], seed[1]);
+	fprintf(out, "const uint32_t asset_slots = %d;\n", slots);
+	fprintf(out, "const uint32_t asset_buckets = %d;\n\n", buckets);
+
+	fprintf(out, "const uint32_t asset_disp[%d] = {", buckets);
+	for (i = 0; i < buckets; i++)
+		fprintf(out, "%s%u", !i ? "\n\t" : i % 16 ? ", " : ",\n\t", disp[i]);
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "const struct asset asset_table[%d] = {\n", slots);
+	for (i = 0; i < n_files; i++) {
+		struct file *f = &files[i];
+		uint64_t h = body_hash(f->data, f->len);
+
+		fprintf(out, "\t[%d] = {\n\t\t", f->slot);
+		write_string(out, f->path, f->path_len);
+		fprintf(out, ", %d, \"%s\",\n", f->path_len, mime_lookup(f->path));
+		fprintf(out, "\t\t\"\\\"%016llx\\\"\", \"\\\"%016llx-gz\\\"\", %lld,\n",
+			(unsigned long long) h, (unsigned long long) h, (long long) f->mtime);
+		fprintf(out, "\t\tasset_%d, %d, ", i, f->len);
+		if (f->gz)
+			fprintf(out, "asset_%d_gz, %d\n\t},\n", i, f->gz_len);
+		else
+			fprintf(out, "NULL, 0\n\t},\n");
+	}
+	fprintf(out, "};\n");
+
+	if (fclose(out)) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: trace.c
+ * Description: the flight recorder. Every client carries the trace of
+ * its current request, finished traces are copied into a ring of the
+ * last TRACE_RING requests and into a table with the slowest request of
+ * each route. Nothing is allocated while serving.
+ *
+ * Created by: Daan Pape
+ * Created on: June 17, 2014
+ */
+
+#include <signal.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "trace.h"
+
+/* The last requests, recent_next is the oldest once the ring is full */
+static struct trace recent[TRACE_RING];
+static int recent_next, n_recent;
+
+/* The slowest request of every route */
+static struct trace slowest[TRACE_ROUTES];
+static int n_slowest;
+
+static const char * const phase_names[TRACE_PHASES] = {
+	[TRACE_FIRST_BYTE] = "first_byte",
+	[TRACE_HEADERS] = "headers",
+	[TRACE_HANDLER] = "handler",
+	[TRACE_HANDLER_END] = "handler_end",
+	[TRACE_RESPONSE] = "response",
+	[TRACE_DONE] = "done",
+};
+
+void trace_start(struct client *cl)
+{
+	bool reused = cl->trace.start != 0;
+
+	memset(&cl->trace, 0, sizeof(cl->trace));
+	cl->trace.start = uh_monotonic_us();
+	cl->trace.reused = reused;
+}
+
+void trace_mark(struct client *cl, enum trace_phase phase)
+{
+	int64_t at;
+
+	if (cl->trace.at[phase])
+		return;
+
+	/* A phase reached right at the start still counts as reached */
+	at = uh_monotonic_us() - cl->trace.start;
+	cl->trace.at[phase] = max(min(at, (int64_t) UINT32_MAX), (int64_t) 1);
+}
+
+void trace_handler(struct client *cl, const char *url)
+{
+	int len = min(strcspn(url, "?"), sizeof(cl->trace.route) - 1);
+
+	memcpy(cl->trace.route, url, len);
+	cl->trace.route[len] = 0;
+	cl->trace.method = cl->request.method;
+	trace_mark(cl, TRACE_HANDLER);
+}
+
+void trace_response(struct client *cl, int code)
+{
+	if (cl->trace.at[TRACE_RESPONSE])
+		return;
+
+	cl->trace.status = code;
+	trace_mark(cl, TRACE_RESPONSE);
+}
+
+uint32_t trace_total(const struct trace *t)
+{
+	uint32_t last = 0;
+	int i;
+
+	for (i = 0; i < TRACE_PHASES; i++)
+		last = max(last, t->at[i]);
+
+	/* The time a kept alive connection waited for the request does not count */
+	return last - t->at[TRACE_FIRST_BYTE];
+}
+
+/**
+ * Keep a trace when it is the slowest of its route. A new route takes
+ * the place of the fastest one when the table is full.
+ * @t the trace
+ */
+static void trace_keep_slowest(const struct trace *t)
+{
+	uint32_t total = trace_total(t);
+	struct trace *fastest = NULL;
+	int i;
+
+	for (i = 0; i < n_slowest; i++) {
+		if (!strcmp(slowest[i].route, t->route)) {
+			if (trace_total(&slowest[i]) < total)
+				slowest[i] = *t;
+			return;
+		}
+
+		if (!fastest || trace_total(&slowest[i]) < trace_total(fastest))
+			fastest = &slowest[i];
+	}
+
+	if (n_slowest < TRACE_ROUTES)
+		slowest[n_slowest++] = *t;
+	else if (trace_total(fastest) < total)
+		*fastest = *t;
+}
+
+void trace_done(struct client *cl)
+{
+	struct trace *t = &cl->trace;
+
+	/* Switched protocols are no longer a request */
+	if (t->at[TRACE_FIRST_BYTE] && t->status != 101) {
+		/* A handler that finished right away ends with the request */
+		if (t->at[TRACE_HANDLER])
+			trace_mark(cl, TRACE_HANDLER_END);
+
+		trace_mark(cl, TRACE_DONE);
+		t->done = time(NULL);
+
+		recent[recent_next] = *t;
+		recent_next = (recent_next + 1) % TRACE_RING;
+		n_recent = min(n_recent + 1, TRACE_RING);
+
+		trace_keep_slowest(t);
+	}
+
+	trace_start(cl);
+}
+
+void trace_for_each(bool slowest_only, void (*cb)(const struct trace *t, void *priv), void *priv)
+{
+	int i;
+
+	if (slowest_only) {
+		for (i = 0; i < n_slowest; i++)
+			cb(&slowest[i], priv);
+		return;
+	}
+
+	for (i = 0; i < n_recent; i++)
+		cb(&recent[(recent_next - n_recent + i + TRACE_RING) % TRACE_RING], priv);
+}
+
+const char *trace_phase_name(enum trace_phase phase)
+{
+	return phase_names[phase];
+}
+
+/**
+ * Write a trace to the log
+ */
+static void trace_log(const struct trace *t, void *priv)
+{
+	char when[32];
+	int i;
+
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t->done));
+	fprintf(stderr, "[TRACE] %s %s %s %s %d total=%uus", (const char *) priv, when,
+		http_methods[t->method], t->route, t->status, trace_total(t));
+
+	for (i = 0; i < TRACE_PHASES; i++)
+		if (t->at[i])
+			fprintf(stderr, " %s=%u", phase_names[i], t->at[i]);
+
+	fprintf(stderr, "%s\n", t->reused ? " reused" : "");
+}
+
+/**
+ * Dump the recorder to the log, runs from the event loop
+ */
+static void trace_dump(void)
+{
+	trace_for_each(false, trace_log, "recent");
+	trace_for_each(true, trace_log, "slowest");
+}
+
+void trace_init(void)
+{
+	if (!uh_signal_add(SIGUSR1, trace_dump))
+		fprintf(stderr, "[ERROR] Could not watch for SIGUSR1\n");
+}
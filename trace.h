@@ -0,0 +1,111 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: trace.h
+ * Description: the flight recorder, keeps the phase timings of the last
+ * requests and of the slowest request per route.
+ *
+ * Created by: Daan Pape
+ * Created on: June 17, 2014
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "config.h"
+
+struct client;
+
+/* The phases of a request, in the order they are normally reached */
+enum trace_phase {
+	TRACE_FIRST_BYTE,		/* The request line started arriving */
+	TRACE_HEADERS,			/* The headers are complete */
+	TRACE_HANDLER,			/* The handler was called */
+	TRACE_HANDLER_END,		/* The handler returned to the event loop */
+	TRACE_RESPONSE,			/* The status line was written */
+	TRACE_DONE,				/* request_done() */
+	TRACE_PHASES
+};
+
+/**
+ * The trace of one request. It starts when the connection is accepted
+ * or when the previous request on it is done, so the first phase
+ * includes the time a kept alive connection was idle.
+ */
+struct trace {
+	int64_t start;					/* Monotonic microseconds */
+	uint32_t at[TRACE_PHASES];		/* Microseconds after start, 0 when not reached */
+	time_t done;					/* Wall clock time of request_done() */
+	uint16_t status;
+	uint8_t method;
+	bool reused;					/* Not the first request of the connection */
+	char route[TRACE_ROUTE_LEN];	/* The URL path */
+};
+
+/**
+ * Dump the recorder on SIGUSR1, call after uloop_init()
+ */
+void trace_init(void);
+
+/**
+ * Start the trace of the next request of a connection
+ * @cl the client
+ */
+void trace_start(struct client *cl);
+
+/**
+ * Note that a request reached a phase, later calls for the same phase
+ * are ignored
+ * @cl the client
+ * @phase the phase
+ */
+void trace_mark(struct client *cl, enum trace_phase phase);
+
+/**
+ * Note the route and the start of the handler of a request
+ * @cl the client
+ * @url the request URL
+ */
+void trace_handler(struct client *cl, const char *url);
+
+/**
+ * Note the status line of the response
+ * @cl the client
+ * @code the status code
+ */
+void trace_response(struct client *cl, int code);
+
+/**
+ * Record the trace of a finished request and start the next one
+ * @cl the client
+ */
+void trace_done(struct client *cl);
+
+/**
+ * Call a function for the recorded traces, oldest first
+ * @slowest_only false for the last requests, true for the slowest per route
+ * @cb the function
+ * @priv passed to the function
+ */
+void trace_for_each(bool slowest_only, void (*cb)(const struct trace *t, void *priv), void *priv);
+
+/**
+ * Get the name of a phase
+ * @phase the phase
+ */
+const char *trace_phase_name(enum trace_phase phase);
+
+/**
+ * Get the total time of a trace
+ * @t the trace
+ * @return microseconds from the first byte to the last phase reached
+ */
+uint32_t trace_total(const struct trace *t);
+
+#endif /* TRACE_H_ */
@@ -35,13 +35,15 @@
 #endif
 
 #include "utils.h"
-
-#define UH_LIMIT_CLIENTS	64
+#include "uring.h"
+#include "trace.h"
 
 #define __enum_header(_name, _val) HDR_##_name,
 #define __blobmsg_header(_name, _val) [HDR_##_name] = { .name = #_val, .type = BLOBMSG_TYPE_STRING },
 
 struct client;
+struct param_index;
+struct script_worker;
 
 struct config {
 	const char *docroot;
@@ -55,16 +57,35 @@ struct config {
 	const char *lua_prefix;
 	const char *ubus_prefix;
 	const char *ubus_socket;
+	const char *listen;
 	int no_symlinks;
 	int no_dirlists;
 	int network_timeout;
 	int rfc1918_filter;
+	int stats_api;
 	int tcp_keepalive;
 	int max_script_requests;
 	int max_connections;
 	int http_keepalive;
 	int script_timeout;
 	int ubus_noauth;
+	int listen_backlog;
+	int read_buffer_size;
+	int dirlist_cache_entries;
+	int dirlist_cache_max;
+	int auth_cache_size;
+	int tls_session_cache_size;
+	int mem_budget;
+	int drain_timeout;
+	int script_workers;
+	int peer_max_connections;
+	int peer_request_rate;
+	int peer_request_burst;
+	int io_uring;
+	int request_line_timeout;
+	int header_timeout;
+	int body_min_rate;
+	int response_min_rate;
 };
 
 struct auth_realm {
@@ -99,6 +120,19 @@ enum http_user_agent {
 	UH_UA_MSIE_NEW,
 };
 
+enum http_upgrade {
+	UH_UPGRADE_NONE,
+	UH_UPGRADE_WEBSOCKET,
+	UH_UPGRADE_H2C,
+};
+
+enum admit_class {
+	ADMIT_NONE,
+	ADMIT_NORMAL,
+	ADMIT_PRIORITY,
+	__ADMIT_MAX
+};
+
 struct http_request {
 	enum http_method method;
 	enum http_version version;
@@ -107,8 +141,11 @@ struct http_request {
 	int content_length;
 	bool expect_cont;
 	bool connection_close;
+	enum http_upgrade upgrade;
 	uint8_t transfer_chunked;
+	bool respond_chunked;			/* The response body is sent in chunks */
 	const struct auth_realm *realm;
+	const char *query;				/* The query string of an API call */
 };
 
 enum client_state {
@@ -118,6 +155,8 @@ enum client_state {
 	CLIENT_STATE_DONE,
 	CLIENT_STATE_CLOSE,
 	CLIENT_STATE_CLEANUP,
+	CLIENT_STATE_WEBSOCKET,
+	CLIENT_STATE_HTTP2,
 };
 
 struct interpreter {
@@ -185,6 +224,7 @@ struct dispatch {
 	void (*write_cb)(struct client *cl);
 	void (*close_fds)(struct client *cl);
 	void (*free)(struct client *cl);
+	void (*cancel)(struct client *cl);		/* Stop operations holding a reference */
 
 	void *req_data;
 	void (*req_free)(struct client *cl);
@@ -195,8 +235,35 @@ struct dispatch {
 		struct {
 			struct blob_attr **hdr;
 			int fd;
+			off_t left;
+			off_t off;						/* The offset of the next body byte */
+			const char *data;
+			struct uring_op read, send;		/* The io_uring window in flight */
+			int busy;						/* Operations in flight */
+			int sent;						/* The result of the send */
 		} file;
+		struct {
+			DIR *dir;
+			bool json;
+			bool first;
+			struct stat st;
+			char *cache;
+			int cache_len;
+			int cache_size;
+		} dirlist;
+		struct {
+			struct json_object *calls;
+			int idx;
+			bool pending;
+		} batch;
 		struct dispatch_proc proc;
+		struct {
+			struct list_head list;		/* In the queue while waiting for a worker */
+			bool queued;
+			struct script_worker *worker;
+			char *msg;					/* The request for the worker */
+			int msg_len;
+		} script;
 #ifdef HAVE_UBUS
 		struct dispatch_ubus ubus;
 #endif
@@ -210,6 +277,7 @@ struct http_response {
 };
 
 extern const struct http_response r_ok;
+extern const struct http_response r_bad_req;
 
 struct client {
 	struct list_head list;
@@ -218,25 +286,61 @@ struct client {
 
 	struct ustream *us;
 	struct ustream_fd sfd;
+	void (*fd_cb)(struct uloop_fd *fd, unsigned int events);	/* The ustream socket handler */
+	bool write_wait;			/* A body writer waits for the socket */
 #ifdef HAVE_TLS
 	struct ustream_ssl ssl;
 #endif
 	struct uloop_timeout timeout;
 	int requests;
+	int64_t first_byte;				/* Monotonic ms the request started arriving, 0 before */
+	struct {
+		struct uloop_timeout timer;
+		int rx, tx;					/* Body bytes read and bytes sent in this window */
+		int pending;				/* Bytes the client had to take at the window start */
+		bool blocked;				/* A body writer waits for the socket */
+	} progress;
 
 	enum client_state state;
 	bool tls;
+#ifdef HAVE_TLS
+	bool ktls;
+	bool ktls_pending;			/* Kernel TLS waits for the handshake to drain */
+#endif
 
 	struct http_request request;
 	struct uh_addr srv_addr, peer_addr;
 
 	struct blob_buf hdr;
 	struct dispatch dispatch;
+	struct ws_client *ws;
+	struct h2_conn *h2;
+	struct h2_stream *h2_stream;
 	char *response;
 	struct http_response http_status;
+	struct param_index *params;
+	struct trace trace;
 	int readidx;
 	bool ispostdata;
 	char *postdata;
+	int postdata_len;				/* Body bytes collected, -1 when the body is too large */
+
+	struct list_head admit_list;
+	enum admit_class admit;
+
+	struct list_head budget;
+	int mem_used;
+	time_t mem_active;
+	bool mem_wait;
+
+	struct {
+		int size;					/* Body bytes kept queued */
+		int sndbuf;					/* The socket send buffer size set */
+		int refills;				/* Refills in this request */
+		bool filling;				/* Refilling up to the window */
+		char *buf;					/* Scratch buffer for body reads */
+		int buf_len;
+	} win;
 };
 
 extern char uh_buf[4096];
@@ -259,6 +363,7 @@ void uh_handle_request(struct client *cl);
 
 void uh_auth_add(const char *path, const char *user, const char *pass);
 bool uh_auth_check(struct client *cl, struct path_info *pi);
+void uh_auth_cache_resize(void);
 
 void uh_interpreter_add(const char *ext, const char *path);
 void uh_dispatch_add(struct dispatch_handler *d);
@@ -0,0 +1,230 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: upgrade.c
+ * Description: binary upgrades without closing the listening sockets.
+ * On SIGUSR2 the server starts the binary again and lets it inherit the
+ * listening sockets. Both processes accept connections until the new
+ * one reports it is serving, then the old one stops accepting, closes
+ * its connections as soon as they are idle and exits when they are all
+ * gone or the drain timeout passes.
+ *
+ * Created by: Daan Pape
+ * Created on: June 14, 2014
+ */
+
+#include <signal.h>
+#include <limits.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "listen.h"
+#include "client.h"
+#include "upgrade.h"
+
+/* Environment passing the sockets to the new process */
+#define UPGRADE_ENV_LISTEN		"WOODBOX_LISTEN_FDS"
+#define UPGRADE_ENV_READY		"WOODBOX_READY_FD"
+
+/* The most listening sockets handed over */
+#define UPGRADE_MAX_LISTENERS	16
+
+/* The command line to start the new binary with */
+static char **upgrade_argv;
+static char upgrade_path[PATH_MAX];
+
+/* Reports the new process is serving, -1 when no upgrade runs */
+static struct uloop_fd ready_fd = {
+	.fd = -1,
+};
+
+/* True while the connections are drained */
+static bool draining;
+
+/* Monotonic time the draining gives up */
+static time_t drain_end;
+
+static void upgrade_drain_cb(struct uloop_timeout *t);
+
+/* Closes idle connections while draining */
+static struct uloop_timeout drain_timer = {
+	.cb = upgrade_drain_cb
+};
+
+bool upgrade_inherit(char **argv)
+{
+	const char *env = getenv(UPGRADE_ENV_LISTEN);
+	bool inherited = false;
+	char *end;
+	long fd, tls;
+
+	upgrade_argv = argv;
+
+	/* The working directory changes when the server forks */
+	if (!strchr(argv[0], '/') || !realpath(argv[0], upgrade_path))
+		snprintf(upgrade_path, sizeof(upgrade_path), "%s", argv[0]);
+
+	if (!env)
+		return false;
+
+	/* The sockets are passed as fd:tls pairs separated by commas */
+	while (*env) {
+		fd = strtol(env, &end, 10);
+		if (end == env || *end != ':' || fd < 0 || fd > INT_MAX)
+			break;
+
+		env = end + 1;
+		tls = strtol(env, &end, 10);
+		if (end == env || (*end && *end != ','))
+			break;
+
+		if (adopt_listener_socket(fd, tls))
+			inherited = true;
+		else
+			fprintf(stderr, "[ERROR] Inherited descriptor %ld is no listening socket\n", fd);
+
+		env = *end ? end + 1 : end;
+	}
+
+	unsetenv(UPGRADE_ENV_LISTEN);
+
+	return inherited;
+}
+
+/**
+ * Check if the new process is serving
+ */
+static void upgrade_ready_cb(struct uloop_fd *fd, unsigned int events)
+{
+	char c;
+	int ret;
+
+	ret = read(fd->fd, &c, 1);
+	if (ret < 0 && errno == EAGAIN)
+		return;
+
+	uloop_fd_delete(fd);
+	close(fd->fd);
+	fd->fd = -1;
+
+	/* The new process exits without writing when it fails to start */
+	if (ret != 1) {
+		fprintf(stderr, "[ERROR] Upgrade failed, the new server did not start\n");
+		return;
+	}
+
+	fprintf(stderr, "Upgrade started, draining %d clients\n", n_clients);
+
+	release_listeners();
+	draining = true;
+	drain_end = uh_monotonic() + conf.drain_timeout;
+	upgrade_drain_cb(&drain_timer);
+}
+
+/**
+ * Close idle connections, stop when all are gone
+ */
+static void upgrade_drain_cb(struct uloop_timeout *t)
+{
+	close_idle_clients();
+
+	if (!n_clients || uh_monotonic() >= drain_end) {
+		if (n_clients)
+			fprintf(stderr, "Drain timeout, closing %d clients\n", n_clients);
+
+		uloop_end();
+		return;
+	}
+
+	uloop_timeout_set(t, 1000);
+}
+
+/**
+ * Start the binary again and hand the listening sockets over
+ */
+static void upgrade_start(void)
+{
+	int fds[UPGRADE_MAX_LISTENERS], pipefd[2], n, i, len = 0;
+	bool tls[UPGRADE_MAX_LISTENERS];
+	char env[UPGRADE_MAX_LISTENERS * 16], num[16];
+	pid_t pid;
+
+	if (draining || ready_fd.fd >= 0)
+		return;
+
+	n = get_listener_sockets(fds, tls, UPGRADE_MAX_LISTENERS);
+	if (!n || n > UPGRADE_MAX_LISTENERS) {
+		fprintf(stderr, "[ERROR] Cannot hand over %d listening sockets\n", n);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		len += snprintf(env + len, sizeof(env) - len, "%s%d:%d",
+				i ? "," : "", fds[i], tls[i]);
+
+	if (pipe(pipefd)) {
+		perror("pipe()");
+		return;
+	}
+
+	fd_cloexec(pipefd[0]);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork()");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return;
+	}
+
+	if (!pid) {
+		/* Only the listening sockets and the pipe survive the exec */
+		for (i = 0; i < n; i++)
+			fcntl(fds[i], F_SETFD, fcntl(fds[i], F_GETFD) & ~FD_CLOEXEC);
+
+		snprintf(num, sizeof(num), "%d", pipefd[1]);
+		setenv(UPGRADE_ENV_LISTEN, env, 1);
+		setenv(UPGRADE_ENV_READY, num, 1);
+
+		execvp(upgrade_path, upgrade_argv);
+		perror("execvp()");
+		_exit(EXIT_FAILURE);
+	}
+
+	close(pipefd[1]);
+
+	fprintf(stderr, "Upgrading to %s, pid %d\n", upgrade_path, (int) pid);
+
+	ready_fd.fd = pipefd[0];
+	ready_fd.cb = upgrade_ready_cb;
+	uloop_fd_add(&ready_fd, ULOOP_READ);
+}
+
+void upgrade_watch(void)
+{
+	const char *env = getenv(UPGRADE_ENV_READY);
+	int fd;
+
+	/* Let the previous process start draining */
+	if (env) {
+		fd = atoi(env);
+		if (fd > 2) {
+			if (write(fd, "1", 1) != 1)
+				perror("write()");
+
+			close(fd);
+		}
+
+		unsetenv(UPGRADE_ENV_READY);
+	}
+
+	if (!uh_signal_add(SIGUSR2, upgrade_start))
+		fprintf(stderr, "[ERROR] Could not watch for SIGUSR2\n");
+}
+
+bool upgrade_draining(void)
+{
+	return draining;
+}
@@ -0,0 +1,38 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: upgrade.h
+ * Description: binary upgrades without closing the listening sockets.
+ *
+ * Created by: Daan Pape
+ * Created on: June 14, 2014
+ */
+
+#ifndef UPGRADE_H_
+#define UPGRADE_H_
+
+#include <stdbool.h>
+
+/**
+ * Remember how the server was started and take over the listening
+ * sockets of the process that started this one for an upgrade.
+ * @argv the command line arguments
+ * @return true when listening sockets were inherited
+ */
+bool upgrade_inherit(char **argv);
+
+/**
+ * Tell the previous process this one is serving and start an upgrade
+ * on SIGUSR2, call after the listeners are set up.
+ */
+void upgrade_watch(void);
+
+/**
+ * Check if this process is handing over to a new one. Draining
+ * connections are closed after their current request.
+ */
+bool upgrade_draining(void);
+
+#endif /* UPGRADE_H_ */
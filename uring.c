@@ -0,0 +1,326 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: uring.c
+ * Description: the io_uring backend. Operations are queued while the
+ * event loop runs callbacks and submitted together once per loop
+ * iteration. The ring descriptor is watched by uloop, it becomes
+ * readable when completions are waiting.
+ *
+ * Created by: Daan Pape
+ * Created on: June 17, 2014
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "uring.h"
+
+/* Headers older than multishot accept only build single shot accepts */
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE		0
+#endif
+
+/**
+ * The shared ring memory
+ */
+static struct {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_entries;
+	unsigned queued;			/* Entries not submitted yet */
+} ring = { .fd = -1 };
+
+/* Multishot accept came with the socket operation, older kernels get single shots */
+static bool accept_multishot;
+
+static void uring_complete(struct uloop_fd *fd, unsigned int events);
+static void uring_flush_cb(struct uloop_timeout *t);
+
+static struct uloop_fd ring_fd = {
+	.cb = uring_complete
+};
+
+/* Submits the queued entries once per loop iteration */
+static struct uloop_timeout flush_timer = {
+	.cb = uring_flush_cb
+};
+
+/**
+ * Submit the queued entries
+ */
+static void uring_flush(void)
+{
+	int r;
+
+	while (ring.queued) {
+		r = syscall(__NR_io_uring_enter, ring.fd, ring.queued, 0, 0, NULL, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* Completions free room for more, they are reaped next */
+			if (errno == EAGAIN || errno == EBUSY)
+				break;
+
+			perror("io_uring_enter()");
+			break;
+		}
+
+		ring.queued -= r;
+	}
+}
+
+static void uring_flush_cb(struct uloop_timeout *t)
+{
+	uring_flush();
+}
+
+/**
+ * Get free submission entries, submits the queue when it is full so the
+ * entries of a linked chain are submitted together
+ * @n the number of entries needed
+ * @return the first entry, the others follow it in the ring
+ */
+static struct io_uring_sqe *uring_get_sqes(unsigned n)
+{
+	unsigned head, tail = *ring.sq_tail;
+	struct io_uring_sqe *sqe;
+	int i;
+
+	head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head + n > ring.sq_entries) {
+		uring_flush();
+		head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head + n > ring.sq_entries)
+			return NULL;
+	}
+
+	for (i = 0; i < n; i++)
+		memset(&ring.sqes[(tail + i) & *ring.sq_mask], 0, sizeof(*sqe));
+
+	if (!flush_timer.pending)
+		uloop_timeout_set(&flush_timer, 0);
+
+	return &ring.sqes[tail & *ring.sq_mask];
+}
+
+/**
+ * Queue the entries taken with uring_get_sqes()
+ * @n the number of entries
+ */
+static void uring_queue(unsigned n)
+{
+	__atomic_store_n(ring.sq_tail, *ring.sq_tail + n, __ATOMIC_RELEASE);
+	ring.queued += n;
+}
+
+/**
+ * Run the callbacks of the waiting completions
+ */
+static void uring_complete(struct uloop_fd *fd, unsigned int events)
+{
+	unsigned head = *ring.cq_head, tail;
+	struct io_uring_cqe *cqe;
+	struct uring_op *op;
+
+	for (;;) {
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			break;
+
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		op = (struct uring_op *) (uintptr_t) cqe->user_data;
+
+		/* The callback may queue new entries, free the slot first */
+		__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+		if (op)
+			op->cb(op, cqe->res, cqe->flags & IORING_CQE_F_MORE);
+	}
+}
+
+/**
+ * Check if the kernel supports all operations that are used
+ */
+static bool uring_probe(void)
+{
+	static const int ops[] = {
+		IORING_OP_ACCEPT, IORING_OP_READ, IORING_OP_SEND, IORING_OP_ASYNC_CANCEL
+	};
+	struct io_uring_probe *probe;
+	bool ok = true;
+	int i;
+
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if (!probe)
+		return false;
+
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		free(probe);
+		return false;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ops); i++)
+		if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			ok = false;
+
+#ifdef IORING_ACCEPT_MULTISHOT
+	accept_multishot = IORING_OP_SOCKET <= probe->last_op &&
+		(probe->ops[IORING_OP_SOCKET].flags & IO_URING_OP_SUPPORTED);
+#endif
+
+	free(probe);
+	return ok;
+}
+
+void uring_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	unsigned *array, i;
+	void *sq = MAP_FAILED, *cq = MAP_FAILED;
+
+	if (!conf.io_uring)
+		return;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring.fd < 0) {
+		fprintf(stderr, "[WARNING] io_uring is not available, using epoll\n");
+		return;
+	}
+
+	if (!(p.features & IORING_FEAT_NODROP) || !uring_probe()) {
+		fprintf(stderr, "[WARNING] The kernel io_uring is too old, using epoll\n");
+		goto error;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = max(sq_size, cq_size);
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		  ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto error;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto error;
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto error;
+
+	ring.sq_head = (unsigned *) ((char *) sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *) ((char *) sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) ((char *) sq + p.sq_off.ring_mask);
+	ring.cq_head = (unsigned *) ((char *) cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) ((char *) cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) ((char *) cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) ((char *) cq + p.cq_off.cqes);
+	ring.sq_entries = p.sq_entries;
+
+	/* Submission entries are used in ring order */
+	array = (unsigned *) ((char *) sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	fd_cloexec(ring.fd);
+	ring_fd.fd = ring.fd;
+	uloop_fd_add(&ring_fd, ULOOP_READ);
+	return;
+
+error:
+	if (cq != MAP_FAILED && cq != sq)
+		munmap(cq, cq_size);
+	if (sq != MAP_FAILED)
+		munmap(sq, sq_size);
+
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+bool uring_active(void)
+{
+	return ring.fd >= 0;
+}
+
+bool uring_accept(struct uring_op *op, int fd)
+{
+	struct io_uring_sqe *sqe = uring_get_sqes(1);
+
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = fd;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = (uintptr_t) op;
+#ifdef IORING_ACCEPT_MULTISHOT
+	if (accept_multishot)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+#endif
+
+	uring_queue(1);
+	return true;
+}
+
+bool uring_read_send(struct uring_op *read, struct uring_op *send, int fd, off_t off,
+		     int sock, void *buf, int len)
+{
+	struct io_uring_sqe *sqe = uring_get_sqes(2), *next;
+
+	if (!sqe)
+		return false;
+
+	/* A short read breaks the link and cancels the send */
+	sqe->opcode = IORING_OP_READ;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->addr = (uintptr_t) buf;
+	sqe->len = len;
+	sqe->user_data = (uintptr_t) read;
+
+	next = &ring.sqes[(*ring.sq_tail + 1) & *ring.sq_mask];
+	next->opcode = IORING_OP_SEND;
+	next->fd = sock;
+	next->addr = (uintptr_t) buf;
+	next->len = len;
+	next->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	next->user_data = (uintptr_t) send;
+
+	uring_queue(2);
+	return true;
+}
+
+void uring_cancel(struct uring_op *op)
+{
+	struct io_uring_sqe *sqe = uring_get_sqes(1);
+
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t) op;
+	uring_queue(1);
+}
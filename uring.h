@@ -0,0 +1,104 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: uring.h
+ * Description: the io_uring backend for accepting connections and
+ * sending file bodies. Without io_uring support the server uses the
+ * uloop event loop for everything.
+ *
+ * Created by: Daan Pape
+ * Created on: June 17, 2014
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * A submitted operation, the callback gets every completion
+ */
+struct uring_op {
+	/**
+	 * @op the operation
+	 * @res the result, a negative error number on failure
+	 * @more true when the operation completes again later
+	 */
+	void (*cb)(struct uring_op *op, int res, bool more);
+};
+
+#ifdef HAVE_URING
+
+/**
+ * Set up the ring, call after uloop_init(). The server falls back to
+ * uloop when the kernel lacks any of the operations that are used.
+ */
+void uring_init(void);
+
+/**
+ * Check if the ring is in use
+ */
+bool uring_active(void);
+
+/**
+ * Accept connections on a listening socket until the operation is
+ * cancelled, the callback gets the accepted sockets
+ * @op the operation
+ * @fd the listening socket
+ * @return false when the ring is full
+ */
+bool uring_accept(struct uring_op *op, int fd);
+
+/**
+ * Read from a file and send the data to a socket in one linked pair of
+ * operations. The send is cancelled when the read is short.
+ * @read the read operation
+ * @send the send operation
+ * @fd the file
+ * @off the file offset
+ * @sock the socket
+ * @buf the buffer for the data
+ * @len the number of bytes
+ * @return false when the ring is full
+ */
+bool uring_read_send(struct uring_op *read, struct uring_op *send, int fd, off_t off,
+		     int sock, void *buf, int len);
+
+/**
+ * Cancel an operation, its callback still gets the final completion
+ * @op the operation
+ */
+void uring_cancel(struct uring_op *op);
+
+#else
+
+static inline void uring_init(void)
+{
+}
+
+static inline bool uring_active(void)
+{
+	return false;
+}
+
+static inline bool uring_accept(struct uring_op *op, int fd)
+{
+	return false;
+}
+
+static inline bool uring_read_send(struct uring_op *read, struct uring_op *send, int fd,
+				   off_t off, int sock, void *buf, int len)
+{
+	return false;
+}
+
+static inline void uring_cancel(struct uring_op *op)
+{
+}
+
+#endif
+
+#endif /* URING_H_ */
@@ -18,18 +18,14 @@
  */
 
 #include <ctype.h>
+#include <signal.h>
 #include "uhttpd.h"
 #include "config.h"
+#include "budget.h"
 
 bool uh_use_chunked(struct client *cl)
 {
-	if (cl->request.version != UH_HTTP_VER_1_1)
-		return false;
-
-	if (cl->request.method == UH_HTTP_MSG_HEAD)
-		return false;
-
-	return true;
+	return cl->request.respond_chunked;
 }
 
 void uh_chunk_write(struct client *cl, const void *data, int len)
@@ -39,12 +35,13 @@ void uh_chunk_write(struct client *cl, const void *data, int len)
 	if (cl->state == CLIENT_STATE_CLEANUP)
 		return;
 
-	uloop_timeout_set(&cl->timeout, NETWORK_TIMEOUT * 1000);
+	uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
 	if (chunked)
 		ustream_printf(cl->us, "%X\r\n", len);
 	ustream_write(cl->us, data, len, true);
 	if (chunked)
 		ustream_printf(cl->us, "\r\n", len);
+	budget_account(cl);
 }
 
 void uh_chunk_vprintf(struct client *cl, const char *format, va_list arg)
@@ -56,9 +53,10 @@ void uh_chunk_vprintf(struct client *cl, const char *format, va_list arg)
 	if (cl->state == CLIENT_STATE_CLEANUP)
 		return;
 
-	uloop_timeout_set(&cl->timeout, NETWORK_TIMEOUT * 1000);
+	uloop_timeout_set(&cl->timeout, conf.network_timeout * 1000);
 	if (!uh_use_chunked(cl)) {
 		ustream_vprintf(cl->us, format, arg);
+		budget_account(cl);
 		return;
 	}
 
@@ -72,6 +70,7 @@ void uh_chunk_vprintf(struct client *cl, const char *format, va_list arg)
 	else
 		ustream_vprintf(cl->us, format, arg);
 	ustream_printf(cl->us, "\r\n", len);
+	budget_account(cl);
 }
 
 void uh_chunk_printf(struct client *cl, const char *format, ...)
@@ -201,6 +200,35 @@ int uh_b64decode(char *buf, int blen, const void *src, int slen)
 	return len;
 }
 
+int uh_b64encode(char *buf, int blen, const void *src, int slen)
+{
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char *str = src;
+	unsigned int v;
+	int len = 0;
+	int i;
+
+	if (blen < 4 * ((slen + 2) / 3) + 1)
+		return -1;
+
+	for (i = 0; i < slen; i += 3) {
+		v = str[i] << 16;
+		if (i + 1 < slen)
+			v |= str[i + 1] << 8;
+		if (i + 2 < slen)
+			v |= str[i + 2];
+
+		buf[len++] = b64[(v >> 18) & 63];
+		buf[len++] = b64[(v >> 12) & 63];
+		buf[len++] = (i + 1 < slen) ? b64[(v >> 6) & 63] : '=';
+		buf[len++] = (i + 2 < slen) ? b64[v & 63] : '=';
+	}
+
+	buf[len] = 0;
+	return len;
+}
+
 bool uh_path_match(const char *prefix, const char *url)
 {
 	int len = strlen(prefix);
@@ -242,3 +270,243 @@ bool uh_addr_rfc1918(struct uh_addr *addr)
 
 	return 0;
 }
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND						\
+	do {							\
+		v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;	\
+		v0 = ROTL64(v0, 32);				\
+		v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;	\
+		v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;	\
+		v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;	\
+		v2 = ROTL64(v2, 32);				\
+	} while (0)
+
+static uint64_t uh_le64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+/* SipHash-2-4 keyed hash of len bytes of data with a 16 byte key. */
+uint64_t uh_siphash(const uint8_t *key, const void *data, int len)
+{
+	const uint8_t *in = data;
+	uint64_t k0 = uh_le64(key), k1 = uh_le64(key + 8);
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t b = ((uint64_t) len) << 56;
+	uint64_t m;
+	int i;
+
+	for (; len >= 8; len -= 8, in += 8) {
+		m = uh_le64(in);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for (i = len - 1; i >= 0; i--)
+		b |= ((uint64_t) in[i]) << (8 * i);
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Fill buf with len random bytes, returns false if no randomness is available. */
+bool uh_random_bytes(void *buf, int len)
+{
+	int fd, r;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	while (len > 0) {
+		r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r <= 0)
+			break;
+
+		buf = (char *) buf + r;
+		len -= r;
+	}
+
+	close(fd);
+	return !len;
+}
+
+/* Get the monotonic time in seconds. */
+time_t uh_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+int64_t uh_monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int64_t uh_monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define ROTL32(x, b) (uint32_t)(((x) << (b)) | ((x) >> (32 - (b))))
+
+static void uh_sha1_block(uint32_t *h, const uint8_t *p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+		       (p[4 * i + 2] << 8) | p[4 * i + 3];
+
+	for (i = 16; i < 80; i++)
+		w[i] = ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		t = ROTL32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROTL32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/* SHA-1 digest of len bytes of data, out must hold 20 bytes. */
+void uh_sha1(const void *data, int len, uint8_t *out)
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	const uint8_t *p = data;
+	uint64_t bits = (uint64_t) len * 8;
+	uint8_t tail[128];
+	int rest, n, i;
+
+	for (; len >= 64; len -= 64, p += 64)
+		uh_sha1_block(h, p);
+
+	/* Pad the last block(s) with 0x80, zeros and the bit length */
+	rest = len;
+	memcpy(tail, p, rest);
+	tail[rest++] = 0x80;
+	n = (rest > 56) ? 128 : 64;
+	memset(tail + rest, 0, n - rest);
+	for (i = 0; i < 8; i++)
+		tail[n - 1 - i] = bits >> (8 * i);
+
+	uh_sha1_block(h, tail);
+	if (n == 128)
+		uh_sha1_block(h, tail + 64);
+
+	for (i = 0; i < 20; i++)
+		out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* Signals are passed to the event loop through a pipe */
+static int signal_pipe[2] = { -1, -1 };
+static void (*signal_cbs[NSIG])(void);
+
+static void uh_signal_handler(int sig)
+{
+	unsigned char c = sig;
+	int err = errno;
+	ssize_t ret;
+
+	/* A full pipe already has the signal pending */
+	ret = write(signal_pipe[1], &c, 1);
+	(void) ret;
+
+	errno = err;
+}
+
+static void uh_signal_cb(struct uloop_fd *fd, unsigned int events)
+{
+	unsigned char buf[16];
+	int i, n;
+
+	while ((n = read(fd->fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			if (signal_cbs[buf[i]])
+				signal_cbs[buf[i]]();
+}
+
+/* Run cb from the event loop when sig is received, call after uloop_init(). */
+bool uh_signal_add(int sig, void (*cb)(void))
+{
+	static struct uloop_fd signal_fd = {
+		.cb = uh_signal_cb,
+	};
+	struct sigaction sa = {
+		.sa_handler = uh_signal_handler,
+		.sa_flags = SA_RESTART,
+	};
+
+	if (signal_pipe[0] < 0) {
+		if (pipe(signal_pipe)) {
+			perror("pipe()");
+			return false;
+		}
+
+		fd_cloexec(signal_pipe[0]);
+		fd_cloexec(signal_pipe[1]);
+		fcntl(signal_pipe[1], F_SETFL, fcntl(signal_pipe[1], F_GETFL) | O_NONBLOCK);
+
+		signal_fd.fd = signal_pipe[0];
+		uloop_fd_add(&signal_fd, ULOOP_READ);
+	}
+
+	signal_cbs[sig] = cb;
+	sigemptyset(&sa.sa_mask);
+	return !sigaction(sig, &sa, NULL);
+}
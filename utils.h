@@ -70,8 +70,16 @@ time_t timegm (struct tm *tm);
 int uh_urldecode(char *buf, int blen, const char *src, int slen);
 int uh_urlencode(char *buf, int blen, const char *src, int slen);
 int uh_b64decode(char *buf, int blen, const void *src, int slen);
+int uh_b64encode(char *buf, int blen, const void *src, int slen);
 bool uh_path_match(const char *prefix, const char *url);
 char *uh_split_header(char *str);
 bool uh_addr_rfc1918(struct uh_addr *addr);
+uint64_t uh_siphash(const uint8_t *key, const void *data, int len);
+bool uh_random_bytes(void *buf, int len);
+time_t uh_monotonic(void);
+int64_t uh_monotonic_ms(void);
+int64_t uh_monotonic_us(void);
+void uh_sha1(const void *data, int len, uint8_t *out);
+bool uh_signal_add(int sig, void (*cb)(void));
 
 #endif
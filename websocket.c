@@ -0,0 +1,825 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: websocket.c
+ * Description: WebSocket endpoint carrying API calls and pushed
+ * change events over a single connection (RFC 6455, RFC 7692).
+ *
+ * Created by: Daan Pape
+ * Created on: June 5, 2014
+ */
+
+#include <libubox/blobmsg.h>
+#include <json/json.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "uhttpd.h"
+#include "config.h"
+#include "client.h"
+#include "api.h"
+#include "websocket.h"
+#include "budget.h"
+
+#define WS_GUID			"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_TOPIC_LEN	32
+
+enum ws_opcode {
+	WS_OP_CONTINUATION	= 0x0,
+	WS_OP_TEXT			= 0x1,
+	WS_OP_BINARY		= 0x2,
+	WS_OP_CLOSE			= 0x8,
+	WS_OP_PING			= 0x9,
+	WS_OP_PONG			= 0xA,
+};
+
+enum ws_status {
+	WS_CLOSE_NORMAL		= 1000,
+	WS_CLOSE_PROTOCOL	= 1002,
+	WS_CLOSE_DATA		= 1003,
+	WS_CLOSE_TOO_BIG	= 1009,
+};
+
+/**
+ * WebSocket state of an upgraded client connection.
+ */
+struct ws_client {
+	struct list_head list;			/* The list of WebSocket clients */
+	struct client *cl;				/* The connection */
+	bool deflate;					/* Per-message deflate was negotiated */
+	bool blocked;					/* Output is above the high-water mark */
+	bool closing;					/* A close frame was sent */
+
+	char *buf;						/* Received frames not processed yet */
+	int len;
+
+	char *msg;						/* The message being reassembled */
+	int msg_len;
+	int msg_opcode;
+	bool msg_deflate;
+	bool in_msg;
+
+	int dropped;					/* Events missed because of backpressure */
+	char topics[WS_MAX_SUBSCRIPTIONS][WS_TOPIC_LEN];
+};
+
+/* The list of upgraded clients */
+static LIST_HEAD(ws_clients);
+
+#ifdef HAVE_ZLIB
+/* Contexts are reset per message, so all connections share them */
+static z_stream ws_zdef, ws_zinf;
+static bool ws_zlib_ready;
+
+/**
+ * Set up the shared compression contexts
+ */
+static bool ws_zlib_init(void)
+{
+	if (ws_zlib_ready)
+		return true;
+
+	if (deflateInit2(&ws_zdef, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -11, 4,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	if (inflateInit2(&ws_zinf, -15) != Z_OK) {
+		deflateEnd(&ws_zdef);
+		return false;
+	}
+
+	ws_zlib_ready = true;
+	return true;
+}
+
+/**
+ * Compress a message, the caller frees the result
+ * @data the message
+ * @len the message length, replaced by the compressed length
+ * @return NULL when compression failed
+ */
+static char *ws_deflate(const char *data, int *len)
+{
+	int size = deflateBound(&ws_zdef, *len) + 8;
+	char *out = malloc(size);
+
+	if (!out)
+		return NULL;
+
+	deflateReset(&ws_zdef);
+	ws_zdef.next_in = (Bytef *) data;
+	ws_zdef.avail_in = *len;
+	ws_zdef.next_out = (Bytef *) out;
+	ws_zdef.avail_out = size;
+
+	if (deflate(&ws_zdef, Z_SYNC_FLUSH) != Z_OK || ws_zdef.avail_in ||
+	    size - ws_zdef.avail_out < 4) {
+		free(out);
+		return NULL;
+	}
+
+	/* Strip the empty stored block ending the flush */
+	*len = size - ws_zdef.avail_out - 4;
+	return out;
+}
+
+/**
+ * Decompress a message, the caller frees the result
+ * @data the compressed message
+ * @len the compressed length, replaced by the message length
+ * @return NULL when the message is corrupt or too big
+ */
+static char *ws_inflate(const char *data, int *len)
+{
+	static const unsigned char tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	char *out = malloc(WS_MAX_MESSAGE + 1);
+	int ret;
+
+	if (!out)
+		return NULL;
+
+	inflateReset(&ws_zinf);
+	ws_zinf.next_out = (Bytef *) out;
+	ws_zinf.avail_out = WS_MAX_MESSAGE;
+
+	ws_zinf.next_in = (Bytef *) data;
+	ws_zinf.avail_in = *len;
+	ret = inflate(&ws_zinf, Z_SYNC_FLUSH);
+
+	if (ret == Z_OK || ret == Z_BUF_ERROR) {
+		ws_zinf.next_in = (Bytef *) tail;
+		ws_zinf.avail_in = sizeof(tail);
+		ret = inflate(&ws_zinf, Z_SYNC_FLUSH);
+	}
+
+	/* Output space left over means the whole message was inflated */
+	if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+	    ws_zinf.avail_in || !ws_zinf.avail_out) {
+		free(out);
+		return NULL;
+	}
+
+	*len = WS_MAX_MESSAGE - ws_zinf.avail_out;
+	return out;
+}
+#endif
+
+/**
+ * Check the output backpressure of a client, reading stops while the
+ * client does not drain its responses.
+ * @cl the WebSocket client
+ */
+static void ws_check_blocked(struct client *cl)
+{
+	struct ws_client *ws = cl->ws;
+	int pending = cl->us->w.data_bytes;
+
+	if (!ws->blocked && pending > WS_HIGH_WATER) {
+		ws->blocked = true;
+		ustream_set_read_blocked(cl->us, true);
+	} else if (ws->blocked && pending < WS_LOW_WATER) {
+		ws->blocked = false;
+		ustream_set_read_blocked(cl->us, false);
+	}
+}
+
+/**
+ * Send a single frame to a client
+ * @cl the WebSocket client
+ * @opcode the frame opcode
+ * @data the payload
+ * @len the payload length
+ */
+static void ws_send(struct client *cl, int opcode, const char *data, int len)
+{
+	struct ws_client *ws = cl->ws;
+	unsigned char hdr[10];
+	char *zdata = NULL;
+	int hlen = 2;
+
+	if (cl->state == CLIENT_STATE_CLEANUP || ws->closing)
+		return;
+
+	hdr[0] = 0x80 | opcode;
+
+#ifdef HAVE_ZLIB
+	if (ws->deflate && opcode == WS_OP_TEXT && len >= WS_DEFLATE_MIN) {
+		int zlen = len;
+
+		zdata = ws_deflate(data, &zlen);
+		if (zdata) {
+			hdr[0] |= 0x40;
+			data = zdata;
+			len = zlen;
+		}
+	}
+#endif
+
+	if (len < 126) {
+		hdr[1] = len;
+	} else if (len < 65536) {
+		hdr[1] = 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+		hlen = 4;
+	} else {
+		hdr[1] = 127;
+		memset(hdr + 2, 0, 4);
+		hdr[6] = len >> 24;
+		hdr[7] = len >> 16;
+		hdr[8] = len >> 8;
+		hdr[9] = len;
+		hlen = 10;
+	}
+
+	ustream_write(cl->us, (char *) hdr, hlen, true);
+	ustream_write(cl->us, data, len, false);
+	free(zdata);
+
+	if (opcode == WS_OP_CLOSE)
+		ws->closing = true;
+
+	ws_check_blocked(cl);
+	budget_account(cl);
+}
+
+/**
+ * Send a JSON object as text message
+ * @cl the WebSocket client
+ * @obj the object to send
+ */
+static void ws_send_json(struct client *cl, json_object *obj)
+{
+	const char *str = json_object_to_json_string(obj);
+
+	ws_send(cl, WS_OP_TEXT, str, strlen(str));
+}
+
+/**
+ * Close the connection with a status code
+ * @cl the WebSocket client
+ * @status the close status
+ */
+static void ws_close(struct client *cl, int status)
+{
+	char code[2] = { status >> 8, status & 0xff };
+
+	ws_send(cl, WS_OP_CLOSE, code, sizeof(code));
+	close_connection(cl);
+}
+
+/**
+ * Find the subscription slot of a topic
+ * @ws the WebSocket client
+ * @topic the topic, NULL to find a free slot
+ * @return -1 when not found
+ */
+static int ws_topic_find(struct ws_client *ws, const char *topic)
+{
+	int i;
+
+	for (i = 0; i < WS_MAX_SUBSCRIPTIONS; i++) {
+		if (!topic && !ws->topics[i][0])
+			return i;
+
+		if (topic && !strcmp(ws->topics[i], topic))
+			return i;
+	}
+
+	return -1;
+}
+
+/**
+ * Subscribe or unsubscribe from a topic
+ * @ws the WebSocket client
+ * @topic the topic
+ * @subscribe true to subscribe
+ * @return the status code of the request
+ */
+static int ws_subscribe(struct ws_client *ws, const char *topic, bool subscribe)
+{
+	int idx = ws_topic_find(ws, topic);
+
+	if (!*topic || strlen(topic) >= WS_TOPIC_LEN)
+		return 400;
+
+	if (!subscribe) {
+		if (idx >= 0)
+			ws->topics[idx][0] = 0;
+		return 200;
+	}
+
+	if (idx >= 0)
+		return 200;
+
+	idx = ws_topic_find(ws, NULL);
+	if (idx < 0)
+		return 429;
+
+	strcpy(ws->topics[idx], topic);
+	return 200;
+}
+
+/**
+ * Send the reply of a deferred API call
+ */
+static void ws_call_done(struct api_deferred *d, const struct http_response *status,
+			 json_object *result)
+{
+	json_object_object_add(d->tag, "status", json_object_new_int(status->code));
+	if (result)
+		json_object_object_add(d->tag, "result", result);
+
+	ws_send_json(d->cl, d->tag);
+}
+
+/**
+ * Handle a text message. Messages are JSON objects, either an API call
+ * {"id": 1, "call": "freespace", "method": "GET"} or a subscription
+ * {"id": 2, "subscribe": "status"}. Every message is answered with the
+ * id, a status code and for calls the handler result.
+ * @cl the WebSocket client
+ * @msg the message, NUL terminated
+ */
+static void ws_message(struct client *cl, const char *msg)
+{
+	json_object *req, *reply, *val, *result = NULL;
+	enum http_method saved = cl->request.method;
+	api_handler handler;
+	int status = 400;
+	int method;
+
+	req = json_tokener_parse(msg);
+	if (!req || !json_object_is_type(req, json_type_object)) {
+		if (req)
+			json_object_put(req);
+		ws_close(cl, WS_CLOSE_DATA);
+		return;
+	}
+
+	reply = json_object_new_object();
+	if (json_object_object_get_ex(req, "id", &val))
+		json_object_object_add(reply, "id", json_object_get(val));
+
+	if (json_object_object_get_ex(req, "subscribe", &val)) {
+		status = ws_subscribe(cl->ws, json_object_get_string(val), true);
+	} else if (json_object_object_get_ex(req, "unsubscribe", &val)) {
+		status = ws_subscribe(cl->ws, json_object_get_string(val), false);
+	} else if (json_object_object_get_ex(req, "call", &val)) {
+		const char *name = json_object_get_string(val);
+
+		method = api_find_method(json_object_object_get_ex(req, "method", &val) ?
+				   json_object_get_string(val) : NULL);
+		handler = method < 0 ? NULL : api_find_handler(method, name);
+
+		if (!handler) {
+			status = 404;
+		} else {
+			cl->request.method = method;
+			cl->http_status = r_bad_req;
+			result = api_call(cl, handler, ws_call_done, reply);
+			status = result ? cl->http_status.code : 400;
+			cl->request.method = saved;
+		}
+	}
+
+	/* Deferred calls are answered when they complete */
+	if (result == API_PENDING) {
+		json_object_put(reply);
+		json_object_put(req);
+		return;
+	}
+
+	json_object_object_add(reply, "status", json_object_new_int(status));
+	if (result)
+		json_object_object_add(reply, "result", result);
+
+	ws_send_json(cl, reply);
+	json_object_put(reply);
+	json_object_put(req);
+}
+
+/**
+ * Handle a complete data message
+ * @cl the WebSocket client
+ */
+static void ws_message_done(struct client *cl)
+{
+	struct ws_client *ws = cl->ws;
+	char *msg = ws->msg;
+	int len = ws->msg_len;
+
+	ws->in_msg = false;
+	ws->msg = NULL;
+	ws->msg_len = 0;
+
+	if (ws->msg_opcode != WS_OP_TEXT) {
+		free(msg);
+		ws_close(cl, WS_CLOSE_DATA);
+		return;
+	}
+
+#ifdef HAVE_ZLIB
+	if (ws->msg_deflate) {
+		char *plain = ws_inflate(msg ? msg : "", &len);
+
+		free(msg);
+		if (!plain) {
+			ws_close(cl, WS_CLOSE_TOO_BIG);
+			return;
+		}
+		msg = plain;
+	}
+#endif
+
+	if (!msg) {
+		ws_message(cl, "");
+		return;
+	}
+
+	msg[len] = 0;
+	ws_message(cl, msg);
+	free(msg);
+}
+
+/**
+ * Handle a single unmasked frame
+ * @cl the WebSocket client
+ * @b0 the first header byte
+ * @data the payload
+ * @len the payload length
+ */
+static void ws_frame(struct client *cl, unsigned char b0, char *data, int len)
+{
+	struct ws_client *ws = cl->ws;
+	bool fin = b0 & 0x80;
+	bool rsv1 = b0 & 0x40;
+	int opcode = b0 & 0x0f;
+	char *msg;
+
+	/* Control frames may not be fragmented */
+	if (opcode & 0x8) {
+		if (!fin || len > 125 || rsv1) {
+			ws_close(cl, WS_CLOSE_PROTOCOL);
+			return;
+		}
+
+		switch (opcode) {
+		case WS_OP_CLOSE:
+			ws_send(cl, WS_OP_CLOSE, data, min(len, 2));
+			close_connection(cl);
+			break;
+		case WS_OP_PING:
+			ws_send(cl, WS_OP_PONG, data, len);
+			break;
+		case WS_OP_PONG:
+			break;
+		default:
+			ws_close(cl, WS_CLOSE_PROTOCOL);
+			break;
+		}
+		return;
+	}
+
+	if ((opcode == WS_OP_CONTINUATION) != ws->in_msg ||
+	    (rsv1 && (opcode == WS_OP_CONTINUATION || !ws->deflate)) ||
+	    (opcode != WS_OP_CONTINUATION && opcode != WS_OP_TEXT &&
+	     opcode != WS_OP_BINARY)) {
+		ws_close(cl, WS_CLOSE_PROTOCOL);
+		return;
+	}
+
+	if (opcode != WS_OP_CONTINUATION) {
+		ws->in_msg = true;
+		ws->msg_opcode = opcode;
+		ws->msg_deflate = rsv1;
+	}
+
+	if (len) {
+		if (ws->msg_len + len > WS_MAX_MESSAGE) {
+			ws_close(cl, WS_CLOSE_TOO_BIG);
+			return;
+		}
+
+		msg = realloc(ws->msg, ws->msg_len + len + 1);
+		if (!msg) {
+			ws_close(cl, WS_CLOSE_TOO_BIG);
+			return;
+		}
+
+		memcpy(msg + ws->msg_len, data, len);
+		ws->msg = msg;
+		ws->msg_len += len;
+	}
+
+	if (fin)
+		ws_message_done(cl);
+}
+
+/**
+ * Process all complete frames received so far
+ * @cl the WebSocket client
+ */
+static void ws_process(struct client *cl)
+{
+	struct ws_client *ws = cl->ws;
+	unsigned char *p;
+	uint64_t plen;
+	int hlen, i;
+
+	while (ws->len >= 2 && !ws->blocked && cl->state == CLIENT_STATE_WEBSOCKET) {
+		p = (unsigned char *) ws->buf;
+		plen = p[1] & 0x7f;
+		hlen = 2;
+
+		if (plen == 126) {
+			if (ws->len < 4)
+				return;
+			plen = (p[2] << 8) | p[3];
+			hlen = 4;
+		} else if (plen == 127) {
+			if (ws->len < 10)
+				return;
+			for (plen = 0, i = 2; i < 10; i++)
+				plen = (plen << 8) | p[i];
+			hlen = 10;
+		}
+
+		/* Client frames must be masked */
+		if (!(p[1] & 0x80)) {
+			ws_close(cl, WS_CLOSE_PROTOCOL);
+			return;
+		}
+
+		if (plen > WS_MAX_MESSAGE) {
+			ws_close(cl, WS_CLOSE_TOO_BIG);
+			return;
+		}
+
+		if (ws->len < hlen + 4 + plen)
+			return;
+
+		for (i = 0; i < plen; i++)
+			p[hlen + 4 + i] ^= p[hlen + (i & 3)];
+
+		ws_frame(cl, p[0], (char *) p + hlen + 4, plen);
+
+		/* The frame handler may have closed the connection */
+		if (!cl->ws)
+			return;
+
+		ws->len -= hlen + 4 + plen;
+		memmove(ws->buf, ws->buf + hlen + 4 + plen, ws->len);
+	}
+}
+
+/**
+ * Write handler, resumes processing when the client drained its output
+ * @cl the WebSocket client
+ */
+static void ws_write_cb(struct client *cl)
+{
+	if (!cl->ws || !cl->ws->blocked)
+		return;
+
+	ws_check_blocked(cl);
+	if (!cl->ws->blocked)
+		ws_process(cl);
+}
+
+/**
+ * Close idle WebSocket connections
+ */
+static void ws_timeout_cb(struct uloop_timeout *timeout)
+{
+	struct client *cl = container_of(timeout, struct client, timeout);
+
+	ws_close(cl, WS_CLOSE_NORMAL);
+}
+
+/**
+ * Read handler for upgraded connections
+ * @cl the client who sent the data
+ * @buf the buffer containing the data
+ * @len the length of the data
+ */
+bool ws_read_handler(struct client *cl, char *buf, int len)
+{
+	struct ws_client *ws = cl->ws;
+	char *nbuf;
+
+	/* A frame and its header never need more room than this */
+	if (ws->len + len > WS_MAX_MESSAGE + 14) {
+		ws_close(cl, WS_CLOSE_TOO_BIG);
+		return true;
+	}
+
+	nbuf = realloc(ws->buf, ws->len + len);
+	if (!nbuf) {
+		ws_close(cl, WS_CLOSE_TOO_BIG);
+		return true;
+	}
+
+	memcpy(nbuf + ws->len, buf, len);
+	ws->buf = nbuf;
+	ws->len += len;
+	ustream_consume(cl->us, len);
+
+	uloop_timeout_set(&cl->timeout, WS_TIMEOUT * 1000);
+	ws_process(cl);
+
+	return true;
+}
+
+/**
+ * Try to upgrade the connection to a WebSocket. Called when the
+ * request headers are complete and the client asked for an upgrade.
+ * @cl the client that made the request
+ * @return false when the request should be handled as a normal request
+ */
+bool ws_upgrade(struct client *cl)
+{
+	enum {
+		WS_HDR_KEY,
+		WS_HDR_VERSION,
+		WS_HDR_EXTENSIONS,
+		__WS_HDR_MAX
+	};
+	static const struct blobmsg_policy policy[__WS_HDR_MAX] = {
+		[WS_HDR_KEY] = { "sec-websocket-key", BLOBMSG_TYPE_STRING },
+		[WS_HDR_VERSION] = { "sec-websocket-version", BLOBMSG_TYPE_STRING },
+		[WS_HDR_EXTENSIONS] = { "sec-websocket-extensions", BLOBMSG_TYPE_STRING },
+	};
+	struct blob_attr *tb[__WS_HDR_MAX];
+	char *url = blobmsg_data(blob_data(cl->hdr.head));
+	char key[128], accept[32];
+	uint8_t digest[20];
+	struct ws_client *ws;
+	bool deflate = false;
+
+	if (!uh_path_match(WEBSOCKET_PATH, url))
+		return false;
+
+	blobmsg_parse(policy, __WS_HDR_MAX, tb, blob_data(cl->hdr.head), blob_len(cl->hdr.head));
+
+	if (cl->request.method != UH_HTTP_MSG_GET ||
+	    cl->request.version != UH_HTTP_VER_1_1 ||
+	    !tb[WS_HDR_KEY] || !tb[WS_HDR_VERSION] ||
+	    strcmp(blobmsg_data(tb[WS_HDR_VERSION]), "13") ||
+	    strlen(blobmsg_data(tb[WS_HDR_KEY])) > sizeof(key) - sizeof(WS_GUID)) {
+		send_client_error(cl, 400, "Bad Request", "Invalid WebSocket handshake.");
+		return true;
+	}
+
+	ws = calloc(1, sizeof(*ws));
+	if (!ws) {
+		send_client_error(cl, 500, "Internal Server Error", NULL);
+		return true;
+	}
+
+	snprintf(key, sizeof(key), "%s" WS_GUID, (char *) blobmsg_data(tb[WS_HDR_KEY]));
+	uh_sha1(key, strlen(key), digest);
+	uh_b64encode(accept, sizeof(accept), digest, sizeof(digest));
+
+#ifdef HAVE_ZLIB
+	if (tb[WS_HDR_EXTENSIONS] &&
+	    strstr(blobmsg_data(tb[WS_HDR_EXTENSIONS]), "permessage-deflate"))
+		deflate = ws_zlib_init();
+#endif
+
+	ustream_printf(cl->us,
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"%s\r\n", accept,
+		deflate ? "Sec-WebSocket-Extensions: permessage-deflate; "
+			  "server_no_context_takeover; client_no_context_takeover\r\n" : "");
+
+	ws->cl = cl;
+	ws->deflate = deflate;
+	list_add_tail(&ws->list, &ws_clients);
+
+	cl->ws = ws;
+	cl->state = CLIENT_STATE_WEBSOCKET;
+	cl->dispatch.write_cb = ws_write_cb;
+	cl->timeout.cb = ws_timeout_cb;
+	uloop_timeout_set(&cl->timeout, WS_TIMEOUT * 1000);
+
+	return true;
+}
+
+/**
+ * Free the WebSocket state of a client
+ * @cl the client to free the state from
+ */
+void ws_free(struct client *cl)
+{
+	struct ws_client *ws = cl->ws;
+
+	if (!ws)
+		return;
+
+	list_del(&ws->list);
+	free(ws->buf);
+	free(ws->msg);
+	free(ws);
+	cl->ws = NULL;
+}
+
+int ws_buffered(struct client *cl)
+{
+	if (!cl->ws)
+		return 0;
+
+	return cl->ws->len + cl->ws->msg_len;
+}
+
+/**
+ * Push an event to every WebSocket client subscribed to the topic.
+ * @topic the event topic
+ * @data the event data, ownership stays with the caller
+ */
+void ws_publish(const char *topic, json_object *data)
+{
+	struct ws_client *ws;
+	const char *str = NULL;
+	json_object *event = NULL;
+
+	list_for_each_entry(ws, &ws_clients, list) {
+		struct client *cl = ws->cl;
+
+		if (ws->closing || ws_topic_find(ws, topic) < 0)
+			continue;
+
+		/* Slow clients miss events instead of buffering them */
+		if (ws->blocked) {
+			ws->dropped++;
+			continue;
+		}
+
+		if (ws->dropped) {
+			json_object *late = json_object_new_object();
+
+			json_object_object_add(late, "event", json_object_new_string(topic));
+			json_object_object_add(late, "data", json_object_get(data));
+			json_object_object_add(late, "dropped", json_object_new_int(ws->dropped));
+			ws_send_json(cl, late);
+			json_object_put(late);
+			ws->dropped = 0;
+			continue;
+		}
+
+		if (!event) {
+			event = json_object_new_object();
+			json_object_object_add(event, "event", json_object_new_string(topic));
+			json_object_object_add(event, "data", json_object_get(data));
+			str = json_object_to_json_string(event);
+		}
+
+		ws_send(cl, WS_OP_TEXT, str, strlen(str));
+	}
+
+	if (event)
+		json_object_put(event);
+}
+
+/**
+ * Push the result of a GET API call to the clients subscribed to the
+ * call name. The call only runs when somebody listens.
+ * @name the call name
+ */
+void ws_publish_call(const char *name)
+{
+	enum http_method saved;
+	struct ws_client *ws;
+	struct client *cl = NULL;
+	api_handler handler;
+	json_object *result;
+
+	list_for_each_entry(ws, &ws_clients, list) {
+		if (!ws->closing && ws_topic_find(ws, name) >= 0) {
+			cl = ws->cl;
+			break;
+		}
+	}
+
+	handler = cl ? api_find_handler(UH_HTTP_MSG_GET, name) : NULL;
+	if (!handler)
+		return;
+
+	/* Events can not wait for deferred results */
+	saved = cl->request.method;
+	cl->request.method = UH_HTTP_MSG_GET;
+	result = api_call(cl, handler, NULL, NULL);
+	cl->request.method = saved;
+
+	if (!result || result == API_PENDING)
+		return;
+
+	ws_publish(name, result);
+	json_object_put(result);
+}
@@ -0,0 +1,65 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: websocket.h
+ * Description: WebSocket endpoint carrying API calls and pushed
+ * change events over a single connection.
+ *
+ * Created by: Daan Pape
+ * Created on: June 5, 2014
+ */
+
+#ifndef WEBSOCKET_H_
+#define WEBSOCKET_H_
+
+#include <json/json.h>
+
+#include "uhttpd.h"
+
+/**
+ * Try to upgrade the connection to a WebSocket. Called when the
+ * request headers are complete and the client asked for an upgrade.
+ * @cl the client that made the request
+ * @return false when the request should be handled as a normal request
+ */
+bool ws_upgrade(struct client *cl);
+
+/**
+ * Read handler for upgraded connections
+ * @cl the client who sent the data
+ * @buf the buffer containing the data
+ * @len the length of the data
+ */
+bool ws_read_handler(struct client *cl, char *buf, int len);
+
+/**
+ * Free the WebSocket state of a client
+ * @cl the client to free the state from
+ */
+void ws_free(struct client *cl);
+
+/**
+ * Get the number of bytes buffered for received frames and messages
+ * @cl the client
+ */
+int ws_buffered(struct client *cl);
+
+/**
+ * Push an event to every WebSocket client subscribed to the topic.
+ * Clients that can not keep up miss the event, they are told how many
+ * events they missed with the next one delivered.
+ * @topic the event topic
+ * @data the event data, ownership stays with the caller
+ */
+void ws_publish(const char *topic, json_object *data);
+
+/**
+ * Push the result of a GET API call to the clients subscribed to the
+ * call name, used when the data behind the call changed.
+ * @name the call name
+ */
+void ws_publish_call(const char *name);
+
+#endif /* WEBSOCKET_H_ */
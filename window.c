@@ -0,0 +1,107 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: window.c
+ * Description: adaptive output windows. Every connection starts with a
+ * small window that doubles each time the connection sent all queued
+ * output before the next refill, the socket send buffer grows along.
+ * The window halves again when the memory budget stops the output.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#include <sys/socket.h>
+
+#include "config.h"
+#include "uhttpd.h"
+#include "budget.h"
+#include "window.h"
+
+/**
+ * Let the kernel buffer a full window for the socket of a connection
+ * @cl the client
+ */
+static void window_sndbuf(struct client *cl)
+{
+	int size = cl->win.size;
+
+	/* HTTP/2 streams share the socket of their connection */
+	if (cl->h2_stream || size <= cl->win.sndbuf)
+		return;
+
+	if (!setsockopt(cl->sfd.fd.fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+		cl->win.sndbuf = size;
+}
+
+/**
+ * Resize the window of a connection
+ * @cl the client
+ * @size the new size
+ */
+static void window_resize(struct client *cl, int size)
+{
+	cl->win.size = max(min(size, IO_WINDOW_MAX), IO_WINDOW_MIN);
+	window_sndbuf(cl);
+}
+
+int window_room(struct client *cl)
+{
+	int queued = cl->us->w.data_bytes;
+
+	if (!cl->win.size)
+		window_resize(cl, IO_WINDOW_MIN);
+
+	/* Wait for the low watermark before refilling */
+	if (!cl->win.filling && queued >= cl->win.size / IO_WINDOW_LOW_DIV)
+		return 0;
+
+	if (budget_write_blocked(cl)) {
+		window_resize(cl, cl->win.size / 2);
+		cl->win.filling = false;
+		return 0;
+	}
+
+	if (!cl->win.filling) {
+		/* The connection sent everything in time, give it more */
+		if (!queued && cl->win.refills++)
+			window_resize(cl, cl->win.size * 2);
+
+		cl->win.filling = true;
+	}
+
+	if (queued >= cl->win.size) {
+		cl->win.filling = false;
+		return 0;
+	}
+
+	return cl->win.size - queued;
+}
+
+char *window_buf(struct client *cl, int *len)
+{
+	char *buf;
+
+	if (cl->win.buf_len < cl->win.size) {
+		buf = realloc(cl->win.buf, cl->win.size);
+		if (!buf)
+			return NULL;
+
+		cl->win.buf = buf;
+		cl->win.buf_len = cl->win.size;
+	}
+
+	*len = cl->win.buf_len;
+	return cl->win.buf;
+}
+
+void window_release(struct client *cl)
+{
+	free(cl->win.buf);
+	cl->win.buf = NULL;
+	cl->win.buf_len = 0;
+	cl->win.filling = false;
+	cl->win.refills = 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * WoodBOX-server
+ *
+ * Server appliction for the DPTechnics WoodBOX.
+ *
+ * File: window.h
+ * Description: adaptive output windows, the amount of response body
+ * kept queued for a connection follows how fast it drains.
+ *
+ * Created by: Daan Pape
+ * Created on: June 16, 2014
+ */
+
+#ifndef WINDOW_H_
+#define WINDOW_H_
+
+#include "uhttpd.h"
+
+/**
+ * Get the number of body bytes a writer should produce now. Output is
+ * refilled once the queued data drops below the low watermark and then
+ * up to the window size, so the body moves in large batches.
+ * @cl the client the output is for
+ * @return 0 when the writer should wait for its write callback
+ */
+int window_room(struct client *cl);
+
+/**
+ * Get the scratch buffer of a connection, it holds at least the current
+ * window and stays valid until the request is done.
+ * @cl the client
+ * @len set to the size of the buffer
+ * @return NULL when it could not be allocated
+ */
+char *window_buf(struct client *cl, int *len);
+
+/**
+ * Free the scratch buffer of a connection, the window size is kept for
+ * the next request.
+ * @cl the client
+ */
+void window_release(struct client *cl);
+
+#endif /* WINDOW_H_ */